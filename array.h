@@ -0,0 +1,23 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Resizes a single array to hold capacity elements, clearing ok on failure
+#define ARRAY_RESIZE(array, capacity, ok)                                      \
+  do {                                                                         \
+    if ((capacity) == 0) {                                                     \
+      free(array);                                                             \
+      (array) = NULL;                                                          \
+      break;                                                                   \
+    }                                                                          \
+    void *resized = realloc((array), (capacity) * sizeof(*(array)));           \
+    if (resized == NULL) {                                                     \
+      (ok) = false;                                                            \
+      break;                                                                   \
+    }                                                                          \
+    (array) = resized;                                                         \
+  } while (0)
+
+#endif
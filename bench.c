@@ -0,0 +1,477 @@
+#include "springs.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_STEPS 20
+#define DEFAULT_WARMUP_STEPS 5
+#define DEFAULT_MAX_MASSES 1000000
+#define BENCH_DT (1.0 / 240.0)
+#define RANDOM_SPRINGS_PER_MASS 2 // Four springs per mass on average
+#define RANDOM_SEED 0x9e3779b97f4a7c15ull
+// The accuracy run steps the smallest grid for ten simulated seconds
+#define ACCURACY_SIDE 32
+#define ACCURACY_STEPS 2400
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+typedef enum {
+  SCENE_GRID = 0, // The default cloth, structural springs only
+  SCENE_SHEAR,    // Cloth with both diagonals of every cell as well
+  SCENE_RANDOM,   // Random positions, springs to uniformly random masses
+  SCENE_COUNT,
+} Scene;
+
+static const char *scene_names[SCENE_COUNT] = {
+    [SCENE_GRID] = "grid",
+    [SCENE_SHEAR] = "shear",
+    [SCENE_RANDOM] = "random",
+};
+
+// Square grids of about 1K, 10K, 100K and 1M masses
+static const size_t grid_sides[] = {32, 100, 316, 1000};
+#define GRID_SIDE_COUNT (sizeof(grid_sides) / sizeof(grid_sides[0]))
+
+typedef enum {
+  PHASE_SPRING_FORCES = 0, // Includes constraining, applied as forces gather
+  PHASE_INTEGRATE,
+  PHASE_RESET,
+  PHASE_STEP, // A whole system_step with the chosen integrator and solver
+  PHASE_COUNT,
+} Phase;
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_SPRING_FORCES] = "spring_forces",
+    [PHASE_INTEGRATE] = "integrate",
+    [PHASE_RESET] = "reset",
+    [PHASE_STEP] = "step",
+};
+
+typedef struct {
+  size_t steps;
+  size_t threads;
+  size_t max_masses;
+  Integrator integrator;
+  Solver solver;
+  _Bool reference;
+  _Bool scenes[SCENE_COUNT];
+  const char *output;
+  const char *save_positions;
+  const char *compare_positions;
+} Options;
+
+typedef struct {
+  Scene scene;
+  size_t mass_count;
+  size_t spring_count;
+  double seconds[PHASE_COUNT]; // Per step
+} Result;
+
+// Distances of the final positions of the accuracy run from the reference
+typedef struct {
+  _Bool measured;
+  size_t mass_count;
+  double max_error;
+  double rms_error;
+} Accuracy;
+
+void print_usage(const char *program) {
+  printf("Usage: %s [options]\n"
+         "  --steps N        Measured steps per phase and scene (default %d)\n"
+         "  --threads N      Worker threads including the main one (default: "
+         "one per core)\n"
+         "  --max-masses N   Skip scenes larger than this (default %d)\n"
+         "  --scene NAME     grid, shear or random, may be repeated (default: "
+         "all)\n"
+         "  --integrator NAME  Integrator of the step phase\n"
+         "  --solver NAME    Solver of the step phase\n"
+         "  --reference      Use the reference spring kernel\n"
+         "  --output FILE    Write the results as JSON to FILE\n"
+         "  --save-positions FILE  Write the final positions of the accuracy "
+         "run to FILE\n"
+         "  --compare-positions FILE  Compare the final positions of the "
+         "accuracy run\n"
+         "                   with the ones saved to FILE, usually by a double "
+         "build\n",
+         program, DEFAULT_STEPS, DEFAULT_MAX_MASSES);
+}
+
+_Bool parse_options(int argc, char **argv, Options *options) {
+  _Bool any_scene = false;
+  for (int i = 1; i < argc; ++i) {
+    const char *option = argv[i];
+    _Bool has_value = i + 1 < argc;
+    if (strcmp(option, "--help") == 0) {
+      return false;
+    } else if (strcmp(option, "--steps") == 0 && has_value) {
+      options->steps = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--threads") == 0 && has_value) {
+      options->threads = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--max-masses") == 0 && has_value) {
+      options->max_masses = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--integrator") == 0 && has_value) {
+      if (!integrator_from_name(argv[++i], &options->integrator)) {
+        printf("ERROR: Unknown integrator %s\n", argv[i]);
+        return false;
+      }
+    } else if (strcmp(option, "--solver") == 0 && has_value) {
+      if (!solver_from_name(argv[++i], &options->solver)) {
+        printf("ERROR: Unknown solver %s\n", argv[i]);
+        return false;
+      }
+    } else if (strcmp(option, "--reference") == 0) {
+      options->reference = true;
+    } else if (strcmp(option, "--scene") == 0 && has_value) {
+      const char *name = argv[++i];
+      size_t scene = 0;
+      while (scene < SCENE_COUNT && strcmp(name, scene_names[scene]) != 0) {
+        ++scene;
+      }
+      if (scene == SCENE_COUNT) {
+        printf("ERROR: Unknown scene %s\n", name);
+        return false;
+      }
+      options->scenes[scene] = true;
+      any_scene = true;
+    } else if (strcmp(option, "--output") == 0 && has_value) {
+      options->output = argv[++i];
+    } else if (strcmp(option, "--save-positions") == 0 && has_value) {
+      options->save_positions = argv[++i];
+    } else if (strcmp(option, "--compare-positions") == 0 && has_value) {
+      options->compare_positions = argv[++i];
+    } else {
+      printf("ERROR: Unknown or incomplete option %s\n", option);
+      return false;
+    }
+  }
+  for (size_t scene = 0; scene < SCENE_COUNT && !any_scene; ++scene) {
+    options->scenes[scene] = true;
+  }
+  return true;
+}
+
+double seconds_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// xorshift64*, so every run builds the same random scenes
+static uint64_t random_next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ull;
+}
+
+static float random_unit(uint64_t *state) {
+  return (random_next(state) >> 40) * (1.0f / (1 << 24));
+}
+
+static void add_spring_at_rest(System *system, size_t m1, size_t m2) {
+  Vec2 span = vec2_subtract(system->masses.position[m2],
+                            system->masses.position[m1]);
+  system_add_spring(system,
+                    (Spring){.length = vec2_length(span),
+                             .strength = DEFAULT_GRID_STRENGTH,
+                             .dampening = DEFAULT_GRID_DAMPENING},
+                    m1, m2);
+}
+
+// Masses scattered over the area of a side by side cloth, with its top row
+// fixed, and springs between uniformly random masses. Without any locality
+// this is the worst case for the caches.
+static void random_scene_init(System *system, size_t side) {
+  size_t mass_count = side * side;
+  uint64_t state = RANDOM_SEED;
+  float extent = side * DEFAULT_GRID_SIZE;
+  system_reserve(system, mass_count, mass_count * RANDOM_SPRINGS_PER_MASS);
+  for (size_t i = 0; i < mass_count; ++i) {
+    Mass m = {.mass = DEFAULT_GRID_MASS, .fixed = i < side};
+    m.position = (Vec2){random_unit(&state) * extent,
+                        m.fixed ? 0.0f : random_unit(&state) * extent};
+    system_add_mass(system, m);
+  }
+  for (size_t i = 0; i < mass_count; ++i) {
+    for (size_t k = 0; k < RANDOM_SPRINGS_PER_MASS; ++k) {
+      size_t other = random_next(&state) % mass_count;
+      if (other != i) {
+        add_spring_at_rest(system, i, other);
+      }
+    }
+  }
+}
+
+static void scene_init(System *system, Scene scene, size_t side) {
+  if (scene == SCENE_RANDOM) {
+    random_scene_init(system, side);
+    return;
+  }
+  system_init_grid(system, side, side, vec2_zero(), DEFAULT_GRID_SIZE,
+                   DEFAULT_GRID_MASS, DEFAULT_GRID_STRENGTH,
+                   DEFAULT_GRID_DAMPENING);
+  if (scene == SCENE_SHEAR) {
+    system_reserve(system, system->mass_count,
+                   system->spring_count + 2 * (side - 1) * (side - 1));
+    for (size_t r = 0; r + 1 < side; ++r) {
+      for (size_t c = 0; c + 1 < side; ++c) {
+        add_spring_at_rest(system, r * side + c, (r + 1) * side + c + 1);
+        add_spring_at_rest(system, r * side + c + 1, (r + 1) * side + c);
+      }
+    }
+  }
+}
+
+static void scene_run(System *system, const Options *options,
+                      Result *result) {
+  // The warm up builds the adjacency and scratch memory, which the timed
+  // steps then reuse
+  for (size_t i = 0; i < DEFAULT_WARMUP_STEPS; ++i) {
+    system_step(system, BENCH_DT);
+  }
+  double total[PHASE_COUNT] = {0};
+  for (size_t i = 0; i < options->steps; ++i) {
+    double start = seconds_now();
+    system_spring_update(system);
+    double forces_done = seconds_now();
+    system_mass_update(system, BENCH_DT);
+    double integrate_done = seconds_now();
+    system_mass_reset_forces(system);
+    double reset_done = seconds_now();
+    total[PHASE_SPRING_FORCES] += forces_done - start;
+    total[PHASE_INTEGRATE] += integrate_done - forces_done;
+    total[PHASE_RESET] += reset_done - integrate_done;
+  }
+
+  system->integrator = options->integrator;
+  system->solver = options->solver;
+  system_step(system, BENCH_DT);
+  double start = seconds_now();
+  for (size_t i = 0; i < options->steps; ++i) {
+    system_step(system, BENCH_DT);
+  }
+  total[PHASE_STEP] = seconds_now() - start;
+
+  result->mass_count = system->mass_count;
+  result->spring_count = system->active_spring_count;
+  for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+    result->seconds[phase] = total[phase] / options->steps;
+  }
+}
+
+// Steps the smallest grid with the chosen integrator and solver, long enough
+// for rounding errors to show in the positions
+static void accuracy_run(System *system, const Options *options) {
+  system_set_thread_count(system, options->threads);
+  system->spring_kernel =
+      options->reference ? SPRING_KERNEL_REFERENCE : SPRING_KERNEL_BATCHED;
+  scene_init(system, SCENE_GRID, ACCURACY_SIDE);
+  system->integrator = options->integrator;
+  system->solver = options->solver;
+  for (size_t i = 0; i < ACCURACY_STEPS; ++i) {
+    system_step(system, BENCH_DT);
+  }
+}
+
+// Positions are written as text with every digit of a double, so that files
+// from float and double builds compare alike
+static _Bool positions_save(const System *system, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    printf("ERROR: Cannot open %s for writing\n", path);
+    return false;
+  }
+  fprintf(file, "%zu\n", system->mass_count);
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    Vec2 position = system->masses.position[i];
+    fprintf(file, "%.17g %.17g\n", (double)position.x, (double)position.y);
+  }
+  _Bool ok = fclose(file) == 0;
+  if (!ok) {
+    printf("ERROR: Cannot write %s\n", path);
+  }
+  return ok;
+}
+
+static _Bool positions_compare(const System *system, const char *path,
+                               Accuracy *accuracy) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    printf("ERROR: Cannot open %s\n", path);
+    return false;
+  }
+  size_t mass_count;
+  _Bool ok = fscanf(file, "%zu", &mass_count) == 1 &&
+             mass_count == system->mass_count;
+  double sum = 0.0;
+  *accuracy = (Accuracy){.measured = true, .mass_count = mass_count};
+  for (size_t i = 0; i < system->mass_count && ok; ++i) {
+    double x;
+    double y;
+    ok = fscanf(file, "%lg %lg", &x, &y) == 2;
+    Vec2 position = system->masses.position[i];
+    double error = hypot(position.x - x, position.y - y);
+    // NaN positions count as infinitely far off
+    error = error == error ? error : INFINITY;
+    accuracy->max_error = fmax(accuracy->max_error, error);
+    sum += error * error;
+  }
+  fclose(file);
+  if (!ok) {
+    printf("ERROR: %s does not hold the positions of the accuracy run\n",
+           path);
+    accuracy->measured = false;
+    return false;
+  }
+  accuracy->rms_error = mass_count > 0 ? sqrt(sum / mass_count) : 0.0;
+  return true;
+}
+
+static double per_item_ns(double seconds, size_t count) {
+  return count > 0 ? seconds * 1e9 / count : 0.0;
+}
+
+static void result_print(const Result *result) {
+  printf("%-7s %8zu masses %8zu springs", scene_names[result->scene],
+         result->mass_count, result->spring_count);
+  for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+    // Spring forces scale with the springs, everything else with the masses
+    _Bool per_spring = phase == PHASE_SPRING_FORCES;
+    printf("  %s %.2f ns/%s", phase_names[phase],
+           per_item_ns(result->seconds[phase], per_spring
+                                                   ? result->spring_count
+                                                   : result->mass_count),
+           per_spring ? "spring" : "mass");
+  }
+  printf("\n");
+}
+
+static _Bool results_write_json(const char *path, const Options *options,
+                                const System *system, const Result *results,
+                                size_t result_count,
+                                const Accuracy *accuracy) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    printf("ERROR: Cannot open %s for writing\n", path);
+    return false;
+  }
+  fprintf(file,
+          "{\n"
+          "  \"revision\": \"%s\",\n"
+          "  \"precision\": \"%s\",\n"
+          "  \"threads\": %zu,\n"
+          "  \"steps\": %zu,\n"
+          "  \"dt\": %.9g,\n"
+          "  \"spring_kernel\": \"%s\",\n"
+          "  \"integrator\": \"%s\",\n"
+          "  \"solver\": \"%s\",\n",
+          BENCH_REVISION, SCALAR_NAME, options->threads, options->steps,
+          BENCH_DT, spring_kernel_name(system->spring_kernel),
+          integrator_name(options->integrator), solver_name(options->solver));
+  if (accuracy->measured) {
+    fprintf(file,
+            "  \"accuracy\": {\"reference\": \"%s\", \"masses\": %zu, "
+            "\"steps\": %d, \"max_error\": %.9g, \"rms_error\": %.9g},\n",
+            options->compare_positions, accuracy->mass_count, ACCURACY_STEPS,
+            accuracy->max_error, accuracy->rms_error);
+  }
+  fprintf(file, "  \"results\": [\n");
+  for (size_t i = 0; i < result_count; ++i) {
+    const Result *result = &results[i];
+    fprintf(file,
+            "    {\n"
+            "      \"scene\": \"%s\",\n"
+            "      \"masses\": %zu,\n"
+            "      \"springs\": %zu,\n"
+            "      \"phases\": {\n",
+            scene_names[result->scene], result->mass_count,
+            result->spring_count);
+    for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+      fprintf(file,
+              "        \"%s\": {\"seconds_per_step\": %.9g, "
+              "\"ns_per_mass\": %.6g, \"ns_per_spring\": %.6g}%s\n",
+              phase_names[phase], result->seconds[phase],
+              per_item_ns(result->seconds[phase], result->mass_count),
+              per_item_ns(result->seconds[phase], result->spring_count),
+              phase + 1 < PHASE_COUNT ? "," : "");
+    }
+    fprintf(file, "      }\n    }%s\n", i + 1 < result_count ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  _Bool ok = fclose(file) == 0;
+  if (!ok) {
+    printf("ERROR: Cannot write %s\n", path);
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  Options options = {
+      .steps = DEFAULT_STEPS,
+      .threads = sysconf(_SC_NPROCESSORS_ONLN),
+      .max_masses = DEFAULT_MAX_MASSES,
+  };
+  if (!parse_options(argc, argv, &options) || options.steps == 0) {
+    print_usage(argv[0]);
+    return argc > 1 && strcmp(argv[1], "--help") == 0 ? 0 : 1;
+  }
+
+  printf("Precision: %s\n", SCALAR_NAME);
+  Result results[SCENE_COUNT * GRID_SIDE_COUNT];
+  size_t result_count = 0;
+  System system = {0};
+  for (size_t scene = 0; scene < SCENE_COUNT; ++scene) {
+    for (size_t size = 0; size < GRID_SIDE_COUNT; ++size) {
+      size_t side = grid_sides[size];
+      if (!options.scenes[scene] || side * side > options.max_masses) {
+        continue;
+      }
+      system_free(&system);
+      system = (System){0};
+      system_set_thread_count(&system, options.threads);
+      system.spring_kernel = options.reference ? SPRING_KERNEL_REFERENCE
+                                               : SPRING_KERNEL_BATCHED;
+      scene_init(&system, scene, side);
+      Result *result = &results[result_count++];
+      result->scene = scene;
+      scene_run(&system, &options, result);
+      result_print(result);
+    }
+  }
+
+  int status = 0;
+  Accuracy accuracy = {0};
+  if (options.save_positions != NULL || options.compare_positions != NULL) {
+    system_free(&system);
+    system = (System){0};
+    accuracy_run(&system, &options);
+    if (options.save_positions != NULL &&
+        !positions_save(&system, options.save_positions)) {
+      status = 1;
+    }
+    if (options.compare_positions != NULL) {
+      if (positions_compare(&system, options.compare_positions, &accuracy)) {
+        printf("accuracy %8zu masses after %d steps  max error %.3g  rms "
+               "error %.3g\n",
+               accuracy.mass_count, ACCURACY_STEPS, accuracy.max_error,
+               accuracy.rms_error);
+      } else {
+        status = 1;
+      }
+    }
+  }
+  if (options.output != NULL &&
+      !results_write_json(options.output, &options, &system, results,
+                          result_count, &accuracy)) {
+    status = 1;
+  }
+  system_free(&system);
+  return status;
+}
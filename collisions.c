@@ -0,0 +1,451 @@
+#include "springs.h"
+#include "array.h"
+#include "profiler.h"
+#include "springs_internal.h"
+#include <math.h>
+#include <stdio.h>
+
+// Obstacles are few and large next to the masses, so their hash has coarse
+// cells of its own
+#define OBSTACLE_HASH_CELL_SIZE SCALAR_C(64.0)
+// Contacts are looked for every step, so a tight slack is worth the more
+// frequent rebuilds
+#define COLLISION_MAX_SLACK SCALAR_C(0.125)
+
+size_t system_add_obstacle(System *system, Obstacle obstacle) {
+  if (obstacle.kind >= OBSTACLE_COUNT) {
+    printf("ERROR: Unknown obstacle kind %d\n", (int)obstacle.kind);
+    return SIZE_MAX;
+  }
+  if (system->obstacle_count == system->obstacle_capacity) {
+    size_t capacity = system->obstacle_capacity < SYSTEM_MIN_CAPACITY
+                          ? SYSTEM_MIN_CAPACITY
+                          : 2 * system->obstacle_capacity;
+    _Bool ok = true;
+    ARRAY_RESIZE(system->obstacles, capacity, ok);
+    if (!ok) {
+      printf("ERROR: Cannot allocate memory for obstacles\n");
+      return SIZE_MAX;
+    }
+    system->obstacle_capacity = capacity;
+  }
+  system->obstacles[system->obstacle_count] = obstacle;
+  system->obstacle_hash_valid = false;
+  system_wake_all(system);
+  return system->obstacle_count++;
+}
+
+void system_clear_obstacles(System *system) {
+  system->obstacle_count = 0;
+  system->obstacle_hash_valid = false;
+  system_wake_all(system);
+}
+
+void system_free_collisions(System *system) {
+  free(system->obstacles);
+  system->obstacles = NULL;
+  system->obstacle_count = 0;
+  system->obstacle_capacity = 0;
+  spatial_hash_free(&system->obstacle_hash);
+  system->obstacle_hash_valid = false;
+  free(system->link_offset);
+  free(system->links);
+  system->link_offset = NULL;
+  system->links = NULL;
+  system->link_capacity = 0;
+  system->links_valid = false;
+}
+
+// Circles and segments by their middle, bounds are checked for every mass
+static _Bool obstacle_hash_point(const void *context, size_t i, Vec2 *point,
+                                 Scalar *reach) {
+  const Obstacle *obstacle = &((const System *)context)->obstacles[i];
+  if (obstacle->kind == OBSTACLE_CIRCLE) {
+    *point = obstacle->start;
+    *reach = obstacle->radius;
+    return true;
+  }
+  if (obstacle->kind == OBSTACLE_SEGMENT) {
+    *point = vec2_lerp(obstacle->start, obstacle->end, SCALAR_C(0.5));
+    *reach = SCALAR_C(0.5) * vec2_length(vec2_subtract(obstacle->end,
+                                                       obstacle->start)) +
+             obstacle->radius;
+    return true;
+  }
+  return false;
+}
+
+static _Bool system_obstacles_ready(System *system) {
+  if (system->obstacle_hash_valid) {
+    return true;
+  }
+  system->obstacle_bounds_count = 0;
+  system->obstacle_min = (Vec2){INFINITY, INFINITY};
+  system->obstacle_max = (Vec2){-INFINITY, -INFINITY};
+  for (size_t i = 0; i < system->obstacle_count; ++i) {
+    Vec2 point;
+    Scalar reach;
+    if (!obstacle_hash_point(system, i, &point, &reach)) {
+      ++system->obstacle_bounds_count;
+      continue;
+    }
+    system->obstacle_min =
+        (Vec2){scalar_min(system->obstacle_min.x, point.x - reach),
+               scalar_min(system->obstacle_min.y, point.y - reach)};
+    system->obstacle_max =
+        (Vec2){scalar_max(system->obstacle_max.x, point.x + reach),
+               scalar_max(system->obstacle_max.y, point.y + reach)};
+  }
+  system->obstacle_hash_valid =
+      spatial_hash_build(&system->obstacle_hash, system->obstacle_count,
+                         OBSTACLE_HASH_CELL_SIZE, obstacle_hash_point, system);
+  return system->obstacle_hash_valid;
+}
+
+static uint32_t adjacency_other(const System *system, uint32_t entry) {
+  return (entry & 1) ? system->springs.first[entry >> 1]
+                     : system->springs.second[entry >> 1];
+}
+
+// Appends other to the links of the mass whose links start at begin, unless
+// it is there already. Returns false if it runs out of memory.
+static _Bool link_append(System *system, size_t begin, uint32_t other) {
+  size_t end = system->link_offset[system->link_mass_count];
+  for (size_t k = begin; k < end; ++k) {
+    if (system->links[k] == other) {
+      return true;
+    }
+  }
+  if (end == system->link_capacity) {
+    size_t capacity = system->link_capacity < SYSTEM_MIN_CAPACITY
+                          ? SYSTEM_MIN_CAPACITY
+                          : 2 * system->link_capacity;
+    _Bool ok = true;
+    ARRAY_RESIZE(system->links, capacity, ok);
+    if (!ok) {
+      return false;
+    }
+    system->link_capacity = capacity;
+  }
+  system->links[end] = other;
+  ++system->link_offset[system->link_mass_count];
+  return true;
+}
+
+// Lists the masses at most two live springs away from each mass, as the
+// neighbors in a mesh are, which never collide with it
+static _Bool system_links_ready(System *system) {
+  if (system->links_valid) {
+    return true;
+  }
+  if (!system->adjacency_valid && !system_build_adjacency(system)) {
+    return false;
+  }
+  _Bool ok = true;
+  ARRAY_RESIZE(system->link_offset, system->mass_count + 1, ok);
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory for collision links\n");
+    return false;
+  }
+  const size_t *offset = system->adjacency_offset;
+  system->link_offset[0] = 0;
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    // Appending counts up the offset past the masses done so far
+    system->link_mass_count = i + 1;
+    system->link_offset[i + 1] = system->link_offset[i];
+    for (size_t a = offset[i]; a < offset[i + 1] && ok; ++a) {
+      uint32_t other = adjacency_other(system, system->adjacency[a]);
+      ok = link_append(system, system->link_offset[i], other);
+      for (size_t b = offset[other]; b < offset[other + 1] && ok; ++b) {
+        uint32_t next = adjacency_other(system, system->adjacency[b]);
+        ok = next == i || link_append(system, system->link_offset[i], next);
+      }
+    }
+    if (!ok) {
+      printf("ERROR: Cannot allocate memory for collision links\n");
+      return false;
+    }
+  }
+  system->links_valid = true;
+  return true;
+}
+
+static _Bool masses_linked(const System *system, uint32_t i, uint32_t j) {
+  for (size_t k = system->link_offset[i]; k < system->link_offset[i + 1];
+       ++k) {
+    if (system->links[k] == j) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Corrections gathered for one mass from all of its contacts, each computed
+// from the state before any correction is applied
+typedef struct {
+  const System *system;
+  uint32_t mass;
+  Vec2 position;
+  Vec2 velocity;
+  Scalar inverse_mass;
+  Vec2 position_change;
+  Vec2 velocity_change;
+  size_t contact_count;
+} MassContacts;
+
+// Moves the mass its share of depth out along normal, and takes the same
+// share of the relative velocity into the contact and of the sliding that
+// friction stops
+static void contact_resolve(MassContacts *contacts, Vec2 normal, Scalar depth,
+                            Vec2 relative_velocity, Scalar share) {
+  contacts->position_change = vec2_add(contacts->position_change,
+                                       vec2_scale(normal, depth * share));
+  Scalar approach = vec2_dot(relative_velocity, normal);
+  if (approach < SCALAR_C(0.0)) {
+    Vec2 sliding =
+        vec2_subtract(relative_velocity, vec2_scale(normal, approach));
+    Scalar sliding_speed = vec2_length(sliding);
+    Scalar friction = COLLISION_FRICTION * -approach;
+    Scalar stopped = sliding_speed > friction ? friction / sliding_speed
+                                              : SCALAR_C(1.0);
+    Vec2 change = vec2_add(vec2_scale(normal, approach),
+                           vec2_scale(sliding, stopped));
+    contacts->velocity_change =
+        vec2_subtract(contacts->velocity_change, vec2_scale(change, share));
+  }
+  ++contacts->contact_count;
+}
+
+static _Bool mass_contact_visit(void *context, uint32_t item) {
+  MassContacts *contacts = context;
+  const System *system = contacts->system;
+  const MassArrays *masses = &system->masses;
+  if (item == contacts->mass) {
+    return true;
+  }
+  Vec2 offset = vec2_subtract(contacts->position, masses->position[item]);
+  Scalar distance_squared = vec2_dot(offset, offset);
+  Scalar contact_distance = SCALAR_C(2.0) * MASS_RADIUS;
+  if (!(distance_squared < contact_distance * contact_distance) ||
+      masses_linked(system, contacts->mass, item)) {
+    return true;
+  }
+  // Sleeping masses do not move this step, so they give way like fixed ones
+  Scalar other_inverse_mass =
+      masses->fixed[item] || system_mass_asleep(system, item)
+          ? SCALAR_C(0.0)
+          : masses->inverse_mass[item];
+  Scalar share = contacts->inverse_mass /
+                 (contacts->inverse_mass + other_inverse_mass);
+  Scalar distance = scalar_sqrt(distance_squared);
+  // Masses on top of each other part along x, in opposite directions
+  Vec2 normal = distance > SCALAR_C(0.0)
+                    ? vec2_scale(offset, SCALAR_C(1.0) / distance)
+                    : (Vec2){contacts->mass < item ? SCALAR_C(-1.0)
+                                                   : SCALAR_C(1.0),
+                             SCALAR_C(0.0)};
+  contact_resolve(contacts, normal, contact_distance - distance,
+                  vec2_subtract(contacts->velocity, masses->velocity[item]),
+                  share);
+  return true;
+}
+
+// Contact with a circle or a capsule around a segment, given the closest
+// point of its center or its segment
+static void obstacle_contact(MassContacts *contacts, Vec2 closest,
+                             Scalar radius) {
+  Vec2 offset = vec2_subtract(contacts->position, closest);
+  Scalar distance_squared = vec2_dot(offset, offset);
+  Scalar contact_distance = radius + MASS_RADIUS;
+  if (!(distance_squared < contact_distance * contact_distance)) {
+    return;
+  }
+  Scalar distance = scalar_sqrt(distance_squared);
+  // A mass right on the center line leaves upwards
+  Vec2 normal = distance > SCALAR_C(0.0)
+                    ? vec2_scale(offset, SCALAR_C(1.0) / distance)
+                    : (Vec2){SCALAR_C(0.0), SCALAR_C(-1.0)};
+  contact_resolve(contacts, normal, contact_distance - distance,
+                  contacts->velocity, SCALAR_C(1.0));
+}
+
+static Vec2 segment_closest_point(Vec2 p, Vec2 a, Vec2 b) {
+  Vec2 ab = vec2_subtract(b, a);
+  Scalar length_squared = vec2_dot(ab, ab);
+  Scalar t = length_squared > SCALAR_C(0.0)
+                 ? vec2_dot(vec2_subtract(p, a), ab) / length_squared
+                 : SCALAR_C(0.0);
+  t = t < SCALAR_C(0.0) ? SCALAR_C(0.0)
+                        : (t > SCALAR_C(1.0) ? SCALAR_C(1.0) : t);
+  return vec2_add(a, vec2_scale(ab, t));
+}
+
+static _Bool obstacle_contact_visit(void *context, uint32_t item) {
+  MassContacts *contacts = context;
+  const Obstacle *obstacle = &contacts->system->obstacles[item];
+  Vec2 closest = obstacle->kind == OBSTACLE_CIRCLE
+                     ? obstacle->start
+                     : segment_closest_point(contacts->position,
+                                             obstacle->start, obstacle->end);
+  obstacle_contact(contacts, closest, obstacle->radius);
+  return true;
+}
+
+// Keeps the whole sphere of the mass inside the box, one axis at a time
+static void bounds_contact(MassContacts *contacts, const Obstacle *bounds) {
+  Scalar min[2] = {scalar_min(bounds->start.x, bounds->end.x) + MASS_RADIUS,
+                   scalar_min(bounds->start.y, bounds->end.y) + MASS_RADIUS};
+  Scalar max[2] = {scalar_max(bounds->start.x, bounds->end.x) - MASS_RADIUS,
+                   scalar_max(bounds->start.y, bounds->end.y) - MASS_RADIUS};
+  Scalar position[2] = {contacts->position.x, contacts->position.y};
+  for (int axis = 0; axis < 2; ++axis) {
+    Vec2 normal = vec2_zero();
+    Scalar depth = SCALAR_C(0.0);
+    if (position[axis] < min[axis]) {
+      depth = min[axis] - position[axis];
+      *(axis == 0 ? &normal.x : &normal.y) = SCALAR_C(1.0);
+    } else if (position[axis] > max[axis]) {
+      depth = position[axis] - max[axis];
+      *(axis == 0 ? &normal.x : &normal.y) = SCALAR_C(-1.0);
+    }
+    if (depth > SCALAR_C(0.0)) {
+      contact_resolve(contacts, normal, depth, contacts->velocity,
+                      SCALAR_C(1.0));
+    }
+  }
+}
+
+typedef struct {
+  Vec2 *position_change;
+  Vec2 *velocity_change;
+  Scalar reach; // Half the side of the query box around a mass
+} ContactPass;
+
+static MassContacts mass_contacts_init(const System *system, size_t i) {
+  const MassArrays *masses = &system->masses;
+  return (MassContacts){
+      .system = system,
+      .mass = i,
+      .position = masses->position[i],
+      .velocity = masses->velocity[i],
+      .inverse_mass = masses->inverse_mass[i],
+      .position_change = vec2_zero(),
+      .velocity_change = vec2_zero(),
+  };
+}
+
+// Gathers the corrections of masses [begin, end) from their contacts with the
+// other masses, and returns how many contacts there were. Every mass only
+// writes its own corrections, so the masses can be spread over threads.
+static double mass_contact_sum(System *system, size_t begin, size_t end,
+                               void *argument) {
+  ContactPass *pass = argument;
+  const MassArrays *masses = &system->masses;
+  Vec2 extent = {pass->reach, pass->reach};
+  size_t contact_count = 0;
+  for (size_t i = begin; i < end; ++i) {
+    pass->position_change[i] = vec2_zero();
+    pass->velocity_change[i] = vec2_zero();
+    if (masses->fixed[i] || system_mass_asleep(system, i)) {
+      continue;
+    }
+    MassContacts contacts = mass_contacts_init(system, i);
+    spatial_hash_query(&system->mass_hash,
+                       vec2_subtract(contacts.position, extent),
+                       vec2_add(contacts.position, extent),
+                       mass_contact_visit, &contacts);
+    // Summed rather than averaged as in Jacobi XPBD. Each contact only moves
+    // the mass its share of the overlap, and averaging left piles of cloth
+    // sinking into themselves.
+    pass->position_change[i] = contacts.position_change;
+    pass->velocity_change[i] = contacts.velocity_change;
+    contact_count += contacts.contact_count;
+  }
+  return contact_count;
+}
+
+static void mass_contact_apply_range(System *system, size_t begin, size_t end,
+                                     void *argument) {
+  ContactPass *pass = argument;
+  MassArrays *masses = &system->masses;
+  for (size_t i = begin; i < end; ++i) {
+    masses->position[i] =
+        vec2_add(masses->position[i], pass->position_change[i]);
+    masses->velocity[i] =
+        vec2_add(masses->velocity[i], pass->velocity_change[i]);
+  }
+}
+
+// Moves masses [begin, end) out of the obstacles in full, as the obstacles do
+// not give way, and returns how many contacts there were
+static double obstacle_contact_sum(System *system, size_t begin, size_t end,
+                                   void *argument) {
+  (void)argument;
+  MassArrays *masses = &system->masses;
+  Vec2 extent = {MASS_RADIUS, MASS_RADIUS};
+  size_t contact_count = 0;
+  for (size_t i = begin; i < end; ++i) {
+    if (masses->fixed[i] || system_mass_asleep(system, i)) {
+      continue;
+    }
+    MassContacts contacts = mass_contacts_init(system, i);
+    // Most masses are nowhere near any circle or segment
+    Vec2 p = contacts.position;
+    if (p.x + MASS_RADIUS >= system->obstacle_min.x &&
+        p.x - MASS_RADIUS <= system->obstacle_max.x &&
+        p.y + MASS_RADIUS >= system->obstacle_min.y &&
+        p.y - MASS_RADIUS <= system->obstacle_max.y) {
+      spatial_hash_query(&system->obstacle_hash, vec2_subtract(p, extent),
+                         vec2_add(p, extent), obstacle_contact_visit,
+                         &contacts);
+    }
+    for (size_t k = 0;
+         system->obstacle_bounds_count > 0 && k < system->obstacle_count;
+         ++k) {
+      if (system->obstacles[k].kind == OBSTACLE_BOUNDS) {
+        bounds_contact(&contacts, &system->obstacles[k]);
+      }
+    }
+    if (contacts.contact_count > 0) {
+      masses->position[i] = vec2_add(contacts.position,
+                                     contacts.position_change);
+      masses->velocity[i] = vec2_add(contacts.velocity,
+                                     contacts.velocity_change);
+      contact_count += contacts.contact_count;
+    }
+  }
+  return contact_count;
+}
+
+// Masses first push each other apart, then the obstacles push them out, so
+// no mass ends the step inside an obstacle
+void system_collide(System *system) {
+  system->contact_count = 0;
+  if (system->collide_masses) {
+    PROFILE_SCOPE(PROFILE_ZONE_COLLIDE);
+    size_t n = system->mass_count;
+    Vec2 *scratch = system_mass_scratch(system, 2);
+    // The step moved the masses since the hashes were last brought up to date
+    system->hash_moved = true;
+    if (scratch != NULL &&
+        system_hashes_ready(system, COLLISION_MAX_SLACK, false) &&
+        system_links_ready(system)) {
+      // Masses are bucketed where they were at the last build, up to the
+      // slack away from where they are now
+      ContactPass pass = {scratch, scratch + n,
+                          SCALAR_C(2.0) * MASS_RADIUS + system->hash_slack};
+      size_t contact_count =
+          system_parallel_sum(system, n, mass_contact_sum, &pass);
+      if (contact_count > 0) {
+        system_parallel_for(system, n, mass_contact_apply_range, &pass);
+      }
+      system->contact_count += contact_count;
+    }
+  }
+  if (system->obstacle_count > 0 && system_obstacles_ready(system)) {
+    PROFILE_SCOPE(PROFILE_ZONE_COLLIDE);
+    system->contact_count += system_parallel_sum(
+        system, system->mass_count, obstacle_contact_sum, NULL);
+  }
+  PROFILE_COUNT(PROFILE_COUNTER_CONTACTS, system->contact_count);
+}
@@ -0,0 +1,155 @@
+#include "draw_cache.h"
+#include "array.h"
+#include "raymath.h"
+#include "springs_internal.h"
+#include <math.h>
+#include <stdio.h>
+
+#define SPRING_MIN_SPAN 1e-6f // Below which springs are drawn fully compressed
+// Per mass state bits
+#define MASS_PACKED 1  // By the last update
+#define MASS_SETTLED 2 // Asleep and drawn where it rests
+
+static Color color_lerp(Color c1, Color c2, double amount) {
+  Vector4 v1 = (Vector4){c1.r, c1.g, c1.b, c1.a};
+  Vector4 v2 = (Vector4){c2.r, c2.g, c2.b, c2.a};
+  Vector4 lerped = Vector4Lerp(v1, v2, Clamp(amount, 0.0f, 1.0f));
+  return (Color){lerped.x, lerped.y, lerped.z, lerped.w};
+}
+
+void draw_cache_free(DrawCache *cache) {
+  free(cache->masses);
+  free(cache->springs);
+  free(cache->state);
+  *cache = (DrawCache){0};
+}
+
+void draw_cache_invalidate(DrawCache *cache) { cache->valid = false; }
+
+static _Bool draw_cache_reserve(DrawCache *cache, size_t mass_count,
+                                size_t spring_count) {
+  _Bool ok = true;
+  if (mass_count > cache->mass_capacity) {
+    ARRAY_RESIZE(cache->masses, mass_count, ok);
+    ARRAY_RESIZE(cache->state, mass_count, ok);
+    cache->mass_capacity = ok ? mass_count : 0;
+  }
+  if (ok && spring_count > cache->spring_capacity) {
+    ARRAY_RESIZE(cache->springs, spring_count, ok);
+    cache->spring_capacity = ok ? spring_count : 0;
+  }
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory for the draw cache\n");
+  }
+  return ok;
+}
+
+static void mass_pack(DrawCache *cache, const System *system, size_t i,
+                      double alpha) {
+  const MassArrays *masses = &system->masses;
+  Vec2 position =
+      vec2_lerp(masses->previous_position[i], masses->position[i], alpha);
+  cache->masses[i] = (MassDraw){
+      {position.x, position.y},
+      color_lerp(BLUE, RED,
+                 vec2_length(masses->velocity[i]) / MASS_COLOR_SCALE)};
+}
+
+// Reads the endpoints back from the packed masses
+static void spring_pack(DrawCache *cache, const System *system, size_t i) {
+  const SpringArrays *springs = &system->springs;
+  Vector2 first = cache->masses[springs->first[i]].position;
+  if (springs->cut[i]) {
+    cache->springs[i] = (SpringDraw){first, first, BLANK};
+    return;
+  }
+  Vector2 second = cache->masses[springs->second[i]].position;
+  float span = fmaxf(Vector2Distance(first, second), SPRING_MIN_SPAN);
+  float stretch = (springs->length[i] - span) / span;
+  Color c = stretch < 0.0f ? color_lerp(WHITE, RED, -stretch)
+                           : color_lerp(WHITE, BLUE, stretch);
+  cache->springs[i] = (SpringDraw){first, second, c};
+}
+
+// Settled masses stay where they were drawn until their island wakes
+static _Bool mass_settles(const System *system, size_t i) {
+  const MassArrays *masses = &system->masses;
+  return system_mass_asleep(system, i) &&
+         masses->previous_position[i].x == masses->position[i].x &&
+         masses->previous_position[i].y == masses->position[i].y;
+}
+
+_Bool draw_cache_update(DrawCache *cache, const System *system, double alpha) {
+  const SpringArrays *springs = &system->springs;
+  size_t mass_count = system->mass_count;
+  size_t spring_count = system->active_spring_count;
+  _Bool masses_valid = cache->valid && cache->system == system &&
+                       cache->mass_count == mass_count &&
+                       cache->id_version == system->id_version &&
+                       cache->mass_order_version == system->mass_order_version;
+  _Bool springs_valid = masses_valid && cache->spring_count == spring_count &&
+                        cache->topology_version == system->topology_version;
+  _Bool moved = cache->motion_version != system->motion_version ||
+                (cache->alpha != alpha && cache->unsettled_count > 0);
+  ++cache->revision;
+  cache->mass_begin = cache->mass_end = 0;
+  cache->spring_begin = cache->spring_end = 0;
+  if (springs_valid && !moved) {
+    return true;
+  }
+  if (!draw_cache_reserve(cache, mass_count, spring_count)) {
+    cache->mass_count = cache->spring_count = 0;
+    cache->valid = false;
+    return false;
+  }
+  // Masses first, as the springs read their packed endpoints back
+  size_t mass_begin = mass_count;
+  size_t mass_end = 0;
+  cache->unsettled_count = 0;
+  for (size_t i = 0; i < mass_count; ++i) {
+    if (masses_valid && (cache->state[i] & MASS_SETTLED) &&
+        system_mass_asleep(system, i)) {
+      cache->state[i] = MASS_SETTLED;
+      continue;
+    }
+    mass_pack(cache, system, i, alpha);
+    _Bool settled = mass_settles(system, i);
+    cache->state[i] = MASS_PACKED | (settled ? MASS_SETTLED : 0);
+    cache->unsettled_count += !settled;
+    mass_begin = i < mass_begin ? i : mass_begin;
+    mass_end = i + 1;
+  }
+  // Springs on repacked masses, everything after topology changes
+  size_t spring_begin = spring_count;
+  size_t spring_end = 0;
+  for (size_t i = 0; i < spring_count; ++i) {
+    if (springs_valid &&
+        !((cache->state[springs->first[i]] |
+           cache->state[springs->second[i]]) &
+          MASS_PACKED)) {
+      continue;
+    }
+    spring_pack(cache, system, i);
+    spring_begin = i < spring_begin ? i : spring_begin;
+    spring_end = i + 1;
+  }
+
+  if (mass_begin < mass_end) {
+    cache->mass_begin = mass_begin;
+    cache->mass_end = mass_end;
+  }
+  if (spring_begin < spring_end) {
+    cache->spring_begin = spring_begin;
+    cache->spring_end = spring_end;
+  }
+  cache->mass_count = mass_count;
+  cache->spring_count = spring_count;
+  cache->system = system;
+  cache->id_version = system->id_version;
+  cache->mass_order_version = system->mass_order_version;
+  cache->topology_version = system->topology_version;
+  cache->motion_version = system->motion_version;
+  cache->alpha = alpha;
+  cache->valid = true;
+  return true;
+}
@@ -0,0 +1,65 @@
+#ifndef DRAW_CACHE_H
+#define DRAW_CACHE_H
+
+#include "raylib.h"
+#include "springs.h"
+#include <stdint.h>
+
+#define MASS_COLOR_SCALE 100.0f // Speed at which masses are drawn fully red
+
+// What a mass or spring is drawn as, laid out as the instances of the mesh
+// renderer. Cut springs collapse onto their first endpoint and are clear.
+typedef struct {
+  Vector2 position;
+  Color color;
+} MassDraw;
+
+typedef struct {
+  Vector2 first;
+  Vector2 second;
+  Color color;
+} SpringDraw;
+
+// The interpolated positions and the stress and speed colors of a system, kept
+// from frame to frame. Updates only pack the masses again that may have moved
+// since, and then the springs on them, so redrawing a paused or sleeping
+// system costs nothing. Settled masses, asleep and resting where they were
+// drawn last, are skipped. Topology changes pack every spring again, and
+// adding, removing or reordering masses packs everything.
+typedef struct {
+  MassDraw *masses;
+  SpringDraw *springs; // Per active spring
+  uint8_t *state;      // Per mass, whether it was packed and settled
+  size_t mass_count;
+  size_t spring_count;
+  size_t mass_capacity;
+  size_t spring_capacity;
+  size_t unsettled_count;
+
+  // Instances packed by the last update, end at zero if none
+  size_t mass_begin;
+  size_t mass_end;
+  size_t spring_begin;
+  size_t spring_end;
+  size_t revision; // Bumped by every update
+
+  // Of the system, as last packed
+  const System *system;
+  size_t id_version;
+  size_t mass_order_version;
+  size_t topology_version;
+  size_t motion_version;
+  double alpha;
+  _Bool valid;
+} DrawCache;
+
+void draw_cache_free(DrawCache *cache);
+// Packs everything again on the next update, for when the system was replaced
+// by loading or freed
+void draw_cache_invalidate(DrawCache *cache);
+// Brings the cache up to date with system at positions interpolated alpha of
+// the way from the previous physics state to the current one. Returns false
+// if out of memory, leaving the cache empty.
+_Bool draw_cache_update(DrawCache *cache, const System *system, double alpha);
+
+#endif
@@ -0,0 +1,428 @@
+#include "ensemble.h"
+#include "array.h"
+#include "springs_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define QUEUE_TAKEN UINT32_MAX
+
+_Bool ensemble_init(Ensemble *ensemble, size_t count, size_t thread_count) {
+  *ensemble = (Ensemble){0};
+  ensemble->thread_count = thread_count > 0 ? thread_count : 1;
+  ensemble->systems = calloc(count + 1, sizeof(*ensemble->systems));
+  ensemble->queues =
+      aligned_alloc(_Alignof(EnsembleQueue),
+                    ensemble->thread_count * sizeof(*ensemble->queues));
+  if (ensemble->systems == NULL || ensemble->queues == NULL) {
+    printf("ERROR: Cannot allocate memory for the ensemble\n");
+    ensemble_free(ensemble);
+    return false;
+  }
+  ensemble->count = count;
+  if (ensemble->thread_count > 1) {
+    ensemble->pool = malloc(sizeof(*ensemble->pool));
+    if (ensemble->pool == NULL ||
+        !thread_pool_init(ensemble->pool, ensemble->thread_count - 1)) {
+      printf("ERROR: Cannot start worker threads\n");
+      free(ensemble->pool);
+      ensemble->pool = NULL;
+      ensemble->thread_count = 1;
+    }
+  }
+  return true;
+}
+
+static void batch_free(EnsembleBatch *batch) {
+  free(batch->position_x);
+  free(batch->position_y);
+  free(batch->velocity_x);
+  free(batch->velocity_y);
+  free(batch->force_x);
+  free(batch->force_y);
+  free(batch->inverse_mass);
+  free(batch->strength);
+  free(batch->dampening);
+  free(batch->spring_force_x);
+  free(batch->spring_force_y);
+  *batch = (EnsembleBatch){0};
+}
+
+void ensemble_free(Ensemble *ensemble) {
+  for (size_t i = 0; i < ensemble->count; ++i) {
+    system_free(&ensemble->systems[i]);
+  }
+  for (size_t i = 0; i < ensemble->batch_capacity; ++i) {
+    batch_free(&ensemble->batches[i]);
+  }
+  if (ensemble->pool != NULL) {
+    thread_pool_free(ensemble->pool);
+    free(ensemble->pool);
+  }
+  free(ensemble->systems);
+  free(ensemble->queues);
+  free(ensemble->batches);
+  *ensemble = (Ensemble){0};
+}
+
+// Whether the member takes the one path the lanes implement. Brings its
+// adjacency and force field sum up to date, as the lanes use them.
+static _Bool member_fits_lanes(System *system) {
+  if (system->solver != SOLVER_FORCES ||
+      system->integrator != INTEGRATOR_SEMI_IMPLICIT_EULER ||
+      system->spring_kernel != SPRING_KERNEL_BATCHED ||
+      system->sleep_islands || system->sleeping_island_count > 0 ||
+      system->collide_masses || system->obstacle_count > 0 ||
+      system->tear_springs || system->pool != NULL) {
+    return false;
+  }
+  if (!system->adjacency_valid && !system_build_adjacency(system)) {
+    return false;
+  }
+  system_sum_force_fields(system);
+  return system->force_field_sum.local_count == 0;
+}
+
+// Whether member b can share the lanes of a, which fits them
+static _Bool members_share_lanes(const System *a, const System *b) {
+  size_t n = a->mass_count;
+  size_t s = a->active_spring_count;
+  return b->mass_count == n && b->active_spring_count == s &&
+         a->force_field_sum.acceleration.x ==
+             b->force_field_sum.acceleration.x &&
+         a->force_field_sum.acceleration.y ==
+             b->force_field_sum.acceleration.y &&
+         a->force_field_sum.drag == b->force_field_sum.drag &&
+         memcmp(a->masses.fixed, b->masses.fixed, n) == 0 &&
+         memcmp(a->springs.first, b->springs.first, s * sizeof(uint32_t)) ==
+             0 &&
+         memcmp(a->springs.second, b->springs.second, s * sizeof(uint32_t)) ==
+             0 &&
+         memcmp(a->springs.length, b->springs.length, s * sizeof(Scalar)) ==
+             0 &&
+         memcmp(a->springs.cut, b->springs.cut, s) == 0;
+}
+
+static _Bool batch_reserve(EnsembleBatch *batch, size_t mass_count,
+                           size_t spring_count) {
+  _Bool ok = true;
+  if (mass_count > batch->mass_capacity) {
+    size_t capacity = mass_count * ENSEMBLE_LANES;
+    ARRAY_RESIZE(batch->position_x, capacity, ok);
+    ARRAY_RESIZE(batch->position_y, capacity, ok);
+    ARRAY_RESIZE(batch->velocity_x, capacity, ok);
+    ARRAY_RESIZE(batch->velocity_y, capacity, ok);
+    ARRAY_RESIZE(batch->force_x, capacity, ok);
+    ARRAY_RESIZE(batch->force_y, capacity, ok);
+    ARRAY_RESIZE(batch->inverse_mass, capacity, ok);
+    if (ok) {
+      batch->mass_capacity = mass_count;
+    }
+  }
+  if (ok && spring_count > batch->spring_capacity) {
+    size_t capacity = spring_count * ENSEMBLE_LANES;
+    ARRAY_RESIZE(batch->strength, capacity, ok);
+    ARRAY_RESIZE(batch->dampening, capacity, ok);
+    ARRAY_RESIZE(batch->spring_force_x, capacity, ok);
+    ARRAY_RESIZE(batch->spring_force_y, capacity, ok);
+    if (ok) {
+      batch->spring_capacity = spring_count;
+    }
+  }
+  return ok;
+}
+
+// Splits the members into batches: runs of up to ENSEMBLE_LANES members that
+// share their lanes, and members stepped alone. Returns false if it runs out
+// of memory.
+static _Bool ensemble_plan(Ensemble *ensemble) {
+  if (ensemble->count > ensemble->batch_capacity) {
+    _Bool ok = true;
+    ARRAY_RESIZE(ensemble->batches, ensemble->count, ok);
+    if (!ok) {
+      printf("ERROR: Cannot allocate memory for the ensemble\n");
+      return false;
+    }
+    for (size_t i = ensemble->batch_capacity; i < ensemble->count; ++i) {
+      ensemble->batches[i] = (EnsembleBatch){0};
+    }
+    ensemble->batch_capacity = ensemble->count;
+  }
+  // Batches keep their lane memory from earlier steps, wherever they start
+  ensemble->batch_count = 0;
+  ensemble->interleaved_count = 0;
+  for (size_t i = 0; i < ensemble->count;) {
+    EnsembleBatch *batch = &ensemble->batches[ensemble->batch_count++];
+    System *first = &ensemble->systems[i];
+    size_t count = 1;
+    if (ensemble->interleave && member_fits_lanes(first)) {
+      while (count < ENSEMBLE_LANES && i + count < ensemble->count &&
+             member_fits_lanes(&ensemble->systems[i + count]) &&
+             members_share_lanes(first, &ensemble->systems[i + count])) {
+        ++count;
+      }
+      if (count > 1 && !batch_reserve(batch, first->mass_count,
+                                      first->active_spring_count)) {
+        printf("ERROR: Cannot allocate memory for ensemble lanes\n");
+        count = 1;
+      }
+    }
+    batch->first = i;
+    batch->count = count;
+    ensemble->interleaved_count += count > 1 ? count : 0;
+    i += count;
+  }
+  return true;
+}
+
+// Copies the state of the members into the lanes. Lanes without a member
+// step a copy of the first one, which is never copied back.
+static void batch_pack(EnsembleBatch *batch, System *systems) {
+  const System *first = &systems[batch->first];
+  for (size_t lane = 0; lane < ENSEMBLE_LANES; ++lane) {
+    const System *system =
+        &systems[batch->first + (lane < batch->count ? lane : 0)];
+    const MassArrays *masses = &system->masses;
+    const SpringArrays *springs = &system->springs;
+    for (size_t i = 0; i < first->mass_count; ++i) {
+      size_t k = i * ENSEMBLE_LANES + lane;
+      batch->position_x[k] = masses->position[i].x;
+      batch->position_y[k] = masses->position[i].y;
+      batch->velocity_x[k] = masses->velocity[i].x;
+      batch->velocity_y[k] = masses->velocity[i].y;
+      batch->force_x[k] = masses->force[i].x;
+      batch->force_y[k] = masses->force[i].y;
+      batch->inverse_mass[k] = masses->inverse_mass[i];
+    }
+    for (size_t i = 0; i < first->active_spring_count; ++i) {
+      size_t k = i * ENSEMBLE_LANES + lane;
+      batch->strength[k] = springs->strength[i];
+      batch->dampening[k] = springs->dampening[i];
+    }
+  }
+}
+
+static void batch_unpack(const EnsembleBatch *batch, System *systems,
+                         size_t steps, double dt) {
+  for (size_t lane = 0; lane < batch->count; ++lane) {
+    System *system = &systems[batch->first + lane];
+    MassArrays *masses = &system->masses;
+    for (size_t i = 0; i < system->mass_count; ++i) {
+      size_t k = i * ENSEMBLE_LANES + lane;
+      masses->position[i] = (Vec2){batch->position_x[k], batch->position_y[k]};
+      masses->velocity[i] = (Vec2){batch->velocity_x[k], batch->velocity_y[k]};
+      masses->force[i] = vec2_zero();
+    }
+    for (size_t i = 0; i < steps; ++i) {
+      system->time += dt;
+    }
+    system->hash_moved = true;
+    ++system->motion_version;
+  }
+}
+
+// The spring kernel over the lanes, with the same operations in the same
+// order as spring_force_one, so every lane gets the forces to the bit. Each
+// spring is one vector of lanes, its masses two more.
+SPRING_KERNEL_CLONES
+static void lanes_spring_kernel(
+    size_t count, const uint32_t *restrict first,
+    const uint32_t *restrict second, const Scalar *restrict length,
+    const Scalar *restrict strength, const Scalar *restrict dampening,
+    const Scalar *restrict position_x, const Scalar *restrict position_y,
+    const Scalar *restrict velocity_x, const Scalar *restrict velocity_y,
+    Scalar *restrict force_x, Scalar *restrict force_y) {
+  for (size_t i = 0; i < count; ++i) {
+    size_t m1 = first[i] * ENSEMBLE_LANES;
+    size_t m2 = second[i] * ENSEMBLE_LANES;
+    size_t s = i * ENSEMBLE_LANES;
+    for (size_t l = 0; l < ENSEMBLE_LANES; ++l) {
+      Scalar dx = position_x[m2 + l] - position_x[m1 + l];
+      Scalar dy = position_y[m2 + l] - position_y[m1 + l];
+      Scalar span_length = scalar_sqrt(dx * dx + dy * dy);
+      Scalar inverse_length =
+          SCALAR_C(1.0) /
+          (span_length > SCALAR_C(0.0) ? span_length : SCALAR_C(1.0));
+      Scalar nx = dx * inverse_length;
+      Scalar ny = dy * inverse_length;
+
+      Scalar displacement = length[i] - span_length;
+      Scalar displacement_rate =
+          (velocity_x[m1 + l] - velocity_x[m2 + l]) * nx +
+          (velocity_y[m1 + l] - velocity_y[m2 + l]) * ny;
+      Scalar magnitude = -(strength[s + l] * displacement +
+                           dampening[s + l] * displacement_rate);
+      force_x[s + l] = nx * magnitude;
+      force_y[s + l] = ny * magnitude;
+    }
+  }
+}
+
+// Clamps the spring forces as force_accumulate would on either mass, which
+// comes to the same once per spring. Branch free, scaling by one leaves the
+// forces within FORCES_CONSTRAINT be. Like the rest of the mass sweep, and
+// unlike the spring kernel, it is built for the baseline instruction set
+// alone.
+static void lanes_clamp_kernel(size_t count, Scalar *restrict force_x,
+                               Scalar *restrict force_y) {
+  for (size_t i = 0; CONSTRAIN_FORCES && i < count * ENSEMBLE_LANES; ++i) {
+    Scalar length_squared = force_x[i] * force_x[i] + force_y[i] * force_y[i];
+    Scalar length = scalar_sqrt(length_squared);
+    Scalar scale = length_squared > SCALAR_C(0.0) &&
+                           length > (Scalar)FORCES_CONSTRAINT
+                       ? (Scalar)FORCES_CONSTRAINT / length
+                       : SCALAR_C(1.0);
+    force_x[i] *= scale;
+    force_y[i] *= scale;
+  }
+}
+
+// Adds the spring forces on every free mass to its force
+static void lanes_gather_kernel(size_t count, const _Bool *restrict fixed,
+                                const size_t *restrict offset,
+                                const uint32_t *restrict adjacency,
+                                const Scalar *restrict spring_force_x,
+                                const Scalar *restrict spring_force_y,
+                                Scalar *restrict force_x,
+                                Scalar *restrict force_y) {
+  for (size_t i = 0; i < count; ++i) {
+    if (fixed[i]) {
+      continue;
+    }
+    Scalar *x = force_x + i * ENSEMBLE_LANES;
+    Scalar *y = force_y + i * ENSEMBLE_LANES;
+    for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
+      size_t s = (adjacency[j] >> 1) * ENSEMBLE_LANES;
+      Scalar sign = (adjacency[j] & 1) ? SCALAR_C(-1.0) : SCALAR_C(1.0);
+      for (size_t l = 0; l < ENSEMBLE_LANES; ++l) {
+        x[l] += sign * spring_force_x[s + l];
+        y[l] += sign * spring_force_y[s + l];
+      }
+    }
+  }
+}
+
+// Integrates the free masses with the force fields and their gathered forces
+// as fused_euler_range does, and resets the forces of all of them
+static void lanes_euler_kernel(
+    size_t count, const _Bool *restrict fixed, Vec2 gravity, Scalar drag,
+    Scalar dt, const Scalar *restrict inverse_mass,
+    Scalar *restrict position_x, Scalar *restrict position_y,
+    Scalar *restrict velocity_x, Scalar *restrict velocity_y,
+    Scalar *restrict force_x, Scalar *restrict force_y) {
+  for (size_t i = 0; i < count; ++i) {
+    size_t m = i * ENSEMBLE_LANES;
+    for (size_t l = 0; !fixed[i] && l < ENSEMBLE_LANES; ++l) {
+      size_t k = m + l;
+      Scalar ax = gravity.x;
+      Scalar ay = gravity.y;
+      if (drag != SCALAR_C(0.0)) {
+        ax = ax - velocity_x[k] * drag;
+        ay = ay - velocity_y[k] * drag;
+      }
+      ax = ax + force_x[k] * inverse_mass[k];
+      ay = ay + force_y[k] * inverse_mass[k];
+      velocity_x[k] = velocity_x[k] + ax * dt;
+      velocity_y[k] = velocity_y[k] + ay * dt;
+      position_x[k] = position_x[k] + velocity_x[k] * dt;
+      position_y[k] = position_y[k] + velocity_y[k] * dt;
+    }
+    for (size_t l = 0; l < ENSEMBLE_LANES; ++l) {
+      force_x[m + l] = SCALAR_C(0.0);
+      force_y[m + l] = SCALAR_C(0.0);
+    }
+  }
+}
+
+static void batch_step(EnsembleBatch *batch, System *systems, size_t steps,
+                       double dt) {
+  if (batch->count == 1) {
+    for (size_t i = 0; i < steps; ++i) {
+      system_step(&systems[batch->first], dt);
+    }
+    return;
+  }
+  const System *first = &systems[batch->first];
+  batch_pack(batch, systems);
+  for (size_t i = 0; i < steps; ++i) {
+    lanes_spring_kernel(first->active_spring_count, first->springs.first,
+                        first->springs.second, first->springs.length,
+                        batch->strength, batch->dampening, batch->position_x,
+                        batch->position_y, batch->velocity_x,
+                        batch->velocity_y, batch->spring_force_x,
+                        batch->spring_force_y);
+    lanes_clamp_kernel(first->active_spring_count, batch->spring_force_x,
+                       batch->spring_force_y);
+    lanes_gather_kernel(first->mass_count, first->masses.fixed,
+                        first->adjacency_offset, first->adjacency,
+                        batch->spring_force_x, batch->spring_force_y,
+                        batch->force_x, batch->force_y);
+    lanes_euler_kernel(first->mass_count, first->masses.fixed,
+                       first->force_field_sum.acceleration,
+                       first->force_field_sum.drag, dt, batch->inverse_mass,
+                       batch->position_x, batch->position_y,
+                       batch->velocity_x, batch->velocity_y, batch->force_x,
+                       batch->force_y);
+  }
+  batch_unpack(batch, systems, steps, dt);
+}
+
+// Takes the next batch off the front of a queue, or off the back when
+// stealing, or returns QUEUE_TAKEN if it is empty
+static uint32_t queue_take(EnsembleQueue *queue, _Bool steal) {
+  uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_ACQUIRE);
+  while (true) {
+    uint32_t next = range >> 32;
+    uint32_t end = (uint32_t)range;
+    if (next >= end) {
+      return QUEUE_TAKEN;
+    }
+    uint64_t taken = steal ? (uint64_t)next << 32 | (end - 1)
+                           : (uint64_t)(next + 1) << 32 | end;
+    if (__atomic_compare_exchange_n(&queue->range, &range, taken, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return steal ? end - 1 : next;
+    }
+  }
+}
+
+typedef struct {
+  Ensemble *ensemble;
+  size_t steps;
+  double dt;
+} EnsembleJob;
+
+// Runs the batches of one queue, then steals from the others in turn until
+// every queue is empty
+static void ensemble_worker(void *context, size_t worker) {
+  EnsembleJob *job = context;
+  Ensemble *ensemble = job->ensemble;
+  size_t thread_count = ensemble->thread_count;
+  for (size_t k = 0; k < thread_count; ++k) {
+    EnsembleQueue *queue = &ensemble->queues[(worker + k) % thread_count];
+    uint32_t batch;
+    while ((batch = queue_take(queue, k > 0)) != QUEUE_TAKEN) {
+      batch_step(&ensemble->batches[batch], ensemble->systems, job->steps,
+                 job->dt);
+    }
+  }
+}
+
+void ensemble_step(Ensemble *ensemble, size_t steps, double dt) {
+  if (!ensemble_plan(ensemble)) {
+    return;
+  }
+  // Every thread starts with an even share of the batches
+  size_t thread_count = ensemble->thread_count;
+  for (size_t i = 0; i < thread_count; ++i) {
+    uint64_t begin = ensemble->batch_count * i / thread_count;
+    uint64_t end = ensemble->batch_count * (i + 1) / thread_count;
+    ensemble->queues[i].range = begin << 32 | end;
+  }
+  EnsembleJob job = {ensemble, steps, dt};
+  if (ensemble->pool == NULL) {
+    ensemble_worker(&job, 0);
+  } else {
+    thread_pool_run(ensemble->pool, ensemble_worker, &job, thread_count);
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include "springs.h"
+
+// Many independent systems stepped side by side, for sweeps over their
+// parameters. Each thread starts on its own share of the members and steals
+// from the others once it runs out, so members that step slower, with more
+// contacts or tears, do not hold the rest up.
+//
+// With interleave set, runs of consecutive members that share their topology
+// are stepped together, each in its own lane of ENSEMBLE_LANES. The springs
+// and masses are visited once for all of the lanes, which sit next to each
+// other in memory, so the loops over the lanes vectorize without gathers. The
+// lanes may differ in everything per mass or spring but the endpoints, rest
+// lengths, cuts and fixed flags. They take the default path alone: spring
+// forces and semi-implicit Euler with the batched kernel, uniform force fields
+// and drag, no contacts, tearing or sleeping. Other members are stepped on
+// their own.
+
+// A lane per value of an AVX-512 register. Neither path fuses multiplies and
+// adds, so a lane steps its member to the bit as system_step would, which
+// headless --check verifies.
+#ifdef SPRINGS_DOUBLE
+#define ENSEMBLE_LANES 8
+#else
+#define ENSEMBLE_LANES 16
+#endif
+
+// Members stepped together, or a single member if count is one. The lanes
+// hold each mass or spring as ENSEMBLE_LANES consecutive values.
+typedef struct {
+  size_t first;
+  size_t count;
+  Scalar *position_x;
+  Scalar *position_y;
+  Scalar *velocity_x;
+  Scalar *velocity_y;
+  Scalar *force_x;
+  Scalar *force_y;
+  Scalar *inverse_mass;
+  Scalar *strength;
+  Scalar *dampening;
+  Scalar *spring_force_x;
+  Scalar *spring_force_y;
+  size_t mass_capacity;
+  size_t spring_capacity;
+} EnsembleBatch;
+
+// Batches left to a thread, the next one to take in the high half of range
+// and the end in the low half. Kept on a cache line of its own.
+typedef struct {
+  _Alignas(64) uint64_t range;
+} EnsembleQueue;
+
+typedef struct {
+  System *systems; // Set up by the caller, freed with the ensemble
+  size_t count;
+  _Bool interleave;
+  size_t interleaved_count; // Members stepped in lanes by the last step
+
+  ThreadPool *pool;
+  size_t thread_count;
+  EnsembleQueue *queues;
+  EnsembleBatch *batches;
+  size_t batch_count; // Of the last step
+  size_t batch_capacity;
+} Ensemble;
+
+// Makes count zeroed systems and the threads to step them on. The systems
+// step on a single thread each. Returns false if it runs out of memory.
+_Bool ensemble_init(Ensemble *ensemble, size_t count, size_t thread_count);
+void ensemble_free(Ensemble *ensemble);
+// Steps every member steps times by dt, the same as calling system_step on
+// each of them in turn. Members stepped in lanes keep no spring forces.
+void ensemble_step(Ensemble *ensemble, size_t steps, double dt);
+
+#endif
@@ -0,0 +1,149 @@
+#include "springs.h"
+#include "springs_internal.h"
+#include <math.h>
+#include <stdio.h>
+
+// Noise lattice coordinates are kept within this, so that they fit int32_t for
+// any position and time
+#define NOISE_MAX_CELL SCALAR_C(1e9)
+
+static void force_fields_init(System *system) {
+  if (system->force_fields_initialized) {
+    return;
+  }
+  system->force_fields[0] = (ForceField){
+      .kind = FORCE_FIELD_UNIFORM,
+      .enabled = true,
+      .vector = GRAVITATIONAL_ACCELERATION,
+  };
+  system->force_field_count = 1;
+  system->force_fields_initialized = true;
+}
+
+size_t system_add_force_field(System *system, ForceField field) {
+  force_fields_init(system);
+  if (system->force_field_count >= SYSTEM_MAX_FORCE_FIELDS ||
+      field.kind >= FORCE_FIELD_COUNT) {
+    printf("ERROR: Cannot add more force fields to the system\n");
+    return SIZE_MAX;
+  }
+  system->force_fields[system->force_field_count] = field;
+  return system->force_field_count++;
+}
+
+void system_clear_force_fields(System *system) {
+  system->force_field_count = 0;
+  system->force_fields_initialized = true;
+}
+
+void system_sum_force_fields(System *system) {
+  force_fields_init(system);
+  ForceFieldSum *sum = &system->force_field_sum;
+  *sum = (ForceFieldSum){.acceleration = vec2_zero(), .drag = SCALAR_C(0.0)};
+  for (size_t i = 0; i < system->force_field_count; ++i) {
+    const ForceField *field = &system->force_fields[i];
+    if (!field->enabled) {
+      continue;
+    }
+    switch (field->kind) {
+    case FORCE_FIELD_UNIFORM:
+      sum->acceleration = vec2_add(sum->acceleration, field->vector);
+      break;
+    case FORCE_FIELD_TURBULENCE:
+      // The mean wind is uniform, only the gusts are evaluated per mass
+      sum->acceleration = vec2_add(sum->acceleration, field->vector);
+      if (field->strength != SCALAR_C(0.0) && field->scale > SCALAR_C(0.0)) {
+        sum->local[sum->local_count++] = i;
+      }
+      break;
+    case FORCE_FIELD_ATTRACTOR:
+      if (field->strength != SCALAR_C(0.0)) {
+        sum->local[sum->local_count++] = i;
+      }
+      break;
+    case FORCE_FIELD_DRAG:
+      sum->drag += field->strength;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static uint32_t noise_hash(int32_t x, int32_t y, int32_t t, uint32_t seed) {
+  uint32_t h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^
+               (uint32_t)t * 0xcb1ab31fu ^ seed;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  return h;
+}
+
+// Two independent values in [-1, 1] at a lattice point, one per axis
+static Vec2 noise_lattice(int32_t x, int32_t y, int32_t t, uint32_t seed) {
+  const Scalar unit = SCALAR_C(2.0) / 0xffff;
+  uint32_t h = noise_hash(x, y, t, seed);
+  return (Vec2){(Scalar)(h & 0xffff) * unit - SCALAR_C(1.0),
+                (Scalar)(h >> 16) * unit - SCALAR_C(1.0)};
+}
+
+// Splits a noise coordinate into its lattice cell and the smoothstep of the
+// position within it
+static int32_t noise_cell(Scalar value, Scalar *weight) {
+  // Also keeps NaN coordinates in range
+  if (!(value > -NOISE_MAX_CELL && value < NOISE_MAX_CELL)) {
+    value = SCALAR_C(0.0);
+  }
+  Scalar cell = scalar_floor(value);
+  Scalar fraction = value - cell;
+  *weight = fraction * fraction * (SCALAR_C(3.0) - SCALAR_C(2.0) * fraction);
+  return (int32_t)cell;
+}
+
+// Value noise over the plane and time, interpolated between the eight
+// corners of its lattice cell
+static Vec2 turbulence_gust(const ForceField *field, uint32_t seed,
+                            Vec2 position, double time) {
+  Scalar wx;
+  Scalar wy;
+  Scalar wt;
+  Scalar inverse_scale = SCALAR_C(1.0) / field->scale;
+  int32_t x = noise_cell(position.x * inverse_scale, &wx);
+  int32_t y = noise_cell(position.y * inverse_scale, &wy);
+  // Wrapped in double first, as float loses the fraction of long runs
+  double phase = time * field->frequency;
+  if (!(fabs(phase) < NOISE_MAX_CELL)) {
+    phase = fmod(phase, NOISE_MAX_CELL);
+  }
+  int32_t t = noise_cell(phase, &wt);
+  Vec2 layers[2];
+  for (int32_t k = 0; k < 2; ++k) {
+    Vec2 bottom = vec2_lerp(noise_lattice(x, y, t + k, seed),
+                            noise_lattice(x + 1, y, t + k, seed), wx);
+    Vec2 top = vec2_lerp(noise_lattice(x, y + 1, t + k, seed),
+                         noise_lattice(x + 1, y + 1, t + k, seed), wx);
+    layers[k] = vec2_lerp(bottom, top, wy);
+  }
+  return vec2_scale(vec2_lerp(layers[0], layers[1], wt), field->strength);
+}
+
+// Softened inverse square pull, which eases off to zero at the center
+static Vec2 attractor_pull(const ForceField *field, Vec2 position) {
+  Vec2 offset = vec2_subtract(field->center, position);
+  Scalar radius_squared = field->scale * field->scale;
+  Scalar softened = vec2_dot(offset, offset) + radius_squared;
+  if (!(softened > SCALAR_C(0.0))) {
+    return vec2_zero();
+  }
+  return vec2_scale(offset, field->strength * radius_squared /
+                                (softened * scalar_sqrt(softened)));
+}
+
+Vec2 force_field_local_acceleration(const System *system, size_t i,
+                                    Vec2 position) {
+  const ForceField *field = &system->force_fields[i];
+  if (field->kind == FORCE_FIELD_TURBULENCE) {
+    return turbulence_gust(field, i, position, system->time);
+  }
+  return attractor_pull(field, position);
+}
@@ -0,0 +1,481 @@
+#include "gpu_simulation.h"
+#include "array.h"
+#include "profiler.h"
+#include "rlgl.h"
+#include "springs_internal.h"
+#include <math.h>
+#include <stdio.h>
+
+#define GPU_GROUP_SIZE 256
+#define GPU_GROUP_SIZE_STRING "256"
+#define GPU_PARAMETER_FLOATS 4
+
+// rlgl has no memory barrier, so it is looked up from the GLFW context Raylib
+// creates on desktop. Every dispatch is followed by one, since the next pass
+// or draw reads what the dispatch wrote.
+#define GL_SHADER_STORAGE_BARRIER_BIT 0x00002000
+#define GL_BUFFER_UPDATE_BARRIER_BIT 0x00000200
+typedef void (*GLFWglproc)(void);
+GLFWglproc glfwGetProcAddress(const char *name);
+typedef void (*MemoryBarrierFunction)(unsigned int barriers);
+static MemoryBarrierFunction memory_barrier;
+
+// Same kernel as the batched CPU path, with cut springs giving no force so
+// that cutting does not need a new adjacency
+static const char *spring_compute_shader =
+    "#version 430\n"
+    "layout(local_size_x = " GPU_GROUP_SIZE_STRING ") in;\n"
+    "layout(std430, binding = 0) readonly buffer Positions {\n"
+    "  vec2 position[];\n"
+    "};\n"
+    "layout(std430, binding = 1) readonly buffer Velocities {\n"
+    "  vec2 velocity[];\n"
+    "};\n"
+    "layout(std430, binding = 2) readonly buffer Endpoints {\n"
+    "  uvec2 endpoints[];\n"
+    "};\n"
+    "layout(std430, binding = 3) readonly buffer Parameters {\n"
+    "  vec4 parameters[];\n"
+    "};\n"
+    "layout(std430, binding = 4) writeonly buffer Forces {\n"
+    "  vec2 force[];\n"
+    "};\n"
+    "uniform int count;\n"
+    "void main() {\n"
+    "  uint i = gl_GlobalInvocationID.x;\n"
+    "  if (i >= uint(count)) {\n"
+    "    return;\n"
+    "  }\n"
+    "  uvec2 m = endpoints[i];\n"
+    "  vec4 spring = parameters[i];\n"
+    "  vec2 span = position[m.y] - position[m.x];\n"
+    "  float span_length = length(span);\n"
+    "  vec2 direction = span / (span_length > 0.0 ? span_length : 1.0);\n"
+    "  float displacement = spring.x - span_length;\n"
+    "  float rate = dot(velocity[m.x] - velocity[m.y], direction);\n"
+    "  float magnitude = -(spring.y * displacement + spring.z * rate);\n"
+    "  force[i] = spring.w != 0.0 ? vec2(0.0) : direction * magnitude;\n"
+    "}\n";
+
+// Gathers the forces of each mass over the adjacency, so no two invocations
+// write the same mass and no atomics are needed
+static const char *mass_compute_shader =
+    "#version 430\n"
+    "layout(local_size_x = " GPU_GROUP_SIZE_STRING ") in;\n"
+    "layout(std430, binding = 0) buffer Positions {\n"
+    "  vec2 position[];\n"
+    "};\n"
+    "layout(std430, binding = 1) buffer Velocities {\n"
+    "  vec2 velocity[];\n"
+    "};\n"
+    "layout(std430, binding = 2) readonly buffer Forces {\n"
+    "  vec2 force[];\n"
+    "};\n"
+    "layout(std430, binding = 3) readonly buffer Offsets {\n"
+    "  uint offset[];\n"
+    "};\n"
+    "layout(std430, binding = 4) readonly buffer Adjacency {\n"
+    "  uint adjacency[];\n"
+    "};\n"
+    "layout(std430, binding = 5) readonly buffer InverseMasses {\n"
+    "  float inverse_mass[];\n"
+    "};\n"
+    "layout(std430, binding = 6) readonly buffer Fixed {\n"
+    "  uint fixed_mass[];\n"
+    "};\n"
+    "uniform int count;\n"
+    "uniform float dt;\n"
+    "uniform vec2 acceleration;\n"
+    "uniform float drag;\n"
+    "uniform float force_limit;\n"
+    "vec2 constrain(vec2 f) {\n"
+    "  float f_length = length(f);\n"
+    "  return f_length > force_limit ? f * (force_limit / f_length) : f;\n"
+    "}\n"
+    "void main() {\n"
+    "  uint i = gl_GlobalInvocationID.x;\n"
+    "  if (i >= uint(count) || fixed_mass[i] != 0u) {\n"
+    "    return;\n"
+    "  }\n"
+    "  vec2 total = vec2(0.0);\n"
+    "  for (uint j = offset[i]; j < offset[i + 1u]; ++j) {\n"
+    "    uint entry = adjacency[j];\n"
+    "    vec2 f = force[entry >> 1];\n"
+    "    total += constrain((entry & 1u) != 0u ? -f : f);\n"
+    "  }\n"
+    "  vec2 a = acceleration - drag * velocity[i] + total * inverse_mass[i];\n"
+    "  vec2 v = velocity[i] + a * dt;\n"
+    "  velocity[i] = v;\n"
+    "  position[i] += v * dt;\n"
+    "}\n";
+
+// Tests every spring, which on the GPU is cheap enough for one segment per
+// frame and keeps the positions off the CPU
+static const char *cut_compute_shader =
+    "#version 430\n"
+    "layout(local_size_x = " GPU_GROUP_SIZE_STRING ") in;\n"
+    "layout(std430, binding = 0) readonly buffer Positions {\n"
+    "  vec2 position[];\n"
+    "};\n"
+    "layout(std430, binding = 1) readonly buffer Endpoints {\n"
+    "  uvec2 endpoints[];\n"
+    "};\n"
+    "layout(std430, binding = 2) buffer Parameters {\n"
+    "  vec4 parameters[];\n"
+    "};\n"
+    "uniform int count;\n"
+    "uniform vec2 start;\n"
+    "uniform vec2 end;\n"
+    "uniform float cut_distance;\n"
+    "float cross2(vec2 a, vec2 b) { return a.x * b.y - a.y * b.x; }\n"
+    "float distance_squared(vec2 p, vec2 a, vec2 b) {\n"
+    "  vec2 ab = b - a;\n"
+    "  float ab_squared = dot(ab, ab);\n"
+    "  float t = ab_squared > 0.0 ? dot(p - a, ab) / ab_squared : 0.0;\n"
+    "  vec2 offset = p - a - ab * clamp(t, 0.0, 1.0);\n"
+    "  return dot(offset, offset);\n"
+    "}\n"
+    "void main() {\n"
+    "  uint i = gl_GlobalInvocationID.x;\n"
+    "  if (i >= uint(count) || parameters[i].w != 0.0) {\n"
+    "    return;\n"
+    "  }\n"
+    "  vec2 b0 = position[endpoints[i].x];\n"
+    "  vec2 b1 = position[endpoints[i].y];\n"
+    "  vec2 a = end - start;\n"
+    "  vec2 b = b1 - b0;\n"
+    "  float d0 = cross2(a, b0 - start);\n"
+    "  float d1 = cross2(a, b1 - start);\n"
+    "  float d2 = cross2(b, start - b0);\n"
+    "  float d3 = cross2(b, end - b0);\n"
+    "  float limit = cut_distance * cut_distance;\n"
+    "  if ((d0 * d1 < 0.0 && d2 * d3 < 0.0) ||\n"
+    "      distance_squared(start, b0, b1) <= limit ||\n"
+    "      distance_squared(end, b0, b1) <= limit ||\n"
+    "      distance_squared(b0, start, end) <= limit ||\n"
+    "      distance_squared(b1, start, end) <= limit) {\n"
+    "    parameters[i].w = 1.0;\n"
+    "  }\n"
+    "}\n";
+
+static unsigned int compute_program_load(const char *code) {
+  unsigned int shader = rlCompileShader(code, RL_COMPUTE_SHADER);
+  return shader != 0 ? rlLoadComputeShaderProgram(shader) : 0;
+}
+
+static void program_unload(unsigned int *program) {
+  if (*program != 0) {
+    rlUnloadShaderProgram(*program);
+  }
+  *program = 0;
+}
+
+static void buffer_unload(unsigned int *buffer) {
+  if (*buffer != 0) {
+    rlUnloadShaderBuffer(*buffer);
+  }
+  *buffer = 0;
+}
+
+static void gpu_buffers_unload(GpuSimulation *gpu) {
+  buffer_unload(&gpu->position_buffer);
+  buffer_unload(&gpu->previous_position_buffer);
+  buffer_unload(&gpu->velocity_buffer);
+  buffer_unload(&gpu->inverse_mass_buffer);
+  buffer_unload(&gpu->fixed_buffer);
+  buffer_unload(&gpu->endpoint_buffer);
+  buffer_unload(&gpu->parameter_buffer);
+  buffer_unload(&gpu->spring_force_buffer);
+  buffer_unload(&gpu->adjacency_offset_buffer);
+  buffer_unload(&gpu->adjacency_buffer);
+  gpu->uploaded = false;
+}
+
+_Bool gpu_simulation_init(GpuSimulation *gpu) {
+  *gpu = (GpuSimulation){0};
+  if (rlGetVersion() != RL_OPENGL_43) {
+    printf("ERROR: Compute shaders need OpenGL 4.3, simulating on the CPU\n");
+    return false;
+  }
+  memory_barrier =
+      (MemoryBarrierFunction)glfwGetProcAddress("glMemoryBarrier");
+  gpu->spring_program = compute_program_load(spring_compute_shader);
+  gpu->mass_program = compute_program_load(mass_compute_shader);
+  gpu->cut_program = compute_program_load(cut_compute_shader);
+  if (memory_barrier == NULL || gpu->spring_program == 0 ||
+      gpu->mass_program == 0 || gpu->cut_program == 0) {
+    printf("ERROR: Cannot load the compute shaders, simulating on the CPU\n");
+    gpu_simulation_free(gpu);
+    return false;
+  }
+  return true;
+}
+
+void gpu_simulation_free(GpuSimulation *gpu) {
+  gpu_buffers_unload(gpu);
+  program_unload(&gpu->spring_program);
+  program_unload(&gpu->mass_program);
+  program_unload(&gpu->cut_program);
+  free(gpu->staging);
+  *gpu = (GpuSimulation){0};
+}
+
+const char *gpu_simulation_unsupported(System *system) {
+  if (system->tear_springs) {
+    return "tearing";
+  }
+  if (system->collide_masses || system->obstacle_count > 0) {
+    return "collisions";
+  }
+  system_sum_force_fields(system);
+  if (system->force_field_sum.local_count > 0) {
+    return "force fields that vary over space";
+  }
+  return NULL;
+}
+
+static void *gpu_staging(GpuSimulation *gpu, size_t size) {
+  if (size > gpu->staging_capacity) {
+    _Bool ok = true;
+    unsigned char *staging = gpu->staging;
+    ARRAY_RESIZE(staging, size, ok);
+    gpu->staging = staging;
+    if (!ok) {
+      printf("ERROR: Cannot allocate memory for the GPU upload\n");
+      return NULL;
+    }
+    gpu->staging_capacity = size;
+  }
+  return gpu->staging;
+}
+
+static unsigned int buffer_load(const void *data, size_t size) {
+  return rlLoadShaderBuffer(size, data, RL_DYNAMIC_COPY);
+}
+
+// Total buffer sizes have to fit the 32 bit sizes rlgl takes
+static _Bool gpu_fits(const System *system) {
+  return system->mass_count * sizeof(Vec2) <= UINT32_MAX &&
+         system->active_spring_count * GPU_PARAMETER_FLOATS * sizeof(float) <=
+             UINT32_MAX;
+}
+
+_Bool gpu_simulation_upload(GpuSimulation *gpu, System *system) {
+  gpu_buffers_unload(gpu);
+  if (!gpu_fits(system)) {
+    printf("ERROR: System too large for the GPU buffers\n");
+    return false;
+  }
+  // Compacts the springs first, so the counts below are the final ones
+  if (!system->adjacency_valid && !system_build_adjacency(system)) {
+    return false;
+  }
+  // The GPU steps every mass, sleeping masses would wake up moving
+  system_wake_all(system);
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  size_t mass_count = system->mass_count;
+  size_t spring_count = system->active_spring_count;
+  size_t largest = mass_count + 1 > spring_count * GPU_PARAMETER_FLOATS
+                       ? mass_count + 1
+                       : spring_count * GPU_PARAMETER_FLOATS;
+  uint32_t *staging = gpu_staging(gpu, largest * sizeof(uint32_t));
+  if (staging == NULL) {
+    return false;
+  }
+
+  // Vec2 already has the std430 layout of vec2
+  gpu->position_buffer =
+      buffer_load(masses->position, mass_count * sizeof(Vec2));
+  gpu->previous_position_buffer =
+      buffer_load(masses->previous_position, mass_count * sizeof(Vec2));
+  gpu->velocity_buffer =
+      buffer_load(masses->velocity, mass_count * sizeof(Vec2));
+  float *inverse_mass = (float *)staging;
+  for (size_t i = 0; i < mass_count; ++i) {
+    inverse_mass[i] = masses->inverse_mass[i];
+  }
+  gpu->inverse_mass_buffer =
+      buffer_load(inverse_mass, mass_count * sizeof(float));
+  for (size_t i = 0; i < mass_count; ++i) {
+    staging[i] = masses->fixed[i];
+  }
+  gpu->fixed_buffer = buffer_load(staging, mass_count * sizeof(uint32_t));
+  for (size_t i = 0; i <= mass_count; ++i) {
+    staging[i] = system->adjacency_offset[i];
+  }
+  gpu->adjacency_offset_buffer =
+      buffer_load(staging, (mass_count + 1) * sizeof(uint32_t));
+  gpu->adjacency_buffer =
+      buffer_load(system->adjacency, system->adjacency_offset[mass_count] *
+                                          sizeof(uint32_t));
+
+  for (size_t i = 0; i < spring_count; ++i) {
+    staging[2 * i] = springs->first[i];
+    staging[2 * i + 1] = springs->second[i];
+  }
+  gpu->endpoint_buffer =
+      buffer_load(staging, spring_count * 2 * sizeof(uint32_t));
+  float *parameter = (float *)staging;
+  for (size_t i = 0; i < spring_count; ++i) {
+    parameter[0] = springs->length[i];
+    parameter[1] = springs->strength[i];
+    parameter[2] = springs->dampening[i];
+    parameter[3] = springs->cut[i];
+    parameter += GPU_PARAMETER_FLOATS;
+  }
+  gpu->parameter_buffer =
+      buffer_load(staging, spring_count * GPU_PARAMETER_FLOATS * sizeof(float));
+  gpu->spring_force_buffer = buffer_load(NULL, spring_count * sizeof(Vec2));
+
+  gpu->mass_count = mass_count;
+  gpu->spring_count = spring_count;
+  gpu->topology_version = system->topology_version;
+  gpu->uploaded = true;
+  return true;
+}
+
+void gpu_simulation_upload_mass(GpuSimulation *gpu, const System *system,
+                                size_t i) {
+  if (!gpu->uploaded || i >= gpu->mass_count) {
+    return;
+  }
+  const MassArrays *masses = &system->masses;
+  uint32_t fixed = masses->fixed[i];
+  rlUpdateShaderBuffer(gpu->position_buffer, &masses->position[i],
+                       sizeof(Vec2), i * sizeof(Vec2));
+  rlUpdateShaderBuffer(gpu->velocity_buffer, &masses->velocity[i],
+                       sizeof(Vec2), i * sizeof(Vec2));
+  rlUpdateShaderBuffer(gpu->fixed_buffer, &fixed, sizeof(fixed),
+                       i * sizeof(fixed));
+}
+
+void gpu_simulation_download(GpuSimulation *gpu, System *system) {
+  if (!gpu->uploaded || gpu->mass_count != system->mass_count) {
+    return;
+  }
+  MassArrays *masses = &system->masses;
+  size_t mass_bytes = gpu->mass_count * sizeof(Vec2);
+  rlReadShaderBuffer(gpu->position_buffer, masses->position, mass_bytes, 0);
+  rlReadShaderBuffer(gpu->previous_position_buffer, masses->previous_position,
+                     mass_bytes, 0);
+  rlReadShaderBuffer(gpu->velocity_buffer, masses->velocity, mass_bytes, 0);
+  system->hash_moved = true;
+  ++system->motion_version;
+  // The GPU moves every mass, asleep or not
+  system_wake_all(system);
+
+  // Springs only still match the upload if the topology is unchanged since
+  size_t parameter_bytes =
+      gpu->spring_count * GPU_PARAMETER_FLOATS * sizeof(float);
+  float *parameter = gpu_staging(gpu, parameter_bytes);
+  if (gpu->topology_version != system->topology_version || parameter == NULL) {
+    return;
+  }
+  rlReadShaderBuffer(gpu->parameter_buffer, parameter, parameter_bytes, 0);
+  _Bool cut_any = false;
+  for (size_t i = 0; i < gpu->spring_count; ++i) {
+    if (parameter[i * GPU_PARAMETER_FLOATS + 3] != 0.0f &&
+        !system->springs.cut[i]) {
+      system->springs.cut[i] = true;
+      system_island_spring_cut(system, i);
+      cut_any = true;
+    }
+  }
+  if (cut_any) {
+    system_invalidate_topology(system);
+    // The GPU has had these cuts all along
+    gpu->topology_version = system->topology_version;
+  }
+}
+
+// Runs the enabled program over count items
+static void gpu_dispatch(size_t count) {
+  rlComputeShaderDispatch((count + GPU_GROUP_SIZE - 1) / GPU_GROUP_SIZE, 1, 1);
+  rlDisableShader();
+  memory_barrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+static void uniform_int(unsigned int program, const char *name, int value) {
+  rlSetUniform(rlGetLocationUniform(program, name), &value,
+               RL_SHADER_UNIFORM_INT, 1);
+}
+
+static void uniform_float(unsigned int program, const char *name,
+                          float value) {
+  rlSetUniform(rlGetLocationUniform(program, name), &value,
+               RL_SHADER_UNIFORM_FLOAT, 1);
+}
+
+static void uniform_vec2(unsigned int program, const char *name, Vec2 value) {
+  rlSetUniform(rlGetLocationUniform(program, name), &value,
+               RL_SHADER_UNIFORM_VEC2, 1);
+}
+
+void gpu_simulation_step(GpuSimulation *gpu, System *system, double dt) {
+  PROFILE_SCOPE(PROFILE_ZONE_STEP);
+  if ((!gpu->uploaded || gpu->mass_count != system->mass_count ||
+       gpu->topology_version != system->topology_version) &&
+      !gpu_simulation_upload(gpu, system)) {
+    return;
+  }
+  if (gpu->mass_count == 0) {
+    return;
+  }
+
+  if (gpu->spring_count > 0) {
+    unsigned int program = gpu->spring_program;
+    rlEnableShader(program);
+    uniform_int(program, "count", gpu->spring_count);
+    rlBindShaderBuffer(gpu->position_buffer, 0);
+    rlBindShaderBuffer(gpu->velocity_buffer, 1);
+    rlBindShaderBuffer(gpu->endpoint_buffer, 2);
+    rlBindShaderBuffer(gpu->parameter_buffer, 3);
+    rlBindShaderBuffer(gpu->spring_force_buffer, 4);
+    gpu_dispatch(gpu->spring_count);
+  }
+
+  unsigned int program = gpu->mass_program;
+  rlEnableShader(program);
+  uniform_int(program, "count", gpu->mass_count);
+  uniform_float(program, "dt", dt);
+  system_sum_force_fields(system);
+  uniform_vec2(program, "acceleration", system->force_field_sum.acceleration);
+  uniform_float(program, "drag", system->force_field_sum.drag);
+  uniform_float(program, "force_limit",
+                CONSTRAIN_FORCES ? FORCES_CONSTRAINT : INFINITY);
+  rlBindShaderBuffer(gpu->position_buffer, 0);
+  rlBindShaderBuffer(gpu->velocity_buffer, 1);
+  rlBindShaderBuffer(gpu->spring_force_buffer, 2);
+  rlBindShaderBuffer(gpu->adjacency_offset_buffer, 3);
+  rlBindShaderBuffer(gpu->adjacency_buffer, 4);
+  rlBindShaderBuffer(gpu->inverse_mass_buffer, 5);
+  rlBindShaderBuffer(gpu->fixed_buffer, 6);
+  gpu_dispatch(gpu->mass_count);
+  system->time += dt;
+}
+
+void gpu_simulation_store_previous_positions(GpuSimulation *gpu) {
+  if (gpu->uploaded && gpu->mass_count > 0) {
+    rlCopyShaderBuffer(gpu->previous_position_buffer, gpu->position_buffer, 0,
+                       0, gpu->mass_count * sizeof(Vec2));
+    memory_barrier(GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+}
+
+void gpu_simulation_cut_segment(GpuSimulation *gpu, Vec2 start, Vec2 end,
+                                float distance) {
+  if (!gpu->uploaded || gpu->spring_count == 0) {
+    return;
+  }
+  unsigned int program = gpu->cut_program;
+  rlEnableShader(program);
+  uniform_int(program, "count", gpu->spring_count);
+  uniform_vec2(program, "start", start);
+  uniform_vec2(program, "end", end);
+  uniform_float(program, "cut_distance", distance);
+  rlBindShaderBuffer(gpu->position_buffer, 0);
+  rlBindShaderBuffer(gpu->endpoint_buffer, 1);
+  rlBindShaderBuffer(gpu->parameter_buffer, 2);
+  gpu_dispatch(gpu->spring_count);
+}
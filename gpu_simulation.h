@@ -0,0 +1,75 @@
+#ifndef GPU_SIMULATION_H
+#define GPU_SIMULATION_H
+
+#include "springs.h"
+
+// The buffers are loaded from the mass arrays as they are, and the shaders
+// read them as floats
+#ifdef SPRINGS_DOUBLE
+#error "The GPU simulation and the viewer need the float build"
+#endif
+
+// Steps a system with OpenGL 4.3 compute shaders instead of the CPU loops.
+// The masses, the active springs and their adjacency stay resident in shader
+// storage buffers, which the mesh renderer draws straight from. Only the
+// default path is implemented: spring forces and semi-implicit Euler, with
+// only the uniform parts of the force fields. There is no tearing, no
+// collisions with other masses or obstacles and no force fields that vary
+// over space, gpu_simulation_unsupported tells systems that need them apart.
+// Every island is woken on upload and stays awake, the GPU does not sleep.
+//
+// While stepping on the GPU its buffers hold the state, the System only keeps
+// the topology. Springs cut on the GPU and the mass positions reach the System
+// through gpu_simulation_download.
+typedef struct {
+  unsigned int spring_program; // Force of every spring
+  unsigned int mass_program;   // Gathers the spring forces and integrates
+  unsigned int cut_program;    // Cuts the springs near a segment
+
+  unsigned int position_buffer;
+  unsigned int previous_position_buffer;
+  unsigned int velocity_buffer;
+  unsigned int inverse_mass_buffer;
+  unsigned int fixed_buffer;
+  unsigned int endpoint_buffer;  // First and second mass per spring
+  unsigned int parameter_buffer; // Length, strength, dampening and cut flag
+  unsigned int spring_force_buffer;
+  unsigned int adjacency_offset_buffer;
+  unsigned int adjacency_buffer;
+
+  size_t mass_count;
+  size_t spring_count;     // Active springs of the system as uploaded
+  size_t topology_version; // Of the system as uploaded
+  _Bool uploaded;
+
+  void *staging; // Conversion to the GPU layouts on upload and download
+  size_t staging_capacity;
+} GpuSimulation;
+
+// Returns false if the context has no compute shaders, which needs Raylib
+// built for OpenGL 4.3, in which case the caller should step on the CPU
+_Bool gpu_simulation_init(GpuSimulation *gpu);
+void gpu_simulation_free(GpuSimulation *gpu);
+// Returns what the GPU lacks to step system as system_step would, for the
+// caller to step it on the CPU instead, or NULL if nothing
+const char *gpu_simulation_unsupported(System *system);
+// Copies the whole system to the GPU, waking it. Stepping does this by itself
+// whenever the system changed its masses or topology since.
+_Bool gpu_simulation_upload(GpuSimulation *gpu, System *system);
+// Copies the position, velocity and fixed flag of mass i, after moving it by
+// hand
+void gpu_simulation_upload_mass(GpuSimulation *gpu, const System *system,
+                                size_t i);
+// Copies the mass state and the springs cut on the GPU back to the system.
+// This stalls until the GPU is done, so only call it when the CPU needs them.
+void gpu_simulation_download(GpuSimulation *gpu, System *system);
+// Advances by one step of dt, the same as system_step up to the force fields
+// that vary over space, which are left out
+void gpu_simulation_step(GpuSimulation *gpu, System *system, double dt);
+void gpu_simulation_store_previous_positions(GpuSimulation *gpu);
+// Cuts every live spring passing within distance of the segment, like
+// system_cut_segment but on the GPU positions
+void gpu_simulation_cut_segment(GpuSimulation *gpu, Vec2 start, Vec2 end,
+                                float distance);
+
+#endif
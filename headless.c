@@ -0,0 +1,963 @@
+#include "ensemble.h"
+#include "lod.h"
+#include "profiler.h"
+#include "scene.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "springs.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_STEPS 1000
+#define DEFAULT_DT (1.0 / 60.0)
+#define DEFAULT_CHECKPOINT_EVERY 100
+// Gusts of --turbulence change over cells of this many pixels, this often a
+// second
+#define TURBULENCE_SCALE 200.0
+#define TURBULENCE_FREQUENCY 0.5
+#define ATTRACTOR_STRENGTH 400.0
+#define ATTRACTOR_RADIUS 50.0
+// Members of a --sweep go from this fraction of the parameter to its inverse
+#define SWEEP_LOW 0.5
+#define SWEEP_HIGH 1.5
+
+typedef enum {
+  SWEEP_NONE = 0,
+  SWEEP_STRENGTH,
+  SWEEP_DAMPENING,
+  SWEEP_MASS,
+} Sweep;
+
+typedef struct {
+  size_t steps;
+  size_t substeps;
+  double dt;
+  size_t threads;
+  size_t rows;
+  size_t cols;
+  Integrator integrator;
+  Solver solver;
+  size_t iterations;
+  _Bool jacobi;
+  _Bool compact;
+  _Bool sleep;
+  size_t cut_every;
+  size_t remove_every;
+  size_t merge_every;
+  _Bool tear;
+  double max_strain;
+  _Bool reference;
+  _Bool wind;
+  _Bool turbulence;
+  double drag;
+  _Bool attractor;
+  Vec2 attractor_center;
+  _Bool collide;
+  _Bool circle;
+  Obstacle circle_obstacle;
+  _Bool bounds;
+  Obstacle bounds_obstacle;
+  const char *trace;
+  const char *load;
+  const char *scene;
+  Ordering ordering;
+  Ordering reorder;
+  const char *checkpoint;
+  size_t checkpoint_every;
+  const char *record;
+  float quantum;
+  _Bool compress;
+  _Bool keep_every_frame;
+  size_t ensemble;
+  Sweep sweep;
+  _Bool lanes;
+  _Bool lod;
+  _Bool check;
+} Options;
+
+void print_usage(const char *program) {
+  printf("Usage: %s [options]\n"
+         "  --steps N      Number of frames to simulate (default %d)\n"
+         "  --dt SECONDS   Fixed frame time (default 1/60)\n"
+         "  --substeps N   Physics steps per frame (default 1)\n"
+         "  --threads N    Worker threads including the main one (default: "
+         "one per core)\n"
+         "  --rows N       Rows in the cloth grid (default %d)\n"
+         "  --cols N       Columns in the cloth grid (default %d)\n"
+         "  --integrator NAME  semi-implicit-euler (default), verlet, rk4 or "
+         "implicit-euler\n"
+         "  --solver NAME  forces (default) or xpbd\n"
+         "  --iterations N XPBD iterations per step (default %d)\n"
+         "  --jacobi       Use Jacobi instead of Gauss-Seidel XPBD iterations\n"
+         "  --compact      Move cut springs out of the loops over springs\n"
+         "  --sleep        Stop stepping islands of masses that settled, with "
+         "semi-implicit\n"
+         "                 Euler. Needs --drag for a swinging cloth to "
+         "settle\n"
+         "  --cut-every N  Cut every Nth spring before simulating\n"
+         "  --remove-every N  Remove every Nth mass before simulating\n"
+         "  --merge-every N  Merge every Nth mass into the next one before "
+         "simulating\n"
+         "  --tear STRAIN  Cut springs stretched past 1 + their max strain "
+         "times their\n"
+         "                 length, STRAIN for those the scene gives none\n"
+         "  --reference    Use the reference spring kernel\n"
+         "  --wind         Apply the wind force\n"
+         "  --turbulence   Apply gusts of wind that vary over space and time\n"
+         "  --drag COEFF   Slow every mass by COEFF times its velocity\n"
+         "  --attractor X,Y  Pull the masses towards the point X,Y\n"
+         "  --collide      Keep the masses from passing through each other\n"
+         "  --circle X,Y,R Add a circular obstacle at X,Y of radius R\n"
+         "  --bounds X0,Y0,X1,Y1  Keep the masses inside the box from X0,Y0 "
+         "to X1,Y1\n"
+         "  --trace FILE   Write a Chrome trace of the last frames to FILE, "
+         "needs make PROFILE=1\n"
+         "  --scene FILE   Load the masses and springs from a scene file "
+         "instead of the grid\n"
+         "  --order NAME   Order of the scene's masses: rcm (default), morton "
+         "or none\n"
+         "  --reorder NAME Reorder the masses and springs for locality, and "
+         "again as cuts\n"
+         "                 spread them: morton, rcm or none (default)\n"
+         "  --load FILE    Start from a snapshot instead of the grid, with the "
+         "solver settings saved in it\n"
+         "  --checkpoint FILE  Save a snapshot to FILE periodically and at the "
+         "end\n"
+         "  --checkpoint-every N  Frames between checkpoints (default %d)\n"
+         "  --record FILE  Record the positions and cuts of every frame to "
+         "FILE\n"
+         "  --quantum SIZE Precision of the recorded positions (default "
+         "1/64)\n"
+         "  --compress     Compress the recorded frames, needs make ZSTD=1\n"
+         "  --keep-every-frame  Wait for the recorder instead of dropping "
+         "frames\n"
+         "  --ensemble N   Step N copies of the system, one thread each\n"
+         "  --sweep NAME   Scale the strength, dampening or mass of the "
+         "ensemble members\n"
+         "                 from %.1f to %.1f times\n"
+         "  --lanes        Step ensemble members that share their springs "
+         "side by side\n"
+         "  --lod          Step the grid at full resolution only where it is "
+         "busy\n"
+         "  --check        Check the fast paths against the plain ones with "
+         "the system the\n"
+         "                 other options set up, instead of simulating\n",
+         program, DEFAULT_STEPS, DEFAULT_GRID_ROWS, DEFAULT_GRID_COLS,
+         XPBD_DEFAULT_ITERATIONS, DEFAULT_CHECKPOINT_EVERY,
+         SWEEP_LOW, SWEEP_HIGH);
+}
+
+_Bool parse_options(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; ++i) {
+    const char *option = argv[i];
+    _Bool has_value = i + 1 < argc;
+    if (strcmp(option, "--help") == 0) {
+      return false;
+    } else if (strcmp(option, "--reference") == 0) {
+      options->reference = true;
+    } else if (strcmp(option, "--wind") == 0) {
+      options->wind = true;
+    } else if (strcmp(option, "--turbulence") == 0) {
+      options->turbulence = true;
+    } else if (strcmp(option, "--drag") == 0 && has_value) {
+      options->drag = strtod(argv[++i], NULL);
+    } else if (strcmp(option, "--attractor") == 0 && has_value) {
+      double x;
+      double y;
+      if (sscanf(argv[++i], "%lf,%lf", &x, &y) != 2) {
+        printf("ERROR: Expected the attractor as X,Y instead of %s\n",
+               argv[i]);
+        return false;
+      }
+      options->attractor = true;
+      options->attractor_center = (Vec2){x, y};
+    } else if (strcmp(option, "--collide") == 0) {
+      options->collide = true;
+    } else if (strcmp(option, "--circle") == 0 && has_value) {
+      double x;
+      double y;
+      double radius;
+      if (sscanf(argv[++i], "%lf,%lf,%lf", &x, &y, &radius) != 3) {
+        printf("ERROR: Expected the circle as X,Y,R instead of %s\n",
+               argv[i]);
+        return false;
+      }
+      options->circle = true;
+      options->circle_obstacle = (Obstacle){
+          .kind = OBSTACLE_CIRCLE, .start = {x, y}, .radius = radius};
+    } else if (strcmp(option, "--bounds") == 0 && has_value) {
+      double x0;
+      double y0;
+      double x1;
+      double y1;
+      if (sscanf(argv[++i], "%lf,%lf,%lf,%lf", &x0, &y0, &x1, &y1) != 4) {
+        printf("ERROR: Expected the bounds as X0,Y0,X1,Y1 instead of %s\n",
+               argv[i]);
+        return false;
+      }
+      options->bounds = true;
+      options->bounds_obstacle = (Obstacle){
+          .kind = OBSTACLE_BOUNDS, .start = {x0, y0}, .end = {x1, y1}};
+    } else if (strcmp(option, "--integrator") == 0 && has_value) {
+      if (!integrator_from_name(argv[++i], &options->integrator)) {
+        printf("ERROR: Unknown integrator %s\n", argv[i]);
+        return false;
+      }
+    } else if (strcmp(option, "--solver") == 0 && has_value) {
+      if (!solver_from_name(argv[++i], &options->solver)) {
+        printf("ERROR: Unknown solver %s\n", argv[i]);
+        return false;
+      }
+    } else if (strcmp(option, "--iterations") == 0 && has_value) {
+      options->iterations = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--jacobi") == 0) {
+      options->jacobi = true;
+    } else if (strcmp(option, "--trace") == 0 && has_value) {
+      options->trace = argv[++i];
+    } else if (strcmp(option, "--scene") == 0 && has_value) {
+      options->scene = argv[++i];
+    } else if (strcmp(option, "--order") == 0 && has_value) {
+      if (!ordering_from_name(argv[++i], &options->ordering)) {
+        printf("ERROR: Unknown order %s\n", argv[i]);
+        return false;
+      }
+    } else if (strcmp(option, "--reorder") == 0 && has_value) {
+      if (!ordering_from_name(argv[++i], &options->reorder)) {
+        printf("ERROR: Unknown order %s\n", argv[i]);
+        return false;
+      }
+    } else if (strcmp(option, "--load") == 0 && has_value) {
+      options->load = argv[++i];
+    } else if (strcmp(option, "--checkpoint") == 0 && has_value) {
+      options->checkpoint = argv[++i];
+    } else if (strcmp(option, "--checkpoint-every") == 0 && has_value) {
+      options->checkpoint_every = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--record") == 0 && has_value) {
+      options->record = argv[++i];
+    } else if (strcmp(option, "--quantum") == 0 && has_value) {
+      options->quantum = strtof(argv[++i], NULL);
+    } else if (strcmp(option, "--compress") == 0) {
+      options->compress = true;
+    } else if (strcmp(option, "--keep-every-frame") == 0) {
+      options->keep_every_frame = true;
+    } else if (strcmp(option, "--compact") == 0) {
+      options->compact = true;
+    } else if (strcmp(option, "--sleep") == 0) {
+      options->sleep = true;
+    } else if (strcmp(option, "--cut-every") == 0 && has_value) {
+      options->cut_every = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--remove-every") == 0 && has_value) {
+      options->remove_every = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--merge-every") == 0 && has_value) {
+      options->merge_every = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--tear") == 0 && has_value) {
+      options->tear = true;
+      options->max_strain = strtod(argv[++i], NULL);
+    } else if (strcmp(option, "--ensemble") == 0 && has_value) {
+      options->ensemble = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--sweep") == 0 && has_value) {
+      const char *name = argv[++i];
+      if (strcmp(name, "strength") == 0) {
+        options->sweep = SWEEP_STRENGTH;
+      } else if (strcmp(name, "dampening") == 0) {
+        options->sweep = SWEEP_DAMPENING;
+      } else if (strcmp(name, "mass") == 0) {
+        options->sweep = SWEEP_MASS;
+      } else {
+        printf("ERROR: Unknown sweep %s\n", name);
+        return false;
+      }
+    } else if (strcmp(option, "--lanes") == 0) {
+      options->lanes = true;
+    } else if (strcmp(option, "--lod") == 0) {
+      options->lod = true;
+    } else if (strcmp(option, "--check") == 0) {
+      options->check = true;
+    } else if (strcmp(option, "--steps") == 0 && has_value) {
+      options->steps = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--substeps") == 0 && has_value) {
+      options->substeps = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--dt") == 0 && has_value) {
+      options->dt = strtod(argv[++i], NULL);
+    } else if (strcmp(option, "--threads") == 0 && has_value) {
+      options->threads = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--rows") == 0 && has_value) {
+      options->rows = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(option, "--cols") == 0 && has_value) {
+      options->cols = strtoull(argv[++i], NULL, 10);
+    } else {
+      printf("ERROR: Unknown or incomplete option %s\n", option);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Merges every merge_every-th mass into the one after it, then removes every
+// remove_every-th of the masses there were
+_Bool edit_masses(System *system, size_t merge_every, size_t remove_every) {
+  size_t count = system->mass_count;
+  MassHandle *handles = malloc((count > 0 ? count : 1) * sizeof(*handles));
+  if (handles == NULL) {
+    printf("ERROR: Cannot allocate memory for mass handles\n");
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    handles[i] = system_mass_handle(system, i);
+  }
+  for (size_t i = 0; merge_every > 0 && i + 1 < count; i += merge_every) {
+    system_merge_masses(system, handles[i + 1], handles[i]);
+  }
+  // Masses merged away no longer resolve, removing them does nothing
+  for (size_t i = 0; remove_every > 0 && i < count; i += remove_every) {
+    system_remove_mass(system, handles[i]);
+  }
+  free(handles);
+  return true;
+}
+
+// Sets up the system the options ask for, stepping on threads threads.
+// Returns false if it cannot, leaving the system for the caller to free.
+_Bool setup_system(System *system, const Options *options, size_t threads) {
+  system->spring_kernel =
+      options->reference ? SPRING_KERNEL_REFERENCE : SPRING_KERNEL_BATCHED;
+  system->integrator = options->integrator;
+  system->solver = options->solver;
+  system->xpbd_method = options->jacobi ? XPBD_JACOBI : XPBD_GAUSS_SEIDEL;
+  system->xpbd_iterations = options->iterations;
+  system->compact_springs = options->compact;
+  system->sleep_islands = options->sleep;
+  system_set_thread_count(system, threads);
+  if (options->load != NULL) {
+    if (!system_load_snapshot(system, options->load)) {
+      return false;
+    }
+  } else if (options->scene != NULL) {
+    if (!system_load_scene(system, options->scene, options->ordering)) {
+      return false;
+    }
+  } else {
+    system_init_grid(system, options->rows, options->cols, (Vec2){0.0f, 0.0f},
+                     DEFAULT_GRID_SIZE, DEFAULT_GRID_MASS,
+                     DEFAULT_GRID_STRENGTH, DEFAULT_GRID_DAMPENING);
+  }
+  if (options->wind) {
+    system_add_force_field(
+        system, (ForceField){.kind = FORCE_FIELD_UNIFORM,
+                             .enabled = true,
+                             .vector = {WIND_STRENGTH, SCALAR_C(0.0)}});
+  }
+  if (options->turbulence) {
+    system_add_force_field(system,
+                           (ForceField){.kind = FORCE_FIELD_TURBULENCE,
+                                        .enabled = true,
+                                        .strength = WIND_STRENGTH,
+                                        .scale = TURBULENCE_SCALE,
+                                        .frequency = TURBULENCE_FREQUENCY});
+  }
+  if (options->drag != 0.0) {
+    system_add_force_field(system, (ForceField){.kind = FORCE_FIELD_DRAG,
+                                                .enabled = true,
+                                                .strength = options->drag});
+  }
+  if (options->attractor) {
+    system_add_force_field(system,
+                           (ForceField){.kind = FORCE_FIELD_ATTRACTOR,
+                                        .enabled = true,
+                                        .center = options->attractor_center,
+                                        .strength = ATTRACTOR_STRENGTH,
+                                        .scale = ATTRACTOR_RADIUS});
+  }
+  system->collide_masses = options->collide;
+  if (options->circle) {
+    system_add_obstacle(system, options->circle_obstacle);
+  }
+  if (options->bounds) {
+    system_add_obstacle(system, options->bounds_obstacle);
+  }
+  if (options->cut_every > 0) {
+    for (size_t i = 0; i < system->spring_count; i += options->cut_every) {
+      system_cut_spring(system, i);
+    }
+  }
+  // Edits move the masses to other indices, so they go by handle
+  if ((options->merge_every > 0 || options->remove_every > 0) &&
+      !edit_masses(system, options->merge_every, options->remove_every)) {
+    return false;
+  }
+  system->tear_springs = options->tear;
+  system_default_max_strain(system, options->max_strain);
+  system->reorder_ordering = options->reorder;
+  if (!system_reorder(system, options->reorder, NULL, 0)) {
+    return false;
+  }
+  return true;
+}
+
+double seconds_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Scales the swept parameter of every mass or spring by scale
+void sweep_system(System *system, Sweep sweep, Scalar scale) {
+  for (size_t i = 0; sweep == SWEEP_STRENGTH && i < system->spring_count;
+       ++i) {
+    system->springs.strength[i] *= scale;
+  }
+  for (size_t i = 0; sweep == SWEEP_DAMPENING && i < system->spring_count;
+       ++i) {
+    system->springs.dampening[i] *= scale;
+  }
+  // Fixed masses are scaled as well, they do not move whatever their mass
+  for (size_t i = 0; sweep == SWEEP_MASS && i < system->mass_count; ++i) {
+    system->masses.inverse_mass[i] /= scale;
+  }
+}
+
+// Sets up count members of an ensemble, sweeping a parameter across them.
+// Returns false if it cannot, freeing the ensemble.
+_Bool setup_ensemble(Ensemble *ensemble, const Options *options, size_t count,
+                     Sweep sweep) {
+  if (!ensemble_init(ensemble, count, options->threads)) {
+    return false;
+  }
+  for (size_t i = 0; i < ensemble->count; ++i) {
+    System *system = &ensemble->systems[i];
+    if (!setup_system(system, options, 1)) {
+      ensemble_free(ensemble);
+      return false;
+    }
+    double t = ensemble->count > 1 ? (double)i / (ensemble->count - 1) : 0.5;
+    sweep_system(system, sweep, SWEEP_LOW + (SWEEP_HIGH - SWEEP_LOW) * t);
+  }
+  return true;
+}
+
+// Steps options->ensemble copies of the system, sweeping a parameter across
+// them if asked, and reports how far down each one hangs
+int run_ensemble(const Options *options) {
+  Ensemble ensemble;
+  if (!setup_ensemble(&ensemble, options, options->ensemble,
+                      options->sweep)) {
+    return 1;
+  }
+  ensemble.interleave = options->lanes;
+
+  // Nothing happens between the frames, so the members take all of their
+  // steps in one go
+  PhysicsClock clock =
+      physics_clock_init(1.0 / options->dt, options->substeps, options->dt);
+  size_t total_steps = 0;
+  for (size_t frame = 0; frame < options->steps; ++frame) {
+    total_steps += physics_clock_advance(&clock, options->dt);
+  }
+  double start = seconds_now();
+  ensemble_step(&ensemble, total_steps, clock.step);
+  double elapsed = seconds_now() - start;
+
+  // The y axis points down, the lowest point has the largest y
+  double lowest_min = 0.0;
+  double lowest_max = 0.0;
+  for (size_t i = 0; i < ensemble.count; ++i) {
+    const System *system = &ensemble.systems[i];
+    double lowest = system->mass_count > 0 ? system->masses.position[0].y : 0.0;
+    for (size_t j = 1; j < system->mass_count; ++j) {
+      if (system->masses.position[j].y > lowest) {
+        lowest = system->masses.position[j].y;
+      }
+    }
+    lowest_min = i == 0 || lowest < lowest_min ? lowest : lowest_min;
+    lowest_max = i == 0 || lowest > lowest_max ? lowest : lowest_max;
+  }
+
+  const System *first = &ensemble.systems[0];
+  printf("Simulated %zu frames (%zu steps) of %zu members, %zu masses and %zu "
+         "springs each\n",
+         options->steps, total_steps, ensemble.count, first->mass_count,
+         first->spring_count);
+  printf("Threads: %zu, interleaved: %zu of %zu members, precision: %s\n",
+         ensemble.thread_count, ensemble.interleaved_count, ensemble.count,
+         SCALAR_NAME);
+  printf("Elapsed: %.3f s, %.1f member steps/sec\n", elapsed,
+         elapsed > 0.0 ? total_steps * ensemble.count / elapsed : 0.0);
+  printf("Lowest point: from %.3f to %.3f\n", lowest_min, lowest_max);
+  ensemble_free(&ensemble);
+  return 0;
+}
+
+// Whether the masses of a and b are at the same positions with the same
+// velocities, to the bit. Reports the first one that is not.
+_Bool masses_match(const System *a, const System *b, const char *check) {
+  if (a->mass_count != b->mass_count) {
+    printf("ERROR: Check %s: %zu masses instead of %zu\n", check,
+           b->mass_count, a->mass_count);
+    return false;
+  }
+  const MassArrays *ma = &a->masses;
+  const MassArrays *mb = &b->masses;
+  for (size_t i = 0; i < a->mass_count; ++i) {
+    if (memcmp(&ma->position[i], &mb->position[i], sizeof(Vec2)) != 0 ||
+        memcmp(&ma->velocity[i], &mb->velocity[i], sizeof(Vec2)) != 0) {
+      printf("ERROR: Check %s: mass %zu at %.9g,%.9g instead of %.9g,%.9g\n",
+             check, i, (double)mb->position[i].x, (double)mb->position[i].y,
+             (double)ma->position[i].x, (double)ma->position[i].y);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Steps a full set of lanes of members with and without interleaving, and
+// compares every member across the two. Sweeps the mass unless the options
+// sweep something else.
+_Bool check_lanes(const Options *options, size_t steps, double dt) {
+  Sweep sweep = options->sweep != SWEEP_NONE ? options->sweep : SWEEP_MASS;
+  Ensemble alone;
+  Ensemble lanes;
+  if (!setup_ensemble(&alone, options, ENSEMBLE_LANES, sweep)) {
+    return false;
+  }
+  if (!setup_ensemble(&lanes, options, ENSEMBLE_LANES, sweep)) {
+    ensemble_free(&alone);
+    return false;
+  }
+  lanes.interleave = true;
+  ensemble_step(&alone, steps, dt);
+  ensemble_step(&lanes, steps, dt);
+  _Bool ok = true;
+  for (size_t i = 0; ok && i < alone.count; ++i) {
+    ok = masses_match(&alone.systems[i], &lanes.systems[i], "lanes");
+  }
+  if (ok && lanes.interleaved_count == 0) {
+    printf("Check lanes: skipped, no member fits the lanes\n");
+  } else if (ok) {
+    printf("Check lanes: %zu members match after %zu steps\n",
+           lanes.interleaved_count, steps);
+  }
+  ensemble_free(&lanes);
+  ensemble_free(&alone);
+  return ok;
+}
+
+// Whether b holds the masses and springs of a under the same ids, with the
+// same state to the bit, wherever they are stored. Reports the first one that
+// does not.
+_Bool ids_match(const System *a, const System *b, const char *check) {
+  const MassArrays *ma = &a->masses;
+  const MassArrays *mb = &b->masses;
+  const SpringArrays *sa = &a->springs;
+  const SpringArrays *sb = &b->springs;
+  if (a->mass_count != b->mass_count || a->spring_count != b->spring_count ||
+      a->mass_id_count != b->mass_id_count ||
+      a->spring_id_count != b->spring_id_count) {
+    printf("ERROR: Check %s: %zu masses and %zu springs instead of %zu and "
+           "%zu\n",
+           check, b->mass_count, b->spring_count, a->mass_count,
+           a->spring_count);
+    return false;
+  }
+  for (size_t id = 0; id < a->mass_id_count; ++id) {
+    uint32_t i = ma->slot[id];
+    uint32_t j = mb->slot[id];
+    if (i == HANDLE_NONE || j == HANDLE_NONE) {
+      if (i != j) {
+        printf("ERROR: Check %s: mass %zu lost or found\n", check, id);
+        return false;
+      }
+      continue;
+    }
+    if (mb->id[j] != id ||
+        memcmp(&ma->position[i], &mb->position[j], sizeof(Vec2)) != 0 ||
+        memcmp(&ma->previous_position[i], &mb->previous_position[j],
+               sizeof(Vec2)) != 0 ||
+        memcmp(&ma->velocity[i], &mb->velocity[j], sizeof(Vec2)) != 0 ||
+        memcmp(&ma->inverse_mass[i], &mb->inverse_mass[j], sizeof(Scalar)) !=
+            0 ||
+        ma->fixed[i] != mb->fixed[j]) {
+      printf("ERROR: Check %s: mass %zu changed\n", check, id);
+      return false;
+    }
+  }
+  for (size_t id = 0; id < a->spring_id_count; ++id) {
+    uint32_t i = sa->slot[id];
+    uint32_t j = sb->slot[id];
+    if (i == HANDLE_NONE || j == HANDLE_NONE) {
+      if (i != j) {
+        printf("ERROR: Check %s: spring %zu lost or found\n", check, id);
+        return false;
+      }
+      continue;
+    }
+    if (sb->id[j] != id ||
+        ma->id[sa->first[i]] != mb->id[sb->first[j]] ||
+        ma->id[sa->second[i]] != mb->id[sb->second[j]] ||
+        memcmp(&sa->length[i], &sb->length[j], sizeof(Scalar)) != 0 ||
+        memcmp(&sa->strength[i], &sb->strength[j], sizeof(Scalar)) != 0 ||
+        memcmp(&sa->dampening[i], &sb->dampening[j], sizeof(Scalar)) != 0 ||
+        memcmp(&sa->max_strain[i], &sb->max_strain[j], sizeof(Scalar)) != 0 ||
+        sa->cut[i] != sb->cut[j]) {
+      printf("ERROR: Check %s: spring %zu changed\n", check, id);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Steps two copies of the system alike, then reorders one of them every way
+// there is and compares it with the other by id after each. A held mass has
+// to follow along.
+_Bool check_reorder(const Options *options, size_t steps, double dt) {
+  System plain = {0};
+  System reordered = {0};
+  _Bool ok = setup_system(&plain, options, 1) &&
+             setup_system(&reordered, options, 1);
+  for (size_t i = 0; ok && i < steps; ++i) {
+    system_step(&plain, dt);
+    system_step(&reordered, dt);
+  }
+  const Ordering orderings[] = {ORDERING_MORTON, ORDERING_RCM, ORDERING_NONE};
+  size_t held = reordered.mass_count / 2;
+  uint32_t held_id = held < reordered.mass_count
+                         ? reordered.masses.id[held]
+                         : HANDLE_NONE;
+  for (size_t i = 0; ok && i < sizeof(orderings) / sizeof(*orderings); ++i) {
+    ok = system_reorder(&reordered, orderings[i], &held, 1) &&
+         ids_match(&plain, &reordered, "reorder");
+    if (ok && held < reordered.mass_count &&
+        reordered.masses.id[held] != held_id) {
+      printf("ERROR: Check reorder: held mass %u moved to mass %u\n",
+             held_id, reordered.masses.id[held]);
+      ok = false;
+    }
+  }
+  if (ok) {
+    printf("Check reorder: %zu masses and %zu springs kept after %zu steps\n",
+           reordered.mass_count, reordered.spring_count, steps);
+  }
+  system_free(&reordered);
+  system_free(&plain);
+  return ok;
+}
+
+// Makes an empty file for a check to write to, returns false if it cannot
+_Bool check_file(char *path) {
+  int descriptor = mkstemp(path);
+  if (descriptor < 0) {
+    printf("ERROR: Cannot create %s\n", path);
+    return false;
+  }
+  close(descriptor);
+  return true;
+}
+
+// Steps the system, saves a snapshot of it and resumes from that, as --load
+// would with the same fields and obstacles but no edits or reordering, then
+// steps both as far again. The two have to match to the bit right after loading and after.
+_Bool check_snapshot(const Options *options, size_t steps, double dt) {
+  char path[] = "/tmp/springs_check_snapshot_XXXXXX";
+  if (!check_file(path)) {
+    return false;
+  }
+  Options resume = *options;
+  resume.load = path;
+  resume.cut_every = 0;
+  resume.remove_every = 0;
+  resume.merge_every = 0;
+  resume.reorder = ORDERING_NONE;
+  System saved = {0};
+  System resumed = {0};
+  _Bool ok = setup_system(&saved, options, 1);
+  for (size_t i = 0; ok && i < steps; ++i) {
+    system_step(&saved, dt);
+  }
+  ok = ok && system_save_snapshot(&saved, path) &&
+       setup_system(&resumed, &resume, 1) &&
+       masses_match(&saved, &resumed, "snapshot");
+  for (size_t i = 0; ok && i < steps; ++i) {
+    system_step(&saved, dt);
+    system_step(&resumed, dt);
+  }
+  ok = ok && masses_match(&saved, &resumed, "snapshot");
+  if (ok) {
+    printf("Check snapshot: resumed after %zu steps, matches %zu steps on\n",
+           steps, steps);
+  }
+  unlink(path);
+  system_free(&resumed);
+  system_free(&saved);
+  return ok;
+}
+
+// Whether the replayed masses are within half a quantum of the simulated
+// ones, and the same springs are cut. Reports the first that are not.
+_Bool replay_matches(const System *system, const System *replay,
+                     float quantum, size_t frame) {
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    Vec2 simulated = masses->position[i];
+    Vec2 replayed = replay->masses.position[i];
+    double tolerance = 0.5 * quantum +
+                       1e-6 * (fabs(simulated.x) + fabs(simulated.y));
+    if (!(fabs(replayed.x - simulated.x) <= tolerance &&
+          fabs(replayed.y - simulated.y) <= tolerance)) {
+      printf("ERROR: Check trajectory: frame %zu has mass %zu at %.9g,%.9g "
+             "instead of %.9g,%.9g\n",
+             frame, i, (double)replayed.x, (double)replayed.y,
+             (double)simulated.x, (double)simulated.y);
+      return false;
+    }
+  }
+  // The replayed springs are stored by id
+  for (size_t id = 0; id < system->spring_id_count; ++id) {
+    if (springs->cut[springs->slot[id]] != replay->springs.cut[id]) {
+      printf("ERROR: Check trajectory: frame %zu has spring %zu %s\n", frame,
+             id, replay->springs.cut[id] ? "cut" : "uncut");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Records every step of the system to a file, then replays it next to a copy
+// stepped alike and compares the two frame by frame
+_Bool check_trajectory(const Options *options, size_t steps, double dt) {
+  System recorded = {0};
+  if (!setup_system(&recorded, options, 1)) {
+    system_free(&recorded);
+    return false;
+  }
+  // Recordings need the spring ids without gaps
+  if (recorded.free_spring_id_count > 0 || steps == 0) {
+    printf("Check trajectory: skipped, nothing to record\n");
+    system_free(&recorded);
+    return true;
+  }
+  char path[] = "/tmp/springs_check_trajectory_XXXXXX";
+  TrajectoryRecorder recorder;
+  if (!check_file(path)) {
+    system_free(&recorded);
+    return false;
+  }
+  _Bool ok = trajectory_recorder_open(&recorder, &recorded, path,
+                                      options->quantum, options->compress);
+  if (ok) {
+    recorder.keep_every_frame = true;
+    for (size_t i = 0; ok && i < steps; ++i) {
+      system_step(&recorded, dt);
+      ok = trajectory_recorder_frame(&recorder, &recorded);
+    }
+    ok = trajectory_recorder_close(&recorder) && ok;
+  }
+  float quantum = recorder.quantum;
+  system_free(&recorded);
+
+  System system = {0};
+  System replay = {0};
+  TrajectoryPlayer player;
+  ok = ok && setup_system(&system, options, 1) &&
+       trajectory_player_open(&player, path, &replay);
+  size_t frame = 0;
+  if (ok) {
+    do {
+      system_step(&system, dt);
+      ok = replay_matches(&system, &replay, quantum, frame);
+    } while (ok && ++frame < steps && trajectory_player_next(&player, &replay));
+    trajectory_player_close(&player);
+  }
+  if (ok && frame != steps) {
+    printf("ERROR: Check trajectory: %zu frames instead of %zu\n", frame,
+           steps);
+    ok = false;
+  }
+  if (ok) {
+    printf("Check trajectory: %zu frames replay within half a quantum\n",
+           frame);
+  }
+  unlink(path);
+  system_free(&replay);
+  system_free(&system);
+  return ok;
+}
+
+// Runs the checks of --check for as many steps as the frames take. Returns
+// the exit status.
+int run_checks(const Options *options) {
+  PhysicsClock clock =
+      physics_clock_init(1.0 / options->dt, options->substeps, options->dt);
+  size_t steps = 0;
+  for (size_t frame = 0; frame < options->steps; ++frame) {
+    steps += physics_clock_advance(&clock, options->dt);
+  }
+  _Bool ok = check_lanes(options, steps, clock.step);
+  ok = check_reorder(options, steps, clock.step) && ok;
+  ok = check_snapshot(options, steps, clock.step) && ok;
+  ok = check_trajectory(options, steps, clock.step) && ok;
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  Options options = {
+      .steps = DEFAULT_STEPS,
+      .substeps = 1,
+      .dt = DEFAULT_DT,
+      .threads = sysconf(_SC_NPROCESSORS_ONLN),
+      .rows = DEFAULT_GRID_ROWS,
+      .cols = DEFAULT_GRID_COLS,
+      .checkpoint_every = DEFAULT_CHECKPOINT_EVERY,
+      .ordering = ORDERING_RCM,
+  };
+  if (!parse_options(argc, argv, &options) || options.substeps == 0 ||
+      options.dt <= 0.0 || options.checkpoint_every == 0) {
+    print_usage(argv[0]);
+    return argc > 1 && strcmp(argv[1], "--help") == 0 ? 0 : 1;
+  }
+
+  if (options.check) {
+    return run_checks(&options);
+  }
+  if (options.ensemble > 0) {
+    return run_ensemble(&options);
+  }
+
+  // With level of detail the system is only written to, the levels step on
+  // the threads
+  System system = {0};
+  LodGrid lod = {0};
+  if (!setup_system(&system, &options, options.lod ? 1 : options.threads) ||
+      (options.lod && !lod_grid_init(&lod, &system, options.rows, options.cols,
+                                     options.threads))) {
+    system_free(&system);
+    return 1;
+  }
+
+  TrajectoryRecorder recorder;
+  if (options.record != NULL &&
+      !trajectory_recorder_open(&recorder, &system, options.record,
+                                options.quantum, options.compress)) {
+    system_free(&system);
+    return 1;
+  }
+  recorder.keep_every_frame = options.keep_every_frame;
+
+  PhysicsClock clock =
+      physics_clock_init(1.0 / options.dt, options.substeps, options.dt);
+  size_t total_steps = 0;
+  size_t fine_mass_steps = 0;
+
+  double start = seconds_now();
+  for (size_t frame = 0; frame < options.steps; ++frame) {
+    profile_frame_begin();
+    size_t steps = physics_clock_advance(&clock, options.dt);
+    for (size_t i = 0; i < steps && options.lod; ++i) {
+      if (!lod_grid_step(&lod, &system, clock.step)) {
+        printf("ERROR: Level of detail stopped, carrying on at full "
+               "resolution\n");
+        lod_grid_sync(&lod, &system);
+        options.lod = false;
+        break;
+      }
+      fine_mass_steps += lod.free_count;
+    }
+    for (size_t i = 0; i < steps && !options.lod; ++i) {
+      system_step(&system, clock.step);
+    }
+    total_steps += steps;
+    _Bool checkpoint = options.checkpoint != NULL &&
+                       (frame + 1) % options.checkpoint_every == 0;
+    if (options.lod && (options.record != NULL || checkpoint)) {
+      lod_grid_sync(&lod, &system);
+    }
+    // Recordings keep the order they started with
+    if (options.record == NULL) {
+      system_reorder_if_needed(&system, NULL, 0);
+    }
+    if (options.record != NULL) {
+      trajectory_recorder_frame(&recorder, &system);
+    }
+    PROFILE_SET(PROFILE_COUNTER_ACTIVE_SPRINGS, system.active_spring_count);
+    PROFILE_SET(PROFILE_COUNTER_SLEEPING_MASSES, system.sleeping_mass_count);
+    profile_frame_end();
+    if (checkpoint) {
+      system_save_snapshot(&system, options.checkpoint);
+    }
+  }
+  double elapsed = seconds_now() - start;
+  if (options.lod) {
+    lod_grid_sync(&lod, &system);
+  }
+
+  printf("Simulated %zu frames (%zu steps) of %zu masses and %zu springs\n",
+         options.steps, total_steps, system.mass_count, system.spring_count);
+  if (system.solver == SOLVER_XPBD) {
+    printf("Solver: xpbd, %s, %zu iterations, threads: %zu, precision: %s\n",
+           system.xpbd_method == XPBD_JACOBI ? "jacobi" : "gauss-seidel",
+           system.xpbd_iterations > 0 ? system.xpbd_iterations
+                                      : (size_t)XPBD_DEFAULT_ITERATIONS,
+           options.threads, SCALAR_NAME);
+  } else {
+    printf("Integrator: %s, spring kernel: %s, threads: %zu, precision: %s\n",
+           integrator_name(system.integrator),
+           spring_kernel_name(system.spring_kernel), options.threads,
+           SCALAR_NAME);
+  }
+  printf("Elapsed: %.3f s, %.1f steps/sec\n", elapsed,
+         elapsed > 0.0 ? total_steps / elapsed : 0.0);
+  if (system.collide_masses || system.obstacle_count > 0) {
+    printf("Contacts: %zu in the last step\n", system.contact_count);
+  }
+  if (system.tear_springs && system.tear_event_count > 0) {
+    printf("Torn: %zu springs, the first at %.3f s\n", system.torn_count,
+           system.tear_events[0].time);
+  } else if (system.tear_springs) {
+    printf("Torn: 0 springs\n");
+  }
+  if (system.sleep_islands) {
+    printf("Sleeping: %zu of %zu islands, %zu masses\n",
+           system.sleeping_island_count, system.island_count,
+           system.sleeping_mass_count);
+  }
+  if (options.lod) {
+    printf("Level of detail: %zu of %zu blocks refined, %.1f%% of the masses "
+           "stepped at full resolution\n",
+           lod.refined_count, lod.block_rows * lod.block_cols,
+           total_steps > 0 ? 100.0 * fine_mass_steps /
+                                 ((double)total_steps * system.mass_count)
+                           : 0.0);
+  }
+
+  int status = 0;
+  if (options.record != NULL) {
+    uint64_t recorded = recorder.frame_count - recorder.dropped_frames;
+    uint64_t dropped = recorder.dropped_frames;
+    if (!trajectory_recorder_close(&recorder)) {
+      status = 1;
+    }
+    printf("Recorded %llu frames to %s, %llu dropped\n",
+           (unsigned long long)recorded, options.record,
+           (unsigned long long)dropped);
+  }
+  // The last frame may have been checkpointed already
+  if (options.checkpoint != NULL &&
+      (options.steps == 0 || options.steps % options.checkpoint_every != 0) &&
+      !system_save_snapshot(&system, options.checkpoint)) {
+    status = 1;
+  }
+  if (options.trace != NULL && !profile_enabled()) {
+    printf("ERROR: No trace written, build with make PROFILE=1\n");
+    status = 1;
+  } else if (options.trace != NULL &&
+             !profile_write_chrome_trace(options.trace)) {
+    status = 1;
+  }
+  lod_grid_free(&lod);
+  system_free(&system);
+  return status;
+}
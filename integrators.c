@@ -0,0 +1,496 @@
+#include "springs.h"
+#include "profiler.h"
+#include "springs_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+#define IMPLICIT_MAX_ITERATIONS 64
+#define IMPLICIT_TOLERANCE 1e-4
+// Floats stored per spring by the implicit solver: the symmetric stiffness
+// block and the symmetric system matrix block, three entries each
+#define IMPLICIT_SPRING_FLOATS 6
+
+static const char *integrator_names[INTEGRATOR_COUNT] = {
+    [INTEGRATOR_SEMI_IMPLICIT_EULER] = "semi-implicit-euler",
+    [INTEGRATOR_VERLET] = "verlet",
+    [INTEGRATOR_RK4] = "rk4",
+    [INTEGRATOR_IMPLICIT_EULER] = "implicit-euler",
+};
+
+const char *integrator_name(Integrator integrator) {
+  if (integrator >= INTEGRATOR_COUNT) {
+    return "unknown";
+  }
+  return integrator_names[integrator];
+}
+
+_Bool integrator_from_name(const char *name, Integrator *integrator) {
+  for (size_t i = 0; i < INTEGRATOR_COUNT; ++i) {
+    if (strcmp(name, integrator_names[i]) == 0) {
+      *integrator = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static _Bool system_adjacency_ready(System *system) {
+  return system->adjacency_valid || system_build_adjacency(system);
+}
+
+typedef struct {
+  const Vec2 *force;
+  Scalar dt;
+} Kick;
+
+static void drift_range(System *system, size_t begin, size_t end,
+                        void *argument) {
+  Scalar dt = *(double *)argument;
+  MassArrays *masses = &system->masses;
+  for (size_t i = begin; i < end; ++i) {
+    if (!masses->fixed[i]) {
+      masses->position[i] =
+          vec2_add(masses->position[i], vec2_scale(masses->velocity[i], dt));
+    }
+  }
+}
+
+static void kick_range(System *system, size_t begin, size_t end,
+                       void *argument) {
+  const Kick *kick = argument;
+  MassArrays *masses = &system->masses;
+  for (size_t i = begin; i < end; ++i) {
+    Vec2 acceleration =
+        mass_acceleration(system, i, masses->position[i], masses->velocity[i],
+                          kick->force[i]);
+    masses->velocity[i] =
+        vec2_add(masses->velocity[i], vec2_scale(acceleration, kick->dt));
+  }
+}
+
+// Drifts half a step, evaluates the forces there, kicks the velocity a full
+// step and drifts the remaining half
+static _Bool verlet_step(System *system, double dt) {
+  MassArrays *masses = &system->masses;
+  Vec2 *force = system_mass_scratch(system, 1);
+  if (force == NULL || !system_adjacency_ready(system)) {
+    return false;
+  }
+
+  double half_dt = 0.5 * dt;
+  system_parallel_for(system, system->mass_count, drift_range, &half_dt);
+  system_evaluate_forces(system, masses->position, masses->velocity,
+                         masses->force, force, system->tear_springs);
+  Kick kick = {force, dt};
+  system_parallel_for(system, system->mass_count, kick_range, &kick);
+  system_parallel_for(system, system->mass_count, drift_range, &half_dt);
+  return true;
+}
+
+typedef struct {
+  const Vec2 *position; // Position at the stage state
+  const Vec2 *velocity; // Velocity at the stage state
+  const Vec2 *force;    // Forces at the stage state
+  Vec2 *position_sum;   // Weighted sum of the position derivatives so far
+  Vec2 *velocity_sum;   // Weighted sum of the velocity derivatives so far
+  Vec2 *next_position;  // State for the next stage, may alias velocity
+  Vec2 *next_velocity;
+  Scalar weight;      // Weight of this stage's derivatives
+  Scalar next_offset; // Time from the start of the step to the next stage
+  Scalar dt;
+  _Bool first;
+  _Bool last; // The last stage applies the sums instead of a next state
+} Rk4Stage;
+
+static void rk4_stage_range(System *system, size_t begin, size_t end,
+                            void *argument) {
+  const Rk4Stage *stage = argument;
+  MassArrays *masses = &system->masses;
+
+  for (size_t i = begin; i < end; ++i) {
+    Vec2 dx = masses->fixed[i] ? vec2_zero() : stage->velocity[i];
+    Vec2 dv = mass_acceleration(system, i, stage->position[i],
+                                stage->velocity[i], stage->force[i]);
+    Vec2 position_sum = vec2_scale(dx, stage->weight);
+    Vec2 velocity_sum = vec2_scale(dv, stage->weight);
+    if (!stage->first) {
+      position_sum = vec2_add(stage->position_sum[i], position_sum);
+      velocity_sum = vec2_add(stage->velocity_sum[i], velocity_sum);
+    }
+
+    if (stage->last) {
+      masses->position[i] =
+          vec2_add(masses->position[i], vec2_scale(position_sum, stage->dt));
+      masses->velocity[i] =
+          vec2_add(masses->velocity[i], vec2_scale(velocity_sum, stage->dt));
+      continue;
+    }
+    stage->position_sum[i] = position_sum;
+    stage->velocity_sum[i] = velocity_sum;
+    stage->next_position[i] =
+        vec2_add(masses->position[i], vec2_scale(dx, stage->next_offset));
+    stage->next_velocity[i] =
+        vec2_add(masses->velocity[i], vec2_scale(dv, stage->next_offset));
+  }
+}
+
+static _Bool rk4_step(System *system, double dt) {
+  MassArrays *masses = &system->masses;
+  size_t n = system->mass_count;
+  Vec2 *scratch = system_mass_scratch(system, 5);
+  if (scratch == NULL || !system_adjacency_ready(system)) {
+    return false;
+  }
+  Vec2 *stage_position = scratch;
+  Vec2 *stage_velocity = scratch + n;
+  Vec2 *position_sum = scratch + 2 * n;
+  Vec2 *velocity_sum = scratch + 3 * n;
+  Vec2 *force = scratch + 4 * n;
+
+  const double weights[4] = {1.0 / 6.0, 2.0 / 6.0, 2.0 / 6.0, 1.0 / 6.0};
+  const double next_offsets[4] = {0.5 * dt, 0.5 * dt, dt, 0.0};
+  const Vec2 *position = masses->position;
+  const Vec2 *velocity = masses->velocity;
+  for (size_t k = 0; k < 4; ++k) {
+    // Springs tear at the start of the step only
+    system_evaluate_forces(system, position, velocity, masses->force, force,
+                           system->tear_springs && k == 0);
+    Rk4Stage stage = {
+        .position = position,
+        .velocity = velocity,
+        .force = force,
+        .position_sum = position_sum,
+        .velocity_sum = velocity_sum,
+        .next_position = stage_position,
+        .next_velocity = stage_velocity,
+        .weight = weights[k],
+        .next_offset = next_offsets[k],
+        .dt = dt,
+        .first = k == 0,
+        .last = k == 3,
+    };
+    system_parallel_for(system, n, rk4_stage_range, &stage);
+    position = stage_position;
+    velocity = stage_velocity;
+  }
+  return true;
+}
+
+static Vec2 symmetric_multiply(const Scalar *block, Vec2 v) {
+  return (Vec2){block[0] * v.x + block[1] * v.y,
+                block[1] * v.x + block[2] * v.y};
+}
+
+typedef struct {
+  Scalar *jacobian;
+  Scalar dt;
+} JacobianAssembly;
+
+// Stores the stiffness block K = df_first/dx_second of every spring, and the
+// block S = dt * D + dt^2 * K it contributes to the system matrix, where D is
+// the damping block. The transverse part of K is clamped at zero for
+// compressed springs, which keeps the system positive definite.
+static void spring_jacobian_range(System *system, size_t begin, size_t end,
+                                  void *argument) {
+  const JacobianAssembly *assembly = argument;
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  Scalar dt = assembly->dt;
+
+  for (size_t i = begin; i < end; ++i) {
+    Scalar *block = assembly->jacobian + i * IMPLICIT_SPRING_FLOATS;
+    Vec2 span = vec2_subtract(masses->position[springs->second[i]],
+                              masses->position[springs->first[i]]);
+    Scalar span_length = vec2_length(span);
+    if (span_length <= SCALAR_C(0.0)) {
+      for (size_t j = 0; j < IMPLICIT_SPRING_FLOATS; ++j) {
+        block[j] = SCALAR_C(0.0);
+      }
+      continue;
+    }
+
+    Vec2 n = vec2_scale(span, SCALAR_C(1.0) / span_length);
+    Scalar transverse = SCALAR_C(1.0) - springs->length[i] / span_length;
+    transverse = transverse > SCALAR_C(0.0) ? transverse : SCALAR_C(0.0);
+    Scalar k = springs->strength[i];
+    Scalar c = springs->dampening[i];
+    Scalar nn[3] = {n.x * n.x, n.x * n.y, n.y * n.y};
+    Scalar identity[3] = {SCALAR_C(1.0), SCALAR_C(0.0), SCALAR_C(1.0)};
+    for (size_t j = 0; j < 3; ++j) {
+      Scalar stiffness = k * (nn[j] + transverse * (identity[j] - nn[j]));
+      block[j] = stiffness;
+      block[3 + j] = dt * c * nn[j] + dt * dt * stiffness;
+    }
+  }
+}
+
+static size_t other_endpoint(const SpringArrays *springs, uint32_t entry) {
+  uint32_t spring = entry >> 1;
+  return (entry & 1) ? springs->first[spring] : springs->second[spring];
+}
+
+typedef struct {
+  const Scalar *jacobian;
+  const Vec2 *force;
+  Vec2 *residual;
+  Vec2 *direction;
+  Vec2 *velocity_change;
+  Scalar dt;
+} ImplicitRhs;
+
+// Right hand side dt * (f + dt * df/dx * v), used as the initial residual and
+// search direction of a solve starting from a zero velocity change
+static void implicit_rhs_range(System *system, size_t begin, size_t end,
+                               void *argument) {
+  const ImplicitRhs *rhs = argument;
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  const size_t *offset = system->adjacency_offset;
+  Scalar dt = rhs->dt;
+
+  for (size_t i = begin; i < end; ++i) {
+    rhs->velocity_change[i] = vec2_zero();
+    if (masses->fixed[i]) {
+      rhs->residual[i] = vec2_zero();
+      rhs->direction[i] = vec2_zero();
+      continue;
+    }
+
+    Vec2 acceleration =
+        mass_acceleration(system, i, masses->position[i], masses->velocity[i],
+                          rhs->force[i]);
+    Vec2 b = vec2_scale(acceleration, dt / masses->inverse_mass[i]);
+    for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
+      uint32_t entry = system->adjacency[j];
+      const Scalar *stiffness =
+          rhs->jacobian + (entry >> 1) * IMPLICIT_SPRING_FLOATS;
+      Vec2 relative = vec2_subtract(
+          masses->velocity[i],
+          masses->velocity[other_endpoint(springs, entry)]);
+      b = vec2_subtract(
+          b, vec2_scale(symmetric_multiply(stiffness, relative), dt * dt));
+    }
+    rhs->residual[i] = b;
+    rhs->direction[i] = b;
+  }
+}
+
+typedef struct {
+  const Scalar *jacobian;
+  const Vec2 *in;
+  Vec2 *out;
+} ImplicitProduct;
+
+// Multiplies by the system matrix M - dt * df/dv - dt^2 * df/dx, leaving out
+// the rows and columns of fixed masses
+static void implicit_product_range(System *system, size_t begin, size_t end,
+                                   void *argument) {
+  const ImplicitProduct *product = argument;
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  const size_t *offset = system->adjacency_offset;
+
+  for (size_t i = begin; i < end; ++i) {
+    if (masses->fixed[i]) {
+      product->out[i] = vec2_zero();
+      continue;
+    }
+
+    Vec2 in = product->in[i];
+    Vec2 out = vec2_scale(in, 1.0 / masses->inverse_mass[i]);
+    for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
+      uint32_t entry = system->adjacency[j];
+      const Scalar *block =
+          product->jacobian + (entry >> 1) * IMPLICIT_SPRING_FLOATS + 3;
+      size_t other = other_endpoint(springs, entry);
+      Vec2 other_in = masses->fixed[other] ? vec2_zero() : product->in[other];
+      out = vec2_add(out,
+                     symmetric_multiply(block, vec2_subtract(in, other_in)));
+    }
+    product->out[i] = out;
+  }
+}
+
+typedef struct {
+  const Vec2 *a;
+  const Vec2 *b;
+} Dot;
+
+static double dot_sum(System *system, size_t begin, size_t end,
+                      void *argument) {
+  (void)system;
+  const Dot *dot = argument;
+  double sum = 0.0;
+  for (size_t i = begin; i < end; ++i) {
+    sum += (double)dot->a[i].x * dot->b[i].x +
+           (double)dot->a[i].y * dot->b[i].y;
+  }
+  return sum;
+}
+
+typedef struct {
+  Vec2 *velocity_change;
+  Vec2 *residual;
+  Vec2 *direction;
+  const Vec2 *product;
+  double scale;
+} CgUpdate;
+
+// Steps the solution and residual along the search direction and returns the
+// squared norm of the new residual
+static double cg_update_sum(System *system, size_t begin, size_t end,
+                            void *argument) {
+  (void)system;
+  const CgUpdate *update = argument;
+  Scalar alpha = update->scale;
+  double sum = 0.0;
+  for (size_t i = begin; i < end; ++i) {
+    update->velocity_change[i] = vec2_add(
+        update->velocity_change[i], vec2_scale(update->direction[i], alpha));
+    Vec2 r = vec2_subtract(update->residual[i],
+                           vec2_scale(update->product[i], alpha));
+    update->residual[i] = r;
+    sum += (double)r.x * r.x + (double)r.y * r.y;
+  }
+  return sum;
+}
+
+static void cg_direction_range(System *system, size_t begin, size_t end,
+                               void *argument) {
+  (void)system;
+  const CgUpdate *update = argument;
+  Scalar beta = update->scale;
+  for (size_t i = begin; i < end; ++i) {
+    update->direction[i] = vec2_add(update->residual[i],
+                                    vec2_scale(update->direction[i], beta));
+  }
+}
+
+typedef struct {
+  const Vec2 *velocity_change;
+  Scalar dt;
+} ImplicitApply;
+
+static void implicit_apply_range(System *system, size_t begin, size_t end,
+                                 void *argument) {
+  const ImplicitApply *apply = argument;
+  MassArrays *masses = &system->masses;
+  for (size_t i = begin; i < end; ++i) {
+    if (masses->fixed[i]) {
+      continue;
+    }
+    masses->velocity[i] =
+        vec2_add(masses->velocity[i], apply->velocity_change[i]);
+    masses->position[i] = vec2_add(masses->position[i],
+                                   vec2_scale(masses->velocity[i], apply->dt));
+  }
+}
+
+// Linearized backward Euler as in Baraff and Witkin's cloth solver. Solves
+// (M - dt * df/dv - dt^2 * df/dx) dv = dt * (f + dt * df/dx * v) with a matrix
+// free conjugate gradient over the spring adjacency, then moves with the new
+// velocity.
+static _Bool implicit_euler_step(System *system, double dt) {
+  PROFILE_SCOPE(PROFILE_ZONE_SOLVE);
+  MassArrays *masses = &system->masses;
+  size_t n = system->mass_count;
+  Vec2 *scratch = system_mass_scratch(system, 5);
+  Scalar *jacobian = system_spring_scratch(system, IMPLICIT_SPRING_FLOATS);
+  if (scratch == NULL || jacobian == NULL || !system_adjacency_ready(system)) {
+    return false;
+  }
+  Vec2 *force = scratch;
+  Vec2 *residual = scratch + n;
+  Vec2 *direction = scratch + 2 * n;
+  Vec2 *product = scratch + 3 * n;
+  Vec2 *velocity_change = scratch + 4 * n;
+
+  system_evaluate_forces(system, masses->position, masses->velocity,
+                         masses->force, force, system->tear_springs);
+  JacobianAssembly assembly = {jacobian, dt};
+  system_parallel_for(system, system->active_spring_count,
+                      spring_jacobian_range, &assembly);
+  ImplicitRhs rhs = {jacobian, force, residual, direction, velocity_change, dt};
+  system_parallel_for(system, n, implicit_rhs_range, &rhs);
+
+  double residual_norm =
+      system_parallel_sum(system, n, dot_sum, &(Dot){residual, residual});
+  double target = IMPLICIT_TOLERANCE * IMPLICIT_TOLERANCE * residual_norm;
+  for (size_t iteration = 0;
+       iteration < IMPLICIT_MAX_ITERATIONS && residual_norm > target;
+       ++iteration) {
+    ImplicitProduct multiply = {jacobian, direction, product};
+    system_parallel_for(system, n, implicit_product_range, &multiply);
+    double curvature =
+        system_parallel_sum(system, n, dot_sum, &(Dot){direction, product});
+    if (curvature <= 0.0) {
+      break;
+    }
+
+    CgUpdate update = {velocity_change, residual, direction, product,
+                       residual_norm / curvature};
+    double next_norm = system_parallel_sum(system, n, cg_update_sum, &update);
+    update.scale = next_norm / residual_norm;
+    system_parallel_for(system, n, cg_direction_range, &update);
+    residual_norm = next_norm;
+  }
+
+  ImplicitApply apply = {velocity_change, dt};
+  system_parallel_for(system, n, implicit_apply_range, &apply);
+  return true;
+}
+
+static _Bool integrator_step(System *system, double dt) {
+  switch (system->integrator) {
+  case INTEGRATOR_VERLET:
+    return verlet_step(system, dt);
+  case INTEGRATOR_RK4:
+    return rk4_step(system, dt);
+  case INTEGRATOR_IMPLICIT_EULER:
+    return implicit_euler_step(system, dt);
+  default:
+    return false;
+  }
+}
+
+void system_step(System *system, double dt) {
+  PROFILE_SCOPE(PROFILE_ZONE_STEP);
+  system_sum_force_fields(system);
+  // Only semi-implicit Euler skips sleeping islands, the rest wake them all
+  _Bool euler = system->solver == SOLVER_FORCES &&
+                system->integrator == INTEGRATOR_SEMI_IMPLICIT_EULER;
+  _Bool sleeping =
+      system->sleep_islands && euler && system_update_islands(system);
+  if (!sleeping && system->sleeping_island_count > 0) {
+    system_wake_all(system);
+  }
+  // Nothing moves while every island sleeps
+  _Bool all_asleep =
+      sleeping && system->sleeping_mass_count == system->mass_count;
+  _Bool stepped = all_asleep;
+  if (!stepped && euler && system->spring_kernel == SPRING_KERNEL_BATCHED) {
+    stepped = system_fused_euler_step(system, dt);
+  }
+  // The XPBD solver replaces both the spring forces and the integrator
+  if (!stepped) {
+    stepped = system->solver == SOLVER_XPBD ? system_xpbd_step(system, dt)
+                                            : integrator_step(system, dt);
+  }
+
+  // Semi-implicit Euler also serves as the fallback when a solver or
+  // integrator cannot get the memory it needs
+  if (!stepped) {
+    system_spring_update(system);
+    system_mass_update(system, dt);
+  }
+  system_collide(system);
+  if (sleeping) {
+    system_update_sleep(system);
+  }
+  system_mass_reset_forces(system);
+  system->hash_moved = true;
+  if (!all_asleep) {
+    ++system->motion_version;
+  }
+  system->time += dt;
+}
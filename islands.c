@@ -0,0 +1,303 @@
+#include "springs.h"
+#include "array.h"
+#include "profiler.h"
+#include "springs_internal.h"
+#include <math.h>
+#include <stdio.h>
+
+static _Bool system_resize_islands(System *system, size_t capacity) {
+  IslandArrays *islands = &system->islands;
+  _Bool ok = true;
+  ARRAY_RESIZE(islands->sleeping, capacity, ok);
+  ARRAY_RESIZE(islands->dirty, capacity, ok);
+  ARRAY_RESIZE(islands->moving, capacity, ok);
+  ARRAY_RESIZE(islands->reused, capacity, ok);
+  ARRAY_RESIZE(islands->mass_count, capacity, ok);
+  ARRAY_RESIZE(islands->quiet_steps, capacity, ok);
+  ARRAY_RESIZE(islands->min, capacity, ok);
+  ARRAY_RESIZE(islands->max, capacity, ok);
+  // Every island holds at least one mass, so there are never more islands
+  ARRAY_RESIZE(system->mass_island, capacity, ok);
+  ARRAY_RESIZE(system->island_visited, capacity, ok);
+  ARRAY_RESIZE(system->island_queue, capacity, ok);
+  return ok;
+}
+
+void system_invalidate_islands(System *system) {
+  system->sleeping_island_count = 0;
+  system->sleeping_mass_count = 0;
+  system->islands_valid = false;
+}
+
+void system_free_islands(System *system) {
+  system_resize_islands(system, 0);
+  system->island_count = 0;
+  system->islands_dirty = false;
+  system_invalidate_islands(system);
+}
+
+// Labels the unvisited masses reachable from start over live springs with
+// island, and returns how many there were
+static size_t island_flood(System *system, uint32_t start, uint32_t island) {
+  const SpringArrays *springs = &system->springs;
+  const size_t *offset = system->adjacency_offset;
+  uint8_t *visited = system->island_visited;
+  uint32_t *queue = system->island_queue;
+  size_t head = 0;
+  size_t tail = 0;
+  queue[tail++] = start;
+  visited[start] = true;
+  while (head < tail) {
+    uint32_t mass = queue[head++];
+    system->mass_island[mass] = island;
+    for (size_t j = offset[mass]; j < offset[mass + 1]; ++j) {
+      uint32_t entry = system->adjacency[j];
+      uint32_t other = (entry & 1) ? springs->first[entry >> 1]
+                                   : springs->second[entry >> 1];
+      if (!visited[other]) {
+        visited[other] = true;
+        queue[tail++] = other;
+      }
+    }
+  }
+  return tail;
+}
+
+static void island_init(IslandArrays *islands, size_t island,
+                        size_t mass_count) {
+  islands->sleeping[island] = false;
+  islands->dirty[island] = false;
+  islands->moving[island] = true;
+  islands->mass_count[island] = mass_count;
+  islands->quiet_steps[island] = 0;
+  islands->min[island] = (Vec2){INFINITY, INFINITY};
+  islands->max[island] = (Vec2){-INFINITY, -INFINITY};
+}
+
+// Labels every mass from scratch, or only the masses of the islands that lost
+// springs. The first part of such an island keeps its id, so a cut that does
+// not split it leaves the ids as they were.
+_Bool system_update_islands(System *system) {
+  if (system->islands_valid && !system->islands_dirty) {
+    return true;
+  }
+  PROFILE_SCOPE(PROFILE_ZONE_ISLANDS);
+  if (!system->adjacency_valid && !system_build_adjacency(system)) {
+    return false;
+  }
+  IslandArrays *islands = &system->islands;
+  uint8_t *visited = system->island_visited;
+  _Bool full = !system->islands_valid;
+  if (full) {
+    if (!system_resize_islands(system, system->mass_count)) {
+      printf("ERROR: Cannot allocate memory for islands\n");
+      return false;
+    }
+    visited = system->island_visited;
+    system->island_count = 0;
+    for (size_t i = 0; i < system->mass_count; ++i) {
+      visited[i] = false;
+    }
+  } else {
+    for (size_t i = 0; i < system->island_count; ++i) {
+      islands->reused[i] = false;
+    }
+    for (size_t i = 0; i < system->mass_count; ++i) {
+      visited[i] = !islands->dirty[system->mass_island[i]];
+    }
+  }
+
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    if (visited[i]) {
+      continue;
+    }
+    uint32_t island;
+    if (!full && !islands->reused[system->mass_island[i]]) {
+      island = system->mass_island[i];
+      islands->reused[island] = true;
+    } else {
+      island = system->island_count++;
+    }
+    island_init(islands, island, island_flood(system, i, island));
+  }
+  system->islands_dirty = false;
+  system->islands_valid = true;
+  return true;
+}
+
+static void island_wake(System *system, size_t island) {
+  IslandArrays *islands = &system->islands;
+  islands->quiet_steps[island] = 0;
+  if (islands->sleeping[island]) {
+    islands->sleeping[island] = false;
+    --system->sleeping_island_count;
+    system->sleeping_mass_count -= islands->mass_count[island];
+  }
+}
+
+void system_wake_mass(System *system, size_t i) {
+  if (system->islands_valid && i < system->mass_count) {
+    island_wake(system, system->mass_island[i]);
+  }
+}
+
+void system_wake_all(System *system) {
+  if (!system->islands_valid) {
+    return;
+  }
+  for (size_t i = 0; i < system->island_count; ++i) {
+    island_wake(system, i);
+  }
+}
+
+void system_island_spring_cut(System *system, size_t i) {
+  if (!system->islands_valid) {
+    return;
+  }
+  uint32_t island = system->mass_island[system->springs.first[i]];
+  system->islands.dirty[island] = true;
+  system->islands_dirty = true;
+  island_wake(system, island);
+}
+
+static _Bool bounds_overlap(const IslandArrays *islands, size_t a, size_t b,
+                            Scalar margin) {
+  return islands->min[a].x - margin <= islands->max[b].x &&
+         islands->min[b].x - margin <= islands->max[a].x &&
+         islands->min[a].y - margin <= islands->max[b].y &&
+         islands->min[b].y - margin <= islands->max[a].y;
+}
+
+// Flags the awake islands with a mass above the sleep energy. Stops as soon as
+// every awake island is known to be moving, which is right away for a cloth
+// in motion.
+static void islands_find_moving(System *system) {
+  IslandArrays *islands = &system->islands;
+  const MassArrays *masses = &system->masses;
+  size_t undecided = 0;
+  for (size_t i = 0; i < system->island_count; ++i) {
+    islands->moving[i] = false;
+    undecided += !islands->sleeping[i];
+  }
+  for (size_t i = 0; i < system->mass_count && undecided > 0; ++i) {
+    uint32_t island = system->mass_island[i];
+    if (islands->sleeping[island] || islands->moving[island] ||
+        masses->fixed[i]) {
+      continue;
+    }
+    // Compared against the energy scaled by the inverse mass, so no division
+    // is needed. NaN velocities count as moving.
+    Vec2 velocity = masses->velocity[i];
+    if (!(SCALAR_C(0.5) * vec2_dot(velocity, velocity) <=
+          SYSTEM_SLEEP_ENERGY * masses->inverse_mass[i])) {
+      islands->moving[island] = true;
+      --undecided;
+    }
+  }
+}
+
+// Measures the bounds of the awake islands. Masses of an island tend to sit
+// together, so the bounds of the current one are kept in locals until the
+// island changes.
+static void islands_measure_bounds(System *system) {
+  IslandArrays *islands = &system->islands;
+  const Vec2 *position = system->masses.position;
+  for (size_t i = 0; i < system->island_count; ++i) {
+    if (!islands->sleeping[i]) {
+      islands->min[i] = (Vec2){INFINITY, INFINITY};
+      islands->max[i] = (Vec2){-INFINITY, -INFINITY};
+    }
+  }
+  size_t current = SIZE_MAX;
+  Vec2 min = vec2_zero();
+  Vec2 max = vec2_zero();
+  for (size_t i = 0; i <= system->mass_count; ++i) {
+    size_t island = i < system->mass_count ? system->mass_island[i] : SIZE_MAX;
+    if (island != current) {
+      if (current != SIZE_MAX) {
+        islands->min[current] = min;
+        islands->max[current] = max;
+      }
+      current =
+          island != SIZE_MAX && !islands->sleeping[island] ? island : SIZE_MAX;
+      if (current != SIZE_MAX) {
+        min = islands->min[current];
+        max = islands->max[current];
+      }
+    }
+    if (current != SIZE_MAX) {
+      Vec2 p = position[i];
+      min = (Vec2){p.x < min.x ? p.x : min.x, p.y < min.y ? p.y : min.y};
+      max = (Vec2){p.x > max.x ? p.x : max.x, p.y > max.y ? p.y : max.y};
+    }
+  }
+}
+
+void system_update_sleep(System *system) {
+  PROFILE_SCOPE(PROFILE_ZONE_ISLANDS);
+  IslandArrays *islands = &system->islands;
+  islands_find_moving(system);
+  size_t falling_asleep = 0;
+  size_t moving_count = 0;
+  for (size_t i = 0; i < system->island_count; ++i) {
+    if (islands->sleeping[i]) {
+      continue;
+    }
+    if (islands->moving[i]) {
+      islands->quiet_steps[i] = 0;
+      ++moving_count;
+    } else if (++islands->quiet_steps[i] >= SYSTEM_SLEEP_STEPS) {
+      ++falling_asleep;
+    }
+  }
+  // Bounds are only needed for islands that fall asleep, and for moving ones
+  // that may wake them
+  _Bool wake_neighbors = moving_count > 0 &&
+                         system->sleeping_island_count + falling_asleep > 0;
+  if (falling_asleep == 0 && !wake_neighbors) {
+    return;
+  }
+  islands_measure_bounds(system);
+
+  if (falling_asleep > 0) {
+    for (size_t i = 0; i < system->island_count; ++i) {
+      if (!islands->sleeping[i] &&
+          islands->quiet_steps[i] >= SYSTEM_SLEEP_STEPS) {
+        islands->sleeping[i] = true;
+        ++system->sleeping_island_count;
+        system->sleeping_mass_count += islands->mass_count[i];
+      }
+    }
+    // Settled islands come to a stop, so that they do not creep once woken
+    MassArrays *masses = &system->masses;
+    for (size_t i = 0; i < system->mass_count; ++i) {
+      if (islands->sleeping[system->mass_island[i]]) {
+        masses->velocity[i] = vec2_zero();
+      }
+    }
+  }
+  if (!wake_neighbors) {
+    return;
+  }
+
+  // Moving islands wake the sleeping ones they come close to. The sleeping
+  // ones are listed first, as there tend to be few of both.
+  uint32_t *asleep = system->island_queue;
+  size_t asleep_count = 0;
+  for (size_t i = 0; i < system->island_count; ++i) {
+    if (islands->sleeping[i]) {
+      asleep[asleep_count++] = i;
+    }
+  }
+  for (size_t i = 0; i < system->island_count; ++i) {
+    if (islands->sleeping[i] || !islands->moving[i]) {
+      continue;
+    }
+    for (size_t j = 0; j < asleep_count; ++j) {
+      if (islands->sleeping[asleep[j]] &&
+          bounds_overlap(islands, i, asleep[j], MASS_RADIUS)) {
+        island_wake(system, asleep[j]);
+      }
+    }
+  }
+}
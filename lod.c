@@ -0,0 +1,692 @@
+#include "lod.h"
+#include "springs_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Grid row or column of boundary k between the blocks along a side of count
+static size_t lod_line(size_t k, size_t count) {
+  size_t line = k * LOD_FACTOR;
+  return line < count - 1 ? line : count - 1;
+}
+
+// Block holding row or column i, the later one for those on a boundary
+static size_t lod_block_of(size_t i, size_t block_count) {
+  size_t block = i / LOD_FACTOR;
+  return block < block_count ? block : block_count - 1;
+}
+
+// First and last block holding row or column i, two on a boundary
+static void lod_blocks_of(size_t i, size_t block_count, size_t *first,
+                          size_t *last) {
+  *last = lod_block_of(i, block_count);
+  *first = i % LOD_FACTOR == 0 && i > 0 ? i / LOD_FACTOR - 1 : *last;
+}
+
+// Ids system_init_grid gives the springs from grid node (r, c) to the right
+// and down
+static size_t lod_right_spring(const LodGrid *lod, size_t r, size_t c) {
+  size_t row_start = r * (2 * lod->cols - 1);
+  return r + 1 < lod->rows ? row_start + 2 * c : row_start + c;
+}
+
+static size_t lod_down_spring(const LodGrid *lod, size_t r, size_t c) {
+  return r * (2 * lod->cols - 1) + 2 * c + (c + 1 < lod->cols);
+}
+
+// Grid node under a mass or spring endpoint of the system
+static size_t lod_node(const System *system, size_t i) {
+  return system->masses.id[i];
+}
+
+static size_t lod_corner_node(const LodGrid *lod, size_t corner) {
+  size_t kr = corner / (lod->block_cols + 1);
+  size_t kc = corner % (lod->block_cols + 1);
+  return lod_line(kr, lod->rows) * lod->cols + lod_line(kc, lod->cols);
+}
+
+// Whether the spring with the given id runs between nodes first and second
+static _Bool lod_spring_matches(const System *system, size_t id, size_t first,
+                                size_t second) {
+  if (id >= system->spring_id_count ||
+      system->springs.slot[id] == HANDLE_NONE) {
+    return false;
+  }
+  size_t slot = system->springs.slot[id];
+  return lod_node(system, system->springs.first[slot]) == first &&
+         lod_node(system, system->springs.second[slot]) == second;
+}
+
+// Whether the system still holds the masses and springs system_init_grid
+// made, under the ids it gave them
+static _Bool lod_matches_grid(const LodGrid *lod, const System *system) {
+  size_t rows = lod->rows;
+  size_t cols = lod->cols;
+  size_t spring_count = rows * (cols - 1) + (rows - 1) * cols;
+  if (system->mass_count != rows * cols ||
+      system->mass_id_count != rows * cols ||
+      system->spring_count != spring_count ||
+      system->spring_id_count != spring_count) {
+    return false;
+  }
+  for (size_t r = 0; r < rows; ++r) {
+    for (size_t c = 0; c < cols; ++c) {
+      size_t node = r * cols + c;
+      if ((c + 1 < cols && !lod_spring_matches(system,
+                                               lod_right_spring(lod, r, c),
+                                               node, node + 1)) ||
+          (r + 1 < rows && !lod_spring_matches(system,
+                                               lod_down_spring(lod, r, c),
+                                               node, node + cols))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Corners of the block holding a grid node, and the bilinear weights of the
+// node between them
+static void lod_weights(const LodGrid *lod, size_t node, size_t corner[4],
+                        Scalar weight[4]) {
+  size_t r = node / lod->cols;
+  size_t c = node % lod->cols;
+  size_t br = lod_block_of(r, lod->block_rows);
+  size_t bc = lod_block_of(c, lod->block_cols);
+  size_t r0 = lod_line(br, lod->rows);
+  size_t c0 = lod_line(bc, lod->cols);
+  Scalar v = (Scalar)(r - r0) / (lod_line(br + 1, lod->rows) - r0);
+  Scalar u = (Scalar)(c - c0) / (lod_line(bc + 1, lod->cols) - c0);
+  size_t width = lod->block_cols + 1;
+  corner[0] = br * width + bc;
+  corner[1] = corner[0] + 1;
+  corner[2] = corner[0] + width;
+  corner[3] = corner[2] + 1;
+  weight[0] = (SCALAR_C(1.0) - u) * (SCALAR_C(1.0) - v);
+  weight[1] = u * (SCALAR_C(1.0) - v);
+  weight[2] = (SCALAR_C(1.0) - u) * v;
+  weight[3] = u * v;
+}
+
+// Position and velocity of a grid node interpolated from the proxy
+static void lod_sample(const LodGrid *lod, size_t node, Vec2 *position,
+                       Vec2 *velocity) {
+  size_t corner[4];
+  Scalar weight[4];
+  lod_weights(lod, node, corner, weight);
+  const MassArrays *masses = &lod->coarse.masses;
+  *position = vec2_zero();
+  *velocity = vec2_zero();
+  for (size_t j = 0; j < 4; ++j) {
+    *position =
+        vec2_add(*position, vec2_scale(masses->position[corner[j]], weight[j]));
+    *velocity =
+        vec2_add(*velocity, vec2_scale(masses->velocity[corner[j]], weight[j]));
+  }
+}
+
+// Adds the coarse spring along the fine springs from grid node start, count
+// of them to the right or down. It stands in for the rows or columns of fine
+// springs halfway to the next edge on either side, side by side.
+static _Bool lod_add_coarse_spring(LodGrid *lod, const System *system,
+                                   size_t k, size_t start, size_t count,
+                                   _Bool right) {
+  const SpringArrays *springs = &system->springs;
+  size_t r = start / lod->cols;
+  size_t c = start % lod->cols;
+  Scalar length = SCALAR_C(0.0);
+  Scalar compliance = SCALAR_C(0.0);
+  Scalar resistance = SCALAR_C(0.0);
+  Scalar max_strain = SCALAR_C(0.0);
+  _Bool slack = false;
+  _Bool undamped = false;
+  for (size_t j = 0; j < count; ++j) {
+    size_t id = right ? lod_right_spring(lod, r, c + j)
+                      : lod_down_spring(lod, r + j, c);
+    size_t slot = springs->slot[id];
+    length += springs->length[slot];
+    slack = slack || !(springs->strength[slot] > SCALAR_C(0.0));
+    undamped = undamped || !(springs->dampening[slot] > SCALAR_C(0.0));
+    compliance += slack ? SCALAR_C(0.0) : 1 / springs->strength[slot];
+    resistance += undamped ? SCALAR_C(0.0) : 1 / springs->dampening[slot];
+    Scalar spring_max_strain = springs->max_strain[slot];
+    if (spring_max_strain > SCALAR_C(0.0) &&
+        (max_strain == SCALAR_C(0.0) || spring_max_strain < max_strain)) {
+      max_strain = spring_max_strain;
+    }
+  }
+  // Rows or columns across, the fine springs on the outline count half
+  size_t across = right ? r : c;
+  size_t line = right ? k / (lod->block_cols + 1) : k % (lod->block_cols + 1);
+  size_t lines = right ? lod->block_rows : lod->block_cols;
+  size_t side = right ? lod->rows : lod->cols;
+  Scalar share = line == 0 || line == lines ? SCALAR_C(0.5) : SCALAR_C(0.0);
+  if (line > 0) {
+    share += SCALAR_C(0.5) * (across - lod_line(line - 1, side));
+  }
+  if (line < lines) {
+    share += SCALAR_C(0.5) * (lod_line(line + 1, side) - across);
+  }
+
+  SpringHandle handle = system_add_spring(
+      &lod->coarse,
+      (Spring){.length = length,
+               .strength = slack ? SCALAR_C(0.0) : share / compliance,
+               .dampening = undamped ? SCALAR_C(0.0) : share / resistance},
+      k, right ? k + 1 : k + lod->block_cols + 1);
+  if (handle.id == HANDLE_NONE) {
+    return false;
+  }
+  // Coarse springs are never cut, so they stay at the index of their id
+  (right ? lod->horizontal : lod->vertical)[k] = handle.id;
+  lod->refine_strain[handle.id] = LOD_TEAR_MARGIN * max_strain;
+  return true;
+}
+
+// Builds the proxy, lumping each fine mass into the corners of its block by
+// its weights
+static _Bool lod_build_coarse(LodGrid *lod, const System *system) {
+  size_t width = lod->block_cols + 1;
+  size_t corner_count = (lod->block_rows + 1) * width;
+  Scalar *lumped = calloc(corner_count, sizeof(*lumped));
+  if (lumped == NULL) {
+    return false;
+  }
+  for (size_t node = 0; node < lod->rows * lod->cols; ++node) {
+    Scalar inverse_mass =
+        system->masses.inverse_mass[system->masses.slot[node]];
+    size_t corner[4];
+    Scalar weight[4];
+    lod_weights(lod, node, corner, weight);
+    for (size_t j = 0; j < 4 && inverse_mass > SCALAR_C(0.0); ++j) {
+      lumped[corner[j]] += weight[j] / inverse_mass;
+    }
+  }
+
+  System *coarse = &lod->coarse;
+  system_reserve(coarse, corner_count, 2 * corner_count);
+  _Bool ok = true;
+  for (size_t k = 0; k < corner_count && ok; ++k) {
+    size_t slot = system->masses.slot[lod_corner_node(lod, k)];
+    MassHandle handle = system_add_mass(
+        coarse,
+        (Mass){.position = system->masses.position[slot],
+               .velocity = system->masses.velocity[slot],
+               .mass = lumped[k] > SCALAR_C(0.0) ? lumped[k] : SCALAR_C(1.0),
+               .fixed = system->masses.fixed[slot]});
+    ok = handle.id != HANDLE_NONE;
+  }
+  for (size_t k = 0; k < corner_count && ok; ++k) {
+    size_t kr = k / width;
+    size_t kc = k % width;
+    size_t start = lod_corner_node(lod, k);
+    lod->horizontal[k] = HANDLE_NONE;
+    lod->vertical[k] = HANDLE_NONE;
+    if (kc < lod->block_cols) {
+      ok = ok && lod_add_coarse_spring(lod, system, k, start,
+                                       lod_line(kc + 1, lod->cols) -
+                                           lod_line(kc, lod->cols),
+                                       true);
+    }
+    if (kr < lod->block_rows) {
+      ok = ok && lod_add_coarse_spring(lod, system, k, start,
+                                       lod_line(kr + 1, lod->rows) -
+                                           lod_line(kr, lod->rows),
+                                       false);
+    }
+  }
+  free(lumped);
+  return ok;
+}
+
+// Whether a block has to stay refined, as it holds a cut spring or a fixed
+// mass the proxy would not hold in place. Fixed masses on the corners, or on
+// an edge between two fixed corners, stay where they are.
+static _Bool lod_block_pinned(const LodGrid *lod, const System *system,
+                              size_t block) {
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  size_t br = block / lod->block_cols;
+  size_t bc = block % lod->block_cols;
+  size_t r0 = lod_line(br, lod->rows);
+  size_t r1 = lod_line(br + 1, lod->rows);
+  size_t c0 = lod_line(bc, lod->cols);
+  size_t c1 = lod_line(bc + 1, lod->cols);
+  size_t cols = lod->cols;
+#define LOD_FIXED(r, c) (masses->fixed[masses->slot[(r) * cols + (c)]])
+  for (size_t r = r0; r <= r1; ++r) {
+    for (size_t c = c0; c <= c1; ++c) {
+      size_t node = r * cols + c;
+      if (LOD_FIXED(r, c) &&
+          !((r == r0 || r == r1) && LOD_FIXED(r, c0) && LOD_FIXED(r, c1)) &&
+          !((c == c0 || c == c1) && LOD_FIXED(r0, c) && LOD_FIXED(r1, c))) {
+        return true;
+      }
+      for (uint32_t entry = masses->spring_list[node]; entry != HANDLE_NONE;
+           entry = springs->next[entry]) {
+        size_t slot = springs->slot[entry >> 1];
+        size_t other = lod_node(system, entry & 1 ? springs->first[slot]
+                                                  : springs->second[slot]);
+        size_t other_r = other / cols;
+        size_t other_c = other % cols;
+        if (springs->cut[slot] && other_r >= r0 && other_r <= r1 &&
+            other_c >= c0 && other_c <= c1) {
+          return true;
+        }
+      }
+    }
+  }
+#undef LOD_FIXED
+  return false;
+}
+
+static void lod_refine(LodGrid *lod, size_t block) {
+  if (!lod->refined[block]) {
+    lod->refined[block] = true;
+    lod->quiet_steps[block] = 0;
+    ++lod->refined_count;
+    lod->rebuild = true;
+  }
+}
+
+// Cuts a spring the system had cut in the active springs, and refines the
+// blocks holding it, which the proxy cannot cut
+static void lod_follow_cut(LodGrid *lod, const System *system, size_t id) {
+  size_t slot = system->springs.slot[id];
+  size_t first = lod_node(system, system->springs.first[slot]);
+  size_t second = lod_node(system, system->springs.second[slot]);
+  size_t first_row, last_row, first_col, last_col;
+  size_t first_row2, last_row2, first_col2, last_col2;
+  lod_blocks_of(first / lod->cols, lod->block_rows, &first_row, &last_row);
+  lod_blocks_of(first % lod->cols, lod->block_cols, &first_col, &last_col);
+  lod_blocks_of(second / lod->cols, lod->block_rows, &first_row2, &last_row2);
+  lod_blocks_of(second % lod->cols, lod->block_cols, &first_col2, &last_col2);
+  first_row = first_row > first_row2 ? first_row : first_row2;
+  last_row = last_row < last_row2 ? last_row : last_row2;
+  first_col = first_col > first_col2 ? first_col : first_col2;
+  last_col = last_col < last_col2 ? last_col : last_col2;
+  for (size_t br = first_row; br <= last_row; ++br) {
+    for (size_t bc = first_col; bc <= last_col; ++bc) {
+      lod_refine(lod, br * lod->block_cols + bc);
+    }
+  }
+  if (lod->spring_active[id] != HANDLE_NONE) {
+    system_cut_spring(&lod->active, lod->spring_active[id]);
+  }
+}
+
+_Bool lod_grid_init(LodGrid *lod, System *system, size_t rows, size_t cols,
+                    size_t thread_count) {
+  *lod = (LodGrid){0};
+  lod->rows = rows;
+  lod->cols = cols;
+  if (rows < 2 || cols < 2 || system->free_mass_id_count > 0 ||
+      system->free_spring_id_count > 0 || !lod_matches_grid(lod, system)) {
+    printf("ERROR: Level of detail needs an unedited grid of %zu by %zu "
+           "masses\n",
+           rows, cols);
+    return false;
+  }
+  if (system->collide_masses || system->obstacle_count > 0) {
+    printf("ERROR: Level of detail does not handle contacts\n");
+    return false;
+  }
+  lod->block_rows = (rows + LOD_FACTOR - 2) / LOD_FACTOR;
+  lod->block_cols = (cols + LOD_FACTOR - 2) / LOD_FACTOR;
+  size_t corner_count = (lod->block_rows + 1) * (lod->block_cols + 1);
+  size_t block_count = lod->block_rows * lod->block_cols;
+  size_t node_count = rows * cols;
+  size_t spring_count = system->spring_id_count;
+  lod->horizontal = malloc(corner_count * sizeof(*lod->horizontal));
+  lod->vertical = malloc(corner_count * sizeof(*lod->vertical));
+  lod->refine_strain = malloc(2 * corner_count * sizeof(*lod->refine_strain));
+  lod->active_node = malloc(node_count * sizeof(*lod->active_node));
+  lod->active_block = malloc(node_count * sizeof(*lod->active_block));
+  lod->active_spring = malloc(spring_count * sizeof(*lod->active_spring));
+  lod->node_active = malloc(node_count * sizeof(*lod->node_active));
+  lod->spring_active = malloc(spring_count * sizeof(*lod->spring_active));
+  lod->refined = calloc(block_count, sizeof(*lod->refined));
+  lod->quiet_steps = calloc(block_count, sizeof(*lod->quiet_steps));
+  lod->block_speed = calloc(block_count, sizeof(*lod->block_speed));
+  if (lod->horizontal == NULL || lod->vertical == NULL ||
+      lod->refine_strain == NULL || lod->active_node == NULL ||
+      lod->active_block == NULL ||
+      lod->active_spring == NULL || lod->node_active == NULL ||
+      lod->spring_active == NULL || lod->refined == NULL ||
+      lod->quiet_steps == NULL || lod->block_speed == NULL ||
+      !lod_build_coarse(lod, system)) {
+    printf("ERROR: Cannot allocate memory for the level of detail\n");
+    lod_grid_free(lod);
+    return false;
+  }
+  memset(lod->node_active, 0xff, node_count * sizeof(*lod->node_active));
+  memset(lod->spring_active, 0xff, spring_count * sizeof(*lod->spring_active));
+  system_set_thread_count(&lod->active, thread_count);
+  // The fine and coarse masses move whether their islands sleep or not
+  system_wake_all(system);
+
+  lod->id_version = system->id_version;
+  lod->mass_count = system->mass_count;
+  lod->spring_count = system->spring_count;
+  lod->topology_version = system->topology_version;
+  for (size_t b = 0; b < block_count; ++b) {
+    if (lod_block_pinned(lod, system, b)) {
+      lod_refine(lod, b);
+    }
+  }
+  lod->rebuild = true;
+  return true;
+}
+
+void lod_grid_free(LodGrid *lod) {
+  system_free(&lod->coarse);
+  system_free(&lod->active);
+  free(lod->horizontal);
+  free(lod->vertical);
+  free(lod->refine_strain);
+  free(lod->active_node);
+  free(lod->active_block);
+  free(lod->active_spring);
+  free(lod->node_active);
+  free(lod->spring_active);
+  free(lod->refined);
+  free(lod->quiet_steps);
+  free(lod->block_speed);
+  *lod = (LodGrid){0};
+}
+
+void lod_grid_focus(LodGrid *lod, Vec2 point, Scalar radius) {
+  lod->focus = point;
+  lod->focus_radius = radius;
+}
+
+// Adds grid node as an active mass, fixed if driven by the proxy
+static _Bool lod_add_active_mass(LodGrid *lod, const System *system,
+                                 size_t node, _Bool driven) {
+  const MassArrays *masses = &system->masses;
+  size_t slot = masses->slot[node];
+  MassHandle handle = system_add_mass(
+      &lod->active, (Mass){.position = masses->position[slot],
+                           .velocity = masses->velocity[slot],
+                           .mass = SCALAR_C(1.0),
+                           .fixed = driven || masses->fixed[slot]});
+  if (handle.id == HANDLE_NONE) {
+    return false;
+  }
+  size_t i = lod->active.mass_count - 1;
+  lod->active.masses.inverse_mass[i] = masses->inverse_mass[slot];
+  lod->active_node[i] = node;
+  lod->node_active[node] = i;
+  return true;
+}
+
+// Makes the active masses and springs over again for the refined blocks
+static _Bool lod_rebuild(LodGrid *lod, System *system) {
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  System *active = &lod->active;
+  // Blocks refined since start from where the proxy has them
+  lod_grid_sync(lod, system);
+  for (size_t i = 0; i < active->mass_count; ++i) {
+    lod->node_active[lod->active_node[i]] = HANDLE_NONE;
+  }
+  for (size_t i = 0; i < active->spring_id_count; ++i) {
+    lod->spring_active[lod->active_spring[i]] = HANDLE_NONE;
+  }
+  system_clear(active);
+  lod->free_count = 0;
+
+  size_t cols = lod->cols;
+  for (size_t b = 0; b < lod->block_rows * lod->block_cols; ++b) {
+    size_t br = b / lod->block_cols;
+    size_t bc = b % lod->block_cols;
+    for (size_t r = lod_line(br, lod->rows);
+         lod->refined[b] && r <= lod_line(br + 1, lod->rows); ++r) {
+      for (size_t c = lod_line(bc, cols); c <= lod_line(bc + 1, cols); ++c) {
+        if (lod->node_active[r * cols + c] != HANDLE_NONE) {
+          continue;
+        }
+        if (!lod_add_active_mass(lod, system, r * cols + c, false)) {
+          return false;
+        }
+        lod->active_block[active->mass_count - 1] =
+            lod_block_of(r, lod->block_rows) * lod->block_cols +
+            lod_block_of(c, lod->block_cols);
+      }
+    }
+  }
+  lod->free_count = active->mass_count;
+
+  // The masses one spring out are driven, and the springs are added from
+  // their free masses, by the first endpoint when both are free
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < lod->free_count; ++i) {
+      for (uint32_t entry = masses->spring_list[lod->active_node[i]];
+           entry != HANDLE_NONE; entry = springs->next[entry]) {
+        size_t id = entry >> 1;
+        size_t slot = springs->slot[id];
+        size_t first = lod_node(system, springs->first[slot]);
+        size_t second = lod_node(system, springs->second[slot]);
+        size_t other = entry & 1 ? first : second;
+        if (pass == 0 && lod->node_active[other] == HANDLE_NONE &&
+            !lod_add_active_mass(lod, system, other, true)) {
+          return false;
+        }
+        if (pass == 0 ||
+            ((entry & 1) && lod->node_active[other] < lod->free_count)) {
+          continue;
+        }
+        SpringHandle handle = system_add_spring(
+            active,
+            (Spring){.length = springs->length[slot],
+                     .strength = springs->strength[slot],
+                     .dampening = springs->dampening[slot],
+                     .max_strain = springs->max_strain[slot],
+                     .cut = springs->cut[slot]},
+            lod->node_active[first], lod->node_active[second]);
+        if (handle.id == HANDLE_NONE) {
+          return false;
+        }
+        lod->active_spring[handle.id] = id;
+        lod->spring_active[id] = handle.id;
+      }
+    }
+  }
+
+  // Proxy corners on free masses follow them
+  for (size_t k = 0; k < lod->coarse.mass_count; ++k) {
+    size_t node = lod_corner_node(lod, k);
+    lod->coarse.masses.fixed[k] = lod->node_active[node] < lod->free_count ||
+                                  masses->fixed[masses->slot[node]];
+  }
+  lod->rebuild = false;
+  return true;
+}
+
+// Takes the settings of the system that the levels step with
+static void lod_follow_settings(System *level, const System *system) {
+  level->spring_kernel = system->spring_kernel;
+  level->integrator = system->integrator;
+  level->solver = system->solver;
+  level->xpbd_method = system->xpbd_method;
+  level->xpbd_iterations = system->xpbd_iterations;
+  memcpy(level->force_fields, system->force_fields,
+         sizeof(level->force_fields));
+  level->force_field_count = system->force_field_count;
+  level->force_fields_initialized = system->force_fields_initialized;
+}
+
+// Moves the tears of the active springs over to the system
+static void lod_take_tears(LodGrid *lod, System *system) {
+  System *active = &lod->active;
+  for (size_t i = 0; i < active->tear_event_count; ++i) {
+    TearEvent event = active->tear_events[i];
+    event.spring = lod->active_spring[event.spring];
+    system_cut_spring(system, event.spring);
+    system_list_tear(system, event);
+    ++system->torn_count;
+    lod_follow_cut(lod, system, event.spring);
+  }
+  active->tear_event_count = 0;
+}
+
+// Whether the focus lies within its radius of the box around the corners
+static _Bool lod_block_focused(const LodGrid *lod, const size_t corner[4]) {
+  if (!(lod->focus_radius > SCALAR_C(0.0))) {
+    return false;
+  }
+  const Vec2 *position = lod->coarse.masses.position;
+  Vec2 min = position[corner[0]];
+  Vec2 max = min;
+  for (size_t j = 1; j < 4; ++j) {
+    Vec2 p = position[corner[j]];
+    min = (Vec2){scalar_min(min.x, p.x), scalar_min(min.y, p.y)};
+    max = (Vec2){scalar_max(max.x, p.x), scalar_max(max.y, p.y)};
+  }
+  Vec2 closest = {scalar_min(scalar_max(lod->focus.x, min.x), max.x),
+                  scalar_min(scalar_max(lod->focus.y, min.y), max.y)};
+  return vec2_length(vec2_subtract(lod->focus, closest)) <= lod->focus_radius;
+}
+
+// Whether an edge of the block is stretched close to tearing
+static _Bool lod_block_strained(const LodGrid *lod, const System *system,
+                                const size_t corner[4]) {
+  if (!system->tear_springs) {
+    return false;
+  }
+  const System *coarse = &lod->coarse;
+  uint32_t edges[4] = {lod->horizontal[corner[0]], lod->horizontal[corner[2]],
+                       lod->vertical[corner[0]], lod->vertical[corner[1]]};
+  for (size_t j = 0; j < 4; ++j) {
+    Vec2 span =
+        vec2_subtract(coarse->masses.position[coarse->springs.second[edges[j]]],
+                      coarse->masses.position[coarse->springs.first[edges[j]]]);
+    Scalar strain =
+        vec2_length(span) / coarse->springs.length[edges[j]] - SCALAR_C(1.0);
+    if (lod->refine_strain[edges[j]] > SCALAR_C(0.0) &&
+        strain > lod->refine_strain[edges[j]]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Refines the blocks that got busy and coarsens those that settled
+static void lod_update_refinement(LodGrid *lod, const System *system) {
+  size_t block_count = lod->block_rows * lod->block_cols;
+  const MassArrays *active = &lod->active.masses;
+  for (size_t b = 0; b < block_count; ++b) {
+    lod->block_speed[b] = SCALAR_C(0.0);
+  }
+  for (size_t i = 0; i < lod->free_count; ++i) {
+    size_t b = lod->active_block[i];
+    Scalar speed = vec2_dot(active->velocity[i], active->velocity[i]);
+    lod->block_speed[b] =
+        speed > lod->block_speed[b] ? speed : lod->block_speed[b];
+  }
+
+  const Vec2 *corner_velocity = lod->coarse.masses.velocity;
+  for (size_t b = 0; b < block_count; ++b) {
+    size_t width = lod->block_cols + 1;
+    size_t first = b / lod->block_cols * width + b % lod->block_cols;
+    size_t corner[4] = {first, first + 1, first + width, first + width + 1};
+    _Bool focused = lod_block_focused(lod, corner);
+    _Bool strained = lod_block_strained(lod, system, corner);
+    if (!lod->refined[b]) {
+      Scalar speed = SCALAR_C(0.0);
+      for (size_t j = 0; j < 4; ++j) {
+        Scalar corner_speed = vec2_length(corner_velocity[corner[j]]);
+        speed = corner_speed > speed ? corner_speed : speed;
+      }
+      if (focused || strained || speed > LOD_REFINE_SPEED) {
+        lod_refine(lod, b);
+      }
+    } else if (focused || strained ||
+               lod->block_speed[b] > LOD_COARSEN_SPEED * LOD_COARSEN_SPEED) {
+      lod->quiet_steps[b] = 0;
+    } else if (++lod->quiet_steps[b] >= LOD_QUIET_STEPS) {
+      lod->quiet_steps[b] = 0;
+      if (!lod_block_pinned(lod, system, b)) {
+        lod->refined[b] = false;
+        --lod->refined_count;
+        lod->rebuild = true;
+      }
+    }
+  }
+}
+
+_Bool lod_grid_step(LodGrid *lod, System *system, double dt) {
+  if (system->id_version != lod->id_version ||
+      system->mass_count != lod->mass_count ||
+      system->spring_count != lod->spring_count || system->collide_masses ||
+      system->obstacle_count > 0) {
+    return false;
+  }
+  if (system->topology_version != lod->topology_version) {
+    for (size_t i = 0; i < system->spring_count; ++i) {
+      if (system->springs.cut[i]) {
+        lod_follow_cut(lod, system, system->springs.id[i]);
+      }
+    }
+  }
+  if (lod->rebuild && !lod_rebuild(lod, system)) {
+    return false;
+  }
+  System *coarse = &lod->coarse;
+  System *active = &lod->active;
+  const MassArrays *masses = &system->masses;
+  lod_follow_settings(coarse, system);
+  lod_follow_settings(active, system);
+  active->tear_springs = system->tear_springs;
+
+  // Masses are dragged by fixing them in the system
+  for (size_t i = 0; i < lod->free_count; ++i) {
+    size_t slot = masses->slot[lod->active_node[i]];
+    active->masses.fixed[i] = masses->fixed[slot];
+    if (masses->fixed[slot]) {
+      active->masses.position[i] = masses->position[slot];
+    }
+  }
+  // The proxy follows the free masses on its corners, and drives the masses
+  // around the refined blocks, both as of the start of the step
+  for (size_t k = 0; k < coarse->mass_count; ++k) {
+    size_t i = lod->node_active[lod_corner_node(lod, k)];
+    if (i < lod->free_count) {
+      coarse->masses.position[k] = active->masses.position[i];
+      coarse->masses.velocity[k] = active->masses.velocity[i];
+    }
+  }
+  for (size_t i = lod->free_count; i < active->mass_count; ++i) {
+    lod_sample(lod, lod->active_node[i], &active->masses.position[i],
+               &active->masses.velocity[i]);
+  }
+  system_step(coarse, dt);
+  if (active->mass_count > 0) {
+    system_step(active, dt);
+  }
+  lod_take_tears(lod, system);
+  lod_update_refinement(lod, system);
+  lod->topology_version = system->topology_version;
+  lod->stepped = true;
+  system->time += dt;
+  return true;
+}
+
+void lod_grid_sync(LodGrid *lod, System *system) {
+  if (!lod->stepped) {
+    return;
+  }
+  MassArrays *masses = &system->masses;
+  for (size_t node = 0; node < lod->rows * lod->cols; ++node) {
+    size_t slot = masses->slot[node];
+    size_t i = lod->node_active[node];
+    if (i < lod->free_count) {
+      masses->position[slot] = lod->active.masses.position[i];
+      masses->velocity[slot] = lod->active.masses.velocity[i];
+    } else if (!masses->fixed[slot]) {
+      lod_sample(lod, node, &masses->position[slot], &masses->velocity[slot]);
+    }
+  }
+  system->hash_moved = true;
+  ++system->motion_version;
+}
@@ -0,0 +1,94 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include "springs.h"
+
+// Level of detail for cloth made by system_init_grid. The grid is split into
+// blocks of LOD_FACTOR by LOD_FACTOR cells. A coarse proxy with a mass on the
+// corners of every block covers the whole cloth, each coarse mass carrying
+// the fine masses around it and each coarse spring the fine springs along
+// its edge, in series and side by side. Blocks that move, stretch close to
+// tearing or lie near the focus are refined: their fine masses and springs
+// step at full resolution, with the fine masses just outside driven by the
+// coarse proxy, which in turn follows the fine masses on its corners. The
+// rest of the cloth is interpolated from the proxy, so the cost follows how
+// much of the cloth is busy rather than how large it is.
+//
+// The system itself is not stepped, lod_grid_sync writes the state back into
+// it for drawing, picking and saving. Dragging masses by setting their fixed
+// flag and position, cutting and tearing go through to the fine masses and
+// springs. Contacts are not handled, and neither are edits that add or remove
+// masses or springs, in which case lod_grid_step refuses to go on and the
+// system carries on at full resolution from the last sync.
+
+#define LOD_FACTOR 4
+// Coarse blocks whose corners move faster than this are refined, refined
+// blocks coarsen once no fine mass of theirs moved faster than the coarsen
+// speed for LOD_QUIET_STEPS steps in a row
+#define LOD_REFINE_SPEED SCALAR_C(20.0)
+#define LOD_COARSEN_SPEED SCALAR_C(5.0)
+#define LOD_QUIET_STEPS 120
+// With tearing, blocks are refined once an edge is stretched past this share
+// of the max strain of the springs along it
+#define LOD_TEAR_MARGIN SCALAR_C(0.8)
+
+typedef struct {
+  size_t rows; // Of the grid the system was made by
+  size_t cols;
+  size_t block_rows;
+  size_t block_cols;
+
+  // The proxy, with the corner masses in rows and the springs along the
+  // edges after horizontal and vertical, by the corner they start at
+  System coarse;
+  uint32_t *horizontal; // HANDLE_NONE on the last column
+  uint32_t *vertical;   // HANDLE_NONE on the last row
+  Scalar *refine_strain; // Per coarse spring, zero never
+
+  // The fine masses of the refined blocks, with the driven ones after the
+  // first free_count, and the springs between them
+  System active;
+  size_t free_count;
+  uint32_t *active_node;   // Grid node of each active mass
+  uint32_t *active_block;  // Block of each free active mass
+  uint32_t *active_spring; // Spring id in the system of each active spring
+  uint32_t *node_active;   // Active mass of each grid node, or HANDLE_NONE
+  uint32_t *spring_active; // Active spring of each spring id, or HANDLE_NONE
+
+  _Bool *refined; // Per block
+  uint32_t *quiet_steps;
+  Scalar *block_speed; // Scratch, squared speed of the fastest fine mass
+  size_t refined_count;
+  _Bool rebuild; // The refined blocks changed since the active masses were set
+  _Bool stepped; // Until the first step the system holds the state
+
+  Vec2 focus;
+  Scalar focus_radius; // Zero for none
+
+  // Of the system, as last seen
+  size_t id_version;
+  size_t mass_count;
+  size_t spring_count;
+  size_t topology_version;
+} LodGrid;
+
+// Sets up the levels for a system made by system_init_grid with rows and
+// cols, with thread_count threads for the fine masses. Returns false if the
+// system has been edited since or has contacts, or memory runs out.
+_Bool lod_grid_init(LodGrid *lod, System *system, size_t rows, size_t cols,
+                    size_t thread_count);
+void lod_grid_free(LodGrid *lod);
+// Keeps the blocks within radius of point refined, until the focus moves or
+// is cleared with a radius of zero
+void lod_grid_focus(LodGrid *lod, Vec2 point, Scalar radius);
+// Advances the cloth by one step of dt, refining and coarsening blocks as
+// they get busy or settle. Returns false without stepping if the system was
+// edited or got contacts since the last step.
+_Bool lod_grid_step(LodGrid *lod, System *system, double dt);
+// Writes the positions and velocities of every mass into the system, from
+// the fine masses where refined and interpolated from the proxy elsewhere.
+// Callers interpolating between steps sync before storing the previous
+// positions, or they are as old as the last sync.
+void lod_grid_sync(LodGrid *lod, System *system);
+
+#endif
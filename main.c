@@ -1,345 +1,624 @@
+#include "draw_cache.h"
+#include "gpu_simulation.h"
+#include "lod.h"
+#include "mesh_renderer.h"
+#include "profiler.h"
 #include "raylib.h"
-#include "raymath.h"
+#include "scene.h"
+#include "snapshot.h"
+#include "springs.h"
+#include "trajectory.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 600
-#define FORCES_CAPACITY 64
-#define FORCES_CONSTRAINT 10e5
-#define SYSTEM_CAPACITY 8096
-#define MASS_RADIUS 8.0f
-#define MASS_COLOR_SCALE 100.0f
 #define TIME_SCALE 1.0f
-#define WIND_STRENGTH 75.0f
-#define GRAVITATIONAL_ACCELERATION                                             \
-  (Vector2) { 0.0f, 98.0f }
+#define PHYSICS_FRAME_RATE 60.0
+#define PHYSICS_SUBSTEPS 4
+#define PHYSICS_MAX_ACCUMULATED 0.1
+#define CUT_DISTANCE 1.0f
+// Masses spawned by the pointer get springs to the masses this close
+#define SPAWN_REACH (1.5f * DEFAULT_GRID_SIZE)
+#define SPAWN_MAX_SPRINGS 32
+// Room for edits, so that spawning does not reallocate mid-frame
+#define EDIT_HEADROOM 1024
+#define TEAR_STRAIN SCALAR_C(0.5)
+#define TEAR_FLASH_FRAMES 20 // Frames a tear stays marked for
+#define TEAR_FLASH_COUNT 256 // Marks shown at once, the oldest go first
+// Blocks this close to the pointer stay refined while the left button is held
+#define LOD_FOCUS_RADIUS SCALAR_C(80.0)
+#define TRACE_PATH "springs_trace.json"
+#define SNAPSHOT_PATH "springs_snapshot.bin"
+#define TRAJECTORY_PATH "springs_trajectory.bin"
+#define OVERLAY_FONT_SIZE 10
+#define OVERLAY_AVERAGE_FRAMES 60 // Zone times are averaged over this many
+#define OVERLAY_GRAPH_SCALE 3.0f  // Pixels per millisecond of frame time
+#define OVERLAY_WIDTH 220
+#define OVERLAY_HEIGHT 270
+#define OVERLAY_MARGIN 10
+#define OVERLAY_GRAPH_HEIGHT 50
 
-#define DEFAULT_GRID_ROWS 40
-#define DEFAULT_GRID_COLS 60
-#define DEFAULT_GRID_SIZE 10.0f
 #define DEFAULT_GRID_ORIGIN                                                    \
-  (Vector2) {                                                                  \
+  (Vec2) {                                                                     \
     WINDOW_WIDTH / 2.0f - DEFAULT_GRID_COLS *DEFAULT_GRID_SIZE * 0.5f, 0.0f    \
   }
-#define DEFAULT_GRID_MASS 1.0f
-#define DEFAULT_GRID_STRENGTH 1000.0f
-#define DEFAULT_GRID_DAMPENING 5.0f
+#define INIT_DEFAULT_GRID(system)                                              \
+  system_init_grid(system, DEFAULT_GRID_ROWS, DEFAULT_GRID_COLS,               \
+                   DEFAULT_GRID_ORIGIN, DEFAULT_GRID_SIZE, DEFAULT_GRID_MASS,  \
+                   DEFAULT_GRID_STRENGTH, DEFAULT_GRID_DAMPENING)
 
-Color color_lerp(Color c1, Color c2, double amount) {
-  Vector4 v1 = (Vector4){c1.r, c1.g, c1.b, c1.a};
-  Vector4 v2 = (Vector4){c2.r, c2.g, c2.b, c2.a};
-  Vector4 lerped = Vector4Lerp(v1, v2, Clamp(amount, 0.0f, 1.0f));
-  return (Color){lerped.x, lerped.y, lerped.z, lerped.w};
-}
+// Mass dragged by the pointer, kept here so that reordering can remap it
+static size_t selected_mass = SIZE_MAX;
 
+// Where springs tore lately, in a ring
 typedef struct {
-  Vector2 position;
-  Vector2 velocity;
-  Vector2 acceleration;
-  Vector2 forces[FORCES_CAPACITY];
-  size_t force_count;
-  double mass;
-  _Bool fixed;
-} Mass;
-
-void mass_force_append(Mass *mass, Vector2 force) {
-  if (mass->force_count >= FORCES_CAPACITY) {
-    printf("ERROR: Cannot append any more forces to mass\n");
-    return;
+  Vec2 position;
+  size_t frames_left;
+} TearFlash;
+static TearFlash tear_flashes[TEAR_FLASH_COUNT];
+static size_t tear_flash_next = 0;
+
+// Loads the scene given on the command line, or the default grid without one,
+// and stores it in the system's reorder_ordering
+_Bool init_system(System *system, const char *scene) {
+  if (scene == NULL) {
+    INIT_DEFAULT_GRID(system);
+  } else if (!system_load_scene(system, scene, ORDERING_NONE)) {
+    return false;
   }
-
-  mass->forces[mass->force_count++] = force;
+  selected_mass = SIZE_MAX;
+  system_reorder(system, system->reorder_ordering, &selected_mass, 1);
+  system_reserve(system, system->mass_count + EDIT_HEADROOM,
+                 system->spring_count + 4 * EDIT_HEADROOM);
+  system_default_max_strain(system, TEAR_STRAIN);
+  return true;
 }
 
-void mass_reset_forces(Mass *mass) { mass->force_count = 0; }
-
-void mass_constrain_forces(Mass *mass) {
-  for (size_t i = 0; i < mass->force_count; ++i) {
-    mass->forces[i] =
-        Vector2ClampValue(mass->forces[i], 0.0f, FORCES_CONSTRAINT);
-  }
-}
+Vec2 to_vec2(Vector2 v) { return (Vec2){v.x, v.y}; }
 
-void mass_update(Mass *mass, double dt) {
-  if (mass->fixed) {
-    return;
+// Immediate mode drawing, used when the batched renderer is not available
+void system_draw(const DrawCache *cache) {
+  for (size_t i = 0; i < cache->spring_count; ++i) {
+    const SpringDraw *spring = &cache->springs[i];
+    // Cut springs are clear
+    if (spring->color.a != 0) {
+      DrawLineV(spring->first, spring->second, spring->color);
+    }
   }
-  mass->acceleration = GRAVITATIONAL_ACCELERATION;
-  for (size_t i = 0; i < mass->force_count; ++i) {
-    Vector2 acceleration_from_force =
-        Vector2Scale(mass->forces[i], 1 / mass->mass);
-    mass->acceleration =
-        Vector2Add(mass->acceleration, acceleration_from_force);
+  for (size_t i = 0; i < cache->mass_count; ++i) {
+    DrawCircleV(cache->masses[i].position, MASS_RADIUS, cache->masses[i].color);
   }
-  mass->velocity =
-      Vector2Add(mass->velocity, Vector2Scale(mass->acceleration, dt));
-  mass->position = Vector2Add(mass->position, Vector2Scale(mass->velocity, dt));
 }
 
-void mass_draw(Mass *mass) {
-  Color c =
-      color_lerp(BLUE, RED, Vector2Length(mass->velocity) / MASS_COLOR_SCALE);
-  DrawCircleV(mass->position, MASS_RADIUS, c);
-}
-
-typedef struct {
-  Mass *first;
-  Mass *second;
-  double length;
-  double strength;
-  double dampening;
-  _Bool cut;
-} Spring;
-
-void spring_update(Spring *spring) {
-  if (spring->cut) {
-    return;
-  }
-
-  Vector2 span =
-      Vector2Subtract(spring->second->position, spring->first->position);
-  Vector2 force_direction = Vector2Normalize(span);
-
-  // Spring force
-  double displacement = spring->length - Vector2Length(span);
-  mass_force_append(
-      spring->first,
-      Vector2Scale(force_direction, spring->strength * -displacement));
-  mass_force_append(
-      spring->second,
-      Vector2Scale(force_direction, spring->strength * displacement));
-
-  // Dampener force
-  double displacement_rate_first =
-      Vector2DotProduct(spring->first->velocity, force_direction);
-  double displacement_rate_second =
-      -Vector2DotProduct(spring->second->velocity, force_direction);
-  double displacement_rate = displacement_rate_first + displacement_rate_second;
-  mass_force_append(
-      spring->first,
-      Vector2Scale(force_direction, spring->dampening * -displacement_rate));
-  mass_force_append(
-      spring->second,
-      Vector2Scale(force_direction, spring->dampening * displacement_rate));
-}
-
-void spring_draw(Spring *spring) {
-  if (spring->cut) {
-    return;
+// Takes the tears since the last frame off the system and marks them for
+// TEAR_FLASH_FRAMES frames
+void tear_flashes_update(System *system) {
+  for (size_t i = 0; i < TEAR_FLASH_COUNT; ++i) {
+    if (tear_flashes[i].frames_left > 0) {
+      --tear_flashes[i].frames_left;
+    }
   }
-  Vector2 span =
-      Vector2Subtract(spring->second->position, spring->first->position);
-  double relative_displacement =
-      (spring->length - Vector2Length(span)) / Vector2Length(span);
-  Color c;
-  if (relative_displacement < 0.0f) {
-    c = color_lerp(WHITE, RED, -relative_displacement);
-  } else {
-    c = color_lerp(WHITE, BLUE, relative_displacement);
+  for (size_t i = 0; i < system->tear_event_count; ++i) {
+    tear_flashes[tear_flash_next] =
+        (TearFlash){system->tear_events[i].position, TEAR_FLASH_FRAMES};
+    tear_flash_next = (tear_flash_next + 1) % TEAR_FLASH_COUNT;
   }
-
-  DrawLineV(spring->first->position, spring->second->position, c);
+  system->tear_event_count = 0;
 }
 
-typedef struct {
-  Mass masses[SYSTEM_CAPACITY];
-  Spring springs[SYSTEM_CAPACITY];
-  size_t mass_count;
-  size_t spring_count;
-} System;
-
-void system_add_mass(System *system, Mass mass) {
-  if (system->mass_count >= SYSTEM_CAPACITY) {
-    printf("ERROR: Cannot add more masses to the system\n");
-    return;
+// Rings around the tears that widen as they fade
+void tear_flashes_draw(void) {
+  for (size_t i = 0; i < TEAR_FLASH_COUNT; ++i) {
+    const TearFlash *flash = &tear_flashes[i];
+    if (flash->frames_left == 0) {
+      continue;
+    }
+    float age = 1.0f - (float)flash->frames_left / TEAR_FLASH_FRAMES;
+    DrawCircleLines(flash->position.x, flash->position.y,
+                    MASS_RADIUS * (1.0f + 2.0f * age),
+                    Fade(YELLOW, 1.0f - age));
   }
-
-  system->masses[system->mass_count++] = mass;
 }
 
-void system_add_spring(System *system, Spring spring, size_t m1, size_t m2) {
-  if (system->spring_count >= SYSTEM_CAPACITY) {
-    printf("ERROR: Cannot add more springs to the system\n");
+// Draws the average zone times over the last frames, the counters of the last
+// frame and a graph of the frame times in the ring buffer
+void profile_overlay_draw(void) {
+  if (!profile_enabled()) {
+    DrawText("Profiler not compiled in, build with make PROFILE=1",
+             OVERLAY_MARGIN, OVERLAY_MARGIN, OVERLAY_FONT_SIZE, YELLOW);
     return;
   }
-  if (system->mass_count <= m1) {
-    printf("ERROR: Index to first mass out of range\n");
-    return;
+  size_t frame_count = profile_frame_count();
+  size_t average_count = frame_count < OVERLAY_AVERAGE_FRAMES
+                             ? frame_count
+                             : OVERLAY_AVERAGE_FRAMES;
+  double frame_seconds = 0.0;
+  double zone_seconds[PROFILE_ZONE_COUNT] = {0};
+  for (size_t age = 0; age < average_count; ++age) {
+    const ProfileFrame *frame = profile_frame(age);
+    frame_seconds += frame->duration;
+    for (size_t zone = 0; zone < PROFILE_ZONE_COUNT; ++zone) {
+      zone_seconds[zone] += frame->zone_seconds[zone];
+    }
   }
-  if (system->mass_count <= m2) {
-    printf("ERROR: Index to second mass out of range\n");
-    return;
+  double scale = average_count > 0 ? 1e3 / average_count : 0.0;
+  DrawRectangle(0, 0, OVERLAY_WIDTH, OVERLAY_HEIGHT, Fade(BLACK, 0.7f));
+  int x = OVERLAY_MARGIN;
+  int y = OVERLAY_MARGIN;
+  DrawText(TextFormat("frame %.2f ms", frame_seconds * scale), x, y,
+           OVERLAY_FONT_SIZE, GREEN);
+  for (size_t zone = 0; zone < PROFILE_ZONE_COUNT; ++zone) {
+    y += OVERLAY_FONT_SIZE + 2;
+    DrawText(TextFormat("  %s %.3f ms", profile_zone_name(zone),
+                        zone_seconds[zone] * scale),
+             x, y, OVERLAY_FONT_SIZE, WHITE);
   }
-
-  spring.first = &system->masses[m1];
-  spring.second = &system->masses[m2];
-  system->springs[system->spring_count++] = spring;
-}
-
-void system_draw(System *system) {
-  for (size_t i = 0; i < system->spring_count; ++i) {
-    spring_draw(&system->springs[i]);
+  const ProfileFrame *last = profile_frame(0);
+  for (size_t counter = 0; counter < PROFILE_COUNTER_COUNT && last != NULL;
+       ++counter) {
+    y += OVERLAY_FONT_SIZE + 2;
+    DrawText(TextFormat("%s %llu", profile_counter_name(counter),
+                        (unsigned long long)last->counters[counter]),
+             x, y, OVERLAY_FONT_SIZE, SKYBLUE);
   }
-  for (size_t i = 0; i < system->mass_count; ++i) {
-    mass_draw(&system->masses[i]);
+  y += OVERLAY_FONT_SIZE + 4;
+  int graph_bottom = y + OVERLAY_GRAPH_HEIGHT;
+  // Newest frame on the right
+  int graph_right = OVERLAY_WIDTH - OVERLAY_MARGIN;
+  size_t graph_frames = graph_right - x;
+  for (size_t age = 0; age < frame_count && age < graph_frames; ++age) {
+    float height = profile_frame(age)->duration * 1e3 * OVERLAY_GRAPH_SCALE;
+    DrawLine(graph_right - age, graph_bottom, graph_right - age,
+             graph_bottom - height, GREEN);
   }
 }
 
-void system_spring_update(System *system) {
-  for (size_t i = 0; i < system->spring_count; ++i) {
-    spring_update(&system->springs[i]);
+// Handles the pointer, on the GPU simulation's state when gpu is not NULL
+void system_handle_mouse_input(System *system, GpuSimulation *gpu) {
+  size_t *selected = &selected_mass;
+  static _Bool erasing = false;
+  static Vec2 previous_mouse_position;
+  MassArrays *masses = &system->masses;
+  Vec2 mouse_position = to_vec2(GetMousePosition());
+  if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
+    // Picking needs the current positions, read back once per click
+    if (gpu != NULL) {
+      gpu_simulation_download(gpu, system);
+    }
+    *selected = system_pick_mass(system, mouse_position, MASS_RADIUS);
+    if (*selected != SIZE_MAX) {
+      masses->fixed[*selected] = true;
+    }
+    erasing = true;
+    previous_mouse_position = mouse_position;
   }
-}
-
-void system_mass_update(System *system, double dt) {
-  for (size_t i = 0; i < system->mass_count; ++i) {
-    mass_update(&system->masses[i], dt);
+  if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+    if (*selected != SIZE_MAX) {
+      masses->position[*selected] = mouse_position;
+      ++system->motion_version;
+      // Keeps the island awake while it is held
+      system_wake_mass(system, *selected);
+      if (gpu != NULL) {
+        gpu_simulation_upload_mass(gpu, system, *selected);
+      }
+    } else if (erasing && gpu != NULL) {
+      gpu_simulation_cut_segment(gpu, previous_mouse_position, mouse_position,
+                                 CUT_DISTANCE);
+    } else if (erasing) {
+      system_cut_segment(system, previous_mouse_position, mouse_position,
+                         CUT_DISTANCE);
+    }
+    previous_mouse_position = mouse_position;
   }
-}
-
-void system_mass_reset_forces(System *system) {
-  for (size_t i = 0; i < system->mass_count; ++i) {
-    mass_reset_forces(&system->masses[i]);
+  if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
+    if (*selected != SIZE_MAX) {
+      masses->fixed[*selected] = false;
+      system_wake_mass(system, *selected);
+      if (gpu != NULL) {
+        gpu_simulation_upload_mass(gpu, system, *selected);
+      }
+      *selected = SIZE_MAX;
+    } else if (erasing) {
+      erasing = false;
+    }
   }
 }
 
-void system_mass_constrain_forces(System *system) {
-  for (size_t i = 0; i < system->mass_count; ++i) {
-    mass_constrain_forces(&system->masses[i]);
+// Spawns a mass at point with springs to up to SPAWN_MAX_SPRINGS masses
+// within SPAWN_REACH. They are found before adding it, which changes the
+// masses the hash was built over.
+static void spawn_mass(System *system, Vec2 point) {
+  size_t near[SPAWN_MAX_SPRINGS];
+  size_t near_count =
+      system_masses_within(system, point, SPAWN_REACH, near, SPAWN_MAX_SPRINGS);
+  near_count = near_count < SPAWN_MAX_SPRINGS ? near_count : SPAWN_MAX_SPRINGS;
+  size_t count = system->mass_count;
+  MassHandle spawned = system_add_mass(
+      system, (Mass){.position = point, .mass = DEFAULT_GRID_MASS});
+  if (system_mass_index(system, spawned) == SIZE_MAX) {
+    return;
   }
-}
-
-void system_mass_force_append(System *system, Vector2 force) {
-  for (size_t i = 0; i < system->mass_count; ++i) {
-    mass_force_append(&system->masses[i], force);
+  for (size_t i = 0; i < near_count; ++i) {
+    Scalar distance =
+        vec2_length(vec2_subtract(system->masses.position[near[i]], point));
+    system_add_spring(system,
+                      (Spring){.length = distance,
+                               .strength = DEFAULT_GRID_STRENGTH,
+                               .dampening = DEFAULT_GRID_DAMPENING,
+                               .max_strain = TEAR_STRAIN},
+                      near[i], count);
   }
 }
 
-#define INIT_DEFAULT_GRID(system)                                              \
-  system_init_grid(system, DEFAULT_GRID_ROWS, DEFAULT_GRID_COLS,               \
-                   DEFAULT_GRID_ORIGIN, DEFAULT_GRID_SIZE, DEFAULT_GRID_MASS,  \
-                   DEFAULT_GRID_STRENGTH, DEFAULT_GRID_DAMPENING)
-void system_init_grid(System *system, size_t rows, size_t cols, Vector2 origin,
-                      double cell_size, double mass, double spring_strength,
-                      double spring_dampening) {
-  system->mass_count = 0;
-  system->spring_count = 0;
-
-  for (size_t r = 0; r < rows; ++r) {
-    for (size_t c = 0; c < cols; ++c) {
-      Mass m = {0};
-      m.position = Vector2Add(origin, Vector2Scale((Vector2){c, r}, cell_size));
-      m.mass = mass;
-      m.fixed = (r == 0);
-      system_add_mass(system, m);
+// Removes and spawns masses with the right button, and merges the mass under
+// the held one into it on M. The held mass goes by handle, as edits move
+// masses to other indices.
+void system_handle_edit_input(System *system) {
+  Vec2 mouse_position = to_vec2(GetMousePosition());
+  MassHandle held = system_mass_handle(system, selected_mass);
+  if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) {
+    size_t picked = system_pick_mass(system, mouse_position, MASS_RADIUS);
+    if (picked == SIZE_MAX) {
+      spawn_mass(system, mouse_position);
+    } else if (picked != selected_mass) {
+      system_remove_mass(system, system_mass_handle(system, picked));
     }
   }
-
-  for (size_t r = 0; r < rows; ++r) {
-    for (size_t c = 0; c < cols; ++c) {
-      size_t m0 = r * cols + c;
-      size_t m1 = r * cols + c + 1;
-      size_t m2 = (r + 1) * cols + c;
-
-      if (c != (cols - 1) && m1 < rows * cols) {
-        system_add_spring(system,
-                          (Spring){.length = cell_size,
-                                   .strength = spring_strength,
-                                   .dampening = spring_dampening},
-                          m0, m1);
-      }
-      if (r != (rows - 1) && m2 < rows * cols) {
-        system_add_spring(system,
-                          (Spring){.length = cell_size,
-                                   .strength = spring_strength,
-                                   .dampening = spring_dampening},
-                          m0, m2);
-      }
-    }
+  if (IsKeyPressed(KEY_M) && selected_mass != SIZE_MAX) {
+    size_t other = system_pick_other_mass(system, mouse_position,
+                                          SCALAR_C(2.0) * MASS_RADIUS,
+                                          selected_mass);
+    system_merge_masses(system, held, system_mass_handle(system, other));
+  }
+  if (selected_mass != SIZE_MAX) {
+    selected_mass = system_mass_index(system, held);
   }
 }
 
-void system_handle_mouse_input(System *system) {
-  static Mass *selected = NULL;
-  static _Bool erasing = false;
-  Vector2 mouse_position = GetMousePosition();
-  if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
-    for (size_t i = 0; i < system->mass_count; ++i) {
-      Mass *mass = &system->masses[i];
-      if (CheckCollisionPointCircle(mouse_position, mass->position,
-                                    MASS_RADIUS)) {
-        selected = mass;
-        selected->fixed = true;
-        break;
+// Steps run on the physics thread while the main thread draws the state from
+// before them. The system and everything else the batch points to belong to
+// the thread until the main thread waits for it, and edits and input are only
+// applied in between, at the boundary of two batches.
+typedef struct {
+  System *system;
+  size_t steps;
+  double dt;
+  LodGrid *lod;                 // Or NULL
+  TrajectoryRecorder *recorder; // Or NULL
+  _Bool lod_stopped;            // By an edit or contact
+  _Bool recording_failed;
+} PhysicsBatch;
+
+void physics_batch_run(void *context) {
+  PhysicsBatch *batch = context;
+  System *system = batch->system;
+  for (size_t i = 0; i < batch->steps; ++i) {
+    if (i == batch->steps - 1) {
+      // The level of detail only writes into the system when synced, which
+      // last happened before the first step
+      if (batch->lod != NULL && i > 0) {
+        lod_grid_sync(batch->lod, system);
       }
+      system_store_previous_positions(system);
     }
-    erasing = true;
-  }
-  if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
-    if (selected != NULL) {
-      selected->position = mouse_position;
-    } else if (erasing) {
-      for (size_t i = 0; i < system->spring_count; ++i) {
-        Spring *spring = &system->springs[i];
-        if (CheckCollisionPointLine(mouse_position, spring->first->position,
-                                    spring->second->position, 1.0f)) {
-          spring->cut = true;
-        }
-      }
+    // Edits and contacts stop the level of detail before it steps. They only
+    // land between batches, so it stops on the first step, and the system
+    // carries on from the sync that ended the batch before.
+    if (batch->lod != NULL && !lod_grid_step(batch->lod, system, batch->dt)) {
+      system_wake_all(system);
+      batch->lod = NULL;
+      batch->lod_stopped = true;
     }
-  }
-  if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
-    if (selected != NULL) {
-      selected->fixed = false;
-      selected = NULL;
-    } else if (erasing) {
-      erasing = false;
+    if (batch->lod == NULL) {
+      system_step(system, batch->dt);
     }
   }
+  if (batch->lod != NULL) {
+    lod_grid_sync(batch->lod, system);
+  }
+  if (batch->recorder != NULL &&
+      !trajectory_recorder_frame(batch->recorder, system)) {
+    batch->recording_failed = true;
+  }
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+  if (argc > 2) {
+    printf("Usage: %s [scene]\n", argv[0]);
+    return 1;
+  }
+  const char *scene = argc == 2 ? argv[1] : NULL;
   InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Springs");
   SetTargetFPS(60);
 
   _Bool running = false;
-  _Bool wind_on = false;
+  PhysicsClock clock = physics_clock_init(PHYSICS_FRAME_RATE, PHYSICS_SUBSTEPS,
+                                          PHYSICS_MAX_ACCUMULATED);
+
+  MeshRenderer renderer;
+  _Bool batched = mesh_renderer_init(&renderer);
+  GpuSimulation gpu = {0};
+  _Bool gpu_loaded = false;
+  _Bool gpu_on = false;
+  LodGrid lod = {0};
+  _Bool lod_on = false;
 
   System system = {0};
-  INIT_DEFAULT_GRID(&system);
+  system.compact_springs = true;
+  system.reorder_ordering = ORDERING_MORTON;
+  system.sleep_islands = true;
+  size_t wind = system_add_force_field(
+      &system, (ForceField){.kind = FORCE_FIELD_UNIFORM,
+                            .vector = {WIND_STRENGTH, SCALAR_C(0.0)}});
+  system_set_thread_count(&system, sysconf(_SC_NPROCESSORS_ONLN));
+  if (!init_system(&system, scene)) {
+    system_free(&system);
+    mesh_renderer_free(&renderer);
+    CloseWindow();
+    return 1;
+  }
+
+  _Bool overlay_on = false;
+  TrajectoryRecorder recorder;
+  _Bool recording = false;
+  // Replays draw a system of their own and leave the simulated one as it was
+  TrajectoryPlayer player;
+  System replay_system = {0};
+  _Bool replaying = false;
+  DrawCache draw_cache = {0};
+
+  BackgroundThread physics;
+  if (!background_thread_init(&physics)) {
+    printf("ERROR: Cannot start the physics thread, stepping before drawing\n");
+  }
+  PhysicsBatch batch = {0};
+  // Of the state the system holds, which lags the clock by the batch in flight
+  double alpha = physics_clock_alpha(&clock);
 
   while (!WindowShouldClose()) {
+    profile_frame_begin();
+    // Usually done before the frame it was started in finished drawing
+    background_thread_wait(&physics);
+    if (batch.lod_stopped) {
+      printf("Level of detail off, it does not follow edits or contacts\n");
+      lod_grid_free(&lod);
+      lod_on = false;
+    }
+    if (batch.recording_failed) {
+      trajectory_recorder_close(&recorder);
+      recording = false;
+    }
+    batch = (PhysicsBatch){.system = &system, .dt = clock.step};
+
+    if (IsKeyPressed(KEY_F3)) {
+      overlay_on = !overlay_on;
+    }
+    if (IsKeyPressed(KEY_F4) && profile_write_chrome_trace(TRACE_PATH)) {
+      printf("Wrote the last %zu frames to %s\n", profile_frame_count(),
+             TRACE_PATH);
+    }
     if (IsKeyPressed(KEY_SPACE)) {
       running = !running;
     }
+    if (IsKeyPressed(KEY_T)) {
+      system.tear_springs = !system.tear_springs;
+    }
     if (IsKeyPressed(KEY_PERIOD)) {
-      wind_on = !wind_on;
+      system.force_fields[wind].enabled = !system.force_fields[wind].enabled;
+      system_wake_all(&system);
+    }
+    // Self collisions and the window edges go on and off together
+    if (IsKeyPressed(KEY_C)) {
+      system.collide_masses = !system.collide_masses;
+      system_clear_obstacles(&system);
+      if (system.collide_masses) {
+        system_add_obstacle(
+            &system, (Obstacle){.kind = OBSTACLE_BOUNDS,
+                                .start = vec2_zero(),
+                                .end = {WINDOW_WIDTH, WINDOW_HEIGHT}});
+      }
     }
+    _Bool replaced = false;
     if (IsKeyPressed(KEY_ENTER)) {
-      INIT_DEFAULT_GRID(&system);
+      replaced = init_system(&system, scene);
+    }
+    if (IsKeyPressed(KEY_F5)) {
+      if (gpu_on) {
+        gpu_simulation_download(&gpu, &system);
+      }
+      if (system_save_snapshot(&system, SNAPSHOT_PATH)) {
+        printf("Saved %zu masses and %zu springs to %s\n", system.mass_count,
+               system.spring_count, SNAPSHOT_PATH);
+      }
+    }
+    if (IsKeyPressed(KEY_F9)) {
+      replaced = system_load_snapshot(&system, SNAPSHOT_PATH) || replaced;
+    }
+    if (IsKeyPressed(KEY_O) && !gpu_on) {
+      system_reorder(&system, system.reorder_ordering, &selected_mass, 1);
+      printf("Reordered, mean spring span %.1f\n",
+             system_spring_span(&system));
+    }
+    // The GPU state is only downloaded on demand, so it may be newer.
+    // Recordings keep the order they started with.
+    if (!gpu_on && !recording) {
+      system_reorder_if_needed(&system, &selected_mass, 1);
+    }
+    // Loading writes the positions without moving anything
+    if (replaced) {
+      draw_cache_invalidate(&draw_cache);
+    }
+    // Downloading the old GPU state would overwrite the new system
+    if (replaced && gpu_on) {
+      gpu_on = gpu_simulation_upload(&gpu, &system);
+    }
+    // The system synced at the end of the last frame, it carries on from there
+    if (lod_on && (replaced || IsKeyPressed(KEY_L))) {
+      lod_grid_free(&lod);
+      system_wake_all(&system);
+      lod_on = false;
+    } else if (IsKeyPressed(KEY_L)) {
+      if (gpu_on || scene != NULL) {
+        printf("ERROR: Level of detail needs the default grid on the CPU\n");
+      } else {
+        lod_on = lod_grid_init(&lod, &system, DEFAULT_GRID_ROWS,
+                               DEFAULT_GRID_COLS,
+                               sysconf(_SC_NPROCESSORS_ONLN));
+      }
+    }
+    if (IsKeyPressed(KEY_R) && !replaying) {
+      if (recording) {
+        unsigned long long frames = recorder.frame_count;
+        trajectory_recorder_close(&recorder);
+        recording = false;
+        printf("Recorded %llu frames to %s\n", frames, TRAJECTORY_PATH);
+      } else {
+        recording = trajectory_recorder_open(&recorder, &system,
+                                             TRAJECTORY_PATH, 0.0f, false);
+      }
+    }
+    if (IsKeyPressed(KEY_P)) {
+      if (replaying) {
+        trajectory_player_close(&player);
+        system_free(&replay_system);
+        replaying = false;
+        draw_cache_invalidate(&draw_cache);
+      } else {
+        if (recording) {
+          trajectory_recorder_close(&recorder);
+          recording = false;
+        }
+        replaying =
+            trajectory_player_open(&player, TRAJECTORY_PATH, &replay_system);
+        draw_cache_invalidate(&draw_cache);
+      }
+    }
+    if (IsKeyPressed(KEY_G)) {
+      if (gpu_on) {
+        // The CPU carries on from the GPU state
+        gpu_simulation_download(&gpu, &system);
+        gpu_on = false;
+      } else if (lod_on) {
+        printf("ERROR: Turn the level of detail off first\n");
+      } else if (gpu_simulation_unsupported(&system) != NULL) {
+        printf("ERROR: The GPU simulation has no %s, turn it off first\n",
+               gpu_simulation_unsupported(&system));
+      } else if (renderer.resident) {
+        gpu_loaded = gpu_loaded || gpu_simulation_init(&gpu);
+        gpu_on = gpu_loaded && gpu_simulation_upload(&gpu, &system);
+      } else {
+        printf("ERROR: GPU simulation needs the batched OpenGL 4.3 renderer\n");
+      }
+    }
+    // Tearing or collisions turned on, or a scene with local fields loaded
+    if (gpu_on && gpu_simulation_unsupported(&system) != NULL) {
+      printf("The GPU simulation has no %s, simulating on the CPU\n",
+             gpu_simulation_unsupported(&system));
+      gpu_simulation_download(&gpu, &system);
+      gpu_on = false;
+    }
+
+    if (running && replaying) {
+      // Loops back to the start once the recording ends
+      if (!trajectory_player_next(&player, &replay_system)) {
+        trajectory_player_rewind(&player);
+        trajectory_player_next(&player, &replay_system);
+      }
+    } else if (running) {
+      PROFILE_BEGIN(PROFILE_ZONE_INPUT);
+      system_handle_mouse_input(&system, gpu_on ? &gpu : NULL);
+      if (!gpu_on) {
+        system_handle_edit_input(&system);
+      }
+      if (lod_on) {
+        lod_grid_focus(&lod, to_vec2(GetMousePosition()),
+                       IsMouseButtonDown(MOUSE_BUTTON_LEFT) ? LOD_FOCUS_RADIUS
+                                                            : SCALAR_C(0.0));
+      }
+      PROFILE_END(PROFILE_ZONE_INPUT);
+      size_t steps =
+          physics_clock_advance(&clock, TIME_SCALE * GetFrameTime());
+      for (size_t i = 0; i < steps && gpu_on; ++i) {
+        if (i == steps - 1) {
+          gpu_simulation_store_previous_positions(&gpu);
+        }
+        gpu_simulation_step(&gpu, &system, clock.step);
+      }
+      if (gpu_on) {
+        alpha = physics_clock_alpha(&clock);
+      } else if (steps > 0 || recording) {
+        batch.steps = steps;
+        batch.lod = lod_on ? &lod : NULL;
+        batch.recorder = recording ? &recorder : NULL;
+      }
+      // The GPU state has to come back every frame for the recorder
+      if (recording && gpu_on) {
+        gpu_simulation_download(&gpu, &system);
+        if (!trajectory_recorder_frame(&recorder, &system)) {
+          trajectory_recorder_close(&recorder);
+          recording = false;
+        }
+      }
+    }
+
+    PROFILE_SET(PROFILE_COUNTER_ACTIVE_SPRINGS, system.active_spring_count);
+    PROFILE_SET(PROFILE_COUNTER_SLEEPING_MASSES, system.sleeping_mass_count);
+    tear_flashes_update(&system);
+
+    // The cache is the snapshot drawn while the next batch steps the system.
+    // Replays draw the frames as recorded.
+    PROFILE_BEGIN(PROFILE_ZONE_DRAW);
+    _Bool resident = gpu_on && !replaying;
+    _Bool packed =
+        !resident && draw_cache_update(&draw_cache,
+                                       replaying ? &replay_system : &system,
+                                       replaying ? 1.0 : alpha);
+    PROFILE_END(PROFILE_ZONE_DRAW);
+    if (batch.steps > 0 || batch.recorder != NULL) {
+      alpha = physics_clock_alpha(&clock);
+      background_thread_start(&physics, physics_batch_run, &batch);
     }
 
     BeginDrawing();
     ClearBackground(BLACK);
-    system_draw(&system);
-    EndDrawing();
-
-    if (!running) {
-      continue;
+    PROFILE_BEGIN(PROFILE_ZONE_DRAW);
+    if (resident) {
+      mesh_renderer_draw_resident(&renderer, &gpu, alpha);
+    } else if (packed && batched) {
+      mesh_renderer_draw(&renderer, &draw_cache);
+    } else if (packed) {
+      system_draw(&draw_cache);
+    }
+    if (!replaying) {
+      tear_flashes_draw();
     }
-    double dt = TIME_SCALE * GetFrameTime();
-    system_handle_mouse_input(&system);
-    system_spring_update(&system);
-    system_mass_constrain_forces(&system);
-    system_mass_update(&system, dt);
-    system_mass_reset_forces(&system);
-    if (wind_on) {
-      system_mass_force_append(&system, (Vector2){WIND_STRENGTH, 0.0f});
+    PROFILE_END(PROFILE_ZONE_DRAW);
+    if (overlay_on) {
+      profile_overlay_draw();
     }
+    EndDrawing();
+    profile_frame_end();
   }
 
+  background_thread_free(&physics);
+  if (recording) {
+    trajectory_recorder_close(&recorder);
+  }
+  if (replaying) {
+    trajectory_player_close(&player);
+    system_free(&replay_system);
+  }
+  draw_cache_free(&draw_cache);
+  lod_grid_free(&lod);
+  system_free(&system);
+  if (gpu_loaded) {
+    gpu_simulation_free(&gpu);
+  }
+  mesh_renderer_free(&renderer);
   CloseWindow();
   return 0;
 }
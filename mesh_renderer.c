@@ -0,0 +1,388 @@
+#include "mesh_renderer.h"
+#include "raymath.h"
+#include "rlgl.h"
+#include <stdio.h>
+
+#define QUAD_VERTICES 6
+#define SPRING_HALF_WIDTH 0.5f
+
+// Spring geometry shared by the vertex shaders, which only differ in where
+// they read the endpoints and color from
+#define SPRING_VERTEX_COMMON                                                   \
+  "layout(location = 0) in vec2 corner;\n"                                     \
+  "uniform mat4 mvp;\n"                                                        \
+  "uniform float half_width;\n"                                                \
+  "out vec4 color;\n"                                                          \
+  "void spring_vertex(vec2 first, vec2 second) {\n"                            \
+  "  vec2 span = second - first;\n"                                            \
+  "  vec2 direction = span / max(length(span), 1e-6);\n"                       \
+  "  vec2 normal = vec2(-direction.y, direction.x) * half_width;\n"            \
+  "  float along = corner.x * 0.5 + 0.5;\n"                                    \
+  "  vec2 point = mix(first, second, along);\n"                                \
+  "  gl_Position = mvp * vec4(point + normal * corner.y, 0.0, 1.0);\n"         \
+  "}\n"
+
+// The stress coloring the draw cache does on the CPU, for the shaders that
+// read the GPU simulation
+#define SPRING_COLOR_COMMON                                                    \
+  "uniform vec4 relaxed_color;\n"                                              \
+  "uniform vec4 stretched_color;\n"                                            \
+  "uniform vec4 compressed_color;\n"                                           \
+  "vec4 spring_color(vec2 first, vec2 second, float rest_length) {\n"          \
+  "  float span_length = length(second - first);\n"                            \
+  "  float stretch = (rest_length - span_length) / span_length;\n"             \
+  "  vec4 extreme = stretch < 0.0 ? stretched_color : compressed_color;\n"     \
+  "  return mix(relaxed_color, extreme, clamp(abs(stretch), 0.0, 1.0));\n"    \
+  "}\n"
+
+static const char *spring_vertex_shader =
+    "#version 330\n"
+    "layout(location = 1) in vec4 endpoints;\n"
+    "layout(location = 2) in vec4 instance_color;\n" SPRING_VERTEX_COMMON
+    "void main() {\n"
+    "  color = instance_color;\n"
+    "  spring_vertex(endpoints.xy, endpoints.zw);\n"
+    "}\n";
+
+// Reads the springs straight from the GPU simulation buffers. Cut springs
+// collapse to a point, so nothing of them is drawn.
+static const char *resident_spring_vertex_shader =
+    "#version 430\n"
+    "layout(std430, binding = 0) readonly buffer Positions {\n"
+    "  vec2 position[];\n"
+    "};\n"
+    "layout(std430, binding = 1) readonly buffer PreviousPositions {\n"
+    "  vec2 previous_position[];\n"
+    "};\n"
+    "layout(std430, binding = 2) readonly buffer Endpoints {\n"
+    "  uvec2 endpoints[];\n"
+    "};\n"
+    "layout(std430, binding = 3) readonly buffer Parameters {\n"
+    "  vec4 parameters[];\n"
+    "};\n"
+    "uniform float alpha;\n" SPRING_VERTEX_COMMON SPRING_COLOR_COMMON
+    "void main() {\n"
+    "  uvec2 m = endpoints[gl_InstanceID];\n"
+    "  vec4 spring = parameters[gl_InstanceID];\n"
+    "  if (spring.w != 0.0) {\n"
+    "    color = vec4(0.0);\n"
+    "    gl_Position = vec4(0.0, 0.0, 0.0, 1.0);\n"
+    "    return;\n"
+    "  }\n"
+    "  vec2 first = mix(previous_position[m.x], position[m.x], alpha);\n"
+    "  vec2 second = mix(previous_position[m.y], position[m.y], alpha);\n"
+    "  color = spring_color(first, second, spring.x);\n"
+    "  spring_vertex(first, second);\n"
+    "}\n";
+
+static const char *spring_fragment_shader =
+    "#version 330\n"
+    "in vec4 color;\n"
+    "out vec4 fragment_color;\n"
+    "void main() {\n"
+    "  fragment_color = color;\n"
+    "}\n";
+
+#define MASS_VERTEX_COMMON                                                     \
+  "layout(location = 0) in vec2 corner;\n"                                     \
+  "uniform mat4 mvp;\n"                                                        \
+  "uniform float radius;\n"                                                    \
+  "out vec2 local;\n"                                                          \
+  "out vec4 color;\n"                                                          \
+  "void mass_vertex(vec2 center) {\n"                                          \
+  "  local = corner;\n"                                                        \
+  "  gl_Position = mvp * vec4(center + corner * radius, 0.0, 1.0);\n"          \
+  "}\n"
+
+#define MASS_COLOR_COMMON                                                      \
+  "uniform float color_scale;\n"                                               \
+  "uniform vec4 slow_color;\n"                                                 \
+  "uniform vec4 fast_color;\n"                                                 \
+  "vec4 mass_color(vec2 motion) {\n"                                           \
+  "  return mix(slow_color, fast_color,\n"                                     \
+  "             clamp(length(motion) / color_scale, 0.0, 1.0));\n"             \
+  "}\n"
+
+static const char *mass_vertex_shader =
+    "#version 330\n"
+    "layout(location = 1) in vec2 center;\n"
+    "layout(location = 2) in vec4 instance_color;\n" MASS_VERTEX_COMMON
+    "void main() {\n"
+    "  color = instance_color;\n"
+    "  mass_vertex(center);\n"
+    "}\n";
+
+static const char *resident_mass_vertex_shader =
+    "#version 430\n"
+    "layout(std430, binding = 0) readonly buffer Positions {\n"
+    "  vec2 position[];\n"
+    "};\n"
+    "layout(std430, binding = 1) readonly buffer PreviousPositions {\n"
+    "  vec2 previous_position[];\n"
+    "};\n"
+    "layout(std430, binding = 2) readonly buffer Velocities {\n"
+    "  vec2 velocity[];\n"
+    "};\n"
+    "uniform float alpha;\n" MASS_VERTEX_COMMON MASS_COLOR_COMMON
+    "void main() {\n"
+    "  uint i = uint(gl_InstanceID);\n"
+    "  color = mass_color(velocity[i]);\n"
+    "  mass_vertex(mix(previous_position[i], position[i], alpha));\n"
+    "}\n";
+
+// Point sprites are quads with everything outside the inscribed circle dropped
+static const char *mass_fragment_shader =
+    "#version 330\n"
+    "in vec2 local;\n"
+    "in vec4 color;\n"
+    "out vec4 fragment_color;\n"
+    "void main() {\n"
+    "  if (dot(local, local) > 1.0) {\n"
+    "    discard;\n"
+    "  }\n"
+    "  fragment_color = color;\n"
+    "}\n";
+
+// Two triangles covering [-1, 1] in both axes
+static const float quad_corners[QUAD_VERTICES * 2] = {
+    -1.0f, -1.0f, 1.0f, -1.0f, 1.0f,  1.0f,
+    -1.0f, -1.0f, 1.0f, 1.0f,  -1.0f, 1.0f,
+};
+
+static void shader_set_color(Shader shader, const char *name, Color color) {
+  Vector4 normalized = ColorNormalize(color);
+  rlSetUniform(rlGetLocationUniform(shader.id, name), &normalized,
+               RL_SHADER_UNIFORM_VEC4, 1);
+}
+
+static void shader_set_float(Shader shader, const char *name, float value) {
+  rlSetUniform(rlGetLocationUniform(shader.id, name), &value,
+               RL_SHADER_UNIFORM_FLOAT, 1);
+}
+
+// Creates a vertex array drawing the shared quad once per instance, with the
+// instances read from a new dynamic buffer of capacity instances. Each holds
+// position_floats floats of position, then a color of four normalized bytes.
+static unsigned int instance_array_load(unsigned int quad_buffer,
+                                        unsigned int *instance_buffer,
+                                        int position_floats, int stride,
+                                        size_t capacity) {
+  unsigned int array = rlLoadVertexArray();
+  rlEnableVertexArray(array);
+  rlEnableVertexBuffer(quad_buffer);
+  rlSetVertexAttribute(0, 2, RL_FLOAT, false, 0, 0);
+  rlEnableVertexAttribute(0);
+
+  *instance_buffer = rlLoadVertexBuffer(NULL, capacity * stride, true);
+  rlSetVertexAttribute(1, position_floats, RL_FLOAT, false, stride, 0);
+  rlSetVertexAttributeDivisor(1, 1);
+  rlEnableVertexAttribute(1);
+  rlSetVertexAttribute(2, 4, RL_UNSIGNED_BYTE, true, stride,
+                       position_floats * sizeof(float));
+  rlSetVertexAttributeDivisor(2, 1);
+  rlEnableVertexAttribute(2);
+  rlDisableVertexArray();
+  rlDisableVertexBuffer();
+  return array;
+}
+
+static void instance_array_unload(unsigned int *array,
+                                  unsigned int *instance_buffer) {
+  if (*array != 0) {
+    rlUnloadVertexArray(*array);
+    rlUnloadVertexBuffer(*instance_buffer);
+  }
+  *array = 0;
+  *instance_buffer = 0;
+}
+
+// Grows the GPU instance storage to hold count instances, returns true if it
+// did, leaving the buffer empty
+static _Bool instance_storage_reserve(MeshRenderer *renderer,
+                                      unsigned int *array,
+                                      unsigned int *instance_buffer,
+                                      size_t *capacity, int position_floats,
+                                      int stride, size_t count) {
+  if (count <= *capacity) {
+    return false;
+  }
+  size_t grown = *capacity > 0 ? *capacity : SYSTEM_MIN_CAPACITY;
+  while (grown < count) {
+    grown *= 2;
+  }
+  instance_array_unload(array, instance_buffer);
+  *array = instance_array_load(renderer->quad_buffer, instance_buffer,
+                               position_floats, stride, grown);
+  *capacity = grown;
+  return true;
+}
+
+// Uploads the instances in [begin, end) of the stride bytes each at data
+static void instances_upload(unsigned int buffer, const void *data,
+                             size_t stride, size_t begin, size_t end) {
+  if (begin < end) {
+    rlUpdateVertexBuffer(buffer, (const char *)data + begin * stride,
+                         (end - begin) * stride, begin * stride);
+  }
+}
+
+static _Bool shader_loaded(Shader shader) {
+  // Raylib falls back to its default shader when compiling fails
+  return shader.id != 0 && shader.id != rlGetShaderIdDefault();
+}
+
+// Loads the shaders drawing from GPU simulation buffers, which need the
+// shader storage buffers of OpenGL 4.3
+static void resident_shaders_init(MeshRenderer *renderer) {
+  if (rlGetVersion() != RL_OPENGL_43) {
+    return;
+  }
+  renderer->resident_spring_shader = LoadShaderFromMemory(
+      resident_spring_vertex_shader, spring_fragment_shader);
+  renderer->resident_mass_shader =
+      LoadShaderFromMemory(resident_mass_vertex_shader, mass_fragment_shader);
+  if (!shader_loaded(renderer->resident_spring_shader) ||
+      !shader_loaded(renderer->resident_mass_shader)) {
+    printf("ERROR: Cannot compile the GPU simulation mesh shaders\n");
+    return;
+  }
+  renderer->resident_array = rlLoadVertexArray();
+  rlEnableVertexArray(renderer->resident_array);
+  rlEnableVertexBuffer(renderer->quad_buffer);
+  rlSetVertexAttribute(0, 2, RL_FLOAT, false, 0, 0);
+  rlEnableVertexAttribute(0);
+  rlDisableVertexArray();
+  rlDisableVertexBuffer();
+  renderer->resident = true;
+}
+
+_Bool mesh_renderer_init(MeshRenderer *renderer) {
+  *renderer = (MeshRenderer){0};
+  renderer->spring_shader =
+      LoadShaderFromMemory(spring_vertex_shader, spring_fragment_shader);
+  renderer->mass_shader =
+      LoadShaderFromMemory(mass_vertex_shader, mass_fragment_shader);
+  if (!shader_loaded(renderer->spring_shader) ||
+      !shader_loaded(renderer->mass_shader)) {
+    printf("ERROR: Cannot compile the mesh shaders, drawing immediately\n");
+    mesh_renderer_free(renderer);
+    return false;
+  }
+  renderer->quad_buffer =
+      rlLoadVertexBuffer(quad_corners, sizeof(quad_corners), false);
+  resident_shaders_init(renderer);
+  return true;
+}
+
+void mesh_renderer_free(MeshRenderer *renderer) {
+  instance_array_unload(&renderer->spring_array, &renderer->spring_buffer);
+  instance_array_unload(&renderer->mass_array, &renderer->mass_buffer);
+  if (renderer->resident_array != 0) {
+    rlUnloadVertexArray(renderer->resident_array);
+  }
+  if (renderer->quad_buffer != 0) {
+    rlUnloadVertexBuffer(renderer->quad_buffer);
+  }
+  Shader *shaders[] = {&renderer->spring_shader, &renderer->mass_shader,
+                       &renderer->resident_spring_shader,
+                       &renderer->resident_mass_shader};
+  for (size_t i = 0; i < sizeof(shaders) / sizeof(shaders[0]); ++i) {
+    if (shader_loaded(*shaders[i])) {
+      UnloadShader(*shaders[i]);
+    }
+  }
+  *renderer = (MeshRenderer){0};
+}
+
+static void instances_draw(unsigned int array, size_t count) {
+  rlEnableVertexArray(array);
+  rlDrawVertexArrayInstanced(0, QUAD_VERTICES, count);
+  rlDisableVertexArray();
+  rlDisableShader();
+}
+
+// Anything raylib has batched so far goes first, and the draws use the same
+// transform it would
+static Matrix mesh_transform(void) {
+  rlDrawRenderBatchActive();
+  return MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+}
+
+static void spring_shader_enable(Shader shader, Matrix mvp) {
+  rlEnableShader(shader.id);
+  rlSetUniformMatrix(rlGetLocationUniform(shader.id, "mvp"), mvp);
+  shader_set_float(shader, "half_width", SPRING_HALF_WIDTH);
+}
+
+static void mass_shader_enable(Shader shader, Matrix mvp) {
+  rlEnableShader(shader.id);
+  rlSetUniformMatrix(rlGetLocationUniform(shader.id, "mvp"), mvp);
+  shader_set_float(shader, "radius", MASS_RADIUS);
+}
+
+void mesh_renderer_draw(MeshRenderer *renderer, const DrawCache *cache) {
+  // Both buffers have to grow before either is uploaded to
+  _Bool grown = instance_storage_reserve(
+      renderer, &renderer->mass_array, &renderer->mass_buffer,
+      &renderer->mass_capacity, 2, sizeof(MassDraw), cache->mass_count);
+  grown = instance_storage_reserve(renderer, &renderer->spring_array,
+                                   &renderer->spring_buffer,
+                                   &renderer->spring_capacity, 4,
+                                   sizeof(SpringDraw), cache->spring_count) ||
+          grown;
+  // Only what the last update packed goes up, unless the buffers hold some
+  // other cache or missed an update
+  size_t missed = cache->revision - renderer->uploaded_revision;
+  if (grown || renderer->uploaded != cache || missed > 1) {
+    instances_upload(renderer->mass_buffer, cache->masses, sizeof(MassDraw), 0,
+                     cache->mass_count);
+    instances_upload(renderer->spring_buffer, cache->springs,
+                     sizeof(SpringDraw), 0, cache->spring_count);
+  } else if (missed == 1) {
+    instances_upload(renderer->mass_buffer, cache->masses, sizeof(MassDraw),
+                     cache->mass_begin, cache->mass_end);
+    instances_upload(renderer->spring_buffer, cache->springs,
+                     sizeof(SpringDraw), cache->spring_begin,
+                     cache->spring_end);
+  }
+  renderer->uploaded = cache;
+  renderer->uploaded_revision = cache->revision;
+
+  Matrix mvp = mesh_transform();
+  spring_shader_enable(renderer->spring_shader, mvp);
+  instances_draw(renderer->spring_array, cache->spring_count);
+  mass_shader_enable(renderer->mass_shader, mvp);
+  instances_draw(renderer->mass_array, cache->mass_count);
+}
+
+void mesh_renderer_draw_resident(MeshRenderer *renderer,
+                                 const GpuSimulation *gpu, double alpha) {
+  if (!renderer->resident || !gpu->uploaded) {
+    return;
+  }
+  // The simulation put a barrier behind its last dispatch, so the buffers can
+  // be bound as they are
+  Matrix mvp = mesh_transform();
+  Shader shader = renderer->resident_spring_shader;
+  spring_shader_enable(shader, mvp);
+  shader_set_float(shader, "alpha", alpha);
+  shader_set_color(shader, "relaxed_color", WHITE);
+  shader_set_color(shader, "stretched_color", RED);
+  shader_set_color(shader, "compressed_color", BLUE);
+  rlBindShaderBuffer(gpu->position_buffer, 0);
+  rlBindShaderBuffer(gpu->previous_position_buffer, 1);
+  rlBindShaderBuffer(gpu->endpoint_buffer, 2);
+  rlBindShaderBuffer(gpu->parameter_buffer, 3);
+  instances_draw(renderer->resident_array, gpu->spring_count);
+
+  shader = renderer->resident_mass_shader;
+  mass_shader_enable(shader, mvp);
+  shader_set_float(shader, "alpha", alpha);
+  shader_set_float(shader, "color_scale", MASS_COLOR_SCALE);
+  shader_set_color(shader, "slow_color", BLUE);
+  shader_set_color(shader, "fast_color", RED);
+  rlBindShaderBuffer(gpu->position_buffer, 0);
+  rlBindShaderBuffer(gpu->previous_position_buffer, 1);
+  rlBindShaderBuffer(gpu->velocity_buffer, 2);
+  instances_draw(renderer->resident_array, gpu->mass_count);
+}
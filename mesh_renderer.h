@@ -0,0 +1,44 @@
+#ifndef MESH_RENDERER_H
+#define MESH_RENDERER_H
+
+#include "draw_cache.h"
+#include "gpu_simulation.h"
+#include "raylib.h"
+#include "springs.h"
+
+// Draws the whole mesh in two instanced draw calls, one for the springs and
+// one for the masses. The instances come from a draw cache, and only those it
+// packed again since the last frame are uploaded to the dynamic vertex
+// buffers. Drawing from a GPU simulation the coloring is done in the shaders.
+typedef struct {
+  Shader spring_shader;
+  Shader mass_shader;
+  unsigned int quad_buffer;   // Corners of the quad every instance expands
+  unsigned int spring_array;  // Vertex array of the spring instances
+  unsigned int spring_buffer; // SpringDraw per active spring
+  unsigned int mass_array;    // Vertex array of the mass instances
+  unsigned int mass_buffer;   // MassDraw per mass
+  // Shaders reading a GPU simulation's buffers, only loaded on OpenGL 4.3
+  Shader resident_spring_shader;
+  Shader resident_mass_shader;
+  unsigned int resident_array; // Vertex array of the quad alone
+  _Bool resident;
+  size_t spring_capacity; // Instances the GPU buffers hold
+  size_t mass_capacity;
+  // Cache and revision of it the buffers were last brought up to date with
+  const DrawCache *uploaded;
+  size_t uploaded_revision;
+} MeshRenderer;
+
+// Returns false if the shaders cannot be compiled, e.g. on OpenGL versions
+// without instancing, in which case the caller should draw some other way
+_Bool mesh_renderer_init(MeshRenderer *renderer);
+void mesh_renderer_free(MeshRenderer *renderer);
+// Draws the system cache was last updated with
+void mesh_renderer_draw(MeshRenderer *renderer, const DrawCache *cache);
+// Same for a system stepped by gpu, drawing from its buffers without reading
+// anything back. Only does something if renderer->resident is set.
+void mesh_renderer_draw_resident(MeshRenderer *renderer,
+                                 const GpuSimulation *gpu, double alpha);
+
+#endif
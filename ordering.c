@@ -0,0 +1,235 @@
+#include "ordering.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MORTON_BITS 16
+
+static const char *ordering_names[ORDERING_COUNT] = {
+    [ORDERING_NONE] = "none",
+    [ORDERING_MORTON] = "morton",
+    [ORDERING_RCM] = "rcm",
+};
+
+const char *ordering_name(Ordering ordering) {
+  if (ordering >= ORDERING_COUNT) {
+    return "unknown";
+  }
+  return ordering_names[ordering];
+}
+
+_Bool ordering_from_name(const char *name, Ordering *ordering) {
+  for (size_t i = 0; i < ORDERING_COUNT; ++i) {
+    if (strcmp(name, ordering_names[i]) == 0) {
+      *ordering = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int compare_keys(const void *a, const void *b) {
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+// Spreads the low 16 bits of value to the even bits
+static uint32_t morton_spread(uint32_t value) {
+  value &= 0xffff;
+  value = (value | (value << 8)) & 0x00ff00ff;
+  value = (value | (value << 4)) & 0x0f0f0f0f;
+  value = (value | (value << 2)) & 0x33333333;
+  value = (value | (value << 1)) & 0x55555555;
+  return value;
+}
+
+static uint32_t morton_cell(Scalar value, Scalar min, Scalar scale) {
+  Scalar cell = (value - min) * scale;
+  // Also keeps NaN positions in range
+  if (!(cell > SCALAR_C(0.0))) {
+    return 0;
+  }
+  return cell < (1 << MORTON_BITS) - 1 ? (uint32_t)cell
+                                       : (1 << MORTON_BITS) - 1;
+}
+
+_Bool order_morton(const Vec2 *position, size_t count, uint32_t *order) {
+  if (count == 0) {
+    return true;
+  }
+  Vec2 min = position[0];
+  Vec2 max = position[0];
+  for (size_t i = 1; i < count; ++i) {
+    min = (Vec2){scalar_min(min.x, position[i].x),
+                 scalar_min(min.y, position[i].y)};
+    max = (Vec2){scalar_max(max.x, position[i].x),
+                 scalar_max(max.y, position[i].y)};
+  }
+  // The same scale on both axes keeps the cells square
+  Scalar extent = scalar_max(max.x - min.x, max.y - min.y);
+  Scalar scale = extent > SCALAR_C(0.0) ? ((1 << MORTON_BITS) - 1) / extent
+                                        : SCALAR_C(0.0);
+
+  // Sorting keys with the index in the low half keeps ties in their order
+  uint64_t *keys = malloc(count * sizeof(*keys));
+  if (keys == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t code =
+        morton_spread(morton_cell(position[i].x, min.x, scale)) |
+        morton_spread(morton_cell(position[i].y, min.y, scale)) << 1;
+    keys[i] = (uint64_t)code << 32 | i;
+  }
+  qsort(keys, count, sizeof(*keys), compare_keys);
+  for (size_t i = 0; i < count; ++i) {
+    order[i] = (uint32_t)keys[i];
+  }
+  free(keys);
+  return true;
+}
+
+// Breadth first search from start over the unvisited nodes, appending them
+// to queue from tail on. Returns the new tail and where its last level begins.
+static size_t rcm_visit(const size_t *offset, const uint64_t *neighbor,
+                        uint8_t *visited, uint32_t start, uint32_t *queue,
+                        size_t tail, size_t *last_level) {
+  size_t head = tail;
+  size_t level_end = tail;
+  queue[tail++] = start;
+  visited[start] = true;
+  *last_level = head;
+  while (head < tail) {
+    if (head == level_end) {
+      *last_level = head;
+      level_end = tail;
+    }
+    uint32_t node = queue[head++];
+    // Neighbors are sorted by degree, so the lowest degrees go first
+    for (size_t j = offset[node]; j < offset[node + 1]; ++j) {
+      uint32_t next = (uint32_t)neighbor[j];
+      if (!visited[next]) {
+        visited[next] = true;
+        queue[tail++] = next;
+      }
+    }
+  }
+  return tail;
+}
+
+_Bool order_rcm(size_t count, const uint32_t *first, const uint32_t *second,
+                size_t edge_count, uint32_t *order) {
+  size_t *offset = calloc(count + 1, sizeof(*offset));
+  uint64_t *neighbor = malloc((2 * edge_count + 1) * sizeof(*neighbor));
+  uint64_t *start = malloc((count + 1) * sizeof(*start));
+  size_t *fill = malloc((count + 1) * sizeof(*fill));
+  uint8_t *visited = calloc(count + 1, 1);
+  if (offset == NULL || neighbor == NULL || start == NULL || fill == NULL ||
+      visited == NULL) {
+    free(offset);
+    free(neighbor);
+    free(start);
+    free(fill);
+    free(visited);
+    return false;
+  }
+
+  // Adjacency in compressed sparse row form, self loops left out
+  for (size_t i = 0; i < edge_count; ++i) {
+    if (first[i] != second[i]) {
+      ++offset[first[i] + 1];
+      ++offset[second[i] + 1];
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    offset[i + 1] += offset[i];
+  }
+  // Keys are the degree of the neighbor above its index
+  memcpy(fill, offset, count * sizeof(*fill));
+  for (size_t i = 0; i < edge_count; ++i) {
+    uint32_t a = first[i];
+    uint32_t b = second[i];
+    if (a != b) {
+      neighbor[fill[a]++] = (uint64_t)(offset[b + 1] - offset[b]) << 32 | b;
+      neighbor[fill[b]++] = (uint64_t)(offset[a + 1] - offset[a]) << 32 | a;
+    }
+  }
+  free(fill);
+
+  for (size_t i = 0; i < count; ++i) {
+    qsort(neighbor + offset[i], offset[i + 1] - offset[i], sizeof(*neighbor),
+          compare_keys);
+    start[i] = (uint64_t)(offset[i + 1] - offset[i]) << 32 | i;
+  }
+  // Components start from their lowest degree node, moved to a node of the
+  // lowest degree on the last level of a search from it, which lies near the
+  // far end of the component
+  qsort(start, count, sizeof(*start), compare_keys);
+  size_t tail = 0;
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t node = (uint32_t)start[i];
+    if (visited[node]) {
+      continue;
+    }
+    size_t last_level;
+    size_t end = rcm_visit(offset, neighbor, visited, node, order, tail,
+                           &last_level);
+    uint32_t peripheral = order[last_level];
+    for (size_t j = last_level; j < end; ++j) {
+      size_t degree = offset[order[j] + 1] - offset[order[j]];
+      if (degree < offset[peripheral + 1] - offset[peripheral]) {
+        peripheral = order[j];
+      }
+    }
+    for (size_t j = tail; j < end; ++j) {
+      visited[order[j]] = false;
+    }
+    tail = rcm_visit(offset, neighbor, visited, peripheral, order, tail,
+                     &last_level);
+  }
+  for (size_t i = 0; i < count / 2; ++i) {
+    uint32_t swapped = order[i];
+    order[i] = order[count - 1 - i];
+    order[count - 1 - i] = swapped;
+  }
+
+  free(offset);
+  free(neighbor);
+  free(start);
+  free(visited);
+  return true;
+}
+
+typedef struct {
+  uint64_t endpoints; // Lower endpoint above the higher one
+  uint32_t index;
+} EdgeKey;
+
+static int compare_edges(const void *a, const void *b) {
+  const EdgeKey *edge_a = a;
+  const EdgeKey *edge_b = b;
+  if (edge_a->endpoints != edge_b->endpoints) {
+    return edge_a->endpoints < edge_b->endpoints ? -1 : 1;
+  }
+  return (edge_a->index > edge_b->index) - (edge_a->index < edge_b->index);
+}
+
+_Bool order_edges(const uint32_t *first, const uint32_t *second,
+                  size_t edge_count, uint32_t *order) {
+  EdgeKey *keys = malloc((edge_count + 1) * sizeof(*keys));
+  if (keys == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < edge_count; ++i) {
+    uint32_t low = first[i] < second[i] ? first[i] : second[i];
+    uint32_t high = first[i] < second[i] ? second[i] : first[i];
+    keys[i] = (EdgeKey){(uint64_t)low << 32 | high, i};
+  }
+  qsort(keys, edge_count, sizeof(*keys), compare_edges);
+  for (size_t i = 0; i < edge_count; ++i) {
+    order[i] = keys[i].index;
+  }
+  free(keys);
+  return true;
+}
@@ -0,0 +1,34 @@
+#ifndef ORDERING_H
+#define ORDERING_H
+
+#include "vec2.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Orders for storing masses so that the masses a spring connects tend to sit
+// close in memory. Each fills order with the old index of every mass in its
+// new place, that is order[new] = old, and returns false if it runs out of
+// memory.
+
+typedef enum {
+  ORDERING_NONE = 0, // Keep the order as given
+  ORDERING_MORTON,   // Along a Z curve over the positions
+  ORDERING_RCM,      // Reverse Cuthill-McKee over the springs, small bandwidth
+  ORDERING_COUNT,
+} Ordering;
+
+const char *ordering_name(Ordering ordering);
+// Looks up an ordering by the name ordering_name gives it
+_Bool ordering_from_name(const char *name, Ordering *ordering);
+
+_Bool order_morton(const Vec2 *position, size_t count, uint32_t *order);
+// Edges connect first[i] and second[i], every endpoint below count
+_Bool order_rcm(size_t count, const uint32_t *first, const uint32_t *second,
+                size_t edge_count, uint32_t *order);
+// Orders edges by their lower endpoint, then their higher one, keeping edges
+// between the same masses in their given order
+_Bool order_edges(const uint32_t *first, const uint32_t *second,
+                  size_t edge_count, uint32_t *order);
+
+#endif
@@ -0,0 +1,205 @@
+#include "profiler.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+static const char *zone_names[PROFILE_ZONE_COUNT] = {
+    [PROFILE_ZONE_INPUT] = "input",
+    [PROFILE_ZONE_STEP] = "step",
+    [PROFILE_ZONE_SPRING_FORCES] = "spring_forces",
+    [PROFILE_ZONE_INTEGRATE] = "integrate",
+    [PROFILE_ZONE_SOLVE] = "solve",
+    [PROFILE_ZONE_RESET] = "reset",
+    [PROFILE_ZONE_HASH] = "hash",
+    [PROFILE_ZONE_ISLANDS] = "islands",
+    [PROFILE_ZONE_COLLIDE] = "collide",
+    [PROFILE_ZONE_DRAW] = "draw",
+};
+
+static const char *counter_names[PROFILE_COUNTER_COUNT] = {
+    [PROFILE_COUNTER_ACTIVE_SPRINGS] = "active_springs",
+    [PROFILE_COUNTER_CUT_SPRINGS] = "cut_springs",
+    [PROFILE_COUNTER_CLAMPED_FORCES] = "clamped_forces",
+    [PROFILE_COUNTER_DROPPED] = "dropped",
+    [PROFILE_COUNTER_SLEEPING_MASSES] = "sleeping_masses",
+    [PROFILE_COUNTER_CONTACTS] = "contacts",
+};
+
+// The ring buffer is only touched by the main thread, the frame being
+// recorded by any thread holding the lock
+static struct {
+  ProfileFrame frames[PROFILE_FRAME_CAPACITY];
+  size_t frame_count; // Frames finished so far, including overwritten ones
+  ProfileFrame current;
+  _Bool in_frame;
+  pthread_mutex_t lock;
+  double epoch;
+  uint64_t counters[PROFILE_COUNTER_COUNT];
+  unsigned thread_count;
+} profiler = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Zones nest per thread
+static _Thread_local double zone_start[PROFILE_ZONE_COUNT];
+static _Thread_local size_t zone_depth[PROFILE_ZONE_COUNT];
+static _Thread_local unsigned zone_thread;
+
+// Numbers threads from one in the order they first time something
+static unsigned profile_thread(void) {
+  if (zone_thread == 0) {
+    zone_thread =
+        __atomic_add_fetch(&profiler.thread_count, 1, __ATOMIC_RELAXED);
+  }
+  return zone_thread;
+}
+
+static double profile_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double seconds = now.tv_sec + now.tv_nsec * 1e-9;
+  if (profiler.epoch == 0.0) {
+    profiler.epoch = seconds;
+  }
+  return seconds - profiler.epoch;
+}
+
+_Bool profile_enabled(void) {
+#ifdef SPRINGS_PROFILE
+  return true;
+#else
+  return false;
+#endif
+}
+
+const char *profile_zone_name(ProfileZone zone) {
+  return zone < PROFILE_ZONE_COUNT ? zone_names[zone] : "unknown";
+}
+
+const char *profile_counter_name(ProfileCounter counter) {
+  return counter < PROFILE_COUNTER_COUNT ? counter_names[counter] : "unknown";
+}
+
+void profile_frame_begin(void) {
+  profile_thread();
+  pthread_mutex_lock(&profiler.lock);
+  profiler.current = (ProfileFrame){.index = profiler.frame_count,
+                                    .start = profile_now()};
+  profiler.in_frame = true;
+  pthread_mutex_unlock(&profiler.lock);
+}
+
+void profile_frame_end(void) {
+  pthread_mutex_lock(&profiler.lock);
+  if (!profiler.in_frame) {
+    pthread_mutex_unlock(&profiler.lock);
+    return;
+  }
+  ProfileFrame *frame = &profiler.current;
+  frame->duration = profile_now() - frame->start;
+  for (size_t i = 0; i < PROFILE_COUNTER_COUNT; ++i) {
+    frame->counters[i] =
+        __atomic_exchange_n(&profiler.counters[i], 0, __ATOMIC_RELAXED);
+  }
+  profiler.frames[profiler.frame_count % PROFILE_FRAME_CAPACITY] = *frame;
+  ++profiler.frame_count;
+  profiler.in_frame = false;
+  pthread_mutex_unlock(&profiler.lock);
+}
+
+void profile_zone_begin(ProfileZone zone) {
+  if (zone_depth[zone]++ == 0) {
+    zone_start[zone] = profile_now();
+  }
+}
+
+// Zones on other threads go in the frame that is being recorded when they end
+void profile_zone_end(ProfileZone zone) {
+  if (zone_depth[zone] == 0 || --zone_depth[zone] > 0) {
+    return;
+  }
+  double start = zone_start[zone];
+  double duration = profile_now() - start;
+  unsigned thread = profile_thread();
+  pthread_mutex_lock(&profiler.lock);
+  if (!profiler.in_frame) {
+    pthread_mutex_unlock(&profiler.lock);
+    return;
+  }
+  ProfileFrame *frame = &profiler.current;
+  frame->zone_seconds[zone] += duration;
+  // Events past the capacity still count towards the totals
+  if (frame->event_count < PROFILE_FRAME_EVENTS) {
+    frame->events[frame->event_count++] = (ProfileEvent){
+        .zone = zone,
+        .start = start,
+        .duration = duration,
+        .thread = thread,
+    };
+  }
+  pthread_mutex_unlock(&profiler.lock);
+}
+
+void profile_count(ProfileCounter counter, uint64_t amount) {
+  __atomic_fetch_add(&profiler.counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+void profile_set(ProfileCounter counter, uint64_t value) {
+  __atomic_store_n(&profiler.counters[counter], value, __ATOMIC_RELAXED);
+}
+
+size_t profile_frame_count(void) {
+  return profiler.frame_count < PROFILE_FRAME_CAPACITY
+             ? profiler.frame_count
+             : PROFILE_FRAME_CAPACITY;
+}
+
+const ProfileFrame *profile_frame(size_t age) {
+  if (age >= profile_frame_count()) {
+    return NULL;
+  }
+  size_t index = profiler.frame_count - 1 - age;
+  return &profiler.frames[index % PROFILE_FRAME_CAPACITY];
+}
+
+_Bool profile_write_chrome_trace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    printf("ERROR: Cannot open %s for writing\n", path);
+    return false;
+  }
+  // Complete events for the frames and zones, counter events for the
+  // counters, all timestamps in microseconds
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  const char *separator = "";
+  for (size_t age = profile_frame_count(); age-- > 0;) {
+    const ProfileFrame *frame = profile_frame(age);
+    fprintf(file,
+            "%s{\"name\": \"frame\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"index\": %zu}}",
+            separator, frame->start * 1e6, frame->duration * 1e6,
+            frame->index);
+    separator = ",\n";
+    for (size_t i = 0; i < frame->event_count; ++i) {
+      const ProfileEvent *event = &frame->events[i];
+      fprintf(file,
+              ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+              "\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+              zone_names[event->zone], event->thread, event->start * 1e6,
+              event->duration * 1e6);
+    }
+    fprintf(file,
+            ",\n{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, "
+            "\"ts\": %.3f, \"args\": {",
+            frame->start * 1e6);
+    for (size_t i = 0; i < PROFILE_COUNTER_COUNT; ++i) {
+      fprintf(file, "%s\"%s\": %llu", i > 0 ? ", " : "", counter_names[i],
+              (unsigned long long)frame->counters[i]);
+    }
+    fprintf(file, "}}");
+  }
+  fprintf(file, "\n]}\n");
+  _Bool ok = fclose(file) == 0;
+  if (!ok) {
+    printf("ERROR: Cannot write %s\n", path);
+  }
+  return ok;
+}
@@ -0,0 +1,109 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frame profiler for the main thread. Zones time the phases of a frame and
+// counters count what happened in it, and the last PROFILE_FRAME_CAPACITY
+// frames are kept in a ring buffer for an overlay or a Chrome trace. Zones
+// may also be timed on a thread working alongside the main one, such as the
+// viewer's physics thread.
+//
+// The hot paths are instrumented through the PROFILE_ macros, which compile
+// to nothing unless SPRINGS_PROFILE is defined (make PROFILE=1).
+
+#define PROFILE_FRAME_CAPACITY 256
+#define PROFILE_FRAME_EVENTS 128 // Zone timings kept per frame for the trace
+
+typedef enum {
+  PROFILE_ZONE_INPUT = 0,
+  PROFILE_ZONE_STEP,
+  PROFILE_ZONE_SPRING_FORCES,
+  PROFILE_ZONE_INTEGRATE,
+  PROFILE_ZONE_SOLVE, // XPBD constraints or the implicit Euler solve
+  PROFILE_ZONE_RESET,
+  PROFILE_ZONE_HASH,    // Spatial hash upkeep and queries
+  PROFILE_ZONE_ISLANDS, // Island labeling and sleep detection
+  PROFILE_ZONE_COLLIDE,
+  PROFILE_ZONE_DRAW,
+  PROFILE_ZONE_COUNT,
+} ProfileZone;
+
+typedef enum {
+  PROFILE_COUNTER_ACTIVE_SPRINGS = 0, // Springs the update loops cover
+  PROFILE_COUNTER_CUT_SPRINGS,        // Springs cut during the frame
+  PROFILE_COUNTER_CLAMPED_FORCES,     // Forces limited to FORCES_CONSTRAINT
+  PROFILE_COUNTER_DROPPED,            // Masses or springs that did not fit
+  PROFILE_COUNTER_SLEEPING_MASSES,    // Masses of sleeping islands
+  PROFILE_COUNTER_CONTACTS,           // Contacts resolved, once per mass
+  PROFILE_COUNTER_COUNT,
+} ProfileCounter;
+
+typedef struct {
+  ProfileZone zone;
+  double start; // Seconds since the profiler started
+  double duration;
+  unsigned thread; // From one, the main thread first
+} ProfileEvent;
+
+typedef struct {
+  size_t index;
+  double start;
+  double duration;
+  double zone_seconds[PROFILE_ZONE_COUNT]; // Totals over the frame
+  uint64_t counters[PROFILE_COUNTER_COUNT];
+  ProfileEvent events[PROFILE_FRAME_EVENTS];
+  size_t event_count;
+} ProfileFrame;
+
+// Whether this build was compiled with the instrumentation
+_Bool profile_enabled(void);
+const char *profile_zone_name(ProfileZone zone);
+const char *profile_counter_name(ProfileCounter counter);
+
+void profile_frame_begin(void);
+void profile_frame_end(void);
+// Zones of the same kind may nest on a thread, only the outermost is timed
+void profile_zone_begin(ProfileZone zone);
+void profile_zone_end(ProfileZone zone);
+// Safe to call from worker threads
+void profile_count(ProfileCounter counter, uint64_t amount);
+void profile_set(ProfileCounter counter, uint64_t value);
+
+// Number of finished frames in the ring buffer, and frame age of them with
+// zero being the latest one
+size_t profile_frame_count(void);
+const ProfileFrame *profile_frame(size_t age);
+// Writes the frames in the ring buffer as Chrome trace event JSON, which
+// chrome://tracing and Perfetto open
+_Bool profile_write_chrome_trace(const char *path);
+
+#ifdef SPRINGS_PROFILE
+#define PROFILE_BEGIN(zone) profile_zone_begin(zone)
+#define PROFILE_END(zone) profile_zone_end(zone)
+#define PROFILE_COUNT(counter, amount) profile_count(counter, amount)
+#define PROFILE_SET(counter, value) profile_set(counter, value)
+#if defined(__GNUC__)
+static inline void profile_scope_end(const ProfileZone *zone) {
+  profile_zone_end(*zone);
+}
+#define PROFILE_SCOPE_NAME(line) profile_scope_##line
+#define PROFILE_SCOPE_AT(zone, line)                                           \
+  __attribute__((cleanup(profile_scope_end))) const ProfileZone                \
+      PROFILE_SCOPE_NAME(line) = (profile_zone_begin(zone), zone)
+// Times the rest of the enclosing block
+#define PROFILE_SCOPE(zone) PROFILE_SCOPE_AT(zone, __LINE__)
+#else
+#error "PROFILE_SCOPE needs the cleanup attribute of GCC or Clang"
+#endif
+#else
+#define PROFILE_BEGIN(zone) ((void)0)
+#define PROFILE_END(zone) ((void)0)
+#define PROFILE_COUNT(counter, amount) ((void)0)
+#define PROFILE_SET(counter, value) ((void)0)
+#define PROFILE_SCOPE(zone) ((void)0)
+#endif
+
+#endif
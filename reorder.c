@@ -0,0 +1,223 @@
+#include "springs.h"
+#include "springs_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REORDER_MASS_FIELDS 7
+#define REORDER_SPRING_FIELDS 9
+
+// An array of the system with the size of its elements
+typedef struct {
+  void **array;
+  size_t element_size;
+} ReorderField;
+
+double system_spring_span(const System *system) {
+  const SpringArrays *springs = &system->springs;
+  double span = 0.0;
+  size_t live_count = 0;
+  for (size_t i = 0; i < system->active_spring_count; ++i) {
+    if (!springs->cut[i]) {
+      span += springs->first[i] > springs->second[i]
+                  ? springs->first[i] - springs->second[i]
+                  : springs->second[i] - springs->first[i];
+      ++live_count;
+    }
+  }
+  return live_count > 0 ? span / live_count : 0.0;
+}
+
+// Copies the first count elements of array in the given order, and any up to
+// the given end as they are, into a new array of capacity elements
+static void *reorder_copy(const void *array, size_t element_size,
+                          const uint32_t *order, size_t count, size_t end,
+                          size_t capacity) {
+  uint8_t *copy = malloc((capacity > 0 ? capacity : 1) * element_size);
+  if (copy == NULL) {
+    return NULL;
+  }
+  const uint8_t *source = array;
+  for (size_t i = 0; i < count; ++i) {
+    memcpy(copy + i * element_size, source + order[i] * element_size,
+           element_size);
+  }
+  // Without any springs the source is NULL
+  if (end > count) {
+    memcpy(copy + count * element_size, source + count * element_size,
+           (end - count) * element_size);
+  }
+  return copy;
+}
+
+// Makes reordered copies of the arrays of fields, which are all NULL if any
+// copy fails
+static _Bool reorder_copy_fields(const ReorderField *fields,
+                                 size_t field_count, const uint32_t *order,
+                                 size_t count, size_t end, size_t capacity,
+                                 void **copies) {
+  _Bool ok = true;
+  for (size_t i = 0; i < field_count; ++i) {
+    copies[i] = ok ? reorder_copy(*fields[i].array, fields[i].element_size,
+                                  order, count, end, capacity)
+                   : NULL;
+    ok = ok && copies[i] != NULL;
+  }
+  for (size_t i = 0; i < field_count && !ok; ++i) {
+    free(copies[i]);
+    copies[i] = NULL;
+  }
+  return ok;
+}
+
+static void reorder_replace_fields(const ReorderField *fields,
+                                   size_t field_count, void **copies) {
+  for (size_t i = 0; i < field_count; ++i) {
+    free(*fields[i].array);
+    *fields[i].array = copies[i];
+  }
+}
+
+// Fills order with the new order of the masses, using first and second as
+// room for the endpoints of the live springs
+static _Bool reorder_masses(const System *system, Ordering ordering,
+                            uint32_t *order, uint32_t *first,
+                            uint32_t *second) {
+  const SpringArrays *springs = &system->springs;
+  if (ordering == ORDERING_MORTON) {
+    return order_morton(system->masses.position, system->mass_count, order);
+  }
+  if (ordering == ORDERING_RCM) {
+    size_t live_count = 0;
+    for (size_t i = 0; i < system->active_spring_count; ++i) {
+      if (!springs->cut[i]) {
+        first[live_count] = springs->first[i];
+        second[live_count++] = springs->second[i];
+      }
+    }
+    return order_rcm(system->mass_count, first, second, live_count, order);
+  }
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    order[i] = i;
+  }
+  return true;
+}
+
+_Bool system_reorder(System *system, Ordering ordering, size_t *held,
+                     size_t held_count) {
+  if (system->mass_count == 0) {
+    return true;
+  }
+  MassArrays *masses = &system->masses;
+  SpringArrays *springs = &system->springs;
+  size_t mass_count = system->mass_count;
+  size_t active_count = system->active_spring_count;
+  uint32_t *mass_order = malloc((mass_count + 1) * sizeof(*mass_order));
+  uint32_t *new_index = malloc((mass_count + 1) * sizeof(*new_index));
+  uint32_t *spring_order = malloc((active_count + 1) * sizeof(*spring_order));
+  uint32_t *first = malloc((active_count + 1) * sizeof(*first));
+  uint32_t *second = malloc((active_count + 1) * sizeof(*second));
+  _Bool ok = mass_order != NULL && new_index != NULL &&
+             spring_order != NULL && first != NULL && second != NULL &&
+             reorder_masses(system, ordering, mass_order, first, second);
+  if (ok) {
+    for (size_t i = 0; i < mass_count; ++i) {
+      new_index[mass_order[i]] = i;
+    }
+    // Springs sorted by their new endpoints. Cut springs in the active range
+    // go along, the ones compacted behind it stay there.
+    for (size_t i = 0; i < active_count; ++i) {
+      first[i] = new_index[springs->first[i]];
+      second[i] = new_index[springs->second[i]];
+    }
+    ok = order_edges(first, second, active_count, spring_order);
+  }
+
+  ReorderField mass_fields[REORDER_MASS_FIELDS] = {
+      {(void **)&masses->position, sizeof(*masses->position)},
+      {(void **)&masses->previous_position,
+       sizeof(*masses->previous_position)},
+      {(void **)&masses->velocity, sizeof(*masses->velocity)},
+      {(void **)&masses->force, sizeof(*masses->force)},
+      {(void **)&masses->inverse_mass, sizeof(*masses->inverse_mass)},
+      {(void **)&masses->fixed, sizeof(*masses->fixed)},
+      {(void **)&masses->id, sizeof(*masses->id)},
+  };
+  ReorderField spring_fields[REORDER_SPRING_FIELDS] = {
+      {(void **)&springs->first, sizeof(*springs->first)},
+      {(void **)&springs->second, sizeof(*springs->second)},
+      {(void **)&springs->length, sizeof(*springs->length)},
+      {(void **)&springs->strength, sizeof(*springs->strength)},
+      {(void **)&springs->dampening, sizeof(*springs->dampening)},
+      {(void **)&springs->max_strain, sizeof(*springs->max_strain)},
+      {(void **)&springs->cut, sizeof(*springs->cut)},
+      {(void **)&springs->force, sizeof(*springs->force)},
+      {(void **)&springs->id, sizeof(*springs->id)},
+  };
+  // Everything is copied before anything is replaced, so running out of
+  // memory leaves the system as it was
+  void *mass_copies[REORDER_MASS_FIELDS] = {0};
+  void *spring_copies[REORDER_SPRING_FIELDS] = {0};
+  ok = ok && reorder_copy_fields(mass_fields, REORDER_MASS_FIELDS, mass_order,
+                                 mass_count, mass_count,
+                                 system->mass_capacity, mass_copies);
+  ok = ok && reorder_copy_fields(spring_fields, REORDER_SPRING_FIELDS,
+                                 spring_order, active_count,
+                                 system->spring_count,
+                                 system->spring_capacity, spring_copies);
+  if (ok) {
+    reorder_replace_fields(mass_fields, REORDER_MASS_FIELDS, mass_copies);
+    reorder_replace_fields(spring_fields, REORDER_SPRING_FIELDS,
+                           spring_copies);
+  } else {
+    for (size_t i = 0; i < REORDER_MASS_FIELDS; ++i) {
+      free(mass_copies[i]);
+    }
+  }
+  free(mass_order);
+  free(spring_order);
+  free(first);
+  free(second);
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory to reorder the system\n");
+    free(new_index);
+    return false;
+  }
+
+  for (size_t i = 0; i < system->spring_count; ++i) {
+    springs->first[i] = new_index[springs->first[i]];
+    springs->second[i] = new_index[springs->second[i]];
+    springs->slot[springs->id[i]] = i;
+  }
+  for (size_t i = 0; i < mass_count; ++i) {
+    masses->slot[masses->id[i]] = i;
+  }
+  for (size_t i = 0; i < held_count; ++i) {
+    if (held[i] < mass_count) {
+      held[i] = new_index[held[i]];
+    }
+  }
+  free(new_index);
+
+  ++system->mass_order_version;
+  system_invalidate_topology(system);
+  system->hash_valid = false;
+  system_invalidate_islands(system);
+  system->reorder_span = system_spring_span(system);
+  system->reorder_checked_version = system->topology_version;
+  return true;
+}
+
+_Bool system_reorder_if_needed(System *system, size_t *held,
+                               size_t held_count) {
+  if (system->reorder_ordering == ORDERING_NONE ||
+      system->reorder_checked_version == system->topology_version) {
+    return false;
+  }
+  system->reorder_checked_version = system->topology_version;
+  if (system_spring_span(system) <=
+      system->reorder_span * SYSTEM_REORDER_TOLERANCE) {
+    return false;
+  }
+  return system_reorder(system, system->reorder_ordering, held, held_count);
+}
@@ -0,0 +1,453 @@
+#include "scene.h"
+#include "array.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCENE_MAX_POLYGON 64 // Vertices of an OBJ face or polyline
+
+// Masses and springs as read, before they are ordered
+typedef struct {
+  Vec2 *position;
+  Scalar *mass;
+  _Bool *fixed;
+  size_t mass_count;
+  size_t mass_capacity;
+
+  uint32_t *first;
+  uint32_t *second;
+  Scalar *strength;
+  Scalar *dampening;
+  Scalar *max_strain;
+  Scalar *length; // NaN to default to the distance between the masses
+  size_t spring_count;
+  size_t spring_capacity;
+
+  Scalar default_mass;
+  Scalar default_strength;
+  Scalar default_dampening;
+  Scalar default_max_strain;
+
+  const char *path;
+  size_t line;
+} Scene;
+
+static void scene_free(Scene *scene) {
+  free(scene->position);
+  free(scene->mass);
+  free(scene->fixed);
+  free(scene->first);
+  free(scene->second);
+  free(scene->strength);
+  free(scene->dampening);
+  free(scene->max_strain);
+  free(scene->length);
+}
+
+static _Bool scene_error(const Scene *scene, const char *message) {
+  printf("ERROR: %s:%zu: %s\n", scene->path, scene->line, message);
+  return false;
+}
+
+static size_t scene_grown_capacity(size_t capacity) {
+  return capacity < SYSTEM_MIN_CAPACITY ? SYSTEM_MIN_CAPACITY : 2 * capacity;
+}
+
+static _Bool scene_add_mass(Scene *scene, Vec2 position, Scalar mass,
+                            _Bool fixed) {
+  if (scene->mass_count >= UINT32_MAX) {
+    return scene_error(scene, "Too many masses");
+  }
+  if (scene->mass_count == scene->mass_capacity) {
+    size_t capacity = scene_grown_capacity(scene->mass_capacity);
+    _Bool ok = true;
+    ARRAY_RESIZE(scene->position, capacity, ok);
+    ARRAY_RESIZE(scene->mass, capacity, ok);
+    ARRAY_RESIZE(scene->fixed, capacity, ok);
+    if (!ok) {
+      return scene_error(scene, "Cannot allocate memory for masses");
+    }
+    scene->mass_capacity = capacity;
+  }
+  size_t i = scene->mass_count++;
+  scene->position[i] = position;
+  scene->mass[i] = mass;
+  scene->fixed[i] = fixed;
+  return true;
+}
+
+static _Bool scene_add_spring(Scene *scene, uint32_t first, uint32_t second,
+                              Scalar strength, Scalar dampening,
+                              Scalar length) {
+  // Adjacency entries store the spring index in 31 bits
+  if (scene->spring_count >= UINT32_MAX / 2) {
+    return scene_error(scene, "Too many springs");
+  }
+  if (scene->spring_count == scene->spring_capacity) {
+    size_t capacity = scene_grown_capacity(scene->spring_capacity);
+    _Bool ok = true;
+    ARRAY_RESIZE(scene->first, capacity, ok);
+    ARRAY_RESIZE(scene->second, capacity, ok);
+    ARRAY_RESIZE(scene->strength, capacity, ok);
+    ARRAY_RESIZE(scene->dampening, capacity, ok);
+    ARRAY_RESIZE(scene->max_strain, capacity, ok);
+    ARRAY_RESIZE(scene->length, capacity, ok);
+    if (!ok) {
+      return scene_error(scene, "Cannot allocate memory for springs");
+    }
+    scene->spring_capacity = capacity;
+  }
+  size_t i = scene->spring_count++;
+  scene->first[i] = first;
+  scene->second[i] = second;
+  scene->strength[i] = strength;
+  scene->dampening[i] = dampening;
+  scene->max_strain[i] = scene->default_max_strain;
+  scene->length[i] = length;
+  return true;
+}
+
+// Splits off the next whitespace separated token, NULL at the end of the line
+// or at a comment
+static char *next_token(char **cursor) {
+  char *token = *cursor + strspn(*cursor, " \t\r\n");
+  if (*token == '\0' || *token == '#') {
+    return NULL;
+  }
+  char *end = token + strcspn(token, " \t\r\n#");
+  *cursor = end;
+  if (*end == '#') {
+    *end = '\0';
+  } else if (*end != '\0') {
+    *end = '\0';
+    *cursor = end + 1;
+  }
+  return token;
+}
+
+static _Bool parse_scalar(const char *token, Scalar *value) {
+  if (token == NULL) {
+    return false;
+  }
+  char *end;
+  *value = scalar_strto(token, &end);
+  return end != token && *end == '\0' && isfinite(*value);
+}
+
+// Parses an optional value, which keeps its default when the token is missing
+static _Bool parse_optional_scalar(const char *token, Scalar *value) {
+  return token == NULL || parse_scalar(token, value);
+}
+
+static _Bool parse_index(const char *token, uint32_t *index) {
+  if (token == NULL || *token < '0' || *token > '9') {
+    return false;
+  }
+  char *end;
+  unsigned long long value = strtoull(token, &end, 10);
+  *index = value;
+  return *end == '\0' && value < UINT32_MAX;
+}
+
+// OBJ indices count from 1, or back from the last vertex when negative, and
+// may carry texture and normal indices after slashes
+static _Bool parse_obj_index(const Scene *scene, const char *token,
+                             uint32_t *index) {
+  char *end;
+  long long value = strtoll(token, &end, 10);
+  if (end == token || (*end != '\0' && *end != '/')) {
+    return false;
+  }
+  long long resolved = value < 0 ? (long long)scene->mass_count + value
+                                 : value - 1;
+  *index = resolved;
+  return value != 0 && resolved >= 0 && resolved < UINT32_MAX;
+}
+
+static _Bool scene_parse_mass(Scene *scene, char **cursor) {
+  Vec2 position;
+  Scalar mass = scene->default_mass;
+  if (!parse_scalar(next_token(cursor), &position.x) ||
+      !parse_scalar(next_token(cursor), &position.y)) {
+    return scene_error(scene, "Expected mass X Y [MASS] [fixed]");
+  }
+  _Bool fixed = false;
+  char *token = next_token(cursor);
+  if (token != NULL && strcmp(token, "fixed") != 0) {
+    if (!parse_scalar(token, &mass)) {
+      return scene_error(scene, "Expected mass X Y [MASS] [fixed]");
+    }
+    token = next_token(cursor);
+  }
+  if (token != NULL && strcmp(token, "fixed") == 0) {
+    fixed = true;
+    token = next_token(cursor);
+  }
+  if (token != NULL) {
+    return scene_error(scene, "Expected mass X Y [MASS] [fixed]");
+  }
+  if (!(mass > SCALAR_C(0.0))) {
+    return scene_error(scene, "Masses must be positive");
+  }
+  return scene_add_mass(scene, position, mass, fixed);
+}
+
+static _Bool scene_parse_spring(Scene *scene, char **cursor) {
+  uint32_t first;
+  uint32_t second;
+  Scalar strength = scene->default_strength;
+  Scalar dampening = scene->default_dampening;
+  Scalar length = NAN;
+  if (!parse_index(next_token(cursor), &first) ||
+      !parse_index(next_token(cursor), &second) ||
+      !parse_optional_scalar(next_token(cursor), &strength) ||
+      !parse_optional_scalar(next_token(cursor), &dampening) ||
+      !parse_optional_scalar(next_token(cursor), &length) ||
+      next_token(cursor) != NULL) {
+    return scene_error(scene,
+                       "Expected spring A B [STRENGTH [DAMPENING [LENGTH]]]");
+  }
+  if (length < SCALAR_C(0.0)) {
+    return scene_error(scene, "Spring lengths cannot be negative");
+  }
+  return scene_add_spring(scene, first, second, strength, dampening, length);
+}
+
+static _Bool scene_parse_pin(Scene *scene, char **cursor) {
+  uint32_t i;
+  if (!parse_index(next_token(cursor), &i) || next_token(cursor) != NULL) {
+    return scene_error(scene, "Expected pin A");
+  }
+  if (i >= scene->mass_count) {
+    return scene_error(scene, "Pinned mass is not defined yet");
+  }
+  scene->fixed[i] = true;
+  return true;
+}
+
+static _Bool scene_parse_default(Scene *scene, char **cursor) {
+  const char *name = next_token(cursor);
+  Scalar value;
+  if (name == NULL || !parse_scalar(next_token(cursor), &value) ||
+      next_token(cursor) != NULL) {
+    return scene_error(scene, "Expected default NAME VALUE");
+  }
+  if (strcmp(name, "mass") == 0 && value > SCALAR_C(0.0)) {
+    scene->default_mass = value;
+  } else if (strcmp(name, "strength") == 0) {
+    scene->default_strength = value;
+  } else if (strcmp(name, "dampening") == 0) {
+    scene->default_dampening = value;
+  } else if (strcmp(name, "max_strain") == 0 && value >= SCALAR_C(0.0)) {
+    scene->default_max_strain = value;
+  } else {
+    return scene_error(scene, "Expected a positive mass, strength, dampening "
+                              "or max_strain default");
+  }
+  return true;
+}
+
+static _Bool scene_parse_vertex(Scene *scene, char **cursor) {
+  Vec2 position;
+  Scalar z;
+  if (!parse_scalar(next_token(cursor), &position.x) ||
+      !parse_scalar(next_token(cursor), &position.y) ||
+      !parse_optional_scalar(next_token(cursor), &z)) {
+    return scene_error(scene, "Expected v X Y [Z]");
+  }
+  return scene_add_mass(scene, position, scene->default_mass, false);
+}
+
+// Springs between consecutive vertices of an OBJ polyline, closed for faces
+static _Bool scene_parse_polygon(Scene *scene, char **cursor, _Bool closed) {
+  uint32_t vertices[SCENE_MAX_POLYGON];
+  size_t count = 0;
+  for (char *token; (token = next_token(cursor)) != NULL; ++count) {
+    if (count == SCENE_MAX_POLYGON) {
+      return scene_error(scene, "Too many vertices in one statement");
+    }
+    if (!parse_obj_index(scene, token, &vertices[count])) {
+      return scene_error(scene, "Invalid vertex index");
+    }
+  }
+  if (count < 2) {
+    return scene_error(scene, "Expected at least two vertices");
+  }
+  size_t edges = closed && count > 2 ? count : count - 1;
+  for (size_t i = 0; i < edges; ++i) {
+    if (!scene_add_spring(scene, vertices[i], vertices[(i + 1) % count],
+                          scene->default_strength, scene->default_dampening,
+                          NAN)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static _Bool scene_parse_line(Scene *scene, char *line) {
+  char *cursor = line;
+  const char *keyword = next_token(&cursor);
+  if (keyword == NULL) {
+    return true;
+  } else if (strcmp(keyword, "mass") == 0) {
+    return scene_parse_mass(scene, &cursor);
+  } else if (strcmp(keyword, "spring") == 0) {
+    return scene_parse_spring(scene, &cursor);
+  } else if (strcmp(keyword, "pin") == 0) {
+    return scene_parse_pin(scene, &cursor);
+  } else if (strcmp(keyword, "default") == 0) {
+    return scene_parse_default(scene, &cursor);
+  } else if (strcmp(keyword, "v") == 0) {
+    return scene_parse_vertex(scene, &cursor);
+  } else if (strcmp(keyword, "l") == 0) {
+    return scene_parse_polygon(scene, &cursor, false);
+  } else if (strcmp(keyword, "f") == 0) {
+    return scene_parse_polygon(scene, &cursor, true);
+  }
+  // OBJ statements without a meaning here
+  static const char *ignored[] = {"vt",     "vn", "vp", "o", "g",
+                                  "s",      "mg", "usemtl", "mtllib",
+                                  "cstype", "p"};
+  for (size_t i = 0; i < sizeof(ignored) / sizeof(*ignored); ++i) {
+    if (strcmp(keyword, ignored[i]) == 0) {
+      return true;
+    }
+  }
+  return scene_error(scene, "Unknown statement");
+}
+
+static _Bool scene_read(Scene *scene, FILE *file) {
+  char *line = NULL;
+  size_t line_capacity = 0;
+  _Bool ok = true;
+  while (ok && getline(&line, &line_capacity, file) >= 0) {
+    ++scene->line;
+    ok = scene_parse_line(scene, line);
+  }
+  if (ok && ferror(file)) {
+    printf("ERROR: Cannot read %s\n", scene->path);
+    ok = false;
+  }
+  free(line);
+  if (!ok) {
+    return false;
+  }
+
+  for (size_t i = 0; i < scene->spring_count; ++i) {
+    uint32_t first = scene->first[i];
+    uint32_t second = scene->second[i];
+    if (first >= scene->mass_count || second >= scene->mass_count) {
+      printf("ERROR: %s: Spring %zu refers to a mass that does not exist\n",
+             scene->path, i);
+      return false;
+    }
+    if (isnan(scene->length[i])) {
+      scene->length[i] = vec2_length(
+          vec2_subtract(scene->position[second], scene->position[first]));
+    }
+  }
+  return true;
+}
+
+// Orders the masses and springs of the scene and adds them to the system
+static _Bool scene_build(Scene *scene, System *system, Ordering ordering) {
+  size_t mass_count = scene->mass_count;
+  size_t spring_count = scene->spring_count;
+  uint32_t *mass_order = malloc((mass_count + 1) * sizeof(*mass_order));
+  uint32_t *new_index = malloc((mass_count + 1) * sizeof(*new_index));
+  uint32_t *spring_order = malloc((spring_count + 1) * sizeof(*spring_order));
+  _Bool ok = mass_order != NULL && new_index != NULL && spring_order != NULL;
+  if (ok && ordering == ORDERING_MORTON) {
+    ok = order_morton(scene->position, mass_count, mass_order);
+  } else if (ok && ordering == ORDERING_RCM) {
+    ok = order_rcm(mass_count, scene->first, scene->second, spring_count,
+                   mass_order);
+  } else {
+    for (size_t i = 0; i < mass_count && ok; ++i) {
+      mass_order[i] = i;
+    }
+  }
+  if (ok) {
+    for (size_t i = 0; i < mass_count; ++i) {
+      new_index[mass_order[i]] = i;
+    }
+    for (size_t i = 0; i < spring_count; ++i) {
+      scene->first[i] = new_index[scene->first[i]];
+      scene->second[i] = new_index[scene->second[i]];
+    }
+    // Springs in the order of their endpoints, which also brings the springs
+    // between the same masses together
+    ok = order_edges(scene->first, scene->second, spring_count, spring_order);
+  }
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory to order the scene\n");
+    free(mass_order);
+    free(new_index);
+    free(spring_order);
+    return false;
+  }
+
+  // Duplicates are turned into self loops, which are left out
+  uint64_t previous = UINT64_MAX;
+  for (size_t i = 0; i < spring_count; ++i) {
+    uint32_t spring = spring_order[i];
+    uint32_t first = scene->first[spring];
+    uint32_t second = scene->second[spring];
+    uint64_t endpoints = first < second ? (uint64_t)first << 32 | second
+                                        : (uint64_t)second << 32 | first;
+    if (endpoints == previous) {
+      scene->first[spring] = second;
+    }
+    previous = endpoints;
+  }
+  if (ordering == ORDERING_NONE) {
+    for (size_t i = 0; i < spring_count; ++i) {
+      spring_order[i] = i;
+    }
+  }
+
+  system_clear(system);
+  system_reserve(system, mass_count, spring_count);
+  for (size_t i = 0; i < mass_count; ++i) {
+    uint32_t mass = mass_order[i];
+    system_add_mass(system, (Mass){.position = scene->position[mass],
+                                   .mass = scene->mass[mass],
+                                   .fixed = scene->fixed[mass]});
+  }
+  for (size_t i = 0; i < spring_count; ++i) {
+    uint32_t spring = spring_order[i];
+    if (scene->first[spring] == scene->second[spring]) {
+      continue;
+    }
+    system_add_spring(system,
+                      (Spring){.length = scene->length[spring],
+                               .strength = scene->strength[spring],
+                               .dampening = scene->dampening[spring],
+                               .max_strain = scene->max_strain[spring]},
+                      scene->first[spring], scene->second[spring]);
+  }
+  free(mass_order);
+  free(new_index);
+  free(spring_order);
+  return true;
+}
+
+_Bool system_load_scene(System *system, const char *path, Ordering ordering) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    printf("ERROR: Cannot open scene %s\n", path);
+    return false;
+  }
+  Scene scene = {
+      .default_mass = DEFAULT_GRID_MASS,
+      .default_strength = DEFAULT_GRID_STRENGTH,
+      .default_dampening = DEFAULT_GRID_DAMPENING,
+      .path = path,
+  };
+  _Bool ok = scene_read(&scene, file);
+  fclose(file);
+  ok = ok && scene_build(&scene, system, ordering);
+  scene_free(&scene);
+  return ok;
+}
@@ -0,0 +1,32 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "ordering.h"
+#include "springs.h"
+
+// Scenes describe arbitrary mass-spring meshes in a line based text format,
+// read one line at a time so that large files never sit in memory whole.
+// Anything after a # is a comment. Lines are one of:
+//
+//   mass X Y [MASS] [fixed]  A mass, fixed ones do not move
+//   spring A B [STRENGTH [DAMPENING [LENGTH]]]
+//                            A spring between masses A and B, counted from 0.
+//                            The length defaults to their distance.
+//   pin A                    Fixes mass A
+//   default mass|strength|dampening|max_strain VALUE
+//                            Changes the value lines after it default to.
+//                            Springs tear past their max strain, none by
+//                            default.
+//
+// The vertices and edges of Wavefront OBJ files are understood as well, so
+// meshes can come straight from modelling tools: v X Y [Z] adds a mass, and
+// l and f add springs along polylines and around faces, with indices counted
+// from 1 or backwards from -1. Other OBJ statements are ignored. Springs
+// between the same two masses are only added once.
+
+// Replaces the masses and springs of system with the scene at path, stored in
+// the given order. Returns false, leaving the system as it was, if the file
+// cannot be read or has errors, which are reported with their line.
+_Bool system_load_scene(System *system, const char *path, Ordering ordering);
+
+#endif
@@ -0,0 +1,315 @@
+#include "snapshot.h"
+#include "springs_internal.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The sections are the arrays as they are in memory
+_Static_assert(sizeof(Vec2) == 2 * sizeof(Scalar), "Vec2 must be two scalars");
+_Static_assert(sizeof(_Bool) == 1, "flags are stored as single bytes");
+
+typedef enum {
+  SECTION_POSITION = 0,
+  SECTION_PREVIOUS_POSITION,
+  SECTION_VELOCITY,
+  SECTION_FORCE,
+  SECTION_INVERSE_MASS,
+  SECTION_FIXED,
+  SECTION_FIRST,
+  SECTION_SECOND,
+  SECTION_LENGTH,
+  SECTION_STRENGTH,
+  SECTION_DAMPENING,
+  SECTION_MAX_STRAIN,
+  SECTION_CUT,
+  SECTION_ID,
+  SNAPSHOT_SECTION_COUNT,
+} SnapshotSectionIndex;
+
+typedef struct {
+  void *data;
+  size_t element_size;
+  _Bool per_spring;
+} SnapshotSection;
+
+static void snapshot_sections(const System *system,
+                              SnapshotSection sections[]) {
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  SnapshotSection all[SNAPSHOT_SECTION_COUNT] = {
+      [SECTION_POSITION] = {masses->position, sizeof(Vec2), false},
+      [SECTION_PREVIOUS_POSITION] = {masses->previous_position, sizeof(Vec2),
+                                     false},
+      [SECTION_VELOCITY] = {masses->velocity, sizeof(Vec2), false},
+      [SECTION_FORCE] = {masses->force, sizeof(Vec2), false},
+      [SECTION_INVERSE_MASS] = {masses->inverse_mass, sizeof(Scalar), false},
+      [SECTION_FIXED] = {masses->fixed, sizeof(_Bool), false},
+      [SECTION_FIRST] = {springs->first, sizeof(uint32_t), true},
+      [SECTION_SECOND] = {springs->second, sizeof(uint32_t), true},
+      [SECTION_LENGTH] = {springs->length, sizeof(Scalar), true},
+      [SECTION_STRENGTH] = {springs->strength, sizeof(Scalar), true},
+      [SECTION_DAMPENING] = {springs->dampening, sizeof(Scalar), true},
+      [SECTION_MAX_STRAIN] = {springs->max_strain, sizeof(Scalar), true},
+      [SECTION_CUT] = {springs->cut, sizeof(_Bool), true},
+      [SECTION_ID] = {springs->id, sizeof(uint32_t), true},
+  };
+  memcpy(sections, all, sizeof(all));
+}
+
+static uint64_t snapshot_align(uint64_t offset) {
+  return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT *
+         SNAPSHOT_ALIGNMENT;
+}
+
+// Offsets of the sections, and the file size after the last one
+static uint64_t snapshot_layout(uint64_t mass_count, uint64_t spring_count,
+                                const SnapshotSection sections[],
+                                uint64_t offsets[]) {
+  uint64_t offset = snapshot_align(sizeof(SnapshotHeader));
+  for (size_t i = 0; i < SNAPSHOT_SECTION_COUNT; ++i) {
+    offsets[i] = offset;
+    uint64_t count = sections[i].per_spring ? spring_count : mass_count;
+    offset = snapshot_align(offset + count * sections[i].element_size);
+  }
+  return offset;
+}
+
+_Bool system_save_snapshot(const System *system, const char *path) {
+  if (!host_little_endian()) {
+    printf("ERROR: Snapshots are only supported on little endian hosts\n");
+    return false;
+  }
+  SnapshotSection sections[SNAPSHOT_SECTION_COUNT];
+  uint64_t offsets[SNAPSHOT_SECTION_COUNT];
+  snapshot_sections(system, sections);
+  SnapshotHeader header = {
+      .magic = SNAPSHOT_MAGIC,
+      .version = SNAPSHOT_VERSION,
+      .header_size = sizeof(SnapshotHeader),
+      .file_size = snapshot_layout(system->mass_count, system->spring_count,
+                                   sections, offsets),
+      .mass_count = system->mass_count,
+      .spring_count = system->spring_count,
+      .active_spring_count = system->active_spring_count,
+      .xpbd_iterations = system->xpbd_iterations,
+      .spring_kernel = system->spring_kernel,
+      .integrator = system->integrator,
+      .solver = system->solver,
+      .xpbd_method = system->xpbd_method,
+      .compact_springs = system->compact_springs,
+      .scalar_size = sizeof(Scalar),
+      .time = system->time,
+      .spring_id_count = system->spring_id_count,
+  };
+
+  size_t path_length = strlen(path);
+  char *partial_path = malloc(path_length + sizeof(".partial"));
+  if (partial_path == NULL) {
+    printf("ERROR: Cannot allocate memory for the snapshot path\n");
+    return false;
+  }
+  memcpy(partial_path, path, path_length);
+  memcpy(partial_path + path_length, ".partial", sizeof(".partial"));
+  FILE *file = fopen(partial_path, "wb");
+  if (file == NULL) {
+    printf("ERROR: Cannot open %s for writing\n", partial_path);
+    free(partial_path);
+    return false;
+  }
+
+  static const uint8_t padding[SNAPSHOT_ALIGNMENT] = {0};
+  _Bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  uint64_t offset = sizeof(header);
+  for (size_t i = 0; i < SNAPSHOT_SECTION_COUNT && ok; ++i) {
+    ok = fwrite(padding, 1, offsets[i] - offset, file) == offsets[i] - offset;
+    size_t count =
+        sections[i].per_spring ? system->spring_count : system->mass_count;
+    ok = ok && fwrite(sections[i].data, sections[i].element_size, count,
+                      file) == count;
+    offset = offsets[i] + count * sections[i].element_size;
+  }
+  ok = ok && fwrite(padding, 1, header.file_size - offset, file) ==
+                 header.file_size - offset;
+  ok = fclose(file) == 0 && ok;
+  if (ok && rename(partial_path, path) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    printf("ERROR: Cannot write snapshot %s\n", path);
+    remove(partial_path);
+  }
+  free(partial_path);
+  return ok;
+}
+
+static _Bool snapshot_header_valid(const SnapshotHeader *header,
+                                   uint64_t file_size) {
+  uint64_t offsets[SNAPSHOT_SECTION_COUNT];
+  SnapshotSection sections[SNAPSHOT_SECTION_COUNT];
+  snapshot_sections(&(System){0}, sections);
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+    printf("ERROR: Not a snapshot\n");
+    return false;
+  }
+  if (header->version != SNAPSHOT_VERSION ||
+      header->header_size != sizeof(SnapshotHeader)) {
+    printf("ERROR: Unsupported snapshot version %u\n", header->version);
+    return false;
+  }
+  if (header->scalar_size != sizeof(Scalar)) {
+    printf("ERROR: Snapshot holds %u byte scalars, this build uses %s\n",
+           header->scalar_size, SCALAR_NAME);
+    return false;
+  }
+  // The same limits system_add_mass and system_add_spring enforce
+  if (header->mass_count >= UINT32_MAX - 1 ||
+      header->spring_count >= UINT32_MAX / 2 ||
+      header->spring_id_count >= UINT32_MAX / 2 ||
+      header->active_spring_count > header->spring_count ||
+      header->spring_id_count < header->spring_count ||
+      header->file_size != file_size ||
+      snapshot_layout(header->mass_count, header->spring_count, sections,
+                      offsets) != file_size) {
+    printf("ERROR: Snapshot is truncated or has inconsistent sizes\n");
+    return false;
+  }
+  if (header->spring_kernel > SPRING_KERNEL_REFERENCE ||
+      header->integrator >= INTEGRATOR_COUNT ||
+      header->solver >= SOLVER_COUNT ||
+      header->xpbd_method >= XPBD_METHOD_COUNT ||
+      header->compact_springs > 1) {
+    printf("ERROR: Snapshot has unknown solver settings\n");
+    return false;
+  }
+  return true;
+}
+
+// Checks what the simulation relies on without checking itself: flags are
+// zero or one, endpoints are masses, the ids are each used once, and springs
+// past the active ones are cut
+static _Bool snapshot_sections_valid(const SnapshotHeader *header,
+                                     const uint8_t *base,
+                                     const uint64_t offsets[]) {
+  size_t mass_count = header->mass_count;
+  size_t spring_count = header->spring_count;
+  size_t id_count = header->spring_id_count;
+  const uint8_t *fixed = base + offsets[SECTION_FIXED];
+  const uint32_t *first = (const uint32_t *)(base + offsets[SECTION_FIRST]);
+  const uint32_t *second = (const uint32_t *)(base + offsets[SECTION_SECOND]);
+  const uint8_t *cut = base + offsets[SECTION_CUT];
+  const uint32_t *id = (const uint32_t *)(base + offsets[SECTION_ID]);
+
+  for (size_t i = 0; i < mass_count; ++i) {
+    if (fixed[i] > 1) {
+      printf("ERROR: Snapshot has an invalid fixed flag\n");
+      return false;
+    }
+  }
+  uint8_t *id_seen = calloc(id_count > 0 ? id_count : 1, 1);
+  if (id_seen == NULL) {
+    printf("ERROR: Cannot allocate memory to check the snapshot\n");
+    return false;
+  }
+  _Bool ok = true;
+  for (size_t i = 0; i < spring_count && ok; ++i) {
+    ok = first[i] < mass_count && second[i] < mass_count && cut[i] <= 1 &&
+         id[i] < id_count && !id_seen[id[i]] &&
+         (i < header->active_spring_count || cut[i]);
+    if (ok) {
+      id_seen[id[i]] = true;
+    }
+  }
+  free(id_seen);
+  if (!ok) {
+    printf("ERROR: Snapshot has invalid springs\n");
+  }
+  return ok;
+}
+
+_Bool system_load_snapshot(System *system, const char *path) {
+  if (!host_little_endian()) {
+    printf("ERROR: Snapshots are only supported on little endian hosts\n");
+    return false;
+  }
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0) {
+    printf("ERROR: Cannot open snapshot %s\n", path);
+    return false;
+  }
+  struct stat status;
+  if (fstat(descriptor, &status) != 0 ||
+      (uint64_t)status.st_size < sizeof(SnapshotHeader)) {
+    printf("ERROR: Snapshot %s is too short\n", path);
+    close(descriptor);
+    return false;
+  }
+  size_t file_size = status.st_size;
+  void *mapped = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  close(descriptor);
+  if (mapped == MAP_FAILED) {
+    printf("ERROR: Cannot map snapshot %s\n", path);
+    return false;
+  }
+  madvise(mapped, file_size, MADV_SEQUENTIAL);
+
+  // The mapping is page aligned, so every section is aligned for its type
+  const uint8_t *base = mapped;
+  SnapshotHeader header;
+  memcpy(&header, base, sizeof(header));
+  uint64_t offsets[SNAPSHOT_SECTION_COUNT];
+  SnapshotSection sections[SNAPSHOT_SECTION_COUNT];
+  snapshot_sections(system, sections);
+  _Bool ok = snapshot_header_valid(&header, file_size);
+  if (ok) {
+    snapshot_layout(header.mass_count, header.spring_count, sections,
+                    offsets);
+    ok = snapshot_sections_valid(&header, base, offsets);
+  }
+  // The arrays indexed by spring id need room for the free ids as well
+  if (ok) {
+    system_reserve(system, header.mass_count, header.spring_id_count);
+    ok = system->mass_capacity >= header.mass_count &&
+         system->spring_capacity >= header.spring_id_count;
+  }
+  if (!ok) {
+    munmap(mapped, file_size);
+    return false;
+  }
+
+  // Nothing can fail from here on. Reserving may have moved the arrays.
+  system_clear(system);
+  snapshot_sections(system, sections);
+  for (size_t i = 0; i < SNAPSHOT_SECTION_COUNT; ++i) {
+    size_t count =
+        sections[i].per_spring ? header.spring_count : header.mass_count;
+    if (count > 0) { // Arrays of systems without springs may be NULL
+      memcpy(sections[i].data, base + offsets[i],
+             count * sections[i].element_size);
+    }
+  }
+  munmap(mapped, file_size);
+
+  system->mass_count = header.mass_count;
+  system->spring_count = header.spring_count;
+  system->active_spring_count = header.active_spring_count;
+  system->spring_id_count = header.spring_id_count;
+  for (size_t i = 0; i < system->spring_count; ++i) {
+    system->springs.force[i] = vec2_zero();
+  }
+  system_rebuild_ids(system);
+  system->spring_kernel = header.spring_kernel;
+  system->integrator = header.integrator;
+  system->solver = header.solver;
+  system->xpbd_method = header.xpbd_method;
+  system->xpbd_iterations = header.xpbd_iterations;
+  system->compact_springs = header.compact_springs;
+  system->time = header.time;
+  system_invalidate_topology(system);
+  system->hash_valid = false;
+  system_invalidate_islands(system);
+  return true;
+}
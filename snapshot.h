@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "springs.h"
+
+// Binary snapshots of a system: the masses, the springs in their stored order
+// with their ids and cut flags, the solver settings and the simulated time.
+// Force fields and obstacles are not saved, they stay as the system has them.
+// Masses get the ids of their indices on loading, so handles from before do
+// not carry over.
+// Files are little endian and laid out like the arrays in memory, a header
+// followed by one section per array, so restoring copies each section in one
+// go.
+//
+// The header is followed by these sections, in this order, each starting at
+// a multiple of SNAPSHOT_ALIGNMENT:
+//   mass position, previous position, velocity, force (2 x scalar each),
+//   inverse mass (scalar), fixed (uint8),
+//   spring first, second (uint32), length, strength, dampening, max strain
+//   (scalar), cut (uint8), id (uint32).
+// Scalars are float32, or float64 in double builds, and snapshots only load
+// into a build of the same precision.
+
+#define SNAPSHOT_MAGIC "SPRINGS"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_ALIGNMENT 64
+
+typedef struct {
+  char magic[8]; // SNAPSHOT_MAGIC, zero padded
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t file_size;
+  uint64_t mass_count;
+  uint64_t spring_count;
+  uint64_t active_spring_count;
+  uint64_t xpbd_iterations;
+  uint32_t spring_kernel;
+  uint32_t integrator;
+  uint32_t solver;
+  uint32_t xpbd_method;
+  uint8_t compact_springs;
+  uint8_t scalar_size; // Bytes per scalar, 4 or 8
+  uint8_t reserved[6];
+  double time; // Simulated time
+  uint64_t spring_id_count; // Ids in use or freed by removing springs
+} SnapshotHeader;
+
+// Writes the system to path. The file is written next to it first and renamed
+// over it when complete, so an interrupted checkpoint keeps the previous one.
+_Bool system_save_snapshot(const System *system, const char *path);
+// Replaces the masses, springs, solver settings and time of the system with
+// the ones saved at path, which is memory mapped and checked before anything
+// changes. Threads, force fields and other runtime state are kept. Returns
+// false, leaving the system as it was, if the file cannot be read or is not a
+// valid snapshot.
+_Bool system_load_snapshot(System *system, const char *path);
+
+#endif
@@ -0,0 +1,251 @@
+#include "spatial_hash.h"
+#include "array.h"
+#include <math.h>
+#include <stdio.h>
+
+#define SPATIAL_HASH_MIN_BUCKETS 64
+#define SPATIAL_HASH_ITEMS_PER_BUCKET 2
+// Cell coordinates are clamped to this, which also catches positions that
+// have blown up to infinity or NaN
+#define SPATIAL_HASH_CELL_LIMIT SCALAR_C(1e9)
+#define SPATIAL_HASH_ROW_MULTIPLIER 2654435761u
+// Box queries with more rows sharing buckets than this visit every item
+#define SPATIAL_HASH_MAX_ALIASES 16
+
+// Cells of a row that share their buckets with the cells offset further along
+// a row rows earlier
+typedef struct {
+  int32_t rows;
+  int64_t offset;
+} SpatialHashAlias;
+
+static int32_t spatial_hash_cell(const SpatialHash *hash, Scalar coordinate) {
+  Scalar cell = coordinate * hash->inverse_cell_size;
+  if (!(cell > -SPATIAL_HASH_CELL_LIMIT)) {
+    return -SPATIAL_HASH_CELL_LIMIT;
+  }
+  if (!(cell < SPATIAL_HASH_CELL_LIMIT)) {
+    return SPATIAL_HASH_CELL_LIMIT;
+  }
+  // Rounds toward minus infinity without a call into libm
+  int32_t truncated = cell;
+  return truncated - (truncated > cell);
+}
+
+static size_t spatial_hash_bucket(const SpatialHash *hash, int32_t x,
+                                  int32_t y) {
+  // Neighbouring cells of a row land in neighbouring buckets, which keeps
+  // building and querying cache friendly for meshes laid out by rows
+  uint32_t h = (uint32_t)x + (uint32_t)y * SPATIAL_HASH_ROW_MULTIPLIER;
+  return h & (hash->bucket_count - 1);
+}
+
+_Bool spatial_hash_build(SpatialHash *hash, size_t count, Scalar cell_size,
+                         SpatialHashPoint point, const void *context) {
+  hash->valid = false;
+  hash->cell_size = cell_size;
+  hash->inverse_cell_size = SCALAR_C(1.0) / cell_size;
+  hash->bucket_count = SPATIAL_HASH_MIN_BUCKETS;
+  while (hash->bucket_count * SPATIAL_HASH_ITEMS_PER_BUCKET < count) {
+    hash->bucket_count *= 2;
+  }
+
+  _Bool ok = true;
+  if (hash->bucket_count + 1 > hash->bucket_capacity) {
+    ARRAY_RESIZE(hash->bucket_offset, hash->bucket_count + 1, ok);
+    if (ok) {
+      hash->bucket_capacity = hash->bucket_count + 1;
+    }
+  }
+  if (ok && count > hash->item_capacity) {
+    ARRAY_RESIZE(hash->items, count, ok);
+    ARRAY_RESIZE(hash->item_bucket, count, ok);
+    if (ok) {
+      hash->item_capacity = count;
+    }
+  }
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory for spatial hash\n");
+    return false;
+  }
+
+  size_t *offset = hash->bucket_offset;
+  for (size_t b = 0; b <= hash->bucket_count; ++b) {
+    offset[b] = 0;
+  }
+  hash->reach = SCALAR_C(0.0);
+  for (size_t i = 0; i < count; ++i) {
+    Vec2 p;
+    Scalar reach;
+    if (!point(context, i, &p, &reach)) {
+      hash->item_bucket[i] = UINT32_MAX;
+      continue;
+    }
+    size_t b = spatial_hash_bucket(hash, spatial_hash_cell(hash, p.x),
+                                   spatial_hash_cell(hash, p.y));
+    hash->item_bucket[i] = b;
+    ++offset[b + 1];
+    hash->reach = reach > hash->reach ? reach : hash->reach;
+  }
+  for (size_t b = 1; b <= hash->bucket_count; ++b) {
+    offset[b] += offset[b - 1];
+  }
+  hash->item_count = offset[hash->bucket_count];
+  // Same fill and shift back as the spring adjacency
+  for (size_t i = 0; i < count; ++i) {
+    if (hash->item_bucket[i] != UINT32_MAX) {
+      hash->items[offset[hash->item_bucket[i]]++] = i;
+    }
+  }
+  for (size_t b = hash->bucket_count; b > 0; --b) {
+    offset[b] = offset[b - 1];
+  }
+  offset[0] = 0;
+
+  hash->valid = true;
+  return true;
+}
+
+static _Bool spatial_hash_visit_all(const SpatialHash *hash,
+                                    SpatialHashVisit visit, void *context) {
+  for (size_t j = 0; j < hash->item_count; ++j) {
+    if (!visit(context, hash->items[j])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Visits the buckets of cells x0 to x1 in row y, skipping the cells that
+// alias a cell of the rows above within the same span. Returns false once a
+// visit asks to stop.
+static _Bool spatial_hash_visit_row(const SpatialHash *hash, int32_t y,
+                                    int32_t x0, int32_t x1, int32_t y0,
+                                    const SpatialHashAlias *aliases,
+                                    size_t alias_count, SpatialHashVisit visit,
+                                    void *context) {
+  for (int32_t x = x0; x <= x1; ++x) {
+    _Bool seen = false;
+    for (size_t k = 0; k < alias_count && !seen; ++k) {
+      int64_t other = x + aliases[k].offset;
+      seen = y - aliases[k].rows >= y0 && other >= x0 && other <= x1;
+    }
+    if (seen) {
+      continue;
+    }
+    size_t b = spatial_hash_bucket(hash, x, y);
+    for (size_t j = hash->bucket_offset[b]; j < hash->bucket_offset[b + 1];
+         ++j) {
+      if (!visit(context, hash->items[j])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Lists the row distances of the box at which cells land in the same bucket.
+// Cell x of row y shares its bucket with cell x + rows * multiplier of row
+// y - rows modulo the bucket count, which within a narrow box is rare. Returns
+// false if there are more than SPATIAL_HASH_MAX_ALIASES.
+static _Bool spatial_hash_aliases(const SpatialHash *hash, int32_t width,
+                                  int32_t height, SpatialHashAlias *aliases,
+                                  size_t *alias_count) {
+  *alias_count = 0;
+  for (int32_t rows = 1; rows < height; ++rows) {
+    int64_t offset = ((uint32_t)rows * SPATIAL_HASH_ROW_MULTIPLIER) &
+                     (hash->bucket_count - 1);
+    int64_t wrapped[2] = {offset, offset - (int64_t)hash->bucket_count};
+    for (int k = 0; k < 2; ++k) {
+      if (wrapped[k] > -width && wrapped[k] < width) {
+        if (*alias_count == SPATIAL_HASH_MAX_ALIASES) {
+          return false;
+        }
+        aliases[(*alias_count)++] = (SpatialHashAlias){rows, wrapped[k]};
+      }
+    }
+  }
+  return true;
+}
+
+void spatial_hash_query(const SpatialHash *hash, Vec2 min, Vec2 max,
+                        SpatialHashVisit visit, void *context) {
+  if (!hash->valid || hash->item_count == 0) {
+    return;
+  }
+  int32_t x0 = spatial_hash_cell(hash, scalar_min(min.x, max.x) - hash->reach);
+  int32_t y0 = spatial_hash_cell(hash, scalar_min(min.y, max.y) - hash->reach);
+  int32_t x1 = spatial_hash_cell(hash, scalar_max(min.x, max.x) + hash->reach);
+  int32_t y1 = spatial_hash_cell(hash, scalar_max(min.y, max.y) + hash->reach);
+
+  // A box of more cells than buckets is cheaper to answer with every item
+  double cells = ((double)x1 - x0 + 1) * ((double)y1 - y0 + 1);
+  SpatialHashAlias aliases[SPATIAL_HASH_MAX_ALIASES];
+  size_t alias_count;
+  if (cells >= hash->bucket_count ||
+      !spatial_hash_aliases(hash, x1 - x0 + 1, y1 - y0 + 1, aliases,
+                            &alias_count)) {
+    spatial_hash_visit_all(hash, visit, context);
+    return;
+  }
+  for (int32_t y = y0; y <= y1; ++y) {
+    if (!spatial_hash_visit_row(hash, y, x0, x1, y0, aliases, alias_count,
+                                visit, context)) {
+      return;
+    }
+  }
+}
+
+void spatial_hash_query_segment(const SpatialHash *hash, Vec2 start, Vec2 end,
+                                Scalar radius, SpatialHashVisit visit,
+                                void *context) {
+  if (!hash->valid || hash->item_count == 0) {
+    return;
+  }
+  Scalar margin = radius + hash->reach;
+  if (start.y > end.y) {
+    Vec2 swap = start;
+    start = end;
+    end = swap;
+  }
+  int32_t y0 = spatial_hash_cell(hash, start.y - margin);
+  int32_t y1 = spatial_hash_cell(hash, end.y + margin);
+  Scalar dy = end.y - start.y;
+  Scalar slope = dy > SCALAR_C(0.0) ? (end.x - start.x) / dy : SCALAR_C(0.0);
+
+  // Rows are visited over the cells the segment crosses within the row's band
+  // widened by the margin, which is a strip around the segment
+  double cells = 0.0;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int32_t y = y0; y <= y1; ++y) {
+      Scalar band_min =
+          scalar_max((Scalar)y * hash->cell_size - margin, start.y);
+      Scalar band_max =
+          scalar_min((Scalar)(y + 1) * hash->cell_size + margin, end.y);
+      Scalar x_a = dy > SCALAR_C(0.0) ? start.x + (band_min - start.y) * slope
+                                      : start.x;
+      Scalar x_b = dy > SCALAR_C(0.0) ? start.x + (band_max - start.y) * slope
+                                      : end.x;
+      int32_t x0 = spatial_hash_cell(hash, scalar_min(x_a, x_b) - margin);
+      int32_t x1 = spatial_hash_cell(hash, scalar_max(x_a, x_b) + margin);
+      if (pass == 0) {
+        cells += (double)x1 - x0 + 1;
+      } else if (!spatial_hash_visit_row(hash, y, x0, x1, y0, NULL, 0, visit,
+                                         context)) {
+        return;
+      }
+    }
+    // A strip of more cells than buckets is cheaper to answer with every item
+    if (pass == 0 && cells >= hash->bucket_count) {
+      spatial_hash_visit_all(hash, visit, context);
+      return;
+    }
+  }
+}
+
+void spatial_hash_free(SpatialHash *hash) {
+  free(hash->bucket_offset);
+  free(hash->items);
+  free(hash->item_bucket);
+  *hash = (SpatialHash){0};
+}
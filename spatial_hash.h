@@ -0,0 +1,48 @@
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H
+
+#include "vec2.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Gives the point item i is bucketed by and how far the item reaches from it,
+// or returns false to leave the item out
+typedef _Bool (*SpatialHashPoint)(const void *context, size_t i, Vec2 *point,
+                                  Scalar *reach);
+// Called for the items of the buckets a query covers, return false to stop
+typedef _Bool (*SpatialHashVisit)(void *context, uint32_t item);
+
+// Uniform grid over the plane whose cells are hashed into a table of buckets,
+// so it covers any area with memory for the items only. Built in one pass with
+// a counting sort, which keeps the items of a bucket in increasing order.
+typedef struct {
+  Scalar cell_size;
+  Scalar inverse_cell_size;
+  Scalar reach;          // Largest reach of any item
+  size_t bucket_count;   // A power of two
+  size_t *bucket_offset; // bucket_count + 1 offsets into items
+  uint32_t *items;
+  uint32_t *item_bucket; // Bucket of every item while building
+  size_t item_count;
+  size_t bucket_capacity;
+  size_t item_capacity;
+  _Bool valid;
+} SpatialHash;
+
+// Buckets items [0, count) by the points given by point
+_Bool spatial_hash_build(SpatialHash *hash, size_t count, Scalar cell_size,
+                         SpatialHashPoint point, const void *context);
+// Visits at least every item that may reach into the box from min to max, in
+// either order, and each of them once
+void spatial_hash_query(const SpatialHash *hash, Vec2 min, Vec2 max,
+                        SpatialHashVisit visit, void *context);
+// Same for the items that may reach within radius of the segment from start to
+// end, covering only the cells along the segment rather than its whole box.
+// Cells sharing a bucket can visit an item more than once.
+void spatial_hash_query_segment(const SpatialHash *hash, Vec2 start, Vec2 end,
+                                Scalar radius, SpatialHashVisit visit,
+                                void *context);
+void spatial_hash_free(SpatialHash *hash);
+
+#endif
@@ -0,0 +1,1133 @@
+#include "springs.h"
+#include "array.h"
+#include "profiler.h"
+#include "springs_internal.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SWAP(type, a, b)                                                       \
+  do {                                                                         \
+    type swapped = (a);                                                        \
+    (a) = (b);                                                                 \
+    (b) = swapped;                                                             \
+  } while (0)
+
+PhysicsClock physics_clock_init(double frame_rate, size_t substeps,
+                                double max_accumulated) {
+  return (PhysicsClock){.step = 1.0 / (frame_rate * substeps),
+                        .max_accumulated = max_accumulated};
+}
+
+size_t physics_clock_advance(PhysicsClock *clock, double frame_time) {
+  clock->accumulator += frame_time;
+  if (clock->accumulator > clock->max_accumulated) {
+    clock->accumulator = clock->max_accumulated;
+  }
+  // Without the tolerance, rounding would turn a frame of exactly N steps into
+  // N - 1 steps now and an extra one on the next frame
+  size_t steps = clock->accumulator / clock->step + 1e-6;
+  clock->accumulator -= steps * clock->step;
+  if (clock->accumulator < 0.0) {
+    clock->accumulator = 0.0;
+  }
+  return steps;
+}
+
+double physics_clock_alpha(const PhysicsClock *clock) {
+  return clock->accumulator / clock->step;
+}
+
+static _Bool system_resize_masses(System *system, size_t capacity) {
+  MassArrays *masses = &system->masses;
+  _Bool ok = true;
+  ARRAY_RESIZE(masses->position, capacity, ok);
+  ARRAY_RESIZE(masses->previous_position, capacity, ok);
+  ARRAY_RESIZE(masses->velocity, capacity, ok);
+  ARRAY_RESIZE(masses->force, capacity, ok);
+  ARRAY_RESIZE(masses->inverse_mass, capacity, ok);
+  ARRAY_RESIZE(masses->fixed, capacity, ok);
+  ARRAY_RESIZE(masses->id, capacity, ok);
+  ARRAY_RESIZE(masses->slot, capacity, ok);
+  ARRAY_RESIZE(masses->generation, capacity, ok);
+  ARRAY_RESIZE(masses->spring_list, capacity, ok);
+  ARRAY_RESIZE(masses->free_id, capacity, ok);
+  // New ids start at generation zero
+  for (size_t i = system->mass_capacity; ok && i < capacity; ++i) {
+    masses->generation[i] = 0;
+  }
+  // A failed shrink leaves the larger arrays in place, which is still safe
+  if (ok || capacity < system->mass_capacity) {
+    system->mass_capacity = capacity;
+  }
+  return ok;
+}
+
+static _Bool system_resize_springs(System *system, size_t capacity) {
+  SpringArrays *springs = &system->springs;
+  _Bool ok = true;
+  ARRAY_RESIZE(springs->first, capacity, ok);
+  ARRAY_RESIZE(springs->second, capacity, ok);
+  ARRAY_RESIZE(springs->length, capacity, ok);
+  ARRAY_RESIZE(springs->strength, capacity, ok);
+  ARRAY_RESIZE(springs->dampening, capacity, ok);
+  ARRAY_RESIZE(springs->max_strain, capacity, ok);
+  ARRAY_RESIZE(springs->cut, capacity, ok);
+  ARRAY_RESIZE(springs->force, capacity, ok);
+  ARRAY_RESIZE(springs->id, capacity, ok);
+  ARRAY_RESIZE(springs->slot, capacity, ok);
+  ARRAY_RESIZE(springs->generation, capacity, ok);
+  ARRAY_RESIZE(springs->free_id, capacity, ok);
+  ARRAY_RESIZE(springs->next, 2 * capacity, ok);
+  for (size_t i = system->spring_capacity; ok && i < capacity; ++i) {
+    springs->generation[i] = 0;
+  }
+  if (ok || capacity < system->spring_capacity) {
+    system->spring_capacity = capacity;
+  }
+  return ok;
+}
+
+void system_reserve(System *system, size_t mass_capacity,
+                    size_t spring_capacity) {
+  if (mass_capacity > system->mass_capacity &&
+      !system_resize_masses(system, mass_capacity)) {
+    printf("ERROR: Cannot allocate memory for masses\n");
+  }
+  if (spring_capacity > system->spring_capacity &&
+      !system_resize_springs(system, spring_capacity)) {
+    printf("ERROR: Cannot allocate memory for springs\n");
+  }
+}
+
+void system_shrink(System *system) {
+  // The arrays indexed by id also hold the free ids and the generations
+  system_resize_masses(system, system->mass_generation_count);
+  system_resize_springs(system, system->spring_generation_count);
+}
+
+void system_set_thread_count(System *system, size_t thread_count) {
+  if (system->pool != NULL) {
+    thread_pool_free(system->pool);
+    free(system->pool);
+    system->pool = NULL;
+  }
+  if (thread_count <= 1) {
+    return;
+  }
+
+  system->pool = malloc(sizeof(*system->pool));
+  if (system->pool == NULL ||
+      !thread_pool_init(system->pool, thread_count - 1)) {
+    printf("ERROR: Cannot start worker threads\n");
+    free(system->pool);
+    system->pool = NULL;
+  }
+}
+
+void system_free(System *system) {
+  system_resize_masses(system, 0);
+  system_resize_springs(system, 0);
+  system->mass_count = 0;
+  system->spring_count = 0;
+  system->active_spring_count = 0;
+  system->mass_id_count = 0;
+  system->spring_id_count = 0;
+  system->free_mass_id_count = 0;
+  system->free_spring_id_count = 0;
+  system->mass_generation_count = 0;
+  system->spring_generation_count = 0;
+  free(system->adjacency_offset);
+  free(system->adjacency);
+  system->adjacency_offset = NULL;
+  system->adjacency = NULL;
+  system->adjacency_valid = false;
+  free(system->color_order);
+  system->color_order = NULL;
+  system->coloring_valid = false;
+  spatial_hash_free(&system->mass_hash);
+  spatial_hash_free(&system->spring_hash);
+  free(system->hash_position);
+  system->hash_position = NULL;
+  system->hash_valid = false;
+  system_free_islands(system);
+  system_free_collisions(system);
+  free(system->mass_scratch);
+  free(system->spring_scratch);
+  free(system->chunk_sums);
+  free(system->tear_flags);
+  system->mass_scratch = NULL;
+  system->spring_scratch = NULL;
+  system->chunk_sums = NULL;
+  system->tear_flags = NULL;
+  system->mass_scratch_capacity = 0;
+  system->spring_scratch_capacity = 0;
+  system->chunk_sum_capacity = 0;
+  system->tear_flag_capacity = 0;
+  free(system->tear_events);
+  system->tear_events = NULL;
+  system->tear_event_count = 0;
+  system->tear_event_capacity = 0;
+  system_set_thread_count(system, 1);
+}
+
+static size_t system_grown_capacity(size_t capacity) {
+  return capacity < SYSTEM_MIN_CAPACITY ? SYSTEM_MIN_CAPACITY : 2 * capacity;
+}
+
+static Vec2 mass_constrain_force(Vec2 force) {
+  if (vec2_dot(force, force) > FORCES_CONSTRAINT * FORCES_CONSTRAINT) {
+    PROFILE_COUNT(PROFILE_COUNTER_CLAMPED_FORCES, 1);
+  }
+  return vec2_clamp_value(force, SCALAR_C(0.0), FORCES_CONSTRAINT);
+}
+
+// Each force is clamped individually as it is applied, so the accumulated net
+// force behaves as if every contribution had been constrained separately.
+static Vec2 force_accumulate(Vec2 total, Vec2 force) {
+  if (CONSTRAIN_FORCES) {
+    force = mass_constrain_force(force);
+  }
+  return vec2_add(total, force);
+}
+
+static void mass_force_append(MassArrays *masses, size_t i, Vec2 force) {
+  masses->force[i] = force_accumulate(masses->force[i], force);
+}
+
+MassHandle system_add_mass(System *system, Mass mass) {
+  // Springs store their endpoints as 32 bit indices, and HANDLE_NONE is not
+  // an id
+  if (system->mass_count >= UINT32_MAX - 1) {
+    printf("ERROR: Cannot add more masses to the system\n");
+    PROFILE_COUNT(PROFILE_COUNTER_DROPPED, 1);
+    return (MassHandle){HANDLE_NONE, 0};
+  }
+  if (system->mass_count >= system->mass_capacity &&
+      !system_resize_masses(system,
+                            system_grown_capacity(system->mass_capacity))) {
+    printf("ERROR: Cannot add more masses to the system\n");
+    PROFILE_COUNT(PROFILE_COUNTER_DROPPED, 1);
+    return (MassHandle){HANDLE_NONE, 0};
+  }
+
+  MassArrays *masses = &system->masses;
+  size_t i = system->mass_count++;
+  masses->position[i] = mass.position;
+  masses->previous_position[i] = mass.position;
+  masses->velocity[i] = mass.velocity;
+  masses->force[i] = vec2_zero();
+  masses->inverse_mass[i] = 1 / mass.mass;
+  masses->fixed[i] = mass.fixed;
+  uint32_t id = system_assign_mass_id(system, i);
+  system_invalidate_topology(system);
+  system->hash_valid = false;
+  system_invalidate_islands(system);
+  return (MassHandle){id, masses->generation[id]};
+}
+
+void mass_swap(MassArrays *masses, size_t a, size_t b) {
+  if (a == b) {
+    return;
+  }
+  SWAP(Vec2, masses->position[a], masses->position[b]);
+  SWAP(Vec2, masses->previous_position[a], masses->previous_position[b]);
+  SWAP(Vec2, masses->velocity[a], masses->velocity[b]);
+  SWAP(Vec2, masses->force[a], masses->force[b]);
+  SWAP(Scalar, masses->inverse_mass[a], masses->inverse_mass[b]);
+  SWAP(_Bool, masses->fixed[a], masses->fixed[b]);
+  SWAP(uint32_t, masses->id[a], masses->id[b]);
+  masses->slot[masses->id[a]] = a;
+  masses->slot[masses->id[b]] = b;
+}
+
+void spring_swap(SpringArrays *springs, size_t a, size_t b) {
+  if (a == b) {
+    return;
+  }
+  SWAP(uint32_t, springs->first[a], springs->first[b]);
+  SWAP(uint32_t, springs->second[a], springs->second[b]);
+  SWAP(Scalar, springs->length[a], springs->length[b]);
+  SWAP(Scalar, springs->strength[a], springs->strength[b]);
+  SWAP(Scalar, springs->dampening[a], springs->dampening[b]);
+  SWAP(Scalar, springs->max_strain[a], springs->max_strain[b]);
+  SWAP(_Bool, springs->cut[a], springs->cut[b]);
+  SWAP(Vec2, springs->force[a], springs->force[b]);
+  SWAP(uint32_t, springs->id[a], springs->id[b]);
+  springs->slot[springs->id[a]] = a;
+  springs->slot[springs->id[b]] = b;
+}
+
+SpringHandle system_add_spring(System *system, Spring spring, size_t m1,
+                               size_t m2) {
+  if (system->mass_count <= m1) {
+    printf("ERROR: Index to first mass out of range\n");
+    return (SpringHandle){HANDLE_NONE, 0};
+  }
+  if (system->mass_count <= m2) {
+    printf("ERROR: Index to second mass out of range\n");
+    return (SpringHandle){HANDLE_NONE, 0};
+  }
+  // Adjacency and spring list entries store the spring index or id in 31 bits
+  if (system->spring_count >= UINT32_MAX / 2) {
+    printf("ERROR: Cannot add more springs to the system\n");
+    PROFILE_COUNT(PROFILE_COUNTER_DROPPED, 1);
+    return (SpringHandle){HANDLE_NONE, 0};
+  }
+  if (system->spring_count >= system->spring_capacity &&
+      !system_resize_springs(system,
+                             system_grown_capacity(system->spring_capacity))) {
+    printf("ERROR: Cannot add more springs to the system\n");
+    PROFILE_COUNT(PROFILE_COUNTER_DROPPED, 1);
+    return (SpringHandle){HANDLE_NONE, 0};
+  }
+
+  SpringArrays *springs = &system->springs;
+  size_t i = system->spring_count++;
+  springs->first[i] = m1;
+  springs->second[i] = m2;
+  springs->length[i] = spring.length;
+  springs->strength[i] = spring.strength;
+  springs->dampening[i] = spring.dampening;
+  springs->max_strain[i] = spring.max_strain;
+  springs->cut[i] = spring.cut;
+  springs->force[i] = vec2_zero();
+  uint32_t id = system_assign_spring_id(system, i);
+  // A live spring goes in front of any springs compacted away
+  if (!spring.cut || system->active_spring_count == i) {
+    spring_swap(springs, system->active_spring_count++, i);
+  }
+  system_invalidate_topology(system);
+  system->hash_valid = false;
+  system_invalidate_islands(system);
+  return (SpringHandle){id, springs->generation[id]};
+}
+
+void system_cut_spring(System *system, size_t i) {
+  if (i >= system->spring_id_count ||
+      system->springs.slot[i] == HANDLE_NONE) {
+    return;
+  }
+  size_t slot = system->springs.slot[i];
+  if (!system->springs.cut[slot]) {
+    system->springs.cut[slot] = true;
+    system_island_spring_cut(system, slot);
+    PROFILE_COUNT(PROFILE_COUNTER_CUT_SPRINGS, 1);
+    system_invalidate_topology(system);
+  }
+}
+
+void system_default_max_strain(System *system, Scalar max_strain) {
+  for (size_t i = 0; i < system->spring_count; ++i) {
+    if (!(system->springs.max_strain[i] > SCALAR_C(0.0))) {
+      system->springs.max_strain[i] = max_strain;
+    }
+  }
+}
+
+void system_compact_springs(System *system) {
+  if (!system->compact_springs) {
+    return;
+  }
+  SpringArrays *springs = &system->springs;
+  size_t live_count = 0;
+  for (size_t i = 0; i < system->active_spring_count; ++i) {
+    if (!springs->cut[i]) {
+      spring_swap(springs, live_count++, i);
+    }
+  }
+  if (live_count != system->active_spring_count) {
+    system->active_spring_count = live_count;
+    system_invalidate_topology(system);
+  }
+}
+
+void system_invalidate_topology(System *system) {
+  ++system->topology_version;
+  system->adjacency_valid = false;
+  system->coloring_valid = false;
+  system->links_valid = false;
+}
+
+// Cells about as large as a spring keep both the buckets and the number of
+// cells a pointer sized query covers small. They are at least as large as two
+// touching masses, so that a contact query covers no more than a few cells.
+static Scalar system_hash_cell_size(const System *system) {
+  double length = 0.0;
+  for (size_t i = 0; i < system->spring_count; ++i) {
+    length += system->springs.length[i];
+  }
+  if (system->spring_count == 0 || !(length > 0.0)) {
+    return SCALAR_C(2.0) * MASS_RADIUS;
+  }
+  return scalar_max(length / system->spring_count,
+                    SCALAR_C(2.0) * MASS_RADIUS);
+}
+
+static _Bool mass_hash_point(const void *context, size_t i, Vec2 *point,
+                             Scalar *reach) {
+  const System *system = context;
+  *point = system->masses.position[i];
+  *reach = SCALAR_C(0.0);
+  return true;
+}
+
+static _Bool spring_hash_point(const void *context, size_t i, Vec2 *point,
+                               Scalar *reach) {
+  const System *system = context;
+  const SpringArrays *springs = &system->springs;
+  i = springs->slot[i];
+  if (i == HANDLE_NONE || springs->cut[i]) {
+    return false;
+  }
+  Vec2 first = system->masses.position[springs->first[i]];
+  Vec2 second = system->masses.position[springs->second[i]];
+  *point = vec2_lerp(first, second, SCALAR_C(0.5));
+  *reach = SCALAR_C(0.5) * vec2_length(vec2_subtract(second, first));
+  return true;
+}
+
+// Largest distance any mass has moved since the hashes were built
+static Scalar system_hash_drift(const System *system) {
+  const Vec2 *position = system->masses.position;
+  Scalar drift_squared = SCALAR_C(0.0);
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    Vec2 offset = vec2_subtract(position[i], system->hash_position[i]);
+    Scalar distance_squared = vec2_dot(offset, offset);
+    // Also catches NaN, which forces a rebuild
+    if (!(distance_squared <= drift_squared)) {
+      drift_squared = distance_squared;
+    }
+  }
+  return scalar_sqrt(drift_squared);
+}
+
+// Brings the hashes up to date. Rather than rebuilding after every step, they
+// are kept while no mass has moved more than max_slack cells since the build,
+// and queries widen by how far the masses have moved.
+_Bool system_hashes_ready(System *system, Scalar max_slack, _Bool springs) {
+  if (system->hash_valid && system->hash_moved) {
+    system->hash_slack = system_hash_drift(system);
+    system->hash_moved = false;
+  }
+  if (system->hash_valid &&
+      (!(system->hash_slack <= max_slack * system->mass_hash.cell_size) ||
+       (springs && !system->spring_hash_built))) {
+    system->hash_valid = false;
+  }
+  if (system->hash_valid) {
+    return true;
+  }
+
+  _Bool ok = true;
+  ARRAY_RESIZE(system->hash_position, system->mass_count, ok);
+  Scalar cell_size = system_hash_cell_size(system);
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory for spatial hash\n");
+    return false;
+  }
+  if (!spatial_hash_build(&system->mass_hash, system->mass_count, cell_size,
+                          mass_hash_point, system) ||
+      (springs &&
+       !spatial_hash_build(&system->spring_hash, system->spring_id_count,
+                           cell_size, spring_hash_point, system))) {
+    return false;
+  }
+  system->spring_hash_built = springs;
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    system->hash_position[i] = system->masses.position[i];
+  }
+  system->hash_slack = SCALAR_C(0.0);
+  system->hash_moved = false;
+  system->hash_valid = true;
+  return true;
+}
+
+typedef struct {
+  const System *system;
+  Vec2 point;
+  Scalar radius_squared;
+  Scalar best_distance_squared;
+  size_t best;
+  size_t except;
+} MassPick;
+
+static _Bool mass_pick_visit(void *context, uint32_t item) {
+  MassPick *pick = context;
+  if (item == pick->except) {
+    return true;
+  }
+  Vec2 offset = vec2_subtract(pick->system->masses.position[item], pick->point);
+  Scalar distance_squared = vec2_dot(offset, offset);
+  if (distance_squared <= pick->radius_squared &&
+      (distance_squared < pick->best_distance_squared ||
+       (distance_squared == pick->best_distance_squared &&
+        item < pick->best))) {
+    pick->best_distance_squared = distance_squared;
+    pick->best = item;
+  }
+  return true;
+}
+
+size_t system_pick_mass(System *system, Vec2 point, Scalar radius) {
+  return system_pick_other_mass(system, point, radius, SIZE_MAX);
+}
+
+size_t system_pick_other_mass(System *system, Vec2 point, Scalar radius,
+                              size_t except) {
+  PROFILE_SCOPE(PROFILE_ZONE_HASH);
+  if (!system_hashes_ready(system, SPATIAL_HASH_MAX_SLACK, true)) {
+    return SIZE_MAX;
+  }
+  MassPick pick = {system, point, radius * radius, INFINITY, SIZE_MAX, except};
+  Scalar reach = radius + system->hash_slack;
+  Vec2 extent = {reach, reach};
+  spatial_hash_query(&system->mass_hash, vec2_subtract(point, extent),
+                     vec2_add(point, extent), mass_pick_visit, &pick);
+  return pick.best;
+}
+
+typedef struct {
+  const System *system;
+  Vec2 point;
+  Scalar radius_squared;
+  size_t *indices;
+  size_t capacity;
+  size_t count;
+} MassGather;
+
+static _Bool mass_gather_visit(void *context, uint32_t item) {
+  MassGather *gather = context;
+  Vec2 offset =
+      vec2_subtract(gather->system->masses.position[item], gather->point);
+  if (vec2_dot(offset, offset) <= gather->radius_squared) {
+    if (gather->count < gather->capacity) {
+      gather->indices[gather->count] = item;
+    }
+    ++gather->count;
+  }
+  return true;
+}
+
+size_t system_masses_within(System *system, Vec2 point, Scalar radius,
+                            size_t *indices, size_t capacity) {
+  PROFILE_SCOPE(PROFILE_ZONE_HASH);
+  if (!system_hashes_ready(system, SPATIAL_HASH_MAX_SLACK, true)) {
+    return 0;
+  }
+  MassGather gather = {system, point, radius * radius, indices, capacity, 0};
+  Scalar reach = radius + system->hash_slack;
+  Vec2 extent = {reach, reach};
+  spatial_hash_query(&system->mass_hash, vec2_subtract(point, extent),
+                     vec2_add(point, extent), mass_gather_visit, &gather);
+  // In index order, whatever order the buckets came in
+  size_t written = gather.count < capacity ? gather.count : capacity;
+  for (size_t i = 1; i < written; ++i) {
+    size_t index = indices[i];
+    size_t j = i;
+    for (; j > 0 && indices[j - 1] > index; --j) {
+      indices[j] = indices[j - 1];
+    }
+    indices[j] = index;
+  }
+  return gather.count;
+}
+
+static Scalar cross(Vec2 a, Vec2 b) { return a.x * b.y - a.y * b.x; }
+
+static _Bool segments_within(Vec2 a0, Vec2 a1, Vec2 b0, Vec2 b1,
+                             Scalar distance) {
+  Vec2 a = vec2_subtract(a1, a0);
+  Vec2 b = vec2_subtract(b1, b0);
+  Scalar d0 = cross(a, vec2_subtract(b0, a0));
+  Scalar d1 = cross(a, vec2_subtract(b1, a0));
+  Scalar d2 = cross(b, vec2_subtract(a0, b0));
+  Scalar d3 = cross(b, vec2_subtract(a1, b0));
+  if (((d0 < 0 && d1 > 0) || (d0 > 0 && d1 < 0)) &&
+      ((d2 < 0 && d3 > 0) || (d2 > 0 && d3 < 0))) {
+    return true;
+  }
+  Scalar distance_squared = distance * distance;
+  return vec2_segment_distance_squared(a0, b0, b1) <= distance_squared ||
+         vec2_segment_distance_squared(a1, b0, b1) <= distance_squared ||
+         vec2_segment_distance_squared(b0, a0, a1) <= distance_squared ||
+         vec2_segment_distance_squared(b1, a0, a1) <= distance_squared;
+}
+
+typedef struct {
+  System *system;
+  Vec2 start;
+  Vec2 end;
+  Scalar distance;
+  size_t cut_count;
+} SegmentCut;
+
+static _Bool segment_cut_visit(void *context, uint32_t item) {
+  SegmentCut *cut = context;
+  System *system = cut->system;
+  SpringArrays *springs = &system->springs;
+  item = springs->slot[item];
+  if (!springs->cut[item] &&
+      segments_within(cut->start, cut->end,
+                      system->masses.position[springs->first[item]],
+                      system->masses.position[springs->second[item]],
+                      cut->distance)) {
+    springs->cut[item] = true;
+    system_island_spring_cut(system, item);
+    ++cut->cut_count;
+  }
+  return true;
+}
+
+size_t system_cut_segment(System *system, Vec2 start, Vec2 end,
+                          Scalar distance) {
+  PROFILE_SCOPE(PROFILE_ZONE_HASH);
+  if (!system_hashes_ready(system, SPATIAL_HASH_MAX_SLACK, true)) {
+    return 0;
+  }
+  // Cut springs stay in the hash, the visit skips them. Moving both endpoints
+  // by the slack moves the midpoint and the reach of a spring by up to as
+  // much.
+  SegmentCut cut = {system, start, end, distance, 0};
+  spatial_hash_query_segment(&system->spring_hash, start, end,
+                             distance + SCALAR_C(2.0) * system->hash_slack,
+                             segment_cut_visit, &cut);
+  if (cut.cut_count > 0) {
+    PROFILE_COUNT(PROFILE_COUNTER_CUT_SPRINGS, cut.cut_count);
+    system_invalidate_topology(system);
+  }
+  return cut.cut_count;
+}
+
+// Rebuilds the per mass spring lists with a counting sort. Every list ends up
+// in increasing spring order, so gathering sums forces in the same order as
+// scattering them spring by spring would.
+_Bool system_build_adjacency(System *system) {
+  system_compact_springs(system);
+  const SpringArrays *springs = &system->springs;
+  size_t entry_count = 0;
+  for (size_t i = 0; i < system->active_spring_count; ++i) {
+    entry_count += springs->cut[i] ? 0 : 2;
+  }
+
+  _Bool ok = true;
+  size_t offset_count = system->mass_count + 1;
+  ARRAY_RESIZE(system->adjacency_offset, offset_count, ok);
+  ARRAY_RESIZE(system->adjacency, entry_count, ok);
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory for spring adjacency\n");
+    return false;
+  }
+
+  size_t *offset = system->adjacency_offset;
+  for (size_t i = 0; i < offset_count; ++i) {
+    offset[i] = 0;
+  }
+  for (size_t i = 0; i < system->active_spring_count; ++i) {
+    if (!springs->cut[i]) {
+      ++offset[springs->first[i] + 1];
+      ++offset[springs->second[i] + 1];
+    }
+  }
+  for (size_t i = 1; i < offset_count; ++i) {
+    offset[i] += offset[i - 1];
+  }
+  // Fill using the start offsets as cursors, which leaves each offset pointing
+  // at the start of the next list, then shift them back into place
+  for (size_t i = 0; i < system->active_spring_count; ++i) {
+    if (!springs->cut[i]) {
+      system->adjacency[offset[springs->first[i]]++] = (uint32_t)i << 1;
+      system->adjacency[offset[springs->second[i]]++] = (uint32_t)i << 1 | 1;
+    }
+  }
+  for (size_t i = offset_count - 1; i > 0; --i) {
+    offset[i] = offset[i - 1];
+  }
+  offset[0] = 0;
+
+  system->adjacency_valid = true;
+  return true;
+}
+
+typedef struct {
+  System *system;
+  RangeFunction function;
+  void *argument;
+  size_t count;
+} RangeJob;
+
+static void range_job_task(void *context, size_t task) {
+  RangeJob *job = context;
+  size_t begin = task * SYSTEM_CHUNK_SIZE;
+  size_t end = begin + SYSTEM_CHUNK_SIZE;
+  if (end > job->count) {
+    end = job->count;
+  }
+  job->function(job->system, begin, end, job->argument);
+}
+
+void system_parallel_for(System *system, size_t count, RangeFunction function,
+                         void *argument) {
+  if (system->pool == NULL || count <= SYSTEM_CHUNK_SIZE) {
+    function(system, 0, count, argument);
+    return;
+  }
+
+  RangeJob job = {system, function, argument, count};
+  thread_pool_run(system->pool, range_job_task, &job,
+                  (count + SYSTEM_CHUNK_SIZE - 1) / SYSTEM_CHUNK_SIZE);
+}
+
+typedef struct {
+  SumFunction function;
+  void *argument;
+  double *chunk_sums;
+} SumJob;
+
+// Sums every chunk separately even when running on a single thread, so that
+// the chunk sums and their total never depend on the thread count
+static void sum_job_range(System *system, size_t begin, size_t end,
+                          void *argument) {
+  SumJob *job = argument;
+  for (size_t chunk = begin; chunk < end; chunk += SYSTEM_CHUNK_SIZE) {
+    size_t chunk_end = chunk + SYSTEM_CHUNK_SIZE < end
+                           ? chunk + SYSTEM_CHUNK_SIZE
+                           : end;
+    job->chunk_sums[chunk / SYSTEM_CHUNK_SIZE] =
+        job->function(system, chunk, chunk_end, job->argument);
+  }
+}
+
+double system_parallel_sum(System *system, size_t count, SumFunction function,
+                           void *argument) {
+  size_t chunk_count = (count + SYSTEM_CHUNK_SIZE - 1) / SYSTEM_CHUNK_SIZE;
+  if (chunk_count > system->chunk_sum_capacity) {
+    _Bool ok = true;
+    ARRAY_RESIZE(system->chunk_sums, chunk_count, ok);
+    if (!ok) {
+      printf("ERROR: Cannot allocate memory for partial sums\n");
+      return function(system, 0, count, argument);
+    }
+    system->chunk_sum_capacity = chunk_count;
+  }
+
+  SumJob job = {function, argument, system->chunk_sums};
+  system_parallel_for(system, count, sum_job_range, &job);
+  double sum = 0.0;
+  for (size_t i = 0; i < chunk_count; ++i) {
+    sum += system->chunk_sums[i];
+  }
+  return sum;
+}
+
+Vec2 *system_mass_scratch(System *system, size_t count) {
+  size_t capacity = count * system->mass_count;
+  if (capacity > system->mass_scratch_capacity) {
+    _Bool ok = true;
+    ARRAY_RESIZE(system->mass_scratch, capacity, ok);
+    if (!ok) {
+      printf("ERROR: Cannot allocate scratch memory for masses\n");
+      return NULL;
+    }
+    system->mass_scratch_capacity = capacity;
+  }
+  return system->mass_scratch;
+}
+
+Scalar *system_spring_scratch(System *system, size_t count) {
+  size_t capacity = count * system->spring_count;
+  if (capacity > system->spring_scratch_capacity) {
+    _Bool ok = true;
+    ARRAY_RESIZE(system->spring_scratch, capacity, ok);
+    if (!ok) {
+      printf("ERROR: Cannot allocate scratch memory for springs\n");
+      return NULL;
+    }
+    system->spring_scratch_capacity = capacity;
+  }
+  return system->spring_scratch;
+}
+
+void system_spring_update_reference(System *system) {
+  MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  uint8_t *tear_flags = system_tear_flags(system);
+  size_t torn = 0;
+
+  for (size_t i = 0; i < system->active_spring_count; ++i) {
+    if (springs->cut[i] || system_mass_asleep(system, springs->first[i])) {
+      continue;
+    }
+    size_t first = springs->first[i];
+    size_t second = springs->second[i];
+
+    Vec2 span =
+        vec2_subtract(masses->position[second], masses->position[first]);
+    Vec2 force_direction = vec2_normalize(span);
+
+    // Spring force
+    Scalar span_length = vec2_length(span);
+    Scalar displacement = springs->length[i] - span_length;
+    if (tear_flags != NULL && springs->max_strain[i] > SCALAR_C(0.0) &&
+        span_length >
+            springs->length[i] * (SCALAR_C(1.0) + springs->max_strain[i])) {
+      tear_flags[i] = 1;
+      ++torn;
+    }
+    mass_force_append(
+        masses, first,
+        vec2_scale(force_direction, springs->strength[i] * -displacement));
+    mass_force_append(
+        masses, second,
+        vec2_scale(force_direction, springs->strength[i] * displacement));
+
+    // Dampener force
+    Scalar displacement_rate_first =
+        vec2_dot(masses->velocity[first], force_direction);
+    Scalar displacement_rate_second =
+        -vec2_dot(masses->velocity[second], force_direction);
+    Scalar displacement_rate =
+        displacement_rate_first + displacement_rate_second;
+    mass_force_append(masses, first,
+                      vec2_scale(force_direction,
+                                 springs->dampening[i] * -displacement_rate));
+    mass_force_append(
+        masses, second,
+        vec2_scale(force_direction, springs->dampening[i] * displacement_rate));
+  }
+  if (torn > 0) {
+    system_tear_flagged(system, system->active_spring_count, false,
+                        masses->position);
+  }
+}
+
+// Combined spring and dampener force of spring i on its first mass, with a
+// zero span giving a zero force. Also returns the length of the span.
+static inline Vec2 spring_force_one(size_t i, const uint32_t *restrict first,
+                                    const uint32_t *restrict second,
+                                    const Scalar *restrict length,
+                                    const Scalar *restrict strength,
+                                    const Scalar *restrict dampening,
+                                    const Vec2 *restrict position,
+                                    const Vec2 *restrict velocity,
+                                    Scalar *span_length) {
+  uint32_t m1 = first[i];
+  uint32_t m2 = second[i];
+
+  Scalar dx = position[m2].x - position[m1].x;
+  Scalar dy = position[m2].y - position[m1].y;
+  *span_length = scalar_sqrt(dx * dx + dy * dy);
+  // A zero span has a zero direction either way, so dividing by one instead
+  // keeps the loop free of branches
+  Scalar inverse_length =
+      SCALAR_C(1.0) /
+      (*span_length > SCALAR_C(0.0) ? *span_length : SCALAR_C(1.0));
+  Scalar nx = dx * inverse_length;
+  Scalar ny = dy * inverse_length;
+
+  Scalar displacement = length[i] - *span_length;
+  Scalar displacement_rate = (velocity[m1].x - velocity[m2].x) * nx +
+                             (velocity[m1].y - velocity[m2].y) * ny;
+  Scalar magnitude =
+      -(strength[i] * displacement + dampening[i] * displacement_rate);
+  return (Vec2){nx * magnitude, ny * magnitude};
+}
+
+// Computes the combined spring and dampener force of every spring without
+// writing to the masses. The loops are branch free so that they vectorize.
+// Cut springs are evaluated as well, it is up to the caller to skip their
+// forces. With tear_flags given, it also flags the live springs stretched past
+// their max strain, and returns how many it flagged.
+SPRING_KERNEL_CLONES
+static size_t spring_force_kernel(
+    size_t count, const uint32_t *restrict first,
+    const uint32_t *restrict second, const Scalar *restrict length,
+    const Scalar *restrict strength, const Scalar *restrict dampening,
+    const Scalar *restrict max_strain, const uint8_t *restrict cut,
+    const Vec2 *restrict position, const Vec2 *restrict velocity,
+    Vec2 *restrict force, uint8_t *restrict tear_flags) {
+  Scalar span_length;
+  if (tear_flags == NULL) {
+    for (size_t i = 0; i < count; ++i) {
+      force[i] = spring_force_one(i, first, second, length, strength,
+                                  dampening, position, velocity, &span_length);
+    }
+    return 0;
+  }
+  size_t torn = 0;
+  for (size_t i = 0; i < count; ++i) {
+    force[i] = spring_force_one(i, first, second, length, strength, dampening,
+                                position, velocity, &span_length);
+    uint8_t over =
+        (max_strain[i] > SCALAR_C(0.0)) &
+        (span_length > length[i] * (SCALAR_C(1.0) + max_strain[i])) &
+        (cut[i] == 0);
+    tear_flags[i] = over;
+    torn += over;
+  }
+  return torn;
+}
+
+const char *spring_kernel_name(SpringKernel kernel) {
+  if (kernel == SPRING_KERNEL_REFERENCE) {
+    return "reference";
+  }
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (__builtin_cpu_supports("avx512f")) {
+    return "avx512f";
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return "avx2";
+  }
+  return "sse2";
+#else
+  return "default";
+#endif
+}
+
+static size_t spring_force_run(System *system,
+                               const ForceEvaluation *evaluation, size_t begin,
+                               size_t end) {
+  SpringArrays *springs = &system->springs;
+  uint8_t *tear_flags = evaluation->tear_flags;
+  // The flags are read as bytes, which vectorizes where _Bool does not
+  const uint8_t *cut = (const uint8_t *)springs->cut;
+  return spring_force_kernel(
+      end - begin, springs->first + begin, springs->second + begin,
+      springs->length + begin, springs->strength + begin,
+      springs->dampening + begin, springs->max_strain + begin, cut + begin,
+      evaluation->position, evaluation->velocity, springs->force + begin,
+      tear_flags == NULL ? NULL : tear_flags + begin);
+}
+
+// Returns the number of springs flagged as torn
+static double spring_force_range(System *system, size_t begin, size_t end,
+                                 void *argument) {
+  const ForceEvaluation *evaluation = argument;
+  SpringArrays *springs = &system->springs;
+  if (system->sleeping_island_count == 0) {
+    return spring_force_run(system, evaluation, begin, end);
+  }
+  // Both ends of a spring are in the same island, so the runs of springs
+  // between sleeping ones go to the kernel whole
+  size_t torn = 0;
+  size_t i = begin;
+  while (i < end) {
+    while (i < end && system_mass_asleep(system, springs->first[i])) {
+      ++i;
+    }
+    size_t run = i;
+    while (i < end && !system_mass_asleep(system, springs->first[i])) {
+      ++i;
+    }
+    torn += spring_force_run(system, evaluation, run, i);
+  }
+  return torn;
+}
+
+// Evaluates the force of every active spring, cutting the ones it finds torn
+// if tear is set
+static void spring_force_pass(System *system, ForceEvaluation *evaluation,
+                              _Bool tear) {
+  evaluation->tear_flags = tear ? system_tear_flags(system) : NULL;
+  if (system_parallel_sum(system, system->active_spring_count,
+                          spring_force_range, evaluation) > 0.0) {
+    system_tear_flagged(system, system->active_spring_count, true,
+                        evaluation->position);
+  }
+}
+
+// Each mass only sums the forces of its own springs, so chunks of masses can
+// be gathered concurrently without any two threads writing the same mass
+static void mass_gather_range(System *system, size_t begin, size_t end,
+                              void *argument) {
+  const ForceEvaluation *evaluation = argument;
+  const Vec2 *spring_force = system->springs.force;
+  const size_t *offset = system->adjacency_offset;
+
+  for (size_t i = begin; i < end; ++i) {
+    if (system_mass_asleep(system, i)) {
+      continue;
+    }
+    Vec2 total = evaluation->external[i];
+    for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
+      uint32_t entry = system->adjacency[j];
+      Vec2 force = spring_force[entry >> 1];
+      total = force_accumulate(total, (entry & 1) ? vec2_negate(force) : force);
+    }
+    evaluation->force[i] = total;
+  }
+}
+
+_Bool system_evaluate_forces(System *system, const Vec2 *position,
+                             const Vec2 *velocity, const Vec2 *external,
+                             Vec2 *force, _Bool tear) {
+  PROFILE_SCOPE(PROFILE_ZONE_SPRING_FORCES);
+  if (!system->adjacency_valid && !system_build_adjacency(system)) {
+    return false;
+  }
+
+  ForceEvaluation evaluation = {position, velocity, external, force, NULL};
+  spring_force_pass(system, &evaluation, tear);
+  system_parallel_for(system, system->mass_count, mass_gather_range,
+                      &evaluation);
+  return true;
+}
+
+void system_spring_update(System *system) {
+  PROFILE_SCOPE(PROFILE_ZONE_SPRING_FORCES);
+  MassArrays *masses = &system->masses;
+  if (system->spring_kernel == SPRING_KERNEL_REFERENCE ||
+      !system_evaluate_forces(system, masses->position, masses->velocity,
+                              masses->force, masses->force,
+                              system->tear_springs)) {
+    system_spring_update_reference(system);
+  }
+}
+
+static void mass_update_range(System *system, size_t begin, size_t end,
+                              void *argument) {
+  Scalar dt = *(double *)argument;
+  MassArrays *masses = &system->masses;
+
+  for (size_t i = begin; i < end; ++i) {
+    if (masses->fixed[i] || system_mass_asleep(system, i)) {
+      continue;
+    }
+    Vec2 acceleration =
+        mass_acceleration(system, i, masses->position[i], masses->velocity[i],
+                          masses->force[i]);
+    masses->velocity[i] =
+        vec2_add(masses->velocity[i], vec2_scale(acceleration, dt));
+    masses->position[i] =
+        vec2_add(masses->position[i], vec2_scale(masses->velocity[i], dt));
+  }
+}
+
+void system_mass_update(System *system, double dt) {
+  PROFILE_SCOPE(PROFILE_ZONE_INTEGRATE);
+  system_sum_force_fields(system);
+  system_parallel_for(system, system->mass_count, mass_update_range, &dt);
+}
+
+// Gathers the forces of each mass, integrates it and resets its force in one
+// sweep. The sums and the updates happen in the same order as in the separate
+// passes, so the results are the same to the bit.
+static void fused_euler_range(System *system, size_t begin, size_t end,
+                              void *argument) {
+  Scalar dt = *(double *)argument;
+  MassArrays *masses = &system->masses;
+  const Vec2 *spring_force = system->springs.force;
+  const size_t *offset = system->adjacency_offset;
+
+  for (size_t i = begin; i < end; ++i) {
+    Vec2 total = masses->force[i];
+    masses->force[i] = vec2_zero();
+    if (masses->fixed[i] || system_mass_asleep(system, i)) {
+      continue;
+    }
+    for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
+      uint32_t entry = system->adjacency[j];
+      Vec2 force = spring_force[entry >> 1];
+      total = force_accumulate(total, (entry & 1) ? vec2_negate(force) : force);
+    }
+    Vec2 acceleration = mass_acceleration(
+        system, i, masses->position[i], masses->velocity[i], total);
+    masses->velocity[i] =
+        vec2_add(masses->velocity[i], vec2_scale(acceleration, dt));
+    masses->position[i] =
+        vec2_add(masses->position[i], vec2_scale(masses->velocity[i], dt));
+  }
+}
+
+_Bool system_fused_euler_step(System *system, double dt) {
+  if (!system->adjacency_valid && !system_build_adjacency(system)) {
+    return false;
+  }
+  MassArrays *masses = &system->masses;
+  ForceEvaluation evaluation = {masses->position, masses->velocity, NULL, NULL,
+                                NULL};
+  PROFILE_BEGIN(PROFILE_ZONE_SPRING_FORCES);
+  spring_force_pass(system, &evaluation, system->tear_springs);
+  PROFILE_END(PROFILE_ZONE_SPRING_FORCES);
+  PROFILE_SCOPE(PROFILE_ZONE_INTEGRATE);
+  system_parallel_for(system, system->mass_count, fused_euler_range, &dt);
+  return true;
+}
+
+static void mass_reset_forces_range(System *system, size_t begin,
+                                    size_t end, void *argument) {
+  (void)argument;
+  for (size_t i = begin; i < end; ++i) {
+    system->masses.force[i] = vec2_zero();
+  }
+}
+
+void system_mass_reset_forces(System *system) {
+  PROFILE_SCOPE(PROFILE_ZONE_RESET);
+  system_parallel_for(system, system->mass_count, mass_reset_forces_range,
+                      NULL);
+}
+
+void system_mass_force_append(System *system, Vec2 force) {
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    mass_force_append(&system->masses, i, force);
+  }
+}
+
+static void store_previous_positions_range(System *system, size_t begin,
+                                           size_t end, void *argument) {
+  (void)argument;
+  MassArrays *masses = &system->masses;
+  for (size_t i = begin; i < end; ++i) {
+    masses->previous_position[i] = masses->position[i];
+  }
+}
+
+void system_store_previous_positions(System *system) {
+  system_parallel_for(system, system->mass_count,
+                      store_previous_positions_range, NULL);
+  ++system->motion_version;
+}
+
+void system_init_grid(System *system, size_t rows, size_t cols, Vec2 origin,
+                      double cell_size, double mass, double spring_strength,
+                      double spring_dampening) {
+  system_clear(system);
+  if (rows > 0 && cols > 0) {
+    system_reserve(system, rows * cols, rows * (cols - 1) + (rows - 1) * cols);
+  }
+
+  for (size_t r = 0; r < rows; ++r) {
+    for (size_t c = 0; c < cols; ++c) {
+      Mass m = {0};
+      m.position = vec2_add(origin, vec2_scale((Vec2){c, r}, cell_size));
+      m.mass = mass;
+      m.fixed = (r == 0);
+      system_add_mass(system, m);
+    }
+  }
+
+  for (size_t r = 0; r < rows; ++r) {
+    for (size_t c = 0; c < cols; ++c) {
+      size_t m0 = r * cols + c;
+      size_t m1 = r * cols + c + 1;
+      size_t m2 = (r + 1) * cols + c;
+
+      if (c != (cols - 1) && m1 < rows * cols) {
+        system_add_spring(system,
+                          (Spring){.length = cell_size,
+                                   .strength = spring_strength,
+                                   .dampening = spring_dampening},
+                          m0, m1);
+      }
+      if (r != (rows - 1) && m2 < rows * cols) {
+        system_add_spring(system,
+                          (Spring){.length = cell_size,
+                                   .strength = spring_strength,
+                                   .dampening = spring_dampening},
+                          m0, m2);
+      }
+    }
+  }
+}
@@ -0,0 +1,499 @@
+#ifndef SPRINGS_H
+#define SPRINGS_H
+
+#include "ordering.h"
+#include "spatial_hash.h"
+#include "thread_pool.h"
+#include "vec2.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONSTRAIN_FORCES true
+#define FORCES_CONSTRAINT 10e5
+#define SYSTEM_MIN_CAPACITY 64
+#define SYSTEM_CHUNK_SIZE 4096
+#define MASS_RADIUS SCALAR_C(8.0)
+#define WIND_STRENGTH SCALAR_C(75.0)
+#define GRAVITATIONAL_ACCELERATION                                             \
+  (Vec2) { SCALAR_C(0.0), SCALAR_C(98.0) }
+#define SYSTEM_MAX_FORCE_FIELDS 16
+// Share of the speed into a contact that friction takes off the sliding speed
+#define COLLISION_FRICTION SCALAR_C(0.2)
+
+// Spatial hashes are rebuilt once any mass moved this many cells
+#define SPATIAL_HASH_MAX_SLACK SCALAR_C(2.0)
+
+// Islands with sleeping enabled fall asleep once no mass of theirs had more
+// kinetic energy than this for SYSTEM_SLEEP_STEPS steps in a row
+#define SYSTEM_SLEEP_ENERGY 0.5
+#define SYSTEM_SLEEP_STEPS 60
+
+// Automatic reordering kicks in once the mean spring span grew this much
+#define SYSTEM_REORDER_TOLERANCE 1.5
+
+#define XPBD_DEFAULT_ITERATIONS 10
+#define XPBD_MAX_COLORS 64
+#define XPBD_JACOBI_RELAXATION SCALAR_C(1.5)
+
+#define DEFAULT_GRID_ROWS 40
+#define DEFAULT_GRID_COLS 60
+#define DEFAULT_GRID_SIZE SCALAR_C(10.0)
+#define DEFAULT_GRID_MASS SCALAR_C(1.0)
+#define DEFAULT_GRID_STRENGTH SCALAR_C(1000.0)
+#define DEFAULT_GRID_DAMPENING SCALAR_C(5.0)
+
+typedef struct {
+  Vec2 position;
+  Vec2 velocity;
+  Scalar mass;
+  _Bool fixed;
+} Mass;
+
+typedef struct {
+  Scalar length;
+  Scalar strength;
+  Scalar dampening;
+  Scalar max_strain; // Tears past 1 + max_strain times the length, zero never
+  _Bool cut;
+} Spring;
+
+// Refer to a mass or spring across edits. Removing it bumps the generation of
+// its id, so a handle stops resolving even once the id is handed out again.
+typedef struct {
+  uint32_t id;
+  uint32_t generation;
+} MassHandle;
+
+typedef struct {
+  uint32_t id;
+  uint32_t generation;
+} SpringHandle;
+
+// Id of a handle that never resolves, as returned when adding fails
+#define HANDLE_NONE UINT32_MAX
+
+// Masses stored as a structure of arrays, so each loop only streams through the
+// fields it actually touches. Removing a mass moves the last one into its
+// index, so the arrays stay dense, and masses are referred to across edits by
+// their id.
+typedef struct {
+  Vec2 *position;
+  Vec2 *previous_position; // Kept for interpolating between physics steps
+  Vec2 *velocity;
+  Vec2 *force; // Net force accumulated since the last reset
+  Scalar *inverse_mass;
+  _Bool *fixed;
+  uint32_t *id;
+  // Indexed by id
+  uint32_t *slot; // Where the mass is stored now, HANDLE_NONE once removed
+  uint32_t *generation;
+  uint32_t *spring_list; // First entry of the list of its springs
+  uint32_t *free_id; // Ids of removed masses, handed out again first
+} MassArrays;
+
+// Springs stored as a structure of arrays, referring to masses by index.
+// Compaction and removals may move a spring to another position in the
+// arrays, so it is referred to by its id. Ids are handed out in the order
+// springs are added, reusing the ids of removed springs first.
+typedef struct {
+  uint32_t *first;
+  uint32_t *second;
+  Scalar *length;
+  Scalar *strength;
+  Scalar *dampening;
+  Scalar *max_strain;
+  _Bool *cut;
+  Vec2 *force; // Force on the first mass, the second mass gets its negation
+  uint32_t *id;
+  // Indexed by id
+  uint32_t *slot; // Where the spring is stored now, HANDLE_NONE once removed
+  uint32_t *generation;
+  uint32_t *free_id; // Ids of removed springs, handed out again first
+  // The springs of each mass form a list of entries, the id shifted left by
+  // one with the low bit set for the second endpoint. Indexed by entry, the
+  // next entry of the same mass, or HANDLE_NONE at the end.
+  uint32_t *next;
+} SpringArrays;
+
+// A spring that tore, with the midpoint of its span and its strain then
+typedef struct {
+  uint32_t spring; // Id
+  Vec2 position;
+  Scalar strain;
+  double time;
+} TearEvent;
+
+// Islands stored as a structure of arrays, indexed by island id
+typedef struct {
+  _Bool *sleeping;
+  _Bool *dirty;  // Lost a spring since the masses were last labeled
+  _Bool *moving; // Some mass was above the sleep energy in the last step
+  _Bool *reused; // Scratch for relabeling, the id went to a part already
+  uint32_t *mass_count;
+  uint32_t *quiet_steps; // Steps in a row without moving
+  Vec2 *min; // Bounds of the masses, as of the last step they were awake
+  Vec2 *max;
+} IslandArrays;
+
+typedef enum {
+  SPRING_KERNEL_BATCHED = 0, // Vectorized kernel, picked per CPU at runtime
+  SPRING_KERNEL_REFERENCE,   // Plain one spring at a time implementation
+} SpringKernel;
+
+typedef enum {
+  INTEGRATOR_SEMI_IMPLICIT_EULER = 0, // Velocity first, then position
+  INTEGRATOR_VERLET,                  // Position Verlet, drift-kick-drift
+  INTEGRATOR_RK4,                     // Classic fourth order Runge-Kutta
+  INTEGRATOR_IMPLICIT_EULER, // Backward Euler, solved with conjugate gradient
+  INTEGRATOR_COUNT,
+} Integrator;
+
+typedef enum {
+  SOLVER_FORCES = 0, // Springs apply forces that the integrator steps
+  SOLVER_XPBD,       // Springs are compliant distance constraints
+  SOLVER_COUNT,
+} Solver;
+
+typedef enum {
+  XPBD_GAUSS_SEIDEL = 0, // Springs of one graph color at a time, in parallel
+  XPBD_JACOBI,           // All springs at once, averaging their corrections
+  XPBD_METHOD_COUNT,
+} XpbdMethod;
+
+// Force fields accelerate every free mass, without storing anything per mass.
+// They are given as accelerations, so light and heavy masses move alike. The
+// kinds use the members of ForceField as follows:
+//   uniform     vector everywhere, such as gravity or a steady wind
+//   turbulence  vector plus gusts of up to strength, value noise over cells
+//               of scale in size that changes frequency times a second
+//   attractor   Pulls towards center by strength * scale^2 / distance^2 far
+//               out, easing off to zero within scale. A negative strength
+//               pushes away.
+//   drag        Slows masses by strength times their velocity
+typedef enum {
+  FORCE_FIELD_UNIFORM = 0,
+  FORCE_FIELD_TURBULENCE,
+  FORCE_FIELD_ATTRACTOR,
+  FORCE_FIELD_DRAG,
+  FORCE_FIELD_COUNT,
+} ForceFieldKind;
+
+typedef struct {
+  ForceFieldKind kind;
+  _Bool enabled;
+  Vec2 vector;
+  Vec2 center;
+  Scalar strength;
+  Scalar scale;
+  Scalar frequency;
+} ForceField;
+
+// The enabled fields as the integrators apply them: every uniform part summed
+// into one acceleration and one drag coefficient, and the fields that vary
+// over space listed by index
+typedef struct {
+  Vec2 acceleration;
+  Scalar drag;
+  uint8_t local[SYSTEM_MAX_FORCE_FIELDS];
+  size_t local_count;
+} ForceFieldSum;
+
+// Static shapes the masses collide with, using the members as follows:
+//   circle   Disc of radius around start
+//   segment  Capsule of radius around the segment from start to end, a plain
+//            wall with a radius of zero
+//   bounds   Keeps the masses inside the box with corners start and end, such
+//            as the window
+typedef enum {
+  OBSTACLE_CIRCLE = 0,
+  OBSTACLE_SEGMENT,
+  OBSTACLE_BOUNDS,
+  OBSTACLE_COUNT,
+} ObstacleKind;
+
+typedef struct {
+  ObstacleKind kind;
+  Vec2 start;
+  Vec2 end;
+  Scalar radius;
+} Obstacle;
+
+// A zero initialized System is a valid empty system. The arrays live on the
+// heap and grow as masses and springs are added, so release them with
+// system_free when done.
+typedef struct {
+  MassArrays masses;
+  SpringArrays springs;
+  size_t mass_count;
+  size_t spring_count;
+  size_t mass_capacity;
+  size_t spring_capacity;
+  // Ids handed out so far, in use or free, and how many of them are free
+  size_t mass_id_count;
+  size_t spring_id_count;
+  size_t free_mass_id_count;
+  size_t free_spring_id_count;
+  // The most ids there were at once. Clearing starts the ids over, so their
+  // generations are kept up to these to tell old handles apart.
+  size_t mass_generation_count;
+  size_t spring_generation_count;
+  size_t id_version; // Bumped whenever a mass or spring is removed
+  SpringKernel spring_kernel;
+  Integrator integrator;
+  Solver solver;
+  XpbdMethod xpbd_method;
+  size_t xpbd_iterations; // Zero uses XPBD_DEFAULT_ITERATIONS
+
+  // The update loops only cover the first active_spring_count springs, and
+  // all springs after those are cut. With compact_springs set, springs cut
+  // since are swapped behind the live ones whenever the topology is rebuilt,
+  // keeping the live ones in order. Otherwise every spring stays active.
+  _Bool compact_springs;
+  size_t active_spring_count;
+
+  // Springs attached to each mass in compressed sparse row form, so that the
+  // batched path can gather forces per mass instead of scattering per spring.
+  // Entries hold the spring index shifted left by one, with the low bit set
+  // when the mass is the second endpoint. Cut springs are left out.
+  size_t *adjacency_offset;
+  uint32_t *adjacency;
+  _Bool adjacency_valid;
+  size_t topology_version; // Bumped whenever the topology is invalidated
+  size_t mass_order_version; // Bumped whenever masses move to other indices
+  // Bumped whenever the masses may have moved, by steps that move them and by
+  // the calls writing positions from elsewhere. Renderers keeping what they
+  // drew last have nothing to redo while it stays the same.
+  size_t motion_version;
+
+  // With reorder_ordering set, system_reorder_if_needed reorders the system
+  // again once its spring span grew past SYSTEM_REORDER_TOLERANCE times the
+  // span right after the last reorder
+  Ordering reorder_ordering;
+  double reorder_span;
+  size_t reorder_checked_version; // Topology the span was last checked at
+
+  // Islands are the groups of masses connected by live springs. With
+  // sleep_islands set, semi-implicit Euler steps skip the masses and springs
+  // of islands that have settled, until system_wake_mass or system_wake_all
+  // wakes them, a spring of theirs is cut, or an awake island moves into
+  // their bounds. Cuts only relabel the islands they split.
+  _Bool sleep_islands;
+  IslandArrays islands;
+  uint32_t *mass_island;
+  uint8_t *island_visited; // Scratch for labeling, one per mass
+  uint32_t *island_queue;  // Scratch for labeling, one per mass
+  size_t island_count;
+  size_t sleeping_island_count;
+  size_t sleeping_mass_count;
+  _Bool islands_dirty; // Some island lost a spring
+  _Bool islands_valid; // Cleared when masses or springs are added or moved
+
+  // Live springs ordered by graph color for the Gauss-Seidel XPBD solver. No
+  // two springs of a color share a mass, so each color can run in parallel.
+  // The last color collects any springs left over past XPBD_MAX_COLORS.
+  uint32_t *color_order;
+  size_t color_offset[XPBD_MAX_COLORS + 2];
+  _Bool coloring_valid;
+
+  // Masses by position and live springs by midpoint under their ids, for
+  // picking, cutting and collisions. Built on the first query and kept while
+  // the masses stay near the positions they were built from.
+  SpatialHash mass_hash;
+  SpatialHash spring_hash;
+  Vec2 *hash_position; // Mass positions at the last build
+  Scalar hash_slack;   // Distance any mass has moved since, at most
+  _Bool hash_valid;
+  _Bool spring_hash_built; // Collisions only rebuild the mass hash
+  _Bool hash_moved; // Set by system_step, the slack needs measuring
+
+  ThreadPool *pool; // Only set when stepping with more than one thread
+
+  // Working memory for the integrators, grown on demand
+  Vec2 *mass_scratch;
+  Scalar *spring_scratch;
+  double *chunk_sums;
+  uint8_t *tear_flags; // Springs the last pass found torn, zero otherwise
+  size_t mass_scratch_capacity;
+  size_t spring_scratch_capacity;
+  size_t chunk_sum_capacity;
+  size_t tear_flag_capacity;
+
+  // Force fields applied by every step. A zero initialized system has gravity
+  // alone, as field 0, until fields are added or cleared. Fields can be
+  // changed or disabled in place, the steps sum them up as they start.
+  ForceField force_fields[SYSTEM_MAX_FORCE_FIELDS];
+  size_t force_field_count;
+  _Bool force_fields_initialized;
+  ForceFieldSum force_field_sum; // As of the start of the last step
+  double time; // Simulated time, which turbulence changes with
+
+  // Contacts are resolved after every step. With collide_masses set, masses
+  // keep two MASS_RADIUS apart, except for those at most two springs apart,
+  // as the neighbors in a mesh are. Every mass also keeps MASS_RADIUS out of
+  // the obstacles. The mass hash finds the pairs, and a hash of the circles
+  // and segments the obstacles near a mass.
+  _Bool collide_masses;
+  Obstacle *obstacles;
+  size_t obstacle_count;
+  size_t obstacle_capacity;
+  size_t obstacle_bounds_count; // Bounds are checked for every mass instead
+  SpatialHash obstacle_hash;
+  Vec2 obstacle_min; // Box around the hashed obstacles
+  Vec2 obstacle_max;
+  _Bool obstacle_hash_valid;
+  // The masses at most two springs from each mass in compressed sparse row
+  // form, which it does not collide with
+  size_t *link_offset;
+  uint32_t *links;
+  size_t link_mass_count; // Masses whose links are listed so far
+  size_t link_capacity;
+  _Bool links_valid;
+  size_t contact_count; // In the last step, counted once for each mass
+
+  // With tear_springs set, live springs with a max_strain above zero are cut
+  // once a step finds them stretched past 1 + max_strain times their rest
+  // length, by the same pass that works out their forces. Every tear goes on
+  // tear_events, which the caller empties once it has drawn or recorded them.
+  _Bool tear_springs;
+  size_t torn_count; // Since the system was cleared
+  TearEvent *tear_events;
+  size_t tear_event_count;
+  size_t tear_event_capacity;
+} System;
+
+// Fixed time step physics clock, decoupling the simulation from the render
+// rate. Each frame adds its duration and the clock hands out whole steps.
+typedef struct {
+  double step;            // Length of one physics step
+  double max_accumulated; // Unsimulated time is capped at this after a hitch
+  double accumulator;     // Frame time not simulated yet
+} PhysicsClock;
+
+// A clock taking substeps fixed steps for every frame at frame_rate
+PhysicsClock physics_clock_init(double frame_rate, size_t substeps,
+                                double max_accumulated);
+// Adds frame_time to the clock and returns the number of steps to take now
+size_t physics_clock_advance(PhysicsClock *clock, double frame_time);
+// How far the clock has advanced past the last step, from 0 to 1
+double physics_clock_alpha(const PhysicsClock *clock);
+
+// Makes room for at least the given number of masses and springs in total
+void system_reserve(System *system, size_t mass_capacity,
+                    size_t spring_capacity);
+// Releases any capacity beyond what the current masses and springs need. The
+// arrays indexed by id keep the generations of every id handed out before,
+// so that handles from before a clear stay stale.
+void system_shrink(System *system);
+void system_free(System *system);
+// Spreads the update loops over the given number of threads, including the
+// calling one. The results do not depend on the thread count.
+void system_set_thread_count(System *system, size_t thread_count);
+
+// Adds a mass at index mass_count, or a spring between the masses at the
+// given indices, and returns its handle. The id of a removed mass or spring
+// is reused if there is one. Neither allocates while there is capacity left,
+// so reserving up front keeps edits from reallocating mid-frame.
+MassHandle system_add_mass(System *system, Mass mass);
+SpringHandle system_add_spring(System *system, Spring spring, size_t m1,
+                               size_t m2);
+// Springs should be cut through here rather than by setting the flag directly,
+// so that the batched path stops applying their forces. i is the spring id.
+void system_cut_spring(System *system, size_t i);
+// Gives every spring without a max strain of its own the given one, which
+// tears them once tear_springs is set
+void system_default_max_strain(System *system, Scalar max_strain);
+// Index of the mass, or id of the spring, a handle refers to, or SIZE_MAX if
+// it was removed
+size_t system_mass_index(const System *system, MassHandle mass);
+size_t system_spring_id(const System *system, SpringHandle spring);
+MassHandle system_mass_handle(const System *system, size_t i);
+SpringHandle system_spring_handle(const System *system, size_t id);
+// Removes a mass with its springs, moving the last mass into its index, or a
+// spring, moving other springs into its place. Both take time in the number
+// of springs at the masses involved, not in the size of the system. Return
+// false if the handle does not resolve.
+_Bool system_remove_mass(System *system, MassHandle mass);
+_Bool system_remove_spring(System *system, SpringHandle spring);
+// Merges other into keep, which takes over its springs, momentum and mass, at
+// their center of mass. A fixed mass stays where it is. Springs between the
+// two are removed. Returns false if either handle does not resolve or both
+// are the same mass.
+_Bool system_merge_masses(System *system, MassHandle keep, MassHandle other);
+// Removes every mass and spring, keeping the capacity. Handles from before
+// stop resolving.
+void system_clear(System *system);
+// Closest mass whose center lies within radius of point, or SIZE_MAX if none
+// does. Queries use the positions as of the last system_step, masses moved by
+// hand since are only seen after the next step.
+size_t system_pick_mass(System *system, Vec2 point, Scalar radius);
+// Same, passing over the mass at index except
+size_t system_pick_other_mass(System *system, Vec2 point, Scalar radius,
+                              size_t except);
+// Writes the indices of the masses whose centers lie within radius of point
+// to indices, in index order, up to capacity of them. Returns how many there
+// are, which may be more than capacity.
+size_t system_masses_within(System *system, Vec2 point, Scalar radius,
+                            size_t *indices, size_t capacity);
+// Cuts every live spring passing within distance of the segment from start to
+// end, and returns how many were cut. Sweeping the segment from the previous
+// pointer position to the current one catches springs a fast swipe jumps over.
+size_t system_cut_segment(System *system, Vec2 start, Vec2 end,
+                          Scalar distance);
+// Stores the masses in the given order and the live springs sorted by their
+// endpoints, so that the spring loops read the masses close to each other.
+// The held_count mass indices in held are remapped along, entries past the
+// masses, as SIZE_MAX, stay as they are. Ids and handles do not change.
+// Returns false if it runs out of memory, in which case nothing changed.
+_Bool system_reorder(System *system, Ordering ordering, size_t *held,
+                     size_t held_count);
+// Calls system_reorder with reorder_ordering if the springs got spread out
+// since the last reorder, as compacting cut springs does. Only measures again
+// after the topology changed. Returns whether it reordered.
+_Bool system_reorder_if_needed(System *system, size_t *held,
+                               size_t held_count);
+// Mean distance in indices between the masses of the live springs, a proxy
+// for how far apart in memory the spring loops read
+double system_spring_span(const System *system);
+// Wakes the island of mass i, so that it moves again from the next step
+void system_wake_mass(System *system, size_t i);
+void system_wake_all(System *system);
+void system_init_grid(System *system, size_t rows, size_t cols, Vec2 origin,
+                      double cell_size, double mass, double spring_strength,
+                      double spring_dampening);
+
+const char *spring_kernel_name(SpringKernel kernel);
+void system_spring_update(System *system);
+void system_spring_update_reference(System *system);
+void system_mass_update(System *system, double dt);
+void system_mass_reset_forces(System *system);
+void system_mass_force_append(System *system, Vec2 force);
+// Adds a force field after the ones there are, which to begin with is the
+// default gravity. Returns its index in force_fields, or SIZE_MAX if there
+// are SYSTEM_MAX_FORCE_FIELDS already. Sleeping islands do not notice new or
+// changed fields until they are woken.
+size_t system_add_force_field(System *system, ForceField field);
+// Removes every force field, gravity included
+void system_clear_force_fields(System *system);
+// Adds an obstacle for the masses to collide with, and returns its index in
+// obstacles, or SIZE_MAX if there is no memory for it. To move obstacles,
+// clear them and add them again.
+size_t system_add_obstacle(System *system, Obstacle obstacle);
+void system_clear_obstacles(System *system);
+const char *solver_name(Solver solver);
+// Looks up a solver by the name solver_name gives it
+_Bool solver_from_name(const char *name, Solver *solver);
+const char *integrator_name(Integrator integrator);
+// Looks up an integrator by the name integrator_name gives it
+_Bool integrator_from_name(const char *name, Integrator *integrator);
+// Advances the system by one step of dt with its solver and integrator,
+// resolves the contacts and resets the forces. Springs tear where the step
+// first works out their forces. Forces appended before the step are held
+// constant during it, and the force fields are evaluated at the time the step
+// starts.
+void system_step(System *system, double dt);
+// Remembers the current positions as the previous physics state, call it right
+// before the last step of a frame to interpolate between the last two states
+void system_store_previous_positions(System *system);
+
+#endif
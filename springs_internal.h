@@ -0,0 +1,165 @@
+#ifndef SPRINGS_INTERNAL_H
+#define SPRINGS_INTERNAL_H
+
+#include "springs.h"
+#include <string.h>
+
+// Helpers shared between the translation units of the simulation core
+
+typedef void (*RangeFunction)(System *system, size_t begin, size_t end,
+                              void *argument);
+typedef double (*SumFunction)(System *system, size_t begin, size_t end,
+                              void *argument);
+
+// Arrays a force evaluation reads the state from and writes the forces to.
+// force may be the same array as external.
+typedef struct {
+  const Vec2 *position;
+  const Vec2 *velocity;
+  const Vec2 *external;
+  Vec2 *force;
+  uint8_t *tear_flags; // Where the spring pass flags torn springs, if tearing
+} ForceEvaluation;
+
+// Calls function over consecutive chunks of [0, count), on the thread pool if
+// there is one. Chunks never depend on the thread count.
+void system_parallel_for(System *system, size_t count, RangeFunction function,
+                         void *argument);
+// Adds up function over chunks of [0, count) in a fixed order, so the result
+// is the same for any thread count
+double system_parallel_sum(System *system, size_t count, SumFunction function,
+                           void *argument);
+
+// Scratch memory of count arrays, each holding one value per mass or spring.
+// The memory is shared, so a caller may only use one at a time of each kind.
+Vec2 *system_mass_scratch(System *system, size_t count);
+Scalar *system_spring_scratch(System *system, size_t count);
+
+// Marks everything derived from the masses and springs as out of date
+void system_invalidate_topology(System *system);
+// Swap two masses or springs within the arrays, along with their ids. The
+// endpoints of the springs are left to the caller.
+void mass_swap(MassArrays *masses, size_t a, size_t b);
+void spring_swap(SpringArrays *springs, size_t a, size_t b);
+// Give the mass or spring in index i an id, the one of a removed mass or
+// spring if there is one. A spring also goes on the lists of its masses.
+uint32_t system_assign_mass_id(System *system, size_t i);
+uint32_t system_assign_spring_id(System *system, size_t i);
+// Raises the generation counts to the ids handed out, after they grew
+void system_keep_generations(System *system);
+// Gives the masses the ids of their indices after the arrays were replaced
+// wholesale, takes the slots of the springs from their ids below
+// spring_id_count, frees the ids not in use and links the spring lists
+void system_rebuild_ids(System *system);
+// Flags for a pass to mark the springs it finds torn in, all zero, or NULL
+// unless tear_springs is set
+uint8_t *system_tear_flags(System *system);
+// Cuts the springs a pass over [0, count) flagged and puts them on
+// tear_events, measured at the given positions. With counted set the pass ran
+// through system_parallel_sum, and only the chunks it counted flags in are
+// looked at.
+void system_tear_flagged(System *system, size_t count, _Bool counted,
+                         const Vec2 *position);
+// Puts a tear on tear_events, dropping it if there is no memory for it
+void system_list_tear(System *system, TearEvent event);
+// Moves the springs cut since the last call out of the active range if the
+// system compacts springs. Call before deriving anything from the springs.
+void system_compact_springs(System *system);
+_Bool system_build_adjacency(System *system);
+// Computes the external plus spring forces on every mass for the given state,
+// using the batched kernel, and tears the springs if tear is set. Returns
+// false if the adjacency cannot be built.
+_Bool system_evaluate_forces(System *system, const Vec2 *position,
+                             const Vec2 *velocity, const Vec2 *external,
+                             Vec2 *force, _Bool tear);
+
+// Brings the island labels up to date, relabeling the islands that lost
+// springs. Returns false if it runs out of memory.
+_Bool system_update_islands(System *system);
+// Puts the islands that settled in the last step to sleep and wakes the ones
+// an island that moved came close to
+void system_update_sleep(System *system);
+// Notes that the spring in slot i was cut, which wakes its island and has it
+// relabeled by the next system_update_islands
+void system_island_spring_cut(System *system, size_t i);
+// Has the next system_update_islands label every mass again, waking them all
+void system_invalidate_islands(System *system);
+void system_free_islands(System *system);
+
+// Takes one semi-implicit Euler step with the batched kernel in two sweeps,
+// one over the springs and one over the masses that also resets their
+// forces. Returns false if the adjacency cannot be built.
+_Bool system_fused_euler_step(System *system, double dt);
+
+// Brings force_field_sum up to date with the enabled force fields
+void system_sum_force_fields(System *system);
+// Acceleration of force field i at position, for the fields that vary over
+// space
+Vec2 force_field_local_acceleration(const System *system, size_t i,
+                                    Vec2 position);
+
+// Brings the mass hash, and the spring hash if springs is set, up to date with
+// the positions, rebuilding them if some mass moved more than max_slack cells
+// since the last build. Returns false if they cannot be built.
+_Bool system_hashes_ready(System *system, Scalar max_slack, _Bool springs);
+// Pushes the masses out of each other and the obstacles, and takes away their
+// speed into the contact. Does nothing without collisions or obstacles.
+void system_collide(System *system);
+void system_free_collisions(System *system);
+
+// Takes one XPBD step, returns false if the solver cannot get its memory
+_Bool system_xpbd_step(System *system, double dt);
+
+// Builds one clone of a kernel per instruction set and lets the loader pick
+// the widest one the CPU supports: AVX-512 and AVX2 evaluate 16 and 8 springs
+// per iteration, the SSE2 baseline 4, and half as many in the double build.
+// Other targets, such as NEON on AArch64, vectorize the single default build.
+// The AVX-512 clone would fuse multiplies and adds wherever each kernel's
+// shape lets it, whatever the command line says, so kernels that have to
+// round alike keep every operation rounded on its own.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SPRING_KERNEL_CLONES                                                   \
+  __attribute__((target_clones("avx512f", "avx2", "default"),                 \
+                 optimize("fp-contract=off")))
+#else
+#define SPRING_KERNEL_CLONES
+#endif
+
+// Snapshots and recordings are written as the values are in memory, which is
+// only the little endian layout of their files on little endian hosts
+static inline _Bool host_little_endian(void) {
+  uint16_t one = 1;
+  uint8_t first;
+  memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+static inline _Bool system_mass_asleep(const System *system, size_t i) {
+  return system->sleeping_island_count > 0 &&
+         system->islands.sleeping[system->mass_island[i]];
+}
+
+// Acceleration of mass i from the force fields and the force on it, at the
+// given position and velocity
+static inline Vec2 mass_acceleration(const System *system, size_t i,
+                                     Vec2 position, Vec2 velocity,
+                                     Vec2 force) {
+  const MassArrays *masses = &system->masses;
+  if (masses->fixed[i]) {
+    return vec2_zero();
+  }
+  const ForceFieldSum *fields = &system->force_field_sum;
+  Vec2 acceleration = fields->acceleration;
+  if (fields->drag != SCALAR_C(0.0)) {
+    acceleration =
+        vec2_subtract(acceleration, vec2_scale(velocity, fields->drag));
+  }
+  for (size_t k = 0; k < fields->local_count; ++k) {
+    acceleration = vec2_add(acceleration, force_field_local_acceleration(
+                                              system, fields->local[k],
+                                              position));
+  }
+  return vec2_add(acceleration, vec2_scale(force, masses->inverse_mass[i]));
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "thread_pool.h"
+#include <stdlib.h>
+
+// Runs tasks of the current job until none are left, with the mutex held
+static void thread_pool_work(ThreadPool *pool) {
+  while (pool->next_task < pool->task_count) {
+    size_t task = pool->next_task++;
+    pthread_mutex_unlock(&pool->mutex);
+    pool->task(pool->context, task);
+    pthread_mutex_lock(&pool->mutex);
+    if (++pool->done_count == pool->task_count) {
+      pthread_cond_broadcast(&pool->finish);
+    }
+  }
+}
+
+static void *thread_pool_worker(void *argument) {
+  ThreadPool *pool = argument;
+  size_t generation = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (!pool->stop && pool->generation == generation) {
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    }
+    if (pool->stop) {
+      break;
+    }
+    generation = pool->generation;
+    thread_pool_work(pool);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+void thread_pool_free(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for (size_t i = 0; i < pool->worker_count; ++i) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  pthread_cond_destroy(&pool->finish);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->workers);
+  *pool = (ThreadPool){0};
+}
+
+_Bool thread_pool_init(ThreadPool *pool, size_t worker_count) {
+  *pool = (ThreadPool){0};
+  pool->workers = malloc(worker_count * sizeof(*pool->workers));
+  if (pool->workers == NULL) {
+    return false;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->finish, NULL);
+  for (; pool->worker_count < worker_count; ++pool->worker_count) {
+    if (pthread_create(&pool->workers[pool->worker_count], NULL,
+                       thread_pool_worker, pool) != 0) {
+      thread_pool_free(pool);
+      return false;
+    }
+  }
+  return true;
+}
+
+void thread_pool_run(ThreadPool *pool, PoolTask task, void *context,
+                     size_t task_count) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->task = task;
+  pool->context = context;
+  pool->task_count = task_count;
+  pool->next_task = 0;
+  pool->done_count = 0;
+  ++pool->generation;
+  pthread_cond_broadcast(&pool->start);
+  thread_pool_work(pool);
+  while (pool->done_count < pool->task_count) {
+    pthread_cond_wait(&pool->finish, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *background_thread_main(void *argument) {
+  BackgroundThread *thread = argument;
+  pthread_mutex_lock(&thread->mutex);
+  while (true) {
+    while (!thread->stop && thread->task == NULL) {
+      pthread_cond_wait(&thread->start, &thread->mutex);
+    }
+    if (thread->stop) {
+      break;
+    }
+    pthread_mutex_unlock(&thread->mutex);
+    thread->task(thread->context);
+    pthread_mutex_lock(&thread->mutex);
+    thread->task = NULL;
+    pthread_cond_broadcast(&thread->finish);
+  }
+  pthread_mutex_unlock(&thread->mutex);
+  return NULL;
+}
+
+_Bool background_thread_init(BackgroundThread *thread) {
+  *thread = (BackgroundThread){0};
+  pthread_mutex_init(&thread->mutex, NULL);
+  pthread_cond_init(&thread->start, NULL);
+  pthread_cond_init(&thread->finish, NULL);
+  thread->started = pthread_create(&thread->thread, NULL,
+                                   background_thread_main, thread) == 0;
+  if (!thread->started) {
+    pthread_cond_destroy(&thread->finish);
+    pthread_cond_destroy(&thread->start);
+    pthread_mutex_destroy(&thread->mutex);
+  }
+  return thread->started;
+}
+
+void background_thread_free(BackgroundThread *thread) {
+  if (thread->started) {
+    pthread_mutex_lock(&thread->mutex);
+    while (thread->task != NULL) {
+      pthread_cond_wait(&thread->finish, &thread->mutex);
+    }
+    thread->stop = true;
+    pthread_cond_broadcast(&thread->start);
+    pthread_mutex_unlock(&thread->mutex);
+    pthread_join(thread->thread, NULL);
+    pthread_cond_destroy(&thread->finish);
+    pthread_cond_destroy(&thread->start);
+    pthread_mutex_destroy(&thread->mutex);
+  }
+  *thread = (BackgroundThread){0};
+}
+
+void background_thread_start(BackgroundThread *thread, BackgroundTask task,
+                             void *context) {
+  if (!thread->started) {
+    task(context);
+    return;
+  }
+  pthread_mutex_lock(&thread->mutex);
+  while (thread->task != NULL) {
+    pthread_cond_wait(&thread->finish, &thread->mutex);
+  }
+  thread->task = task;
+  thread->context = context;
+  pthread_cond_broadcast(&thread->start);
+  pthread_mutex_unlock(&thread->mutex);
+}
+
+void background_thread_wait(BackgroundThread *thread) {
+  if (!thread->started) {
+    return;
+  }
+  pthread_mutex_lock(&thread->mutex);
+  while (thread->task != NULL) {
+    pthread_cond_wait(&thread->finish, &thread->mutex);
+  }
+  pthread_mutex_unlock(&thread->mutex);
+}
@@ -0,0 +1,56 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*PoolTask)(void *context, size_t task);
+
+// Persistent worker threads that run numbered tasks. The thread calling
+// thread_pool_run takes part in the work and returns once all tasks are done.
+typedef struct {
+  pthread_t *workers;
+  size_t worker_count;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t finish;
+  PoolTask task;
+  void *context;
+  size_t task_count;
+  size_t next_task;
+  size_t done_count;
+  size_t generation;
+  _Bool stop;
+} ThreadPool;
+
+_Bool thread_pool_init(ThreadPool *pool, size_t worker_count);
+void thread_pool_free(ThreadPool *pool);
+void thread_pool_run(ThreadPool *pool, PoolTask task, void *context,
+                     size_t task_count);
+
+typedef void (*BackgroundTask)(void *context);
+
+// A persistent thread running one task at a time behind the back of the
+// thread that started it, which goes on with something else until it waits
+// for the task to finish
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t finish;
+  BackgroundTask task; // Set while a task is queued or running
+  void *context;
+  _Bool started; // Without the thread, tasks run on the caller
+  _Bool stop;
+} BackgroundThread;
+
+_Bool background_thread_init(BackgroundThread *thread);
+// Waits for the task in flight first
+void background_thread_free(BackgroundThread *thread);
+// Waits for the task before, then hands task to the thread
+void background_thread_start(BackgroundThread *thread, BackgroundTask task,
+                             void *context);
+void background_thread_wait(BackgroundThread *thread);
+
+#endif
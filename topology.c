@@ -0,0 +1,361 @@
+#include "springs.h"
+#include "array.h"
+#include "profiler.h"
+#include "springs_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void spring_list_push(System *system, uint32_t mass_id,
+                             uint32_t entry) {
+  system->springs.next[entry] = system->masses.spring_list[mass_id];
+  system->masses.spring_list[mass_id] = entry;
+}
+
+// Takes entry out of the list of the mass with the given id. Lists are as
+// long as the mass has springs, which is a handful in a mesh.
+static void spring_list_remove(System *system, uint32_t mass_id,
+                               uint32_t entry) {
+  uint32_t *link = &system->masses.spring_list[mass_id];
+  while (*link != entry) {
+    link = &system->springs.next[*link];
+  }
+  *link = system->springs.next[entry];
+}
+
+void system_keep_generations(System *system) {
+  if (system->mass_id_count > system->mass_generation_count) {
+    system->mass_generation_count = system->mass_id_count;
+  }
+  if (system->spring_id_count > system->spring_generation_count) {
+    system->spring_generation_count = system->spring_id_count;
+  }
+}
+
+uint32_t system_assign_mass_id(System *system, size_t i) {
+  MassArrays *masses = &system->masses;
+  uint32_t id = system->free_mass_id_count > 0
+                    ? masses->free_id[--system->free_mass_id_count]
+                    : (uint32_t)system->mass_id_count++;
+  masses->id[i] = id;
+  masses->slot[id] = i;
+  masses->spring_list[id] = HANDLE_NONE;
+  system_keep_generations(system);
+  return id;
+}
+
+uint32_t system_assign_spring_id(System *system, size_t i) {
+  SpringArrays *springs = &system->springs;
+  uint32_t id = system->free_spring_id_count > 0
+                    ? springs->free_id[--system->free_spring_id_count]
+                    : (uint32_t)system->spring_id_count++;
+  springs->id[i] = id;
+  springs->slot[id] = i;
+  spring_list_push(system, system->masses.id[springs->first[i]], id << 1);
+  spring_list_push(system, system->masses.id[springs->second[i]],
+                   id << 1 | 1);
+  system_keep_generations(system);
+  return id;
+}
+
+size_t system_mass_index(const System *system, MassHandle mass) {
+  if (mass.id >= system->mass_id_count ||
+      system->masses.generation[mass.id] != mass.generation ||
+      system->masses.slot[mass.id] == HANDLE_NONE) {
+    return SIZE_MAX;
+  }
+  return system->masses.slot[mass.id];
+}
+
+size_t system_spring_id(const System *system, SpringHandle spring) {
+  if (spring.id >= system->spring_id_count ||
+      system->springs.generation[spring.id] != spring.generation ||
+      system->springs.slot[spring.id] == HANDLE_NONE) {
+    return SIZE_MAX;
+  }
+  return spring.id;
+}
+
+MassHandle system_mass_handle(const System *system, size_t i) {
+  if (i >= system->mass_count) {
+    return (MassHandle){HANDLE_NONE, 0};
+  }
+  uint32_t id = system->masses.id[i];
+  return (MassHandle){id, system->masses.generation[id]};
+}
+
+SpringHandle system_spring_handle(const System *system, size_t id) {
+  if (id >= system->spring_id_count ||
+      system->springs.slot[id] == HANDLE_NONE) {
+    return (SpringHandle){HANDLE_NONE, 0};
+  }
+  return (SpringHandle){id, system->springs.generation[id]};
+}
+
+// Unlinks a spring and frees its id. The last active spring moves into its
+// place, and the last spring into the place of that one, so every spring
+// after the active ones is still cut.
+static void spring_remove(System *system, uint32_t id) {
+  SpringArrays *springs = &system->springs;
+  const uint32_t *mass_id = system->masses.id;
+  size_t i = springs->slot[id];
+  spring_list_remove(system, mass_id[springs->first[i]], id << 1);
+  spring_list_remove(system, mass_id[springs->second[i]], id << 1 | 1);
+  if (!springs->cut[i]) {
+    system_island_spring_cut(system, i);
+  }
+  if (i < system->active_spring_count) {
+    spring_swap(springs, i, --system->active_spring_count);
+    i = system->active_spring_count;
+  }
+  spring_swap(springs, i, --system->spring_count);
+  springs->slot[id] = HANDLE_NONE;
+  ++springs->generation[id];
+  springs->free_id[system->free_spring_id_count++] = id;
+}
+
+_Bool system_remove_spring(System *system, SpringHandle spring) {
+  if (system_spring_id(system, spring) == SIZE_MAX) {
+    return false;
+  }
+  spring_remove(system, spring.id);
+  ++system->id_version;
+  system_invalidate_topology(system);
+  system->hash_valid = false;
+  return true;
+}
+
+// Frees the mass in index i, which has no springs left, and moves the last
+// mass into its index along with the endpoints of its springs
+static void mass_remove(System *system, size_t i) {
+  MassArrays *masses = &system->masses;
+  SpringArrays *springs = &system->springs;
+  uint32_t id = masses->id[i];
+  size_t last = --system->mass_count;
+  if (i != last) {
+    mass_swap(masses, i, last);
+    for (uint32_t entry = masses->spring_list[masses->id[i]];
+         entry != HANDLE_NONE; entry = springs->next[entry]) {
+      size_t slot = springs->slot[entry >> 1];
+      if (entry & 1) {
+        springs->second[slot] = i;
+      } else {
+        springs->first[slot] = i;
+      }
+    }
+    ++system->mass_order_version;
+  }
+  masses->slot[id] = HANDLE_NONE;
+  ++masses->generation[id];
+  masses->free_id[system->free_mass_id_count++] = id;
+
+  ++system->id_version;
+  system_invalidate_topology(system);
+  system->hash_valid = false;
+  system_invalidate_islands(system);
+}
+
+_Bool system_remove_mass(System *system, MassHandle mass) {
+  size_t i = system_mass_index(system, mass);
+  if (i == SIZE_MAX) {
+    return false;
+  }
+  while (system->masses.spring_list[mass.id] != HANDLE_NONE) {
+    spring_remove(system, system->masses.spring_list[mass.id] >> 1);
+  }
+  mass_remove(system, i);
+  return true;
+}
+
+// Puts other into keep, conserving their mass and momentum. A fixed mass
+// does not move, so it keeps its place and speed.
+static void mass_combine(MassArrays *masses, size_t keep, size_t other) {
+  Scalar keep_inverse = masses->inverse_mass[keep];
+  Scalar other_inverse = masses->inverse_mass[other];
+  if (masses->fixed[other] && !masses->fixed[keep]) {
+    masses->position[keep] = masses->position[other];
+    masses->previous_position[keep] = masses->previous_position[other];
+    masses->velocity[keep] = masses->velocity[other];
+    masses->fixed[keep] = true;
+  } else if (!masses->fixed[keep]) {
+    // The share of other in the total mass
+    Scalar share = keep_inverse / (keep_inverse + other_inverse);
+    masses->position[keep] =
+        vec2_lerp(masses->position[keep], masses->position[other], share);
+    masses->previous_position[keep] =
+        vec2_lerp(masses->previous_position[keep],
+                  masses->previous_position[other], share);
+    masses->velocity[keep] =
+        vec2_lerp(masses->velocity[keep], masses->velocity[other], share);
+  }
+  masses->inverse_mass[keep] =
+      keep_inverse * other_inverse / (keep_inverse + other_inverse);
+  masses->force[keep] = vec2_add(masses->force[keep], masses->force[other]);
+}
+
+_Bool system_merge_masses(System *system, MassHandle keep, MassHandle other) {
+  size_t k = system_mass_index(system, keep);
+  size_t o = system_mass_index(system, other);
+  if (k == SIZE_MAX || o == SIZE_MAX || k == o) {
+    return false;
+  }
+  MassArrays *masses = &system->masses;
+  SpringArrays *springs = &system->springs;
+  mass_combine(masses, k, o);
+  // Springs between the two would be left without a span
+  uint32_t *list = &masses->spring_list[other.id];
+  while (*list != HANDLE_NONE) {
+    uint32_t entry = *list;
+    size_t slot = springs->slot[entry >> 1];
+    uint32_t far = (entry & 1) ? springs->first[slot] : springs->second[slot];
+    if (far == k || far == o) {
+      spring_remove(system, entry >> 1);
+      continue;
+    }
+    *list = springs->next[entry];
+    spring_list_push(system, keep.id, entry);
+    if (entry & 1) {
+      springs->second[slot] = k;
+    } else {
+      springs->first[slot] = k;
+    }
+  }
+  mass_remove(system, o);
+  return true;
+}
+
+void system_clear(System *system) {
+  for (size_t i = 0; i < system->mass_id_count; ++i) {
+    ++system->masses.generation[i];
+  }
+  for (size_t i = 0; i < system->spring_id_count; ++i) {
+    ++system->springs.generation[i];
+  }
+  system->mass_count = 0;
+  system->spring_count = 0;
+  system->active_spring_count = 0;
+  system->mass_id_count = 0;
+  system->spring_id_count = 0;
+  system->free_mass_id_count = 0;
+  system->free_spring_id_count = 0;
+  system->torn_count = 0;
+  system->tear_event_count = 0;
+  ++system->id_version;
+  system_invalidate_topology(system);
+  system->hash_valid = false;
+  system_invalidate_islands(system);
+}
+
+void system_rebuild_ids(System *system) {
+  MassArrays *masses = &system->masses;
+  SpringArrays *springs = &system->springs;
+  for (size_t i = 0; i < system->mass_count; ++i) {
+    masses->id[i] = i;
+    masses->slot[i] = i;
+    masses->spring_list[i] = HANDLE_NONE;
+  }
+  system->mass_id_count = system->mass_count;
+  system->free_mass_id_count = 0;
+  system_keep_generations(system);
+
+  for (size_t id = 0; id < system->spring_id_count; ++id) {
+    springs->slot[id] = HANDLE_NONE;
+  }
+  for (size_t i = 0; i < system->spring_count; ++i) {
+    uint32_t id = springs->id[i];
+    springs->slot[id] = i;
+    spring_list_push(system, springs->first[i], id << 1);
+    spring_list_push(system, springs->second[i], id << 1 | 1);
+  }
+  // Handed out again lowest first
+  system->free_spring_id_count = 0;
+  for (size_t id = system->spring_id_count; id-- > 0;) {
+    if (springs->slot[id] == HANDLE_NONE) {
+      springs->free_id[system->free_spring_id_count++] = id;
+    }
+  }
+}
+
+uint8_t *system_tear_flags(System *system) {
+  if (!system->tear_springs) {
+    return NULL;
+  }
+  size_t capacity = system->spring_count;
+  if (capacity > system->tear_flag_capacity) {
+    _Bool ok = true;
+    ARRAY_RESIZE(system->tear_flags, capacity, ok);
+    if (!ok) {
+      printf("ERROR: Cannot allocate memory for tearing springs\n");
+      return NULL;
+    }
+    // Passes only write the flags of the springs they evaluate
+    memset(system->tear_flags + system->tear_flag_capacity, 0,
+           capacity - system->tear_flag_capacity);
+    system->tear_flag_capacity = capacity;
+  }
+  return system->tear_flags;
+}
+
+void system_list_tear(System *system, TearEvent event) {
+  if (system->tear_event_count == system->tear_event_capacity) {
+    size_t capacity = system->tear_event_capacity < SYSTEM_MIN_CAPACITY
+                          ? SYSTEM_MIN_CAPACITY
+                          : 2 * system->tear_event_capacity;
+    _Bool ok = true;
+    ARRAY_RESIZE(system->tear_events, capacity, ok);
+    if (!ok) {
+      PROFILE_COUNT(PROFILE_COUNTER_DROPPED, 1);
+      return;
+    }
+    system->tear_event_capacity = capacity;
+  }
+  system->tear_events[system->tear_event_count++] = event;
+}
+
+// Cuts the spring in slot i and lists the tear
+static void spring_tear(System *system, size_t i, const Vec2 *position) {
+  SpringArrays *springs = &system->springs;
+  springs->cut[i] = true;
+  system_island_spring_cut(system, i);
+  Vec2 first = position[springs->first[i]];
+  Vec2 second = position[springs->second[i]];
+  system_list_tear(
+      system,
+      (TearEvent){
+          .spring = springs->id[i],
+          .position = vec2_lerp(first, second, SCALAR_C(0.5)),
+          .strain = vec2_length(vec2_subtract(second, first)) /
+                        springs->length[i] -
+                    SCALAR_C(1.0),
+          .time = system->time,
+      });
+}
+
+void system_tear_flagged(System *system, size_t count, _Bool counted,
+                         const Vec2 *position) {
+  size_t chunk_count = (count + SYSTEM_CHUNK_SIZE - 1) / SYSTEM_CHUNK_SIZE;
+  // system_parallel_sum falls back to one sum without chunk sums
+  counted = counted && system->chunk_sum_capacity >= chunk_count;
+  uint8_t *tear_flags = system->tear_flags;
+  size_t torn = 0;
+  for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+    if (counted && system->chunk_sums[chunk] == 0.0) {
+      continue;
+    }
+    size_t begin = chunk * SYSTEM_CHUNK_SIZE;
+    size_t end = begin + SYSTEM_CHUNK_SIZE < count ? begin + SYSTEM_CHUNK_SIZE
+                                                   : count;
+    for (size_t i = begin; i < end; ++i) {
+      if (tear_flags[i]) {
+        tear_flags[i] = 0;
+        spring_tear(system, i, position);
+        ++torn;
+      }
+    }
+  }
+  if (torn > 0) {
+    system->torn_count += torn;
+    PROFILE_COUNT(PROFILE_COUNTER_CUT_SPRINGS, torn);
+    system_invalidate_topology(system);
+  }
+}
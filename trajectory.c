@@ -0,0 +1,628 @@
+#include "trajectory.h"
+#include "springs_internal.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef SPRINGS_ZSTD
+#include <zstd.h>
+#endif
+
+#define VARINT_MAX_BYTES 10
+
+static size_t varint_put(uint8_t *out, uint64_t value) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = (uint8_t)value;
+  return size;
+}
+
+static _Bool varint_get(const uint8_t **in, const uint8_t *end,
+                        uint64_t *value) {
+  *value = 0;
+  for (size_t shift = 0; shift < 7 * VARINT_MAX_BYTES && *in < end;
+       shift += 7) {
+    uint8_t byte = *(*in)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t zigzag_encode(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+  return (int64_t)((value >> 1) ^ -(value & 1));
+}
+
+// Worst case payload of a frame, every coordinate and spring id at full size
+static size_t trajectory_payload_capacity(size_t mass_count,
+                                          size_t spring_count) {
+  return 2 * mass_count * VARINT_MAX_BYTES + spring_count * 5 + 1;
+}
+
+static _Bool predictor_init(TrajectoryPredictor *predictor,
+                            size_t mass_count) {
+  *predictor = (TrajectoryPredictor){0};
+  size_t count = mass_count > 0 ? 2 * mass_count : 1;
+  predictor->last = malloc(count * sizeof(*predictor->last));
+  predictor->before_last = malloc(count * sizeof(*predictor->before_last));
+  return predictor->last != NULL && predictor->before_last != NULL;
+}
+
+static void predictor_free(TrajectoryPredictor *predictor) {
+  free(predictor->last);
+  free(predictor->before_last);
+  *predictor = (TrajectoryPredictor){0};
+}
+
+// Prediction for coordinate k, linear once two frames since the keyframe are
+// known
+static int64_t predictor_guess(const TrajectoryPredictor *predictor, size_t k,
+                               _Bool keyframe) {
+  if (keyframe) {
+    return 0;
+  }
+  if (predictor->frames_since_keyframe < 2) {
+    return predictor->last[k];
+  }
+  return 2 * (int64_t)predictor->last[k] - predictor->before_last[k];
+}
+
+// Call after every coordinate k of the frame went to before_last[k]
+static void predictor_advance(TrajectoryPredictor *predictor,
+                              _Bool keyframe) {
+  int32_t *swapped = predictor->last;
+  predictor->last = predictor->before_last;
+  predictor->before_last = swapped;
+  predictor->frames_since_keyframe =
+      keyframe ? 1 : predictor->frames_since_keyframe + 1;
+}
+
+static int32_t quantize(Scalar value, float quantum) {
+  double scaled = rint(value / (double)quantum);
+  if (!(scaled > INT32_MIN)) { // Also catches NaN
+    return scaled < 0.0 ? INT32_MIN : 0;
+  }
+  return scaled < INT32_MAX ? (int32_t)scaled : INT32_MAX;
+}
+
+static size_t trajectory_encode(TrajectoryRecorder *recorder,
+                                const TrajectoryBuffer *buffer,
+                                _Bool keyframe, uint32_t *cut_count) {
+  uint8_t *out = recorder->encoded;
+  size_t size = 0;
+  *cut_count = 0;
+  if (keyframe) {
+    for (size_t i = 0; i < recorder->spring_count; ++i) {
+      if (recorder->cut_written[i]) {
+        size += varint_put(out + size, i);
+        ++*cut_count;
+      }
+    }
+  } else {
+    for (size_t i = 0; i < buffer->cut_count; ++i) {
+      size += varint_put(out + size, buffer->cuts[i]);
+    }
+    *cut_count = buffer->cut_count;
+  }
+
+  TrajectoryPredictor *predictor = &recorder->predictor;
+  const Scalar *coordinates = (const Scalar *)buffer->position;
+  for (size_t k = 0; k < 2 * recorder->mass_count; ++k) {
+    int32_t quantized = quantize(coordinates[k], recorder->quantum);
+    int64_t guess = predictor_guess(predictor, k, keyframe);
+    size += varint_put(out + size, zigzag_encode(quantized - guess));
+    predictor->before_last[k] = quantized;
+  }
+  predictor_advance(predictor, keyframe);
+  return size;
+}
+
+static void trajectory_write(TrajectoryRecorder *recorder,
+                             const TrajectoryBuffer *buffer) {
+  if (buffer->reset && recorder->spring_count > 0) { // Else may be NULL
+    memset(recorder->cut_written, 0, recorder->spring_count);
+  }
+  for (size_t i = 0; i < buffer->cut_count; ++i) {
+    recorder->cut_written[buffer->cuts[i]] = true;
+  }
+  size_t since_keyframe = recorder->predictor.frames_since_keyframe;
+  _Bool keyframe = buffer->reset || since_keyframe == 0 ||
+                   since_keyframe >= TRAJECTORY_KEYFRAME_INTERVAL;
+  TrajectoryFrameHeader header = {
+      .index = buffer->index,
+      .flags = keyframe ? TRAJECTORY_KEYFRAME : 0,
+  };
+  header.encoded_size =
+      trajectory_encode(recorder, buffer, keyframe, &header.cut_count);
+  header.stored_size = header.encoded_size;
+  const uint8_t *payload = recorder->encoded;
+#ifdef SPRINGS_ZSTD
+  if (recorder->compress) {
+    size_t compressed_size = ZSTD_compress(
+        recorder->compressed, recorder->compressed_capacity, recorder->encoded,
+        header.encoded_size, TRAJECTORY_ZSTD_LEVEL);
+    if (!ZSTD_isError(compressed_size)) {
+      header.flags |= TRAJECTORY_COMPRESSED;
+      header.stored_size = compressed_size;
+      payload = recorder->compressed;
+    }
+  }
+#endif
+  if (fwrite(&header, sizeof(header), 1, recorder->file) != 1 ||
+      fwrite(payload, 1, header.stored_size, recorder->file) !=
+          header.stored_size) {
+    recorder->write_failed = true;
+  }
+}
+
+static void *trajectory_writer(void *argument) {
+  TrajectoryRecorder *recorder = argument;
+  pthread_mutex_lock(&recorder->mutex);
+  while (true) {
+    while (!recorder->pending_ready && !recorder->stop) {
+      pthread_cond_wait(&recorder->ready, &recorder->mutex);
+    }
+    if (!recorder->pending_ready) {
+      break;
+    }
+    TrajectoryBuffer *swapped = recorder->writing;
+    recorder->writing = recorder->pending;
+    recorder->pending = swapped;
+    recorder->pending_ready = false;
+    pthread_cond_signal(&recorder->taken);
+    pthread_mutex_unlock(&recorder->mutex);
+    if (!recorder->write_failed) {
+      trajectory_write(recorder, recorder->writing);
+    }
+    pthread_mutex_lock(&recorder->mutex);
+  }
+  pthread_mutex_unlock(&recorder->mutex);
+  return NULL;
+}
+
+static void trajectory_recorder_release(TrajectoryRecorder *recorder) {
+  for (size_t i = 0; i < 2; ++i) {
+    free(recorder->buffers[i].position);
+    free(recorder->buffers[i].cuts);
+  }
+  free(recorder->cut_recorded);
+  free(recorder->cut_written);
+  free(recorder->encoded);
+  free(recorder->compressed);
+  predictor_free(&recorder->predictor);
+}
+
+static _Bool write_u32(FILE *file, const uint32_t *values, size_t count) {
+  return fwrite(values, sizeof(*values), count, file) == count;
+}
+
+static _Bool trajectory_write_topology(FILE *file, const System *system) {
+  const SpringArrays *springs = &system->springs;
+  size_t mass_count = system->mass_count;
+  size_t spring_count = system->spring_count;
+  if (fwrite(system->masses.fixed, 1, mass_count, file) != mass_count) {
+    return false;
+  }
+  // Springs go by id, which compaction may have moved away from their index
+  uint32_t *values = malloc((spring_count > 0 ? spring_count : 1) *
+                            sizeof(*values));
+  _Bool ok = values != NULL;
+  for (size_t i = 0; i < spring_count && ok; ++i) {
+    values[i] = springs->first[springs->slot[i]];
+  }
+  ok = ok && write_u32(file, values, spring_count);
+  for (size_t i = 0; i < spring_count && ok; ++i) {
+    values[i] = springs->second[springs->slot[i]];
+  }
+  ok = ok && write_u32(file, values, spring_count);
+  for (size_t i = 0; i < spring_count && ok; ++i) {
+    float length = springs->length[springs->slot[i]];
+    memcpy(&values[i], &length, sizeof(length));
+  }
+  ok = ok && write_u32(file, values, spring_count);
+  free(values);
+  return ok;
+}
+
+_Bool trajectory_recorder_open(TrajectoryRecorder *recorder,
+                               const System *system, const char *path,
+                               float quantum, _Bool compress) {
+  *recorder = (TrajectoryRecorder){
+      .mass_count = system->mass_count,
+      .spring_count = system->spring_count,
+      .quantum = quantum > 0.0f ? quantum : TRAJECTORY_DEFAULT_QUANTUM,
+      .compress = compress,
+  };
+  if (!host_little_endian()) {
+    printf("ERROR: Recordings are only supported on little endian hosts\n");
+    return false;
+  }
+#ifndef SPRINGS_ZSTD
+  if (compress) {
+    printf("ERROR: Compressed recordings need make ZSTD=1\n");
+    return false;
+  }
+#endif
+  // The header lists the springs by id, which leaves no room for free ones
+  if (system->spring_id_count != system->spring_count) {
+    printf("ERROR: Cannot record a system that springs were removed from\n");
+    return false;
+  }
+
+  size_t mass_count = recorder->mass_count > 0 ? recorder->mass_count : 1;
+  size_t spring_count =
+      recorder->spring_count > 0 ? recorder->spring_count : 1;
+  size_t payload_capacity =
+      trajectory_payload_capacity(recorder->mass_count, recorder->spring_count);
+  _Bool ok = predictor_init(&recorder->predictor, recorder->mass_count);
+  for (size_t i = 0; i < 2; ++i) {
+    TrajectoryBuffer *buffer = &recorder->buffers[i];
+    buffer->position = malloc(mass_count * sizeof(*buffer->position));
+    // An id is only listed again after a reset clears the list
+    buffer->cuts = malloc(spring_count * sizeof(*buffer->cuts));
+    ok = ok && buffer->position != NULL && buffer->cuts != NULL;
+  }
+  recorder->cut_recorded = calloc(spring_count, 1);
+  recorder->cut_written = calloc(spring_count, 1);
+  recorder->encoded = malloc(payload_capacity);
+  ok = ok && recorder->cut_recorded != NULL &&
+       recorder->cut_written != NULL && recorder->encoded != NULL;
+#ifdef SPRINGS_ZSTD
+  if (compress) {
+    recorder->compressed_capacity = ZSTD_compressBound(payload_capacity);
+    recorder->compressed = malloc(recorder->compressed_capacity);
+    ok = ok && recorder->compressed != NULL;
+  }
+#endif
+  if (!ok) {
+    printf("ERROR: Cannot allocate memory for recording\n");
+    trajectory_recorder_release(recorder);
+    return false;
+  }
+
+  recorder->file = fopen(path, "wb");
+  if (recorder->file == NULL) {
+    printf("ERROR: Cannot open %s for writing\n", path);
+    trajectory_recorder_release(recorder);
+    return false;
+  }
+  TrajectoryHeader header = {
+      .magic = TRAJECTORY_MAGIC,
+      .version = TRAJECTORY_VERSION,
+      .header_size = sizeof(TrajectoryHeader),
+      .mass_count = recorder->mass_count,
+      .spring_count = recorder->spring_count,
+      .quantum = recorder->quantum,
+      .keyframe_interval = TRAJECTORY_KEYFRAME_INTERVAL,
+  };
+  if (fwrite(&header, sizeof(header), 1, recorder->file) != 1 ||
+      !trajectory_write_topology(recorder->file, system)) {
+    printf("ERROR: Cannot write %s\n", path);
+    fclose(recorder->file);
+    trajectory_recorder_release(recorder);
+    return false;
+  }
+
+  recorder->pending = &recorder->buffers[0];
+  recorder->writing = &recorder->buffers[1];
+  // The first frame lists the springs cut before recording started
+  recorder->topology_version = system->topology_version - 1;
+  recorder->mass_order_version = system->mass_order_version;
+  recorder->id_version = system->id_version;
+  pthread_mutex_init(&recorder->mutex, NULL);
+  pthread_cond_init(&recorder->ready, NULL);
+  pthread_cond_init(&recorder->taken, NULL);
+  if (pthread_create(&recorder->writer, NULL, trajectory_writer, recorder) !=
+      0) {
+    printf("ERROR: Cannot start the recording thread\n");
+    pthread_cond_destroy(&recorder->ready);
+    pthread_cond_destroy(&recorder->taken);
+    pthread_mutex_destroy(&recorder->mutex);
+    fclose(recorder->file);
+    trajectory_recorder_release(recorder);
+    return false;
+  }
+  return true;
+}
+
+// Lists the springs cut since the last frame, or all of them from scratch if
+// any spring was uncut, as regenerating the same system does
+static void trajectory_collect_cuts(TrajectoryRecorder *recorder,
+                                    const System *system,
+                                    TrajectoryBuffer *buffer) {
+  const SpringArrays *springs = &system->springs;
+  _Bool reset = false;
+  for (size_t i = 0; i < recorder->spring_count && !reset; ++i) {
+    reset = recorder->cut_recorded[i] && !springs->cut[springs->slot[i]];
+  }
+  if (reset) {
+    memset(recorder->cut_recorded, 0, recorder->spring_count);
+    buffer->cut_count = 0;
+    buffer->reset = true;
+  }
+  for (size_t i = 0; i < recorder->spring_count; ++i) {
+    if (springs->cut[springs->slot[i]] && !recorder->cut_recorded[i]) {
+      recorder->cut_recorded[i] = true;
+      buffer->cuts[buffer->cut_count++] = i;
+    }
+  }
+}
+
+_Bool trajectory_recorder_frame(TrajectoryRecorder *recorder,
+                                const System *system) {
+  if (recorder->stopped) {
+    return false;
+  }
+  if (system->mass_count != recorder->mass_count ||
+      system->spring_count != recorder->spring_count ||
+      system->mass_order_version != recorder->mass_order_version ||
+      system->id_version != recorder->id_version) {
+    printf("ERROR: Recording stopped, the system changed or reordered its "
+           "masses or springs\n");
+    recorder->stopped = true;
+    return false;
+  }
+
+  pthread_mutex_lock(&recorder->mutex);
+  while (recorder->keep_every_frame && recorder->pending_ready) {
+    pthread_cond_wait(&recorder->taken, &recorder->mutex);
+  }
+  TrajectoryBuffer *buffer = recorder->pending;
+  if (recorder->pending_ready) {
+    // The writer has not taken the last frame, which this one replaces
+    ++recorder->dropped_frames;
+  } else {
+    buffer->cut_count = 0;
+    buffer->reset = false;
+  }
+  memcpy(buffer->position, system->masses.position,
+         recorder->mass_count * sizeof(*buffer->position));
+  if (system->topology_version != recorder->topology_version) {
+    trajectory_collect_cuts(recorder, system, buffer);
+    recorder->topology_version = system->topology_version;
+  }
+  buffer->index = recorder->frame_count++;
+  recorder->pending_ready = true;
+  pthread_cond_signal(&recorder->ready);
+  pthread_mutex_unlock(&recorder->mutex);
+  return true;
+}
+
+_Bool trajectory_recorder_close(TrajectoryRecorder *recorder) {
+  pthread_mutex_lock(&recorder->mutex);
+  recorder->stop = true;
+  pthread_cond_signal(&recorder->ready);
+  pthread_mutex_unlock(&recorder->mutex);
+  pthread_join(recorder->writer, NULL);
+  pthread_cond_destroy(&recorder->ready);
+  pthread_cond_destroy(&recorder->taken);
+  pthread_mutex_destroy(&recorder->mutex);
+
+  _Bool ok = fclose(recorder->file) == 0 && !recorder->write_failed;
+  if (!ok) {
+    printf("ERROR: Cannot write all frames of the recording\n");
+  }
+  trajectory_recorder_release(recorder);
+  recorder->file = NULL;
+  return ok;
+}
+
+static _Bool read_u32(FILE *file, uint32_t *values, size_t count) {
+  return fread(values, sizeof(*values), count, file) == count;
+}
+
+// Reads the topology after the header into system, with every mass at the
+// origin and no spring cut
+static _Bool trajectory_read_topology(TrajectoryPlayer *player,
+                                      System *system) {
+  size_t mass_count = player->header.mass_count;
+  size_t spring_count = player->header.spring_count;
+  uint8_t *fixed = malloc(mass_count > 0 ? mass_count : 1);
+  uint32_t *values =
+      malloc(3 * (spring_count > 0 ? spring_count : 1) * sizeof(*values));
+  uint32_t *first = values;
+  uint32_t *second = values + spring_count;
+  uint32_t *length = values + 2 * spring_count;
+  _Bool ok = fixed != NULL && values != NULL &&
+             fread(fixed, 1, mass_count, player->file) == mass_count &&
+             read_u32(player->file, values, 3 * spring_count);
+  for (size_t i = 0; i < spring_count && ok; ++i) {
+    ok = first[i] < mass_count && second[i] < mass_count;
+  }
+  if (ok) {
+    system_clear(system);
+    // Cut springs are uncut again on keyframes, so none may be compacted
+    system->compact_springs = false;
+    system_reserve(system, mass_count, spring_count);
+    for (size_t i = 0; i < mass_count; ++i) {
+      system_add_mass(system,
+                      (Mass){.mass = DEFAULT_GRID_MASS, .fixed = fixed[i]});
+    }
+    for (size_t i = 0; i < spring_count; ++i) {
+      float rest_length;
+      memcpy(&rest_length, &length[i], sizeof(rest_length));
+      system_add_spring(system, (Spring){.length = rest_length}, first[i],
+                        second[i]);
+    }
+    ok = system->mass_count == mass_count &&
+         system->spring_count == spring_count;
+  }
+  free(fixed);
+  free(values);
+  return ok;
+}
+
+_Bool trajectory_player_open(TrajectoryPlayer *player, const char *path,
+                             System *system) {
+  *player = (TrajectoryPlayer){0};
+  if (!host_little_endian()) {
+    printf("ERROR: Recordings are only supported on little endian hosts\n");
+    return false;
+  }
+  player->file = fopen(path, "rb");
+  if (player->file == NULL) {
+    printf("ERROR: Cannot open recording %s\n", path);
+    return false;
+  }
+  TrajectoryHeader *header = &player->header;
+  if (fread(header, sizeof(*header), 1, player->file) != 1 ||
+      memcmp(header->magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) != 0) {
+    printf("ERROR: %s is not a recording\n", path);
+    trajectory_player_close(player);
+    return false;
+  }
+  if (header->version != TRAJECTORY_VERSION ||
+      header->header_size != sizeof(TrajectoryHeader) ||
+      header->mass_count >= UINT32_MAX ||
+      header->spring_count >= UINT32_MAX / 2 || !(header->quantum > 0.0f)) {
+    printf("ERROR: Unsupported recording %s\n", path);
+    trajectory_player_close(player);
+    return false;
+  }
+  player->encoded_capacity =
+      trajectory_payload_capacity(header->mass_count, header->spring_count);
+  player->encoded = malloc(player->encoded_capacity);
+  if (player->encoded == NULL ||
+      !predictor_init(&player->predictor, header->mass_count)) {
+    printf("ERROR: Cannot allocate memory for replaying\n");
+    trajectory_player_close(player);
+    return false;
+  }
+  if (!trajectory_read_topology(player, system)) {
+    printf("ERROR: Cannot read the masses and springs of %s\n", path);
+    trajectory_player_close(player);
+    return false;
+  }
+  player->first_frame = ftell(player->file);
+  if (!trajectory_player_next(player, system)) {
+    printf("ERROR: Recording %s has no frames\n", path);
+    trajectory_player_close(player);
+    return false;
+  }
+  memcpy(system->masses.previous_position, system->masses.position,
+         system->mass_count * sizeof(Vec2));
+  return true;
+}
+
+static _Bool trajectory_decode(TrajectoryPlayer *player, System *system,
+                               const TrajectoryFrameHeader *header,
+                               const uint8_t *in, const uint8_t *end) {
+  _Bool keyframe = header->flags & TRAJECTORY_KEYFRAME;
+  SpringArrays *springs = &system->springs;
+  if (keyframe) {
+    if (system->spring_count > 0) { // Else the array may be NULL
+      memset(springs->cut, 0, system->spring_count * sizeof(*springs->cut));
+    }
+    system_invalidate_topology(system);
+  }
+  for (size_t i = 0; i < header->cut_count; ++i) {
+    uint64_t id;
+    if (!varint_get(&in, end, &id) || id >= system->spring_count) {
+      return false;
+    }
+    system_cut_spring(system, id);
+  }
+
+  MassArrays *masses = &system->masses;
+  memcpy(masses->previous_position, masses->position,
+         system->mass_count * sizeof(Vec2));
+  TrajectoryPredictor *predictor = &player->predictor;
+  Scalar *coordinates = (Scalar *)masses->position;
+  float quantum = player->header.quantum;
+  for (size_t k = 0; k < 2 * system->mass_count; ++k) {
+    uint64_t delta;
+    if (!varint_get(&in, end, &delta)) {
+      return false;
+    }
+    int64_t quantized =
+        predictor_guess(predictor, k, keyframe) + zigzag_decode(delta);
+    if (quantized < INT32_MIN || quantized > INT32_MAX) {
+      return false;
+    }
+    predictor->before_last[k] = quantized;
+    coordinates[k] = quantized * quantum;
+  }
+  predictor_advance(predictor, keyframe);
+  system->hash_moved = true;
+  ++system->motion_version;
+  return in == end;
+}
+
+_Bool trajectory_player_next(TrajectoryPlayer *player, System *system) {
+  TrajectoryFrameHeader header;
+  if (fread(&header, sizeof(header), 1, player->file) != 1) {
+    return false;
+  }
+  _Bool keyframe = header.flags & TRAJECTORY_KEYFRAME;
+  if (header.encoded_size > player->encoded_capacity ||
+      (!keyframe && player->predictor.frames_since_keyframe == 0)) {
+    printf("ERROR: Recording frame %llu is damaged\n",
+           (unsigned long long)header.index);
+    return false;
+  }
+  if (header.stored_size > player->stored_capacity) {
+    uint8_t *stored = realloc(player->stored, header.stored_size);
+    if (stored == NULL) {
+      printf("ERROR: Cannot allocate memory for replaying\n");
+      return false;
+    }
+    player->stored = stored;
+    player->stored_capacity = header.stored_size;
+  }
+  if (fread(player->stored, 1, header.stored_size, player->file) !=
+      header.stored_size) {
+    return false;
+  }
+
+  const uint8_t *payload = player->stored;
+  if (header.flags & TRAJECTORY_COMPRESSED) {
+#ifdef SPRINGS_ZSTD
+    size_t size = ZSTD_decompress(player->encoded, player->encoded_capacity,
+                                  player->stored, header.stored_size);
+    if (ZSTD_isError(size) || size != header.encoded_size) {
+      printf("ERROR: Recording frame %llu is damaged\n",
+             (unsigned long long)header.index);
+      return false;
+    }
+    payload = player->encoded;
+#else
+    printf("ERROR: Compressed recordings need make ZSTD=1\n");
+    return false;
+#endif
+  } else if (header.stored_size != header.encoded_size) {
+    printf("ERROR: Recording frame %llu is damaged\n",
+           (unsigned long long)header.index);
+    return false;
+  }
+  if (!trajectory_decode(player, system, &header, payload,
+                         payload + header.encoded_size)) {
+    printf("ERROR: Recording frame %llu is damaged\n",
+           (unsigned long long)header.index);
+    return false;
+  }
+  player->frame_index = header.index;
+  return true;
+}
+
+void trajectory_player_rewind(TrajectoryPlayer *player) {
+  fseek(player->file, player->first_frame, SEEK_SET);
+  player->predictor.frames_since_keyframe = 0;
+}
+
+void trajectory_player_close(TrajectoryPlayer *player) {
+  if (player->file != NULL) {
+    fclose(player->file);
+  }
+  free(player->stored);
+  free(player->encoded);
+  predictor_free(&player->predictor);
+  *player = (TrajectoryPlayer){0};
+}
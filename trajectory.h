@@ -0,0 +1,151 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include "springs.h"
+#include <pthread.h>
+#include <stdio.h>
+
+// Recordings of the mass positions and spring cuts of a system, frame by
+// frame, for replaying or analysing a run offline. A recording follows one
+// set of masses and springs, which its header stores by spring id.
+//
+// Positions are rounded to multiples of a quantum and every frame stores the
+// difference to a linear prediction from the two frames before, as zigzag
+// varints, so a smoothly moving mass takes one or two bytes per coordinate.
+// Keyframes store the positions themselves and the full set of cut springs,
+// and come every TRAJECTORY_KEYFRAME_INTERVAL frames. Built with make ZSTD=1,
+// frames may also be compressed with zstd.
+
+#define TRAJECTORY_MAGIC "SPRTRAJ"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_DEFAULT_QUANTUM (1.0f / 64.0f)
+#define TRAJECTORY_KEYFRAME_INTERVAL 120
+#define TRAJECTORY_ZSTD_LEVEL 3
+
+enum {
+  TRAJECTORY_KEYFRAME = 1 << 0,   // Positions and cuts do not depend on others
+  TRAJECTORY_COMPRESSED = 1 << 1, // Payload is a zstd frame
+};
+
+// The header is followed by the fixed flags of the masses as bytes, then the
+// first and second mass and the rest length of the springs by id, as 32 bit
+// little endian values. Headers and values are written as they are in memory,
+// so recording and replaying refuse big endian hosts.
+typedef struct {
+  char magic[8]; // TRAJECTORY_MAGIC, zero padded
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t mass_count;
+  uint64_t spring_count;
+  float quantum;
+  uint32_t keyframe_interval;
+} TrajectoryHeader;
+
+// Every frame starts with this, followed by stored_size bytes of payload:
+// cut_count spring ids, then the x and y of every mass, all as varints
+typedef struct {
+  uint64_t index; // Frames the recorder dropped leave gaps
+  uint32_t flags;
+  uint32_t cut_count;
+  uint32_t encoded_size; // Of the payload before compression
+  uint32_t stored_size;
+} TrajectoryFrameHeader;
+
+// State of the frame the recorder hands to its writer thread
+typedef struct {
+  Vec2 *position;
+  uint32_t *cuts; // Ids cut since the frame before, or all cut ids on reset
+  size_t cut_count;
+  uint64_t index;
+  _Bool reset; // Springs were uncut, so the cuts are the full set
+} TrajectoryBuffer;
+
+// Positions rounded by the quantum of the two frames before, shared by the
+// encoder and the decoder
+typedef struct {
+  int32_t *last;
+  int32_t *before_last;
+  size_t frames_since_keyframe;
+} TrajectoryPredictor;
+
+// Records frames on a background thread, so the simulation never waits for
+// encoding or the disk. Recording a frame only copies the positions into a
+// buffer. If the writer is still busy with the frame before, the positions
+// replace the ones waiting and that frame is dropped, but its cuts are kept.
+// Runs that must keep every frame can set keep_every_frame to wait instead.
+typedef struct {
+  FILE *file;
+  size_t mass_count;
+  size_t spring_count;
+  float quantum;
+  _Bool compress;
+  _Bool keep_every_frame;
+
+  pthread_t writer;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready; // A frame is pending
+  pthread_cond_t taken; // The writer took the pending frame
+  TrajectoryBuffer buffers[2];
+  TrajectoryBuffer *pending; // Filled by the simulation thread
+  TrajectoryBuffer *writing; // Owned by the writer thread
+  _Bool pending_ready;
+  _Bool stop;
+
+  // Simulation thread state
+  uint8_t *cut_recorded; // By spring id
+  size_t topology_version;
+  size_t mass_order_version;
+  size_t id_version;
+  uint64_t frame_count;
+  uint64_t dropped_frames;
+  _Bool stopped; // The system changed or reordered its masses or springs
+
+  // Writer thread state
+  uint8_t *cut_written; // By spring id, as of the last written frame
+  TrajectoryPredictor predictor;
+  uint8_t *encoded;
+  uint8_t *compressed;
+  size_t compressed_capacity;
+  _Bool write_failed;
+} TrajectoryRecorder;
+
+// Plays a recording back frame by frame into a system of its own
+typedef struct {
+  FILE *file;
+  TrajectoryHeader header;
+  long first_frame; // File offset to rewind to
+  TrajectoryPredictor predictor;
+  uint8_t *stored;
+  uint8_t *encoded;
+  size_t stored_capacity;
+  size_t encoded_capacity;
+  uint64_t frame_index; // Of the frame read last
+} TrajectoryPlayer;
+
+// Starts recording system to path. A quantum of zero uses
+// TRAJECTORY_DEFAULT_QUANTUM. Compressing needs make ZSTD=1.
+_Bool trajectory_recorder_open(TrajectoryRecorder *recorder,
+                               const System *system, const char *path,
+                               float quantum, _Bool compress);
+// Records the current positions and the springs cut since the last frame.
+// Returns false once recording stopped because the masses or springs changed
+// or were reordered.
+_Bool trajectory_recorder_frame(TrajectoryRecorder *recorder,
+                                const System *system);
+// Writes the frame still waiting and closes the file, returns false if any
+// frame could not be written
+_Bool trajectory_recorder_close(TrajectoryRecorder *recorder);
+
+// Opens the recording at path and replaces system with its masses and
+// springs, positioned as in the first frame
+_Bool trajectory_player_open(TrajectoryPlayer *player, const char *path,
+                             System *system);
+// Moves the masses to the next frame and applies its cuts. Returns false at
+// the end of the recording or if the frame is damaged.
+_Bool trajectory_player_next(TrajectoryPlayer *player, System *system);
+// Goes back to the first frame, which the next call to
+// trajectory_player_next reads
+void trajectory_player_rewind(TrajectoryPlayer *player);
+void trajectory_player_close(TrajectoryPlayer *player);
+
+#endif
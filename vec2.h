@@ -0,0 +1,99 @@
+#ifndef VEC2_H
+#define VEC2_H
+
+#include <math.h>
+
+// The simulation runs in float by default, which fits twice as many values in
+// a vector register and a cache line. make DOUBLE=1 builds it in double
+// instead, for reference runs. Sums over whole systems are taken in double
+// either way.
+#ifdef SPRINGS_DOUBLE
+typedef double Scalar;
+#define SCALAR_NAME "double"
+#define SCALAR_C(value) value
+#define scalar_sqrt sqrt
+#define scalar_min fmin
+#define scalar_max fmax
+#define scalar_floor floor
+#define scalar_strto strtod
+#else
+typedef float Scalar;
+#define SCALAR_NAME "float"
+#define SCALAR_C(value) value##f
+#define scalar_sqrt sqrtf
+#define scalar_min fminf
+#define scalar_max fmaxf
+#define scalar_floor floorf
+#define scalar_strto strtof
+#endif
+
+// Minimal 2D vector math for the simulation core, so that it does not depend
+// on raymath. In float builds, the layout matches Raylib's Vector2.
+typedef struct {
+  Scalar x;
+  Scalar y;
+} Vec2;
+
+static inline Vec2 vec2_zero(void) {
+  return (Vec2){SCALAR_C(0.0), SCALAR_C(0.0)};
+}
+
+static inline Vec2 vec2_add(Vec2 a, Vec2 b) {
+  return (Vec2){a.x + b.x, a.y + b.y};
+}
+
+static inline Vec2 vec2_subtract(Vec2 a, Vec2 b) {
+  return (Vec2){a.x - b.x, a.y - b.y};
+}
+
+static inline Vec2 vec2_scale(Vec2 v, Scalar scale) {
+  return (Vec2){v.x * scale, v.y * scale};
+}
+
+static inline Vec2 vec2_negate(Vec2 v) { return (Vec2){-v.x, -v.y}; }
+
+static inline Scalar vec2_dot(Vec2 a, Vec2 b) { return a.x * b.x + a.y * b.y; }
+
+static inline Scalar vec2_length(Vec2 v) { return scalar_sqrt(vec2_dot(v, v)); }
+
+static inline Vec2 vec2_normalize(Vec2 v) {
+  Scalar length = vec2_length(v);
+  if (length > SCALAR_C(0.0)) {
+    return vec2_scale(v, SCALAR_C(1.0) / length);
+  }
+  return v;
+}
+
+static inline Vec2 vec2_lerp(Vec2 a, Vec2 b, Scalar amount) {
+  return (Vec2){a.x + amount * (b.x - a.x), a.y + amount * (b.y - a.y)};
+}
+
+// Scales v so that its length lies within [min, max]
+static inline Vec2 vec2_clamp_value(Vec2 v, Scalar min, Scalar max) {
+  Scalar length_squared = vec2_dot(v, v);
+  if (length_squared > SCALAR_C(0.0)) {
+    Scalar length = scalar_sqrt(length_squared);
+    if (length < min) {
+      return vec2_scale(v, min / length);
+    }
+    if (length > max) {
+      return vec2_scale(v, max / length);
+    }
+  }
+  return v;
+}
+
+// Squared distance from p to the nearest point on the segment from a to b
+static inline Scalar vec2_segment_distance_squared(Vec2 p, Vec2 a, Vec2 b) {
+  Vec2 ab = vec2_subtract(b, a);
+  Vec2 ap = vec2_subtract(p, a);
+  Scalar length_squared = vec2_dot(ab, ab);
+  Scalar t = length_squared > SCALAR_C(0.0) ? vec2_dot(ap, ab) / length_squared
+                                            : SCALAR_C(0.0);
+  t = t < SCALAR_C(0.0) ? SCALAR_C(0.0)
+                        : (t > SCALAR_C(1.0) ? SCALAR_C(1.0) : t);
+  Vec2 offset = vec2_subtract(ap, vec2_scale(ab, t));
+  return vec2_dot(offset, offset);
+}
+
+#endif
@@ -0,0 +1,359 @@
+#include "array.h"
+#include "profiler.h"
+#include "springs.h"
+#include "springs_internal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Floats stored per spring by the solver: the accumulated Lagrange multiplier,
+// the step's compliance, damping and inverse constraint mass, and the Jacobi
+// position correction
+#define XPBD_SPRING_FLOATS 6
+enum {
+  XPBD_LAMBDA = 0,
+  XPBD_COMPLIANCE,
+  XPBD_DAMPING,
+  XPBD_INVERSE_DENOMINATOR,
+  XPBD_CORRECTION,
+};
+// Color of the bucket that takes springs no regular color can hold. Its
+// springs may share masses, so it is solved serially.
+#define XPBD_OVERFLOW_COLOR XPBD_MAX_COLORS
+
+static const char *solver_names[SOLVER_COUNT] = {
+    [SOLVER_FORCES] = "forces",
+    [SOLVER_XPBD] = "xpbd",
+};
+
+const char *solver_name(Solver solver) {
+  if (solver >= SOLVER_COUNT) {
+    return "unknown";
+  }
+  return solver_names[solver];
+}
+
+_Bool solver_from_name(const char *name, Solver *solver) {
+  for (size_t i = 0; i < SOLVER_COUNT; ++i) {
+    if (strcmp(name, solver_names[i]) == 0) {
+      *solver = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Greedily gives every live spring the lowest color not yet used at either of
+// its masses, then orders the springs by color with a counting sort
+static _Bool system_build_coloring(System *system) {
+  system_compact_springs(system);
+  const SpringArrays *springs = &system->springs;
+  _Bool ok = true;
+  size_t spring_count = system->active_spring_count;
+  ARRAY_RESIZE(system->color_order, spring_count, ok);
+  uint64_t *used = calloc(system->mass_count, sizeof(*used));
+  uint8_t *color = malloc(spring_count * sizeof(*color));
+  if (!ok || (system->mass_count > 0 && used == NULL) ||
+      (spring_count > 0 && color == NULL)) {
+    printf("ERROR: Cannot allocate memory for spring coloring\n");
+    free(used);
+    free(color);
+    return false;
+  }
+
+  size_t *offset = system->color_offset;
+  memset(system->color_offset, 0, sizeof(system->color_offset));
+  for (size_t i = 0; i < spring_count; ++i) {
+    if (springs->cut[i]) {
+      continue;
+    }
+    uint64_t taken = used[springs->first[i]] | used[springs->second[i]];
+    uint64_t free_colors = ~taken;
+    if (free_colors == 0) {
+      color[i] = XPBD_OVERFLOW_COLOR;
+    } else {
+      color[i] = __builtin_ctzll(free_colors);
+      used[springs->first[i]] |= UINT64_C(1) << color[i];
+      used[springs->second[i]] |= UINT64_C(1) << color[i];
+    }
+    ++offset[color[i] + 1];
+  }
+  for (size_t c = 1; c <= XPBD_OVERFLOW_COLOR + 1; ++c) {
+    offset[c] += offset[c - 1];
+  }
+  for (size_t i = 0; i < spring_count; ++i) {
+    if (!springs->cut[i]) {
+      system->color_order[offset[color[i]]++] = i;
+    }
+  }
+  for (size_t c = XPBD_OVERFLOW_COLOR + 1; c > 0; --c) {
+    offset[c] = offset[c - 1];
+  }
+  offset[0] = 0;
+
+  free(used);
+  free(color);
+  system->coloring_valid = true;
+  return true;
+}
+
+typedef struct {
+  Vec2 *start_position; // Positions at the start of the step
+  Scalar *spring_state; // XPBD_SPRING_FLOATS per spring
+  const uint32_t *order;
+  uint8_t *tear_flags; // Set when tearing
+  Scalar dt;
+} XpbdPass;
+
+// Moves every free mass by its velocity after applying the force fields and
+// the forces appended before the step
+static void xpbd_predict_range(System *system, size_t begin, size_t end,
+                               void *argument) {
+  const XpbdPass *pass = argument;
+  MassArrays *masses = &system->masses;
+  Scalar dt = pass->dt;
+
+  for (size_t i = begin; i < end; ++i) {
+    pass->start_position[i] = masses->position[i];
+    if (masses->fixed[i]) {
+      continue;
+    }
+    Vec2 acceleration =
+        mass_acceleration(system, i, masses->position[i], masses->velocity[i],
+                          masses->force[i]);
+    masses->velocity[i] =
+        vec2_add(masses->velocity[i], vec2_scale(acceleration, dt));
+    masses->position[i] =
+        vec2_add(masses->position[i], vec2_scale(masses->velocity[i], dt));
+  }
+}
+
+static Scalar xpbd_inverse_mass(const MassArrays *masses, size_t i) {
+  return masses->fixed[i] ? SCALAR_C(0.0) : masses->inverse_mass[i];
+}
+
+// Flags spring i if it is stretched past its max strain at the start of the
+// step
+static _Bool xpbd_spring_torn(const System *system, const XpbdPass *pass,
+                              size_t i) {
+  const SpringArrays *springs = &system->springs;
+  if (springs->cut[i] || !(springs->max_strain[i] > SCALAR_C(0.0))) {
+    return false;
+  }
+  Vec2 span = vec2_subtract(pass->start_position[springs->second[i]],
+                            pass->start_position[springs->first[i]]);
+  Scalar limit =
+      springs->length[i] * (SCALAR_C(1.0) + springs->max_strain[i]);
+  if (!(vec2_length(span) > limit)) {
+    return false;
+  }
+  pass->tear_flags[i] = 1;
+  return true;
+}
+
+// Clears the multipliers and works out the terms of every spring that stay
+// the same during the step, so the iterations are left with one division.
+// Compliance is 1 / strength and the damping comes from the dampening. Torn
+// springs are flagged and left without terms, so they stop pulling right
+// away. Returns the number of springs torn.
+static double xpbd_prepare_range(System *system, size_t begin, size_t end,
+                                 void *argument) {
+  const XpbdPass *pass = argument;
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  Scalar dt = pass->dt;
+  size_t torn = 0;
+
+  for (size_t i = begin; i < end; ++i) {
+    Scalar *state = pass->spring_state + i * XPBD_SPRING_FLOATS;
+    for (size_t j = 0; j < XPBD_SPRING_FLOATS; ++j) {
+      state[j] = SCALAR_C(0.0);
+    }
+    if (pass->tear_flags != NULL && xpbd_spring_torn(system, pass, i)) {
+      ++torn;
+      continue;
+    }
+    Scalar w = xpbd_inverse_mass(masses, springs->first[i]) +
+              xpbd_inverse_mass(masses, springs->second[i]);
+    Scalar stiffness_dt = springs->strength[i] * dt;
+    if (w <= SCALAR_C(0.0) || stiffness_dt <= SCALAR_C(0.0)) {
+      continue;
+    }
+    Scalar compliance = SCALAR_C(1.0) / (stiffness_dt * dt);
+    Scalar damping = springs->dampening[i] / stiffness_dt;
+    state[XPBD_COMPLIANCE] = compliance;
+    state[XPBD_DAMPING] = damping;
+    state[XPBD_INVERSE_DENOMINATOR] =
+        SCALAR_C(1.0) / ((SCALAR_C(1.0) + damping) * w + compliance);
+  }
+  return torn;
+}
+
+// Solves the distance constraint of spring i given the current positions.
+// Returns the change of the Lagrange multiplier and the direction from the
+// first mass to the second, or zero when the spring cannot move.
+static Scalar xpbd_spring_solve(const System *system, const XpbdPass *pass,
+                                size_t i, Vec2 *direction) {
+  const MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+  Scalar *state = pass->spring_state + i * XPBD_SPRING_FLOATS;
+  size_t first = springs->first[i];
+  size_t second = springs->second[i];
+  Vec2 span = vec2_subtract(masses->position[second], masses->position[first]);
+  Scalar span_length = vec2_length(span);
+  if (state[XPBD_INVERSE_DENOMINATOR] == SCALAR_C(0.0) ||
+      span_length <= SCALAR_C(0.0)) {
+    *direction = vec2_zero();
+    return SCALAR_C(0.0);
+  }
+
+  Vec2 n = vec2_scale(span, SCALAR_C(1.0) / span_length);
+  Vec2 moved = vec2_subtract(
+      vec2_subtract(masses->position[second], pass->start_position[second]),
+      vec2_subtract(masses->position[first], pass->start_position[first]));
+  Scalar constraint = span_length - springs->length[i];
+  Scalar residual = -constraint - state[XPBD_COMPLIANCE] * state[XPBD_LAMBDA] -
+                   state[XPBD_DAMPING] * vec2_dot(n, moved);
+  Scalar delta_lambda = residual * state[XPBD_INVERSE_DENOMINATOR];
+  state[XPBD_LAMBDA] += delta_lambda;
+  *direction = n;
+  return delta_lambda;
+}
+
+static void xpbd_color_range(System *system, size_t begin, size_t end,
+                             void *argument) {
+  const XpbdPass *pass = argument;
+  MassArrays *masses = &system->masses;
+  const SpringArrays *springs = &system->springs;
+
+  for (size_t j = begin; j < end; ++j) {
+    size_t i = pass->order[j];
+    Vec2 n;
+    Scalar delta_lambda = xpbd_spring_solve(system, pass, i, &n);
+    size_t first = springs->first[i];
+    size_t second = springs->second[i];
+    masses->position[first] = vec2_subtract(
+        masses->position[first],
+        vec2_scale(n, delta_lambda * xpbd_inverse_mass(masses, first)));
+    masses->position[second] = vec2_add(
+        masses->position[second],
+        vec2_scale(n, delta_lambda * xpbd_inverse_mass(masses, second)));
+  }
+}
+
+// One sweep over the springs color by color. Colors run in parallel, except
+// for the overflow bucket.
+static void xpbd_gauss_seidel_iteration(System *system, XpbdPass *pass) {
+  const size_t *offset = system->color_offset;
+  for (size_t c = 0; c < XPBD_MAX_COLORS; ++c) {
+    pass->order = system->color_order + offset[c];
+    system_parallel_for(system, offset[c + 1] - offset[c], xpbd_color_range,
+                        pass);
+  }
+  pass->order = system->color_order;
+  xpbd_color_range(system, offset[XPBD_OVERFLOW_COLOR],
+                   offset[XPBD_OVERFLOW_COLOR + 1], pass);
+}
+
+static void xpbd_jacobi_spring_range(System *system, size_t begin, size_t end,
+                                     void *argument) {
+  const XpbdPass *pass = argument;
+  const SpringArrays *springs = &system->springs;
+  for (size_t i = begin; i < end; ++i) {
+    Vec2 n = vec2_zero();
+    Scalar delta_lambda = springs->cut[i]
+                              ? SCALAR_C(0.0)
+                              : xpbd_spring_solve(system, pass, i, &n);
+    Scalar *correction =
+        pass->spring_state + i * XPBD_SPRING_FLOATS + XPBD_CORRECTION;
+    correction[0] = n.x * delta_lambda;
+    correction[1] = n.y * delta_lambda;
+  }
+}
+
+// Applies the average of the corrections of the springs at every mass, over
+// relaxed to make up for averaging
+static void xpbd_jacobi_mass_range(System *system, size_t begin, size_t end,
+                                   void *argument) {
+  const XpbdPass *pass = argument;
+  MassArrays *masses = &system->masses;
+  const size_t *offset = system->adjacency_offset;
+
+  for (size_t i = begin; i < end; ++i) {
+    size_t count = offset[i + 1] - offset[i];
+    if (masses->fixed[i] || count == 0) {
+      continue;
+    }
+    Vec2 sum = vec2_zero();
+    for (size_t j = offset[i]; j < offset[i + 1]; ++j) {
+      uint32_t entry = system->adjacency[j];
+      const Scalar *correction = pass->spring_state +
+                                (entry >> 1) * XPBD_SPRING_FLOATS +
+                                XPBD_CORRECTION;
+      Vec2 c = {correction[0], correction[1]};
+      sum = (entry & 1) ? vec2_add(sum, c) : vec2_subtract(sum, c);
+    }
+    Scalar scale = XPBD_JACOBI_RELAXATION * masses->inverse_mass[i] / count;
+    masses->position[i] = vec2_add(masses->position[i], vec2_scale(sum, scale));
+  }
+}
+
+static void xpbd_velocity_range(System *system, size_t begin, size_t end,
+                                void *argument) {
+  const XpbdPass *pass = argument;
+  MassArrays *masses = &system->masses;
+  Scalar inverse_dt = 1.0 / pass->dt;
+  for (size_t i = begin; i < end; ++i) {
+    if (!masses->fixed[i]) {
+      masses->velocity[i] = vec2_scale(
+          vec2_subtract(masses->position[i], pass->start_position[i]),
+          inverse_dt);
+    }
+  }
+}
+
+// Extended position based dynamics (Macklin, Mueller and Chentanez): predicts
+// the positions from the velocities, moves them to satisfy every spring as a
+// compliant distance constraint and derives the velocities from the motion.
+// With a single substep the result does not blow up for any strength.
+_Bool system_xpbd_step(System *system, double dt) {
+  PROFILE_SCOPE(PROFILE_ZONE_SOLVE);
+  size_t n = system->mass_count;
+  Vec2 *start_position = system_mass_scratch(system, 1);
+  Scalar *spring_state = system_spring_scratch(system, XPBD_SPRING_FLOATS);
+  if ((n > 0 && start_position == NULL) ||
+      (system->spring_count > 0 && spring_state == NULL)) {
+    return false;
+  }
+  _Bool jacobi = system->xpbd_method == XPBD_JACOBI;
+  if (jacobi && !system->adjacency_valid && !system_build_adjacency(system)) {
+    return false;
+  }
+  if (!jacobi && !system->coloring_valid && !system_build_coloring(system)) {
+    return false;
+  }
+
+  XpbdPass pass = {start_position, spring_state, NULL,
+                   system_tear_flags(system), dt};
+  system_parallel_for(system, n, xpbd_predict_range, &pass);
+  if (system_parallel_sum(system, system->active_spring_count,
+                          xpbd_prepare_range, &pass) > 0.0) {
+    system_tear_flagged(system, system->active_spring_count, true,
+                        start_position);
+  }
+
+  size_t iterations = system->xpbd_iterations > 0 ? system->xpbd_iterations
+                                                  : XPBD_DEFAULT_ITERATIONS;
+  for (size_t k = 0; k < iterations; ++k) {
+    if (jacobi) {
+      system_parallel_for(system, system->active_spring_count,
+                          xpbd_jacobi_spring_range, &pass);
+      system_parallel_for(system, n, xpbd_jacobi_mass_range, &pass);
+    } else {
+      xpbd_gauss_seidel_iteration(system, &pass);
+    }
+  }
+
+  system_parallel_for(system, n, xpbd_velocity_range, &pass);
+  return true;
+}